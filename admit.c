@@ -0,0 +1,272 @@
+/*
+ * admit.c
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This file contains the TinyLFU admission filter the
+ * cache can put in front of cache_add. Without it, every object that fits
+ * is added, and the least recently used objects are evicted for it, so a
+ * crawler sweeping through URIs that are each requested once pushes the
+ * whole popular working set out of the cache.
+ *
+ * Each shard keeps a small sketch of how often URIs have been requested
+ * lately, hit or miss. When a new object would evict others, it is
+ * compared with each object the eviction policy picks for it in turn, and
+ * as soon as one has been requested at least as often, the new object is
+ * turned away and that one stays.
+ *
+ * The sketch is a count-min sketch of 4-bit saturating counters, one byte
+ * each, behind a doorkeeper bloom filter: the first access to a URI only
+ * sets its doorkeeper bits, and later ones count in the sketch, so the
+ * many URIs that are only ever requested once cost a bit or two rather
+ * than a counter. The sketch ages by halving every counter and clearing
+ * the doorkeeper once enough accesses have been counted, so that objects
+ * that were popular long ago do not stay in the cache forever.
+ *
+ */
+
+#include "admit.h"
+
+/*
+ * Main Admit Functions
+ * --------------------
+ */
+
+/*
+ * admit_init - This function creates an empty sketch sized for a shard
+ * with the given budget, assuming objects of ADMIT_AVG_OBJECT bytes.
+ *
+ * Parameter:
+ *  - capacity: the shard's budget in bytes
+ * Return value:
+ *  - admit: a pointer to the new sketch
+ */
+Admit *admit_init(size_t capacity)
+{
+    Admit *admit = Malloc(sizeof(Admit));
+    size_t entries = capacity / ADMIT_AVG_OBJECT;
+
+    admit->width = ADMIT_MIN_WIDTH;
+    while (admit->width < entries) {
+        admit->width *= 2;
+    }
+    admit->sample_limit = ADMIT_SAMPLE_FACTOR * admit->width;
+
+    /* About eight doorkeeper bits for every URI seen between agings */
+    admit->door_bits = 64;
+    while (admit->door_bits < 8 * admit->sample_limit) {
+        admit->door_bits *= 2;
+    }
+
+    admit->counters = Calloc(ADMIT_DEPTH * admit->width, sizeof(uint8_t));
+    admit->door = Calloc(admit->door_bits / 64, sizeof(uint64_t));
+    admit->samples = 0;
+    admit->agings = 0;
+    pthread_mutex_init(&admit->age_lock, NULL);
+    return admit;
+}
+
+/*
+ * admit_record - This function counts one access to a URI. The first
+ * access since the last aging only sets the URI's doorkeeper bits; later
+ * ones increment the smallest of its counters, and only those, which
+ * keeps the estimates of other URIs sharing its counters from growing.
+ *
+ * Parameters:
+ *  - admit: the sketch
+ *  - hash: hash of the URI, as returned by hash_uri
+ */
+void admit_record(Admit *admit, uint64_t hash)
+{
+    uint8_t *counter[ADMIT_DEPTH];
+    uint8_t count[ADMIT_DEPTH];
+    uint8_t min = ADMIT_MAX_COUNT;
+    int row;
+
+    if (door_test_and_set(admit, hash)) {
+        for (row = 0; row < ADMIT_DEPTH; row++) {
+            counter[row] = &admit->counters[row * admit->width
+                + counter_index(admit, hash, row)];
+            count[row] = __atomic_load_n(counter[row], __ATOMIC_RELAXED);
+            if (count[row] < min) {
+                min = count[row];
+            }
+        }
+        for (row = 0; row < ADMIT_DEPTH && min < ADMIT_MAX_COUNT; row++) {
+            if (count[row] == min) {
+                __atomic_add_fetch(counter[row], 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    if (__atomic_add_fetch(&admit->samples, 1, __ATOMIC_RELAXED)
+            >= admit->sample_limit) {
+        admit_age(admit);
+    }
+    return;
+}
+
+/*
+ * admit_estimate - Returns how many times a URI has been accessed lately,
+ * as far as the sketch can tell: the smallest of its counters, plus one
+ * if its doorkeeper bits are set. The estimate may be too high, when
+ * other URIs share all of its counters, but never too low, except for
+ * the halving done by aging.
+ *
+ * Parameters:
+ *  - admit: the sketch
+ *  - hash: hash of the URI, as returned by hash_uri
+ * Return value:
+ *  - the estimated number of recent accesses
+ */
+unsigned int admit_estimate(Admit *admit, uint64_t hash)
+{
+    unsigned int min = ADMIT_MAX_COUNT;
+    unsigned int count;
+    int row;
+
+    for (row = 0; row < ADMIT_DEPTH; row++) {
+        count = __atomic_load_n(&admit->counters[row * admit->width
+                + counter_index(admit, hash, row)], __ATOMIC_RELAXED);
+        if (count < min) {
+            min = count;
+        }
+    }
+    return min + door_test(admit, hash);
+}
+
+/*
+ * admit_destroy - This function frees a sketch.
+ *
+ * Parameter:
+ *  - admit: the sketch to destroy
+ */
+void admit_destroy(Admit *admit)
+{
+    pthread_mutex_destroy(&admit->age_lock);
+    Free(admit->counters);
+    Free(admit->door);
+    Free(admit);
+    return;
+}
+
+/*
+ * End Main Admit Functions
+ * ------------------------
+ */
+
+
+/*
+ * Admit Helper Functions
+ * ----------------------
+ */
+
+/*
+ * counter_index - Returns the position of a URI's counter within one row
+ * of the sketch. Each row scrambles the hash with its own seed, so URIs
+ * that share a counter in one row rarely share one in the others.
+ */
+size_t counter_index(Admit *admit, uint64_t hash, int row)
+{
+    static const uint64_t seeds[ADMIT_DEPTH] = {
+        0x97cb3127ULL, 0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL,
+        0x9ae16a3b2f90404fULL
+    };
+
+    hash = (hash ^ seeds[row]) * 0x9e3779b97f4a7c15ULL; /* Golden ratio */
+    return (hash >> 32) & (admit->width - 1);
+}
+
+/*
+ * door_bit - Returns the position of one of a URI's two doorkeeper bits.
+ */
+size_t door_bit(Admit *admit, uint64_t hash, int probe)
+{
+    if (probe == 0) {
+        return hash & (admit->door_bits - 1);
+    }
+    return ((hash >> 32) * 0x9e3779b97f4a7c15ULL >> 32) 
+        & (admit->door_bits - 1);
+}
+
+/*
+ * door_test_and_set - Sets a URI's two doorkeeper bits, and returns
+ * whether both were already set, that is, whether the URI has probably
+ * been seen since the last aging.
+ */
+int door_test_and_set(Admit *admit, uint64_t hash)
+{
+    uint64_t mask;
+    uint64_t old;
+    size_t bit;
+    int seen = 1;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        bit = door_bit(admit, hash, i);
+        mask = 1ULL << (bit % 64);
+        old = __atomic_fetch_or(&admit->door[bit / 64], mask, 
+                __ATOMIC_RELAXED);
+        if (!(old & mask)) {
+            seen = 0;
+        }
+    }
+    return seen;
+}
+
+/*
+ * door_test - Returns whether both of a URI's doorkeeper bits are set.
+ */
+int door_test(Admit *admit, uint64_t hash)
+{
+    size_t bit;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        bit = door_bit(admit, hash, i);
+        if (!(__atomic_load_n(&admit->door[bit / 64], __ATOMIC_RELAXED)
+                    & (1ULL << (bit % 64)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * admit_age - Halves every counter and clears the doorkeeper. Only one
+ * thread ages the sketch at a time; one that finds it already being aged
+ * leaves the work to that thread.
+ */
+void admit_age(Admit *admit)
+{
+    size_t i;
+
+    if (pthread_mutex_trylock(&admit->age_lock) != 0) {
+        return;
+    }
+
+    /* Another thread may have aged it since this one counted */
+    if (__atomic_load_n(&admit->samples, __ATOMIC_RELAXED)
+            >= admit->sample_limit) {
+        for (i = 0; i < ADMIT_DEPTH * admit->width; i++) {
+            __atomic_store_n(&admit->counters[i],
+                    __atomic_load_n(&admit->counters[i], __ATOMIC_RELAXED)
+                    >> 1, __ATOMIC_RELAXED);
+        }
+        for (i = 0; i < admit->door_bits / 64; i++) {
+            __atomic_store_n(&admit->door[i], 0, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&admit->samples, admit->sample_limit / 2,
+                __ATOMIC_RELAXED);
+        admit->agings += 1;
+    }
+
+    pthread_mutex_unlock(&admit->age_lock);
+    return;
+}
+
+/*
+ * End Admit Helper Functions
+ * --------------------------
+ */
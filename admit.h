@@ -0,0 +1,68 @@
+/*
+ * admit.h
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This is the header file for admit.c, which keeps the
+ * frequency sketch the cache uses to decide whether a new object is worth
+ * evicting others for. This file just has the relevant macros, structure
+ * definitions, and function prototypes.
+ *
+ */
+
+/* Include guards */
+#ifndef __ADMIT_H__
+#define __ADMIT_H__
+
+#include <stdint.h>
+
+#include "csapp.h"
+
+/* Macros */
+#define ADMIT_DEPTH 4            /* Rows of counters in the sketch */
+#define ADMIT_MIN_WIDTH 256      /* Fewest counters in a row */
+#define ADMIT_AVG_OBJECT 4096    /* Object size assumed when sizing the
+                                    sketch from a byte budget */
+#define ADMIT_MAX_COUNT 15       /* Counters saturate here */
+#define ADMIT_SAMPLE_FACTOR 10   /* Accesses counted between agings, per
+                                    counter in a row */
+
+/*
+ * Defines the frequency sketch of one cache shard: a count-min sketch of
+ * recent accesses, and a doorkeeper bloom filter in front of it, so that
+ * a URI only starts taking counters on its second access and one-hit
+ * wonders never reach the sketch. Every sample_limit accesses the sketch
+ * ages: its counters are halved and the doorkeeper is cleared, so old
+ * popularity fades.
+ *
+ * Counters and doorkeeper bits are updated with atomic operations, so
+ * accesses are recorded without any lock; aging is serialized by
+ * age_lock, and a count that races with it may be lost, which only makes
+ * the estimate a little less exact.
+ */
+typedef struct Admit {
+    uint8_t *counters;           /* ADMIT_DEPTH rows of width counters */
+    uint64_t *door;              /* Doorkeeper bits, door_bits of them */
+    size_t width;                /* Counters per row, a power of two */
+    size_t door_bits;            /* Bits in the doorkeeper, a power of
+                                    two */
+    unsigned long samples;       /* Accesses since the last aging */
+    unsigned long sample_limit;  /* Accesses between agings */
+    unsigned long agings;        /* Times the sketch has aged */
+    pthread_mutex_t age_lock;    /* Held while aging */
+} Admit;
+
+/* Main Admit Function Prototypes */
+Admit *admit_init(size_t capacity);
+void admit_record(Admit *admit, uint64_t hash);
+unsigned int admit_estimate(Admit *admit, uint64_t hash);
+void admit_destroy(Admit *admit);
+/* Admit Helper Functions */
+size_t counter_index(Admit *admit, uint64_t hash, int row);
+size_t door_bit(Admit *admit, uint64_t hash, int probe);
+int door_test_and_set(Admit *admit, uint64_t hash);
+int door_test(Admit *admit, uint64_t hash);
+void admit_age(Admit *admit);
+
+#endif
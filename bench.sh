@@ -0,0 +1,57 @@
+#!/bin/bash
+#
+# bench.sh - Benchmarks the built proxy end to end on this machine
+#
+# Author: Kais Kudrolli
+# Andrew ID: kkudroll
+#
+# Starts stub_origin and the proxy on local ports, drives the proxy with
+# load_gen, and prints requests/sec, latency percentiles, hit ratio and
+# the proxy's CPU time per request, once for the thread pool and once for
+# the event engine (-e). Everything can be changed from the environment:
+#
+#   PROXY_PORT, ORIGIN_PORT  ports to listen on (18080, 18081)
+#   DURATION, WARMUP         seconds measured, and of warmup first (10, 3)
+#   THREADS                  connections to the proxy (8)
+#   OBJECTS                  distinct objects, Zipf-distributed (10000)
+#   LATENCY                  origin milliseconds per response (5)
+#   SIZES                    origin object sizes: mix, N or MIN-MAX (mix)
+#   PROXY_OPTS               extra options for the proxy, such as "-s 16"
+#   ENGINES                  engines to run: pool, event or both (both)
+#
+
+PROXY_PORT=${PROXY_PORT:-18080}
+ORIGIN_PORT=${ORIGIN_PORT:-18081}
+DURATION=${DURATION:-10}
+WARMUP=${WARMUP:-3}
+THREADS=${THREADS:-8}
+OBJECTS=${OBJECTS:-10000}
+LATENCY=${LATENCY:-5}
+SIZES=${SIZES:-mix}
+ENGINES=${ENGINES:-pool event}
+
+cd "$(dirname "$0")"
+
+./stub_origin -l "$LATENCY" -s "$SIZES" "$ORIGIN_PORT" & ORIGIN_PID=$!
+trap 'kill $ORIGIN_PID $PROXY_PID 2>/dev/null' EXIT
+sleep 0.5
+
+for engine in $ENGINES; do
+    engine_opt=""
+    if [ "$engine" = event ]; then
+        engine_opt="-e"
+    fi
+
+    # Every engine starts with a cold cache
+    ./proxy $engine_opt $PROXY_OPTS "$PROXY_PORT" 2>/dev/null & PROXY_PID=$!
+    sleep 0.5
+
+    echo "--- proxy $engine_opt $PROXY_OPTS: $THREADS connections," \
+        "$OBJECTS objects, $SIZES sizes, origin latency ${LATENCY}ms"
+    ./load_gen -t "$THREADS" -d "$DURATION" -w "$WARMUP" -n "$OBJECTS" \
+        -o "$ORIGIN_PORT" -p "$PROXY_PID" 127.0.0.1 "$PROXY_PORT"
+
+    kill $PROXY_PID
+    wait $PROXY_PID 2>/dev/null
+    echo
+done
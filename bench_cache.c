@@ -0,0 +1,552 @@
+/*
+ * bench_cache.c
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This file is a microbenchmark for the cache. It has
+ * four parts. The first fills a cache with a given number of small objects
+ * and times lookups of random cached URIs (hits) and of URIs that were
+ * never added (misses); the entry counts can be given on the command
+ * line, and otherwise 10, 1000 and 100000 entries are measured. The
+ * second is a thread-count sweep that measures the total hit throughput
+ * of 1 to SWEEP_MAX_THREADS threads, first against a single-shard cache
+ * and then against a cache with the default number of shards. The third
+ * replays a synthetic trace through a cache of the proxy's default size,
+ * once with each eviction policy, and with LRU and GDSF again behind
+ * TinyLFU admission, and compares their hit ratios. In the trace, most
+ * requests go to a fixed set of URIs with Zipf popularity, and the rest
+ * to URIs that are never requested again, as a crawler would send; the
+ * objects are a mix of small ones and ones close to the largest that can
+ * be cached. The fourth runs a mixed workload of lookups and adds of
+ * random URIs on a cache with room for half of them, so that adds evict,
+ * for every combination of entry count, object size, share of lookups and
+ * thread count, and prints the total throughput and the share of lookups
+ * that hit.
+ *
+ * Usage: bench_cache [-s sizes] [-r percents] [-t threads] [entries ...]
+ *  - -s sizes: comma-separated object sizes for the mixed workload
+ *              (default: 64,4096)
+ *  - -r percents: comma-separated shares of lookups, in percent (default:
+ *                 100,90,50)
+ *  - -t threads: comma-separated thread counts (default: 1,4,16)
+ *  - entries: entry counts for the first and fourth parts (default: 10,
+ *             1000 and 100000 for the first, 1000 and 20000 for the
+ *             fourth)
+ */
+
+#include <time.h>
+
+#include "cache.h"
+
+/* Macros */
+#define LOOKUPS     1000000    /* Number of timed lookups per measurement */
+#define OBJECT_TEXT "0123456"  /* Body of every benchmark object */
+#define URI_LEN     48         /* Room for one benchmark URI */
+#define SWEEP_ENTRIES 1000     /* Objects cached during the thread sweep */
+#define SWEEP_LOOKUPS 400000   /* Lookups done by each sweep thread */
+#define SWEEP_MAX_THREADS 16   /* Largest thread count in the sweep */
+#define TRACE_REQUESTS 200000  /* Requests in the replayed trace */
+#define TRACE_HOT 2000         /* URIs requested again and again */
+#define TRACE_SCAN_PERCENT 30  /* Percent of requests for URIs that are
+                                  never requested again */
+#define TRACE_BIG_PERCENT 20   /* Percent of objects that are large */
+#define MIXED_OPS 100000       /* Operations done by each mixed thread */
+#define MIXED_MAX_RUNS 16      /* Most values of each mixed parameter */
+
+/*
+ * Arguments for one thread of the thread-count sweep.
+ */
+typedef struct SweepArgs {
+    Cache *cache;              /* The shared, filled cache */
+    char (*uris)[URI_LEN];     /* The cached URIs */
+    unsigned int seed;         /* Per-thread random seed */
+} SweepArgs;
+
+/*
+ * Arguments for one thread of the mixed workload, and what it counted.
+ */
+typedef struct MixedArgs {
+    Cache *cache;              /* The shared cache */
+    char (*uris)[URI_LEN];     /* The URIs to look up and add */
+    int entries;               /* Number of URIs */
+    char *object;              /* Content of every object added */
+    size_t size;               /* Size of every object */
+    int read_percent;          /* Share of operations that are lookups */
+    unsigned int seed;         /* Per-thread random seed */
+    unsigned long lookups;     /* Lookups done */
+    unsigned long hits;        /* Lookups that hit */
+} MixedArgs;
+
+/* Function prototypes */
+double now_ns(void);
+char (*make_uris(const char *kind, int count))[URI_LEN];
+Cache *fill_cache(char (*uris)[URI_LEN], int entries, int nshards);
+double time_lookups(Cache *cache, char (*uris)[URI_LEN], int entries);
+void bench_entries(int entries);
+void *sweep_thread(void *vargp);
+void bench_sweep(int nshards);
+size_t trace_size(unsigned int id);
+void bench_trace(const char *policy, int admission);
+int parse_list(char *list, int *values);
+void *mixed_thread(void *vargp);
+void bench_mixed(int entries, size_t size, int read_percent, int nthreads);
+
+int main(int argc, char **argv)
+{
+    int default_entries[] = { 10, 1000, 100000 };
+    int mixed_entries[MIXED_MAX_RUNS] = { 1000, 20000 };
+    int sizes[MIXED_MAX_RUNS] = { 64, 4096 };
+    int reads[MIXED_MAX_RUNS] = { 100, 90, 50 };
+    int threads[MIXED_MAX_RUNS] = { 1, 4, 16 };
+    int nentries = 2, nsizes = 2, nreads = 3, nthreads = 3;
+    int e, s, r, t;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "s:r:t:")) != -1) {
+        switch (opt) {
+        case 's':
+            nsizes = parse_list(optarg, sizes);
+            break;
+        case 'r':
+            nreads = parse_list(optarg, reads);
+            break;
+        case 't':
+            nthreads = parse_list(optarg, threads);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s sizes] [-r percents] "
+                    "[-t threads] [entries ...]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    printf("%10s %14s %14s %10s\n", "entries", "hit ns/op", "miss ns/op",
+            "cached");
+    if (optind < argc) {
+        for (nentries = 0; optind < argc && nentries < MIXED_MAX_RUNS;
+                optind++) {
+            mixed_entries[nentries++] = atoi(argv[optind]);
+            bench_entries(atoi(argv[optind]));
+        }
+    } else {
+        for (i = 0; i < 3; i++) {
+            bench_entries(default_entries[i]);
+        }
+    }
+
+    printf("\n%10s %10s %16s\n", "shards", "threads", "hits/sec");
+    bench_sweep(1);
+    bench_sweep(0);
+
+    printf("\n%14s %14s %14s %10s\n", "policy", "object hits", 
+            "byte hits", "rejected");
+    bench_trace("lru", 0);
+    bench_trace("arc", 0);
+    bench_trace("s3fifo", 0);
+    bench_trace("gdsf", 0);
+    bench_trace("lru", 1);
+    bench_trace("gdsf", 1);
+
+    printf("\n%10s %10s %10s %10s %16s %10s\n", "entries", "size",
+            "lookups", "threads", "ops/sec", "hits");
+    for (e = 0; e < nentries; e++) {
+        for (s = 0; s < nsizes; s++) {
+            for (r = 0; r < nreads; r++) {
+                for (t = 0; t < nthreads; t++) {
+                    bench_mixed(mixed_entries[e], sizes[s], reads[r],
+                            threads[t]);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * now_ns - Returns a monotonic timestamp in nanoseconds.
+ */
+double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * make_uris - Builds count distinct benchmark URIs ahead of time so that
+ * formatting them is not part of any timed loop.
+ *
+ * Parameters:
+ *  - kind: path component that tells hit and miss URIs apart
+ *  - count: number of URIs
+ * Return value:
+ *  - an array of count URIs, to be freed by the caller
+ */
+char (*make_uris(const char *kind, int count))[URI_LEN]
+{
+    char (*uris)[URI_LEN] = Malloc(count * sizeof(*uris));
+    int i;
+
+    for (i = 0; i < count; i++) {
+        snprintf(uris[i], URI_LEN, "http://bench.example/%s/%d", kind, i);
+    }
+
+    return uris;
+}
+
+/*
+ * fill_cache - Creates a cache large enough for every URI and adds one
+ * small object under each of them.
+ *
+ * Parameters:
+ *  - uris: the URIs to cache
+ *  - entries: number of URIs
+ *  - nshards: number of shards, or 0 for the default
+ * Return value:
+ *  - the filled cache
+ */
+Cache *fill_cache(char (*uris)[URI_LEN], int entries, int nshards)
+{
+    /* Leave headroom for URIs hashing unevenly across shards */
+    Cache *cache = cache_init(2 * (size_t)entries
+            * CACHE_NODE_CHARGE(URI_LEN, strlen(OBJECT_TEXT))
+            + 16 * CACHE_MIN_SHARD_SIZE, nshards);
+    int i;
+
+    for (i = 0; i < entries; i++) {
+        cache_add(cache, uris[i], OBJECT_TEXT, strlen(OBJECT_TEXT),
+                CACHE_FOREVER);
+    }
+
+    return cache;
+}
+
+/*
+ * time_lookups - Times LOOKUPS lookups of random URIs and returns the
+ * mean cost of one lookup.
+ *
+ * Parameters:
+ *  - cache: the filled cache
+ *  - uris: the URIs to pick from
+ *  - entries: number of URIs
+ * Return value:
+ *  - the mean lookup latency in nanoseconds
+ */
+double time_lookups(Cache *cache, char (*uris)[URI_LEN], int entries)
+{
+    CacheNode *node;
+    unsigned int seed = 1;
+    double start;
+    int i;
+
+    start = now_ns();
+    for (i = 0; i < LOOKUPS; i++) {
+        node = cache_lookup(cache, uris[rand_r(&seed) % entries]);
+        if (node != NULL) {
+            cache_release(node);
+        }
+    }
+
+    return (now_ns() - start) / LOOKUPS;
+}
+
+/*
+ * bench_entries - Fills a fresh single-shard cache with entries objects
+ * and prints the hit and miss lookup latency.
+ *
+ * Parameter:
+ *  - entries: number of objects to cache
+ */
+void bench_entries(int entries)
+{
+    char (*hit_uris)[URI_LEN] = make_uris("obj", entries);
+    char (*miss_uris)[URI_LEN] = make_uris("none", entries);
+    Cache *cache = fill_cache(hit_uris, entries, 1);
+    CacheNode *node;
+    double hit_ns, miss_ns;
+    int cached = 0;
+    int i;
+
+    for (i = 0; i < entries; i++) {
+        if ((node = cache_lookup(cache, hit_uris[i])) != NULL) {
+            cache_release(node);
+            cached++;
+        }
+    }
+
+    hit_ns = time_lookups(cache, hit_uris, entries);
+    miss_ns = time_lookups(cache, miss_uris, entries);
+    printf("%10d %14.1f %14.1f %10d\n", entries, hit_ns, miss_ns, cached);
+
+    cache_destroy(cache);
+    Free(hit_uris);
+    Free(miss_uris);
+    return;
+}
+
+/*
+ * sweep_thread - Body of one sweep thread: SWEEP_LOOKUPS random hits.
+ */
+void *sweep_thread(void *vargp)
+{
+    SweepArgs *args = vargp;
+    CacheNode *node;
+    int i;
+
+    for (i = 0; i < SWEEP_LOOKUPS; i++) {
+        node = cache_lookup(args->cache,
+                args->uris[rand_r(&args->seed) % SWEEP_ENTRIES]);
+        if (node != NULL) {
+            cache_release(node);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * bench_sweep - Runs 1, 2, 4, ... SWEEP_MAX_THREADS threads doing hits
+ * on one shared cache and prints the total hit throughput of each run.
+ *
+ * Parameter:
+ *  - nshards: number of shards, or 0 for the default
+ */
+void bench_sweep(int nshards)
+{
+    char (*uris)[URI_LEN] = make_uris("obj", SWEEP_ENTRIES);
+    Cache *cache = fill_cache(uris, SWEEP_ENTRIES, nshards);
+    pthread_t tids[SWEEP_MAX_THREADS];
+    SweepArgs args[SWEEP_MAX_THREADS];
+    double start, elapsed;
+    int nthreads, i;
+
+    for (nthreads = 1; nthreads <= SWEEP_MAX_THREADS; nthreads *= 2) {
+        start = now_ns();
+        for (i = 0; i < nthreads; i++) {
+            args[i].cache = cache;
+            args[i].uris = uris;
+            args[i].seed = i + 1;
+            Pthread_create(&tids[i], NULL, sweep_thread, &args[i]);
+        }
+        for (i = 0; i < nthreads; i++) {
+            Pthread_join(tids[i], NULL);
+        }
+        elapsed = now_ns() - start;
+        printf("%10d %10d %16.0f\n", cache->nshards, nthreads,
+                (double)nthreads * SWEEP_LOOKUPS / (elapsed / 1e9));
+    }
+
+    cache_destroy(cache);
+    Free(uris);
+    return;
+}
+
+/*
+ * trace_size - Returns the size of the object with a given id in the
+ * trace, the same every time it is requested: a large object of up to
+ * MAX_OBJECT_SIZE for TRACE_BIG_PERCENT of the ids, otherwise a small one
+ * of up to 8 KB.
+ */
+size_t trace_size(unsigned int id)
+{
+    uint64_t hash = (id + 1) * 0x9e3779b97f4a7c15ULL;   /* Golden ratio */
+
+    hash ^= hash >> 29;
+    if ((hash >> 32) % 100 < TRACE_BIG_PERCENT) {
+        return MAX_OBJECT_SIZE / 5 + (hash >> 8) % (4 * MAX_OBJECT_SIZE / 5);
+    }
+    return 512 + (hash >> 8) % (8 * 1024 - 512);
+}
+
+/*
+ * bench_trace - Replays the synthetic trace through a fresh cache of
+ * MAX_CACHE_SIZE bytes, adding every object that misses, and prints the
+ * share of requests and of bytes that hit.
+ *
+ * Parameters:
+ *  - policy: name of the eviction policy
+ *  - admission: whether TinyLFU admission is on
+ */
+void bench_trace(const char *policy, int admission)
+{
+    static char object[MAX_OBJECT_SIZE];
+    Cache *cache = cache_init(MAX_CACHE_SIZE, 1);
+    double *cdf = Malloc(TRACE_HOT * sizeof(double));
+    double total = 0.0;
+    unsigned long hits = 0;
+    unsigned long long bytes = 0, hit_bytes = 0;
+    unsigned int seed = 1;
+    unsigned int scan = TRACE_HOT;
+    unsigned int id, lo, hi;
+    char uri[URI_LEN];
+    char label[URI_LEN];
+    CacheStats stats;
+    CacheNode *node;
+    double pick;
+    size_t size;
+    int i;
+
+    cache_set_policy(cache, policy);
+    if (admission) {
+        cache_set_admit(cache);
+    }
+
+    /* Popularity of the hot URIs falls off as 1 / rank */
+    for (i = 0; i < TRACE_HOT; i++) {
+        total += 1.0 / (i + 1);
+        cdf[i] = total;
+    }
+
+    for (i = 0; i < TRACE_REQUESTS; i++) {
+        if (rand_r(&seed) % 100 < TRACE_SCAN_PERCENT) {
+            id = scan++;
+        } else {
+            pick = (double)rand_r(&seed) / RAND_MAX * total;
+            for (lo = 0, hi = TRACE_HOT - 1; lo < hi; ) {
+                if (cdf[(lo + hi) / 2] < pick) {
+                    lo = (lo + hi) / 2 + 1;
+                } else {
+                    hi = (lo + hi) / 2;
+                }
+            }
+            id = lo;
+        }
+        snprintf(uri, URI_LEN, "http://bench.example/trace/%u", id);
+        size = trace_size(id);
+        bytes += size;
+
+        if ((node = cache_lookup(cache, uri)) != NULL) {
+            hits += 1;
+            hit_bytes += size;
+            cache_release(node);
+        } else {
+            cache_add(cache, uri, object, size, CACHE_FOREVER);
+        }
+    }
+
+    cache_get_stats(cache, &stats);
+    snprintf(label, URI_LEN, "%s%s", policy, admission ? "+tinylfu" : "");
+    printf("%14s %13.1f%% %13.1f%% %10lu\n", label,
+            100.0 * hits / TRACE_REQUESTS, 100.0 * hit_bytes / bytes,
+            stats.rejections);
+
+    cache_destroy(cache);
+    Free(cdf);
+    return;
+}
+
+/*
+ * parse_list - Parses a comma-separated list of at most MIXED_MAX_RUNS
+ * positive numbers, exiting if one is not.
+ *
+ * Return value:
+ *  - the number of values
+ */
+int parse_list(char *list, int *values)
+{
+    char *save;
+    char *item;
+    int n = 0;
+
+    for (item = strtok_r(list, ",", &save); item != NULL
+            && n < MIXED_MAX_RUNS; item = strtok_r(NULL, ",", &save)) {
+        if ((values[n++] = atoi(item)) < 1) {
+            fprintf(stderr, "Not a positive number: %s\n", item);
+            exit(1);
+        }
+    }
+    if (n == 0) {
+        fprintf(stderr, "Empty list\n");
+        exit(1);
+    }
+    return n;
+}
+
+/*
+ * mixed_thread - Body of one mixed workload thread: MIXED_OPS lookups or
+ * adds of random URIs, read_percent of them lookups.
+ */
+void *mixed_thread(void *vargp)
+{
+    MixedArgs *args = vargp;
+    CacheNode *node;
+    char *uri;
+    int i;
+
+    for (i = 0; i < MIXED_OPS; i++) {
+        uri = args->uris[rand_r(&args->seed) % args->entries];
+        if (rand_r(&args->seed) % 100 < args->read_percent) {
+            args->lookups += 1;
+            if ((node = cache_lookup(args->cache, uri)) != NULL) {
+                args->hits += 1;
+                cache_release(node);
+            }
+        } else {
+            cache_add(args->cache, uri, args->object, args->size,
+                    CACHE_FOREVER);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * bench_mixed - Runs the mixed workload on a cache with the default
+ * number of shards and room for half of the URIs, filled first, and
+ * prints the total throughput and the share of lookups that hit.
+ *
+ * Parameters:
+ *  - entries: number of distinct URIs
+ *  - size: size of every object
+ *  - read_percent: share of operations that are lookups
+ *  - nthreads: number of threads
+ */
+void bench_mixed(int entries, size_t size, int read_percent, int nthreads)
+{
+    char (*uris)[URI_LEN] = make_uris("mixed", entries);
+    char *object = Calloc(size, 1);
+    Cache *cache = cache_init((size_t)entries / 2
+            * CACHE_NODE_CHARGE(URI_LEN, size), 0);
+    pthread_t *tids = Malloc(nthreads * sizeof(pthread_t));
+    MixedArgs *args = Calloc(nthreads, sizeof(MixedArgs));
+    unsigned long lookups = 0, hits = 0;
+    double start, elapsed;
+    int i;
+
+    for (i = 0; i < entries; i++) {
+        cache_add(cache, uris[i], object, size, CACHE_FOREVER);
+    }
+
+    start = now_ns();
+    for (i = 0; i < nthreads; i++) {
+        args[i].cache = cache;
+        args[i].uris = uris;
+        args[i].entries = entries;
+        args[i].object = object;
+        args[i].size = size;
+        args[i].read_percent = read_percent;
+        args[i].seed = i + 1;
+        Pthread_create(&tids[i], NULL, mixed_thread, &args[i]);
+    }
+    for (i = 0; i < nthreads; i++) {
+        Pthread_join(tids[i], NULL);
+        lookups += args[i].lookups;
+        hits += args[i].hits;
+    }
+    elapsed = now_ns() - start;
+    printf("%10d %10lu %9d%% %10d %16.0f %9.1f%%\n", entries,
+            (unsigned long)size, read_percent, nthreads,
+            (double)nthreads * MIXED_OPS / (elapsed / 1e9),
+            lookups ? 100.0 * hits / lookups : 0.0);
+
+    cache_destroy(cache);
+    Free(args);
+    Free(tids);
+    Free(object);
+    Free(uris);
+    return;
+}
@@ -0,0 +1,209 @@
+/*
+ * bench_relay.c
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This file is a benchmark for relaying a large
+ * response body. A source thread writes the body into one loopback TCP
+ * connection and a sink thread drains another one, while the main thread
+ * relays between them: first with the rio copy loop get_response used
+ * for every body, then with splice_relay. For each it prints the wall
+ * time, the throughput and the CPU time the relaying thread spent per
+ * GB moved. The body size in MB can be given on the command line and is
+ * 1024 otherwise.
+ *
+ * Usage: bench_relay [megabytes]
+ */
+
+#include <time.h>
+#include <netinet/tcp.h>
+
+#include "relay.h"
+
+/* Macros */
+#define DEFAULT_MB 1024          /* Body size when none is given */
+#define SOURCE_CHUNK (64 * 1024) /* Bytes the source writes at once */
+
+/*
+ * One end of the benchmark: a socket and the bytes to write to it or
+ * read from it.
+ */
+typedef struct Endpoint {
+    int fd;                      /* The socket */
+    long bytes;                  /* Bytes to write, or bytes read */
+} Endpoint;
+
+/* Function prototypes */
+double now_s(clockid_t clock);
+void make_pair(int *ends);
+void *source_thread(void *vargp);
+void *sink_thread(void *vargp);
+long copy_relay(int fromfd, int tofd, long length);
+void bench_relay(const char *mode, long length);
+
+int main(int argc, char **argv)
+{
+    long length = (argc > 1 ? atol(argv[1]) : DEFAULT_MB) * 1024 * 1024;
+
+    Signal(SIGPIPE, SIG_IGN);
+
+    printf("%8s %10s %10s %12s %14s\n", "relay", "MB", "seconds", "MB/sec",
+            "CPU s per GB");
+    bench_relay("copy", length);
+    bench_relay("splice", length);
+
+    return 0;
+}
+
+/*
+ * now_s - Returns the time on a clock in seconds.
+ */
+double now_s(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * make_pair - Opens a loopback TCP connection and returns its two ends,
+ * ends[0] connected and ends[1] accepted.
+ */
+void make_pair(int *ends)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int listenfd;
+
+    listenfd = Socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    Bind(listenfd, (SA *)&addr, sizeof(addr));
+    Listen(listenfd, 1);
+    getsockname(listenfd, (SA *)&addr, &len);
+
+    ends[0] = Socket(AF_INET, SOCK_STREAM, 0);
+    Connect(ends[0], (SA *)&addr, sizeof(addr));
+    ends[1] = Accept(listenfd, NULL, NULL);
+    Close(listenfd);
+    return;
+}
+
+/*
+ * source_thread - Plays the web server: writes the body and closes.
+ */
+void *source_thread(void *vargp)
+{
+    Endpoint *source = vargp;
+    static char chunk[SOURCE_CHUNK];
+    long left = source->bytes;
+    size_t n;
+
+    memset(chunk, 'x', sizeof(chunk));
+    while (left > 0) {
+        n = left < SOURCE_CHUNK ? left : SOURCE_CHUNK;
+        if (rio_writen(source->fd, chunk, n) < 0) {
+            break;
+        }
+        left -= n;
+    }
+    Close(source->fd);
+    return NULL;
+}
+
+/*
+ * sink_thread - Plays the browser: reads until the relay closes.
+ */
+void *sink_thread(void *vargp)
+{
+    Endpoint *sink = vargp;
+    static char chunk[SOURCE_CHUNK];
+    ssize_t n;
+
+    sink->bytes = 0;
+    while ((n = read(sink->fd, chunk, sizeof(chunk))) > 0) {
+        sink->bytes += n;
+    }
+    Close(sink->fd);
+    return NULL;
+}
+
+/*
+ * copy_relay - Relays length bytes the way get_response does when it
+ * does not splice: through a rio buffer and a MAXBUF bounce buffer.
+ *
+ * Return value:
+ *  - the number of bytes relayed
+ */
+long copy_relay(int fromfd, int tofd, long length)
+{
+    rio_t rio;
+    char buf[MAXBUF];
+    long done = 0;
+    ssize_t n;
+
+    Rio_readinitb(&rio, fromfd);
+    while (done < length && (n = rio_readnb(&rio, buf,
+                    length - done < MAXBUF ? length - done : MAXBUF)) > 0) {
+        if (rio_writen(tofd, buf, n) < 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+/*
+ * bench_relay - Relays a body of length bytes with one relay and prints
+ * one row of results.
+ *
+ * Parameters:
+ *  - mode: "copy" or "splice"
+ *  - length: body size in bytes
+ */
+void bench_relay(const char *mode, long length)
+{
+    int in[2], out[2];
+    Endpoint source, sink;
+    pthread_t source_tid, sink_tid;
+    double wall, cpu;
+    long left = length;
+    int on = 1;
+
+    make_pair(in);
+    make_pair(out);
+    setsockopt(out[0], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    source.fd = in[0];
+    source.bytes = length;
+    sink.fd = out[1];
+    Pthread_create(&source_tid, NULL, source_thread, &source);
+    Pthread_create(&sink_tid, NULL, sink_thread, &sink);
+
+    wall = now_s(CLOCK_MONOTONIC);
+    cpu = now_s(CLOCK_THREAD_CPUTIME_ID);
+    if (!strcmp(mode, "splice")) {
+        splice_relay(in[1], out[0], &left);
+    } else {
+        left -= copy_relay(in[1], out[0], length);
+    }
+    cpu = now_s(CLOCK_THREAD_CPUTIME_ID) - cpu;
+    wall = now_s(CLOCK_MONOTONIC) - wall;
+
+    Close(in[1]);
+    Close(out[0]);
+    Pthread_join(source_tid, NULL);
+    Pthread_join(sink_tid, NULL);
+
+    if (left != 0 || sink.bytes != length) {
+        fprintf(stderr, "%s relay moved %ld of %ld bytes\n", mode,
+                sink.bytes, length);
+    }
+    printf("%8s %10ld %10.2f %12.1f %14.3f\n", mode, length >> 20, wall,
+            (length >> 20) / wall, cpu / (length / 1e9));
+    return;
+}
@@ -7,13 +7,25 @@
  * File Description: This file contains the implementations for the main
  * cache interface functions and their associated helper functions. These
  * functions allow a client to intialize a cache, perform a lookup for an 
- * object, strore objects in a cache, and free the cache. Reader/writer
- * locks from the pthread library are used to protect shared variables so
- * that the cache can be used in a concurrent program. The cache is used by
+ * object, strore objects in a cache, and free the cache. The cache is 
+ * split into shards selected by the hash of an object's URI, and each
+ * shard's changes are serialized by its own reader/writer lock from the
+ * pthread library. Lookups take no lock at all: they walk a shard's hash
+ * index inside a read section of the epoch in epoch.c, which keeps what
+ * they read from being freed under them, and buffer their hits for a
+ * writer to apply to the recency list later, so that a hit writes nothing
+ * that another core's hits also write. The cache is used by
  * a proxy to store web objects received from a server so that if the same
  * content is requested again, it can be accessed more quickly because
  * it does not have to be retrieved again from a web server.
  *
+ * By default every object that fits is added and the least recently used
+ * ones are evicted to make room. Another eviction policy from policy.c
+ * may be chosen instead, and the cache then evicts whichever nodes the
+ * policy picks. With admission turned on, a new object that would evict
+ * others is only added if it has been requested more often than they have
+ * lately, as estimated by a sketch in admit.c.
+ *
  */
 
 #include "cache.h"
@@ -24,147 +36,383 @@
  */
 
 /*
- * cache_init - This function initializes a cache with two nodes: a start
- * and and end node. It returns a ponter to the start node, i.e. the start
- * of the linked list that implements the cache.
+ * cache_init - This function initializes a cache made of nshards empty 
+ * shards, which split the capacity evenly between them. It returns a
+ * pointer to the cache.
  *
+ * Parameters:
+ *  - capacity: the most bytes the cache may hold, counted as the sum of
+ *              the CACHE_NODE_CHARGE of every cached object
+ *  - nshards: the number of shards, or 0 to use one per online core, 
+ *             limited so that every shard is at least CACHE_MIN_SHARD_SIZE
  * Return value:
- *  - start: a pointer to the start of the cache (linked list) 
+ *  - cache: a pointer to the new, empty cache
  */
-Cache *cache_init(void) 
+Cache *cache_init(size_t capacity, int nshards) 
 {
-    Cache *start = Malloc(sizeof(Cache));
-    Cache *end = Malloc(sizeof(Cache));
+    Cache *cache = Malloc(sizeof(Cache));
+    int i;
 
-    /* 
-     * Create start and end nodes. These act as dummy nodes on
-     * the end of the linked list so that adding and removing 
-     * nodes is simplified. That is there are always two nodes 
-     * surrounding a node to be added or removed.
-     */
-    start->object_size = 0;
-    start->lru_count = 0;
-    strcpy(start->uri, "");
-    strcpy(start->content, "");
-    start->next = end;
-    start->prev = NULL;
+    if (nshards <= 0) {
+        nshards = sysconf(_SC_NPROCESSORS_ONLN);
+        if ((size_t)nshards > capacity / CACHE_MIN_SHARD_SIZE) {
+            nshards = capacity / CACHE_MIN_SHARD_SIZE;
+        }
+        if (nshards < 1) {
+            nshards = 1;
+        }
+    }
 
-    end->object_size = 0;
-    end->lru_count = 0;
-    strcpy(end->uri, "");
-    strcpy(end->content, "");
-    end->next = NULL;
-    end->prev = start;
+    cache->nshards = nshards;
+    cache->evict = NULL;
+    cache->evict_arg = NULL;
+    cache->epoch = epoch_init();
+    cache->shards = Malloc(nshards * sizeof(CacheShard));
+    for (i = 0; i < nshards; i++) {
+        shard_init(&cache->shards[i], capacity / nshards, cache->epoch);
+    }
 
-    return start;
+    return cache;
 }
 
 /*
- * cache_lookup - Searches for content in the cache by its key (URI).
- * If the content is found, the content paramter is filled with the content,
- * and a hit is returned. Otherwise, content is not filled, and a miss is
- * returned.
+ * cache_lookup - Searches for content in the cache by its key (URI),
+ * without taking any lock. If the content is found, the hit is recorded,
+ * to move the node to the front of the recency list and pass the hit on
+ * to the eviction policy once a batch of hits is drained, and the node is
+ * returned with a new reference held on it. When admission is on, the
+ * request is counted in the shard's sketch, hit or miss. The caller reads
+ * node->content and node->object_size directly, without any lock held
+ * and without copying, and must pass the node to cache_release when it
+ * is done. The content may contain NUL bytes.
  *
  * Parameters:
  *  - cache: a pointer to the cache the function should search
  *  - uri: the uri of the content
- *  - content: a buffer that is filled with the content if there is a hit
  * Return Value:
- *  - 1: a hit, the content is in the cache
- *  - 0: a miss, the content is not in the cache
+ *  - node: a hit, a referenced handle on the cached content
+ *  - NULL: a miss, the content is not in the cache
  */
-int cache_lookup(Cache *cache, char *uri, char *content)
+CacheNode *cache_lookup(Cache *cache, char *uri)
 {
+    uint64_t hash = hash_uri(uri);
+    CacheShard *shard = get_shard(cache, hash);
+    CacheNode *node;
+    int token;
+
+    if (shard->admit != NULL) {
+        admit_record(shard->admit, hash);
+    }
+
     /* 
-     * Use a read lock to allow multiple readers or one writer
-     * to access the function 
+     * Walk the hash index inside a read section, which keeps every node
+     * reachable from it allocated until the section ends. It only needs
+     * to last long enough to take a reference on the node.
      */
-    Pthread_rwlock_rdlock(&cache_lock);
-
-    Cache *rover;
-    int hit = 0;
-
-    /* Search for the uri in the cache */
-    for (rover = cache; rover != NULL; rover = rover->next) {
-        /* Update LRU */
-        rover->lru_count += 1;
-        if (!strcmp(rover->uri, uri)) {
-            /* The content is found */
-            strncpy(content, rover->content, rover->object_size);
-            rover->lru_count = 0;
-            hit = 1;
-        }
+    token = epoch_enter(cache->epoch);
+
+    /* Search for the uri in the hash index */
+    node = find_node(shard, uri, hash);
+    if (node != NULL) {
+        /* The content is found */
+        __atomic_add_fetch(&node->refcount, 1, __ATOMIC_RELAXED);
     }
 
-    /* Unlock the cache lock */
-    Pthread_rwlock_unlock(&cache_lock);
-    return hit;
+    epoch_exit(cache->epoch, token);
+
+    /* Update LRU and the policy, later */
+    if (node != NULL) {
+        record_hit(shard, node);
+    }
+    return node;
 }   
 
+/*
+ * cache_release - Drops a reference on a node returned by cache_lookup.
+ * The node is freed once it has been evicted and no handles remain.
+ *
+ * Parameter:
+ *  - node: the node to release
+ */
+void cache_release(CacheNode *node)
+{
+    if (__atomic_sub_fetch(&node->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        Free(node);
+    }
+    return;
+}
+
 /* 
  * cache_add - This function stores content in the cache. If adding the 
- * content would cause the size of the cache to exceed its limit, the LRU
- * node is removed until there is enough space in the cache for the new 
- * content. The new node is always added to the front of the list.
+ * content would cause the size of its shard to exceed the shard's limit,
+ * the node the shard's eviction policy picks is removed, until there is
+ * enough space for the new content. The new node is always added to the 
+ * front of the list. Content that could never fit within a shard's
+ * capacity is not stored. When admission is on, the nodes the policy
+ * would evict are first picked without evicting any, and the new content
+ * is only stored if it has been requested more often than every one of
+ * them; otherwise nothing is evicted. Hits buffered by lookups are
+ * applied first, so that the policy picks from an up to
+ * date order. If the cache has an evict hook, it is called with every
+ * evicted node once the shard is unlocked, and then removed nodes are
+ * freed once lookups are done with them.
  *
  * Parameters:
  *  - cache: a pointer to the cache to which the content will be added
  *  - uri: the URI of the content
- *  - content: the actual object to be cached
+ *  - content: the actual object to be cached, which may contain NUL bytes
+ *  - size: the length of content in bytes
+ *  - expires: when the content goes stale, or CACHE_FOREVER
  */
-void cache_add(Cache *cache, char *uri, char *content)
+void cache_add(Cache *cache, char *uri, char *content, size_t size,
+        time_t expires)
 {
+    uint64_t hash = hash_uri(uri);
+    CacheShard *shard = get_shard(cache, hash);
+    size_t charge = CACHE_NODE_CHARGE(strlen(uri), size);
+    CacheEvict evict = cache->evict;
+    CacheNode *victims = NULL;
+    CacheNode *held = NULL;
+    CacheNode *victim;
+    unsigned int freq = 0;
+    int admitting = 0;
+    int admitted = 1;
+
+    if (charge > shard->capacity) {
+        return;
+    }
+
     /*
      * Use a writer lock to prevent more than one writer or reader
-     * from accessing this function at a time.
+     * from accessing the shard at a time.
      */
-    Pthread_rwlock_wrlock(&cache_lock);
-
-    int cache_size = get_cache_size(cache);
-    int content_size = strlen(content);
-    int new_size = cache_size + content_size;
-    int remove_size;
+    Pthread_rwlock_wrlock(&shard->lock);
+    drain_hits(shard);
 
     /* 
-     * Does not check for miss/hit. Due to how where cache_add is used 
-     * in the proxy, there will always be a miss in add. Thus, checking
-     * for a miss here would only slow down the add function.
+     * A stale copy being replaced by a new response, or one added by a
+     * request that gave up waiting for another's fetch, is dropped
+     * first. It is out of date, so it is not handed to a lower tier.
      */
+    if ((victim = find_node(shard, uri, hash)) != NULL) {
+        remove_node(shard, victim, 0);
+    } else if (shard->admit != NULL) {
+        admitting = 1;
+        freq = admit_estimate(shard->admit, hash);
+    }
 
-    /* Remove LRU nodes until there is enough space in the cache */
-    while (new_size > MAX_CACHE_SIZE) {
-        remove_size = new_size - MAX_CACHE_SIZE;
-        remove_node(cache, remove_size);
-        /* Update the size of the cache after a removal */
-        new_size = get_cache_size(cache) + content_size;
+    /* With admission, the victims are weighed before any is evicted */
+    if (admitting) {
+        held = pick_victims(shard, charge, freq, &admitted);
+        if (!admitted) {
+            shard->rejections += 1;
+        }
+    }
+
+    /* 
+     * Remove the nodes the policy picks, or the ones admission weighed,
+     * until there is enough space in the shard. If a lower tier wants
+     * them, each is kept referenced and chained through its now unused
+     * next link.
+     */
+    while (admitted && shard->byte_count + charge > shard->capacity) {
+        if (admitting) {
+            victim = held;
+            held = victim->held;
+        } else {
+            victim = shard->policy->victim(shard);
+        }
+        if (evict != NULL) {
+            __atomic_add_fetch(&victim->refcount, 1, __ATOMIC_RELAXED);
+        }
+        remove_node(shard, victim, 1);
+        if (evict != NULL) {
+            victim->next = victims;
+            victims = victim;
+        }
+        shard->evictions += 1;
+    }
+    if (shard->byte_count + charge <= shard->capacity) {
+        add_node(shard, uri, content, size, expires);
     }
-    add_node(cache, uri, content, content_size);
 
     /* Unlock the writer lock */
-    Pthread_rwlock_unlock(&cache_lock);
+    Pthread_rwlock_unlock(&shard->lock);
+
+    /* Hand the evicted nodes down, with no lock held */
+    while (victims != NULL) {
+        victim = victims;
+        victims = victim->next;
+        evict(cache->evict_arg, victim);
+        cache_release(victim);
+    }
+
+    epoch_reclaim(cache->epoch, 0);
+    return;
+}
+
+/*
+ * cache_fresh - Returns whether a node's content may still be served
+ * without asking the web server, at time now.
+ */
+int cache_fresh(CacheNode *node, time_t now)
+{
+    return __atomic_load_n(&node->expires, __ATOMIC_RELAXED) > now;
+}
+
+/*
+ * cache_expires - Returns when a node's content goes, or went, stale.
+ */
+time_t cache_expires(CacheNode *node)
+{
+    return __atomic_load_n(&node->expires, __ATOMIC_RELAXED);
+}
+
+/*
+ * cache_refresh - This function gives a node a new expiry, after the web
+ * server has confirmed that its content is still current. The content
+ * itself never changes, so readers holding the node are unaffected.
+ *
+ * Parameters:
+ *  - node: a node returned by cache_lookup
+ *  - expires: when the content goes stale again
+ */
+void cache_refresh(CacheNode *node, time_t expires)
+{
+    __atomic_store_n(&node->expires, expires, __ATOMIC_RELAXED);
     return;
 }
 
 /*
- * cache_destroy - This functions loops over the list and frees all the 
- * nodes.
+ * cache_destroy - This functions destroys every shard, freeing all of
+ * their nodes, frees the nodes still waiting for a grace period, and then
+ * frees the cache itself. No other thread may be using the cache.
  *
  * Parameter:
  *  - cache: the cache to be destroyed
  */
 void cache_destroy(Cache *cache) 
 {
-    Cache *rover;
+    int i;
 
-    while (cache != NULL) {
-        rover = cache->next;
-        Free(cache);
-        cache = rover;
+    for (i = 0; i < cache->nshards; i++) {
+        shard_destroy(&cache->shards[i]);
     }
+    epoch_destroy(cache->epoch);
+    Free(cache->shards);
+    Free(cache);
+
+    return;
+}
+
+/*
+ * cache_get_stats - This function sums the running counters of every
+ * shard into stats. The counters are kept up to date by add_node and
+ * remove_node, so this does not walk the cache.
+ *
+ * Parameters:
+ *  - cache: the cache to report on
+ *  - stats: filled with the current counters
+ */
+void cache_get_stats(Cache *cache, CacheStats *stats)
+{
+    CacheShard *shard;
+    int i;
+
+    memset(stats, 0, sizeof(CacheStats));
+    for (i = 0; i < cache->nshards; i++) {
+        shard = &cache->shards[i];
+        Pthread_rwlock_rdlock(&shard->lock);
+        stats->nodes += shard->node_count;
+        stats->bytes += shard->byte_count;
+        stats->peak_nodes += shard->peak_nodes;
+        stats->peak_bytes += shard->peak_bytes;
+        stats->evictions += shard->evictions;
+        stats->rejections += shard->rejections;
+        Pthread_rwlock_unlock(&shard->lock);
+    }
+
+    return;
+}
 
+/*
+ * cache_set_evict - This function sets the hook cache_add calls with each
+ * node it evicts, which lets a lower tier keep what the cache cannot. It
+ * should be set before the cache is shared between threads.
+ *
+ * Parameters:
+ *  - cache: the cache
+ *  - evict: the hook, or NULL to simply drop evicted nodes
+ *  - arg: passed to evict as its first argument
+ */
+void cache_set_evict(Cache *cache, CacheEvict evict, void *arg)
+{
+    cache->evict = evict;
+    cache->evict_arg = arg;
+    return;
+}
+
+/*
+ * cache_set_admit - This function turns on TinyLFU admission, giving
+ * every shard a sketch sized for its budget. It should be called before
+ * the cache is shared between threads.
+ *
+ * Parameter:
+ *  - cache: the cache
+ */
+void cache_set_admit(Cache *cache)
+{
+    int i;
+
+    for (i = 0; i < cache->nshards; i++) {
+        if (cache->shards[i].admit == NULL) {
+            cache->shards[i].admit = admit_init(cache->shards[i].capacity);
+        }
+    }
     return;
 }
 
+/*
+ * cache_set_policy - This function makes every shard evict by the named
+ * policy. Nodes already cached are handed to the new policy from the
+ * least to the most recently used, as if they had just been added in
+ * that order. It should be called before the cache is shared between
+ * threads.
+ *
+ * Parameters:
+ *  - cache: the cache
+ *  - name: "lru", "arc", "s3fifo" or "gdsf"
+ * Return value:
+ *  - 0: on success
+ *  - -1: there is no policy by that name, and nothing changed
+ */
+int cache_set_policy(Cache *cache, const char *name)
+{
+    const CachePolicy *policy = policy_find(name);
+    CacheShard *shard;
+    CacheNode *rover;
+    int i;
+
+    if (policy == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < cache->nshards; i++) {
+        shard = &cache->shards[i];
+        Pthread_rwlock_wrlock(&shard->lock);
+        drain_hits(shard);
+        shard->policy->destroy(shard);
+        shard->policy = policy;
+        shard->policy->init(shard);
+        for (rover = shard->end->prev; rover != shard->start;
+                rover = rover->prev) {
+            shard->policy->insert(shard, rover);
+        }
+        Pthread_rwlock_unlock(&shard->lock);
+    }
+    return 0;
+}
+
 /*
  * End Main Cache Functions
  * ------------------------
@@ -177,86 +425,498 @@ void cache_destroy(Cache *cache)
  */
 
 /*
- * get_cache_size - This function calculates the real size of the cache.
- * It loops over the cache and sums the object sizes.
+ * shard_init - This function initializes an empty shard with two nodes: 
+ * a start and and end node, an empty hash index, empty rings of hits, its
+ * lock, and the LRU policy.
+ *
+ * Parameters:
+ *  - shard: the shard to initialize
+ *  - capacity: the shard's share of the cache budget
+ *  - epoch: the cache's epoch
+ */
+void shard_init(CacheShard *shard, size_t capacity, Epoch *epoch)
+{
+    CacheNode *start = Malloc(sizeof(CacheNode) + 1);
+    CacheNode *end = Malloc(sizeof(CacheNode) + 1);
+
+    /* 
+     * Create start and end nodes. These act as dummy nodes on
+     * the end of the linked list so that adding and removing 
+     * nodes is simplified. That is there are always two nodes 
+     * surrounding a node to be added or removed.
+     */
+    start->refcount = 1;
+    start->object_size = 0;
+    start->charge = 0;
+    start->hash = 0;
+    start->expires = 0;
+    start->data[0] = '\0';
+    start->uri = start->data;
+    start->content = start->data;
+    start->next = end;
+    start->prev = NULL;
+    start->hash_next[0] = NULL;
+    start->hash_next[1] = NULL;
+
+    end->refcount = 1;
+    end->object_size = 0;
+    end->charge = 0;
+    end->hash = 0;
+    end->expires = 0;
+    end->data[0] = '\0';
+    end->uri = end->data;
+    end->content = end->data;
+    end->next = NULL;
+    end->prev = start;
+    end->hash_next[0] = NULL;
+    end->hash_next[1] = NULL;
+
+    Pthread_rwlock_init(&shard->lock, NULL);
+    shard->start = start;
+    shard->end = end;
+    shard->index = index_init(CACHE_INIT_BUCKETS, 0);
+    shard->capacity = capacity;
+    shard->node_count = 0;
+    shard->byte_count = 0;
+    shard->peak_nodes = 0;
+    shard->peak_bytes = 0;
+    shard->evictions = 0;
+    shard->rejections = 0;
+    if (posix_memalign((void **)&shard->reads, EPOCH_LINE,
+                CACHE_READ_STRIPES * sizeof(CacheReads)) != 0) {
+        unix_error("posix_memalign error");
+    }
+    memset(shard->reads, 0, CACHE_READ_STRIPES * sizeof(CacheReads));
+    shard->epoch = epoch;
+    shard->admit = NULL;
+    shard->policy = &lru_policy;
+    shard->policy->init(shard);
+
+    return;
+}
+
+/*
+ * shard_destroy - This functions loops over a shard's list and drops the
+ * cache's reference on all the nodes, then frees its hash index, rings of
+ * hits, policy state and lock.
  *
  * Parameter:
- *  - cache: pointer to the cache whose size is being found
+ *  - shard: the shard to be destroyed
+ */
+void shard_destroy(CacheShard *shard)
+{
+    CacheNode *node = shard->start;
+    CacheNode *rover;
+
+    while (node != NULL) {
+        rover = node->next;
+        cache_release(node);
+        node = rover;
+    }
+    Free(shard->index);
+    free(shard->reads);
+    shard->policy->destroy(shard);
+    if (shard->admit != NULL) {
+        admit_destroy(shard->admit);
+    }
+    pthread_rwlock_destroy(&shard->lock);
+
+    return;
+}
+
+/*
+ * get_shard - This function returns the shard responsible for a URI. The
+ * low bits of the hash pick the bucket within a shard, so the shard is
+ * picked with the high bits.
+ *
+ * Parameters:
+ *  - cache: the cache
+ *  - hash: hash of the URI, as returned by hash_uri
  * Return value:
- *  - cache_size: the real size of the cache
+ *  - the shard that holds, or would hold, the URI
  */
-int get_cache_size(Cache *cache)
+CacheShard *get_shard(Cache *cache, uint64_t hash)
+{
+    return &cache->shards[(hash >> 32) % cache->nshards];
+}
+
+/*
+ * pick_victims - This function picks the nodes a shard's policy would
+ * evict to make room for charge more bytes, and compares the new content
+ * with each, without evicting any. Each is held out of the policy's
+ * order while the next is picked, and all are put back before it
+ * returns. It is called with the shard locked for writing.
+ *
+ * Parameters:
+ *  - shard: pointer to the shard
+ *  - charge: the charge of the new content
+ *  - freq: how often the new content has been requested
+ *  - admitted: set to 0 if one of the nodes has been requested at least
+ *              as often as the new content, and to 1 otherwise
+ * Return value:
+ *  - the nodes to evict, in the order the policy picked them, chained
+ *    through their held links, if admitted
+ */
+CacheNode *pick_victims(CacheShard *shard, size_t charge, unsigned int freq,
+        int *admitted)
+{
+    CacheNode *picked = NULL;
+    CacheNode *victims = NULL;
+    CacheNode *node;
+    size_t held_bytes = 0;
+
+    *admitted = 1;
+    while (shard->byte_count - held_bytes + charge > shard->capacity) {
+        node = shard->policy->victim(shard);
+        if (admit_estimate(shard->admit, node->hash) >= freq) {
+            *admitted = 0;
+            break;
+        }
+        shard->policy->hold(shard, node);
+        node->held = picked;
+        picked = node;
+        held_bytes += node->charge;
+    }
+
+    /* Put them back, last picked first, which also restores their order */
+    while (picked != NULL) {
+        node = picked;
+        picked = node->held;
+        shard->policy->unhold(shard, node);
+        node->held = victims;
+        victims = node;
+    }
+
+    return *admitted ? victims : NULL;
+}
+
+/*
+ * find_node - This function looks up a URI in a shard's hash index. Only
+ * the nodes in one bucket are examined, so the cost does not depend on 
+ * how many objects are cached. It may be called with the shard locked, or
+ * from inside a read section of the epoch, while writers change the
+ * index; then every pointer it follows is read atomically, and the nodes
+ * it reaches stay allocated until the section ends.
+ *
+ * Parameters:
+ *  - shard: pointer to the shard to search
+ *  - uri: the URI of the content
+ *  - hash: hash of the URI, as returned by hash_uri
+ * Return value:
+ *  - node: the node holding the URI, or NULL if it is not cached
+ */
+CacheNode *find_node(CacheShard *shard, char *uri, uint64_t hash)
 {
-    int cache_size = 0;
-    Cache *rover;
+    CacheIndex *index = __atomic_load_n(&shard->index, __ATOMIC_ACQUIRE);
+    int link = index->link;
+    CacheNode *node = __atomic_load_n(
+            &index->buckets[hash & (index->nbuckets - 1)], __ATOMIC_ACQUIRE);
 
-    /* Sum up all object sizes */
-    for (rover = cache; rover != NULL; rover = rover->next) {
-        cache_size += rover->object_size;
+    for ( ; node != NULL;
+            node = __atomic_load_n(&node->hash_next[link], __ATOMIC_ACQUIRE)) {
+        if (node->hash == hash && !strcmp(node->uri, uri)) {
+            return node;
+        }
     }
 
-    return cache_size;
+    return NULL;
 }
 
-/* add_node - This adds a node to a link list and initializes the fields
- * of the struct with the parameters given.
+/*
+ * index_init - This function allocates an empty hash index.
  *
  * Parameters:
- *  - cache: pointer to the cache to which we are adding a node
+ *  - nbuckets: number of buckets, a power of two
+ *  - link: which of the nodes' hash_next links its chains use
+ * Return value:
+ *  - the index
+ */
+CacheIndex *index_init(size_t nbuckets, int link)
+{
+    CacheIndex *index = Calloc(1, sizeof(CacheIndex) 
+            + nbuckets * sizeof(CacheNode *));
+
+    index->nbuckets = nbuckets;
+    index->link = link;
+    return index;
+}
+
+/*
+ * grow_index - This function replaces a shard's hash index with one of
+ * twice as many buckets, with every node rehashed into it. It is called
+ * when the index holds more nodes than buckets, which keeps chains short.
+ * The new index chains the nodes through the link the old one does not
+ * use, so lookups still walking the old one are undisturbed; the old one
+ * is freed after a grace period, which also frees its link for the next
+ * time the index grows.
+ *
+ * Parameter:
+ *  - shard: pointer to the shard whose index is grown
+ */
+void grow_index(CacheShard *shard)
+{
+    CacheIndex *old = shard->index;
+    CacheIndex *index = index_init(old->nbuckets * 2, !old->link);
+    CacheNode *rover;
+    size_t i;
+
+    for (rover = shard->start->next; rover != shard->end; 
+            rover = rover->next) {
+        i = rover->hash & (index->nbuckets - 1);
+        __atomic_store_n(&rover->hash_next[index->link], index->buckets[i],
+                __ATOMIC_RELAXED);
+        index->buckets[i] = rover;
+    }
+
+    __atomic_store_n(&shard->index, index, __ATOMIC_RELEASE);
+    epoch_synchronize(shard->epoch);
+    Free(old);
+    return;
+}
+
+/*
+ * get_cache_size - This function returns the real size of the cache, the
+ * bytes charged for all of its nodes, which each shard keeps as a running
+ * count.
+ *
+ * Parameter:
+ *  - cache: pointer to the cache whose size is being found
+ * Return value:
+ *  - the real size of the cache
+ */
+int get_cache_size(Cache *cache)
+{
+    CacheStats stats;
+
+    cache_get_stats(cache, &stats);
+    return stats.bytes;
+}
+
+/* add_node - This adds a node to a shard's list and initializes the fields
+ * of the struct with the parameters given. The node is allocated with
+ * room for exactly its URI and content. The node is also added to the
+ * hash index, which is grown if it has become too full, and handed to the
+ * eviction policy. It is only published to lookups once it is complete.
+ *
+ * Parameters:
+ *  - shard: pointer to the shard to which we are adding a node
  *  - uri: URI of the content
  *  - content: buffer containing the content
- *  - object_size: size of the object (length of the content string)
+ *  - object_size: size of the object in bytes
+ *  - expires: when the object goes stale
  */
-void add_node(Cache *cache, char *uri, char *content, int object_size)
+void add_node(CacheShard *shard, char *uri, char *content, 
+        size_t object_size, time_t expires)
 {
-    Cache *node = Malloc(sizeof(Cache));
+    size_t uri_len = strlen(uri);
+    CacheNode *node = Malloc(sizeof(CacheNode) + uri_len + 1 
+            + object_size);
+    CacheIndex *index = shard->index;
+    CacheNode **bucket;
     
     /* Initialize the struct fields */
+    node->refcount = 1;
     node->object_size = object_size;
-    node->lru_count = 0;
-    strcpy(node->uri, uri);
-    strcpy(node->content, content);
-    /* Link the node into the cache */
-    node->next = cache->next;
-    node->prev = cache;
+    node->charge = CACHE_NODE_CHARGE(uri_len, object_size);
+    node->hash = hash_uri(uri);
+    node->expires = expires;
+    node->uri = node->data;
+    node->content = node->data + uri_len + 1;
+    memcpy(node->uri, uri, uri_len + 1);
+    memcpy(node->content, content, object_size);
+    /* Link the node into the shard */
+    node->next = shard->start->next;
+    node->prev = shard->start;
     node->next->prev = node;
-    cache->next = node;
+    shard->start->next = node;
+    /* Link the node into its hash bucket */
+    bucket = &index->buckets[node->hash & (index->nbuckets - 1)];
+    node->hash_next[index->link] = *bucket;
+    node->hash_next[!index->link] = NULL;
+    __atomic_store_n(bucket, node, __ATOMIC_RELEASE);
+
+    /* Update the counters */
+    shard->node_count += 1;
+    shard->byte_count += node->charge;
+    if (shard->node_count > shard->peak_nodes) {
+        shard->peak_nodes = shard->node_count;
+    }
+    if (shard->byte_count > shard->peak_bytes) {
+        shard->peak_bytes = shard->byte_count;
+    }
+
+    if (shard->node_count > index->nbuckets) {
+        grow_index(shard);
+    }
+    shard->policy->insert(shard, node);
 
     return;
 }
 
 /*
- * remove_node - This searches for a node in a linked list and removes it. 
- * The node is a LRU node with object_size greater than or equal to the 
- * remove_size.
+ * record_hit - This records a hit on a node in the ring that the calling
+ * thread's epoch slot maps to, to be passed on to the list and the
+ * policy later. Threads whose slots map to the same ring share it, and
+ * claim entries with an atomic increment of its count. The lookup that
+ * fills the ring drains the shard's rings itself if it can take the
+ * shard lock at once; otherwise the next add drains them, and the ring
+ * meanwhile overwrites its oldest hits.
  *
  * Parameters:
- *  - cache: pointer the cache from which a node will be removed
- *  - remove_size: minimum size of the node to be removed
+ *  - shard: pointer to the shard holding the node
+ *  - node: the node hit, referenced by the caller
  */
-void remove_node(Cache *cache, int remove_size) 
+void record_hit(CacheShard *shard, CacheNode *node)
 {
-    Cache *rover;
-    Cache *rm_node;
-    int highest_lru = -1;
+    CacheReads *reads = &shard->reads[epoch_slot() % CACHE_READ_STRIPES];
+    unsigned long n = __atomic_fetch_add(&reads->recorded, 1,
+            __ATOMIC_RELAXED);
+    CacheRead *hit = &reads->hits[n % CACHE_READ_BUFFER];
 
-    /* 
-     * Finds the LRU node that is big enough to accommodate the new
-     * block if removed.
-     */
-    for (rover = cache; rover != NULL; rover = rover->next) {
-        if (rover->lru_count > highest_lru 
-                && rover->object_size >= remove_size) {
-            rm_node = rover;
+    __atomic_store_n(&hit->hash, node->hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&hit->node, node, __ATOMIC_RELEASE);
+
+    if ((n + 1) % CACHE_READ_BUFFER == 0
+            && pthread_rwlock_trywrlock(&shard->lock) == 0) {
+        drain_hits(shard);
+        Pthread_rwlock_unlock(&shard->lock);
+    }
+    return;
+}
+
+/*
+ * drain_hits - This passes the hits buffered in a shard's rings on to its
+ * recency list and policy, oldest first in each ring. A buffered node may
+ * have been removed, and even freed, since its hit, so it is only touched
+ * once it is found in its hash bucket. It is called with the shard locked
+ * for writing.
+ *
+ * Parameter:
+ *  - shard: pointer to the shard
+ */
+void drain_hits(CacheShard *shard)
+{
+    CacheReads *reads;
+    CacheRead *hit;
+    CacheNode *node;
+    unsigned long recorded, n;
+    uint64_t hash;
+    int i;
+
+    for (i = 0; i < CACHE_READ_STRIPES; i++) {
+        reads = &shard->reads[i];
+        recorded = __atomic_load_n(&reads->recorded, __ATOMIC_ACQUIRE);
+        n = reads->drained;
+        /* Older hits have been overwritten */
+        if (recorded - n > CACHE_READ_BUFFER) {
+            n = recorded - CACHE_READ_BUFFER;
+        }
+        for ( ; n != recorded; n++) {
+            hit = &reads->hits[n % CACHE_READ_BUFFER];
+            node = __atomic_exchange_n(&hit->node, NULL, __ATOMIC_ACQUIRE);
+            hash = __atomic_load_n(&hit->hash, __ATOMIC_RELAXED);
+            if (node != NULL && node_cached(shard, node, hash)) {
+                move_to_front(shard, node);
+            }
         }
+        reads->drained = recorded;
     }
+    return;
+}
 
-    /* Unlink the node and free it */
-    if (rm_node != NULL) {
-        rm_node->next->prev = rm_node->prev;
-        rm_node->prev->next = rm_node->next;
-        Free(rm_node);
+/*
+ * node_cached - This returns whether a node is in a shard's hash index,
+ * comparing pointers only, so that the node is never read if it has been
+ * freed. It is called with the shard locked for writing.
+ *
+ * Parameters:
+ *  - shard: pointer to the shard
+ *  - node: the node, which may no longer be allocated
+ *  - hash: the hash the node's URI had
+ */
+int node_cached(CacheShard *shard, CacheNode *node, uint64_t hash)
+{
+    CacheIndex *index = shard->index;
+    CacheNode *rover = index->buckets[hash & (index->nbuckets - 1)];
+
+    for ( ; rover != NULL; rover = rover->hash_next[index->link]) {
+        if (rover == node) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * move_to_front - This moves a node to the front of its shard's recency
+ * list, marking it as the most recently used, and tells the eviction
+ * policy about the hit. It is called when buffered hits are drained, with
+ * the shard locked for writing.
+ *
+ * Parameters:
+ *  - shard: pointer to the shard holding the node
+ *  - node: the node that was used
+ */
+void move_to_front(CacheShard *shard, CacheNode *node)
+{
+    if (shard->start->next != node) {
+        /* Unlink the node from its current position */
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        /* Relink it right after the start sentinel */
+        node->next = shard->start->next;
+        node->prev = shard->start;
+        node->next->prev = node;
+        shard->start->next = node;
+    }
+    shard->policy->hit(shard, node);
+    return;
+}
+
+/*
+ * remove_node - This unlinks a node from its shard's list, its hash
+ * bucket and its eviction policy, and retires it, so that the cache's
+ * reference on it is dropped after a grace period, once no lookup can be
+ * walking through it, which frees it unless a lookup still holds a
+ * handle.
+ *
+ * Parameters:
+ *  - shard: pointer the shard from which a node will be removed
+ *  - node: the node to remove
+ *  - evicted: 1 if the policy picked it to make room, 0 if it is being
+ *             replaced
+ */
+void remove_node(CacheShard *shard, CacheNode *node, int evicted) 
+{
+    CacheIndex *index = shard->index;
+    CacheNode **link;
+
+    shard->policy->remove(shard, node, evicted);
+
+    /* Unlink the node from the list */
+    node->next->prev = node->prev;
+    node->prev->next = node->next;
+
+    /* Unlink the node from its hash bucket */
+    link = &index->buckets[node->hash & (index->nbuckets - 1)];
+    while (*link != node) {
+        link = &(*link)->hash_next[index->link];
     }
+    __atomic_store_n(link, node->hash_next[index->link], __ATOMIC_RELEASE);
+
+    shard->node_count -= 1;
+    shard->byte_count -= node->charge;
+    epoch_retire(shard->epoch, node, retire_node);
+    return;
+}
+
+/*
+ * retire_node - Drops the cache's reference on a removed node, once a
+ * grace period has passed since it was removed.
+ */
+void retire_node(void *node)
+{
+    cache_release(node);
     return;
 }
 
@@ -268,23 +928,37 @@ void remove_node(Cache *cache, int remove_size)
  */
 void print_cache(Cache *cache)
 {
-    Cache *rover;
-    int max_cache = MAX_CACHE_SIZE;
+    CacheShard *shard;
+    CacheNode *rover;
     int max_obj = MAX_OBJECT_SIZE;
-    int node_count = 0;
+    int node_count;
+    int i;
 
-    printf("MAX_CACHE: %d\n", max_cache);
+    printf("Shards: %d\n", cache->nshards);
     printf("MAX_OBJ: %d\n", max_obj);
 
-    for (rover = cache; rover != NULL; rover = rover->next) {
-        printf("Node %d: %p\n", node_count, rover);
-        printf("Obj size: %d\n", rover->object_size);
-        printf("lru: %d\n", rover->lru_count);
-        printf("uri: %s\n", rover->uri);
-        printf("content: %s\n", rover->content);
-        printf("next: %p\n", rover->next);
-        printf("prev: %p\n", rover->prev);
-        node_count++;
+    for (i = 0; i < cache->nshards; i++) {
+        shard = &cache->shards[i];
+        node_count = 0;
+        printf("Shard %d\n", i);
+        printf("Capacity: %lu\n", (unsigned long)shard->capacity);
+        printf("Buckets: %lu\n", (unsigned long)shard->index->nbuckets);
+        printf("Nodes: %lu (peak %lu)\n", (unsigned long)shard->node_count,
+                (unsigned long)shard->peak_nodes);
+        printf("Bytes: %lu (peak %lu)\n", (unsigned long)shard->byte_count,
+                (unsigned long)shard->peak_bytes);
+        printf("Evictions: %lu\n", shard->evictions);
+
+        for (rover = shard->start; rover != NULL; rover = rover->next) {
+            printf("Node %d: %p\n", node_count, rover);
+            printf("Obj size: %lu\n", (unsigned long)rover->object_size);
+            printf("uri: %s\n", rover->uri);
+            printf("content: %.*s\n", (int)rover->object_size, 
+                    rover->content);
+            printf("next: %p\n", rover->next);
+            printf("prev: %p\n", rover->prev);
+            node_count++;
+        }
     }
 }
 
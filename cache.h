@@ -16,40 +16,222 @@
 #define __CACHE_H__
 
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
 
 #include "csapp.h"
+#include "admit.h"
+#include "policy.h"
+#include "epoch.h"
+#include "hash.h"
 
 /* Macros */
-#define MAX_CACHE_SIZE  1049000 /* Max size of the entire cache */
+#define MAX_CACHE_SIZE  1049000 /* Default memory budget of the cache */
 #define MAX_OBJECT_SIZE 102400  /* Max size of one cache object */
+#define CACHE_INIT_BUCKETS 64   /* Starting number of hash index buckets */
+#define CACHE_READ_STRIPES 16   /* Buffers of hits in each shard */
+#define CACHE_READ_BUFFER 16    /* Hits a buffer holds before it is drained */
+#define CACHE_FOREVER LONG_MAX  /* Expiry of an object that never goes 
+                                   stale */
 
-/* Global variables */
-extern pthread_rwlock_t cache_lock; /* Lock for global cache,
-                                       defined in proxy.c */
+/* 
+ * Bytes charged against the cache budget for one object: the node 
+ * itself, its NUL-terminated URI, its content, and its hash index slot.
+ */
+#define CACHE_NODE_CHARGE(uri_len, object_size) \
+    (sizeof(CacheNode) + (uri_len) + 1 + (object_size) \
+     + sizeof(CacheNode *))
+
+/* 
+ * When the number of shards is chosen automatically, each shard is kept
+ * large enough to hold two of the largest cacheable objects.
+ */
+#define CACHE_MIN_SHARD_SIZE (2 * CACHE_NODE_CHARGE(MAXLINE, MAX_OBJECT_SIZE))
 
 /*
- * Defines a node in the cache, which is implemented as
- * a doubly-linked list.
+ * Defines a node in the cache. All nodes are kept on a doubly-linked
+ * list in recency order, most recently used first, and each node is
+ * also chained into one bucket of the hash index. A node is allocated
+ * with exactly enough room after it for its URI and content. The URI and
+ * content never change once the node is in the cache, and the node is
+ * reference counted: the cache holds one reference while the node is 
+ * cached, and until a grace period after it leaves, since lookups may
+ * still be walking through it, and every handle returned by cache_lookup
+ * holds another, so an evicted node stays readable until its last handle
+ * is released. Only the expiry may change, when a stale node is
+ * revalidated. The shard's eviction policy keeps its own order of the
+ * nodes in the policy fields, which only it touches.
+ */
+typedef struct CacheNode {
+    int refcount;                  /* References held on this node */
+    size_t object_size;            /* Size of cache obj stored at this node */
+    size_t charge;                 /* Bytes this node counts against the
+                                      cache budget */
+    uint64_t hash;                 /* Hash of the URI, computed once on add */
+    time_t expires;                /* When the content goes stale */
+    char *uri;                     /* URI used as key to find content in 
+                                      cache, stored in data */
+    char *content;                 /* The actual content from the web server,
+                                      object_size bytes of arbitrary data
+                                      stored in data after the URI */
+    struct CacheNode *next;        /* Pointer to next node in cache */
+    struct CacheNode *prev;        /* Pointer to previous node in cache */
+    struct CacheNode *hash_next[2]; /* Next node in the same hash bucket,
+                                      through either of the two links an
+                                      index may use */
+    struct CacheNode *qnext;       /* Next older node on the policy's queue */
+    struct CacheNode *qprev;       /* Next newer node on the policy's queue */
+    int queue;                     /* Which of the policy's queues it is on */
+    unsigned int freq;             /* Hits the policy has counted */
+    double priority;               /* Priority, for policies that rank */
+    size_t heap_index;             /* Position in the policy's heap */
+    struct CacheNode *held;        /* Next victim picked for an add */
+    char data[];                   /* Storage for uri and content */
+} CacheNode;
+
+/*
+ * Defines the hash index of a shard, which lookups walk without a lock.
+ * Its buckets chain nodes through one of their two hash_next links. When
+ * the index grows, the new one is chained through the other link, so the
+ * chains of the old one stay intact for the lookups still walking it.
+ */
+typedef struct CacheIndex {
+    size_t nbuckets;               /* Number of buckets, a power of two */
+    int link;                      /* Which hash_next the chains use */
+    CacheNode *buckets[];          /* The chains */
+} CacheIndex;
+
+/*
+ * One hit waiting to be passed on to a shard's recency list and policy.
+ */
+typedef struct CacheRead {
+    uint64_t hash;                 /* Hash of the node's URI */
+    CacheNode *node;               /* The node hit, or NULL once drained */
+} CacheRead;
+
+/*
+ * A ring of hits recorded by the threads whose slot maps to it. Hits are
+ * drained in the order they were recorded; a hit is dropped if the ring
+ * laps it before it is drained, so a busy shard only ever loses recency
+ * information. Each ring has a cache line to itself.
+ */
+typedef struct CacheReads {
+    unsigned long recorded;        /* Hits ever recorded in the ring */
+    unsigned long drained;         /* Hits recorded before the last drain */
+    CacheRead hits[CACHE_READ_BUFFER]; /* The ring */
+} __attribute__((aligned(EPOCH_LINE))) CacheReads;
+
+/*
+ * Defines one shard of the cache: the recency list of nodes, bounded by a
+ * start and end sentinel, and a chained hash index over the URIs of those
+ * nodes. Each shard has its own share of the cache budget and evicts on
+ * its own. The list and index are changed only with the shard's lock held
+ * for writing. Lookups take no lock: they walk the index inside a read
+ * section of the cache's epoch, take a reference on the node hit, and
+ * record the hit in one of the shard's rings rather than reordering the
+ * list. The hits are passed on to the list and the policy in a batch, by
+ * the lookup that fills a ring if the lock is free, and otherwise by the
+ * next add. The policy decides which node is evicted when the shard is
+ * full; the recency list is kept whatever the policy, for snapshots. When
+ * admission is on, the shard also keeps a sketch of how often URIs are
+ * requested, which needs no lock.
+ *
+ * A lookup still writes memory that other threads write too. The rings
+ * are striped, not per-thread: a thread's ring is picked by its epoch
+ * slot, so it has one to itself only while there are no more threads
+ * than CACHE_READ_STRIPES, and threads that share a ring claim entries
+ * with an atomic increment of its count. The epoch's reader counters are
+ * striped the same way, over EPOCH_SLOTS. And every hit increments the
+ * node's refcount, so lookups of one popular node all write its cache
+ * line.
+ */
+typedef struct CacheShard {
+    pthread_rwlock_t lock;         /* Protects everything in the shard */
+    CacheNode *start;              /* Sentinel at the front of the list */
+    CacheNode *end;                /* Sentinel at the back of the list */
+    CacheIndex *index;             /* Hash index */
+    size_t capacity;               /* Budget for byte_count */
+    size_t node_count;             /* Number of nodes in the hash index */
+    size_t byte_count;             /* Sum of charge over all nodes */
+    size_t peak_nodes;             /* High-water mark of node_count */
+    size_t peak_bytes;             /* High-water mark of byte_count */
+    unsigned long evictions;       /* Nodes removed to make room */
+    unsigned long rejections;      /* Adds turned away by admission */
+    CacheReads *reads;             /* CACHE_READ_STRIPES rings of hits */
+    Epoch *epoch;                  /* The cache's epoch */
+    Admit *admit;                  /* Request frequencies, or NULL to add
+                                      every object that fits */
+    const CachePolicy *policy;     /* Picks the nodes to evict */
+    void *policy_state;            /* The policy's own state */
+} CacheShard;
+
+/*
+ * Called with each node the cache evicts to make room, so that a lower
+ * tier can keep it. The node is referenced for the duration of the call,
+ * and no shard lock is held.
+ */
+typedef void (*CacheEvict)(void *arg, CacheNode *node);
+
+/*
+ * Defines the cache itself, a fixed array of independently locked shards,
+ * and the epoch that lets lookups read them without a lock. A URI always
+ * maps to the same shard, chosen by its hash.
  */
 typedef struct Cache {
-    int object_size;               /* Size of cache obj stored at this node */
-    int lru_count;                 /* Counter to keep track of LRU node */
-    char uri[MAXLINE];             /* URI used as key to find content in 
-                                      cache */
-    char content[MAX_OBJECT_SIZE]; /* The actual content from the web server */
-    struct Cache *next;            /* Pointer to next node in cache */
-    struct Cache *prev;            /* Pointer to previous node in cache */
+    int nshards;                   /* Number of shards */
+    CacheShard *shards;            /* The shards */
+    Epoch *epoch;                  /* Defers freeing what lookups read */
+    CacheEvict evict;              /* Told about evicted nodes, or NULL */
+    void *evict_arg;               /* First argument to evict */
 } Cache;
 
+/*
+ * A snapshot of the cache's counters, for monitoring. Each shard is read
+ * consistently, and the shards' counters are summed, so the peaks are the
+ * sum of every shard's own high-water mark.
+ */
+typedef struct CacheStats {
+    size_t nodes;                  /* Objects currently cached */
+    size_t bytes;                  /* Bytes currently charged to the cache */
+    size_t peak_nodes;             /* Sum of shard peaks of nodes */
+    size_t peak_bytes;             /* Sum of shard peaks of bytes */
+    unsigned long evictions;       /* Objects evicted so far */
+    unsigned long rejections;      /* Objects admission turned away */
+} CacheStats;
+
 /* Main Cache Function Prototpyes */
-Cache *cache_init(void);
-int cache_lookup(Cache *cache, char *uri, char *content);
-void cache_add(Cache *cache, char *uri, char *content);
+Cache *cache_init(size_t capacity, int nshards);
+CacheNode *cache_lookup(Cache *cache, char *uri);
+void cache_release(CacheNode *node);
+void cache_add(Cache *cache, char *uri, char *content, size_t size,
+        time_t expires);
+int cache_fresh(CacheNode *node, time_t now);
+time_t cache_expires(CacheNode *node);
+void cache_refresh(CacheNode *node, time_t expires);
 void cache_destroy(Cache *cache);
+void cache_get_stats(Cache *cache, CacheStats *stats);
+void cache_set_evict(Cache *cache, CacheEvict evict, void *arg);
+void cache_set_admit(Cache *cache);
+int cache_set_policy(Cache *cache, const char *name);
 /* Cache Helper Functions */
+void shard_init(CacheShard *shard, size_t capacity, Epoch *epoch);
+void shard_destroy(CacheShard *shard);
+CacheShard *get_shard(Cache *cache, uint64_t hash);
+CacheNode *find_node(CacheShard *shard, char *uri, uint64_t hash);
+CacheNode *pick_victims(CacheShard *shard, size_t charge, unsigned int freq,
+        int *admitted);
+CacheIndex *index_init(size_t nbuckets, int link);
+void grow_index(CacheShard *shard);
 int get_cache_size(Cache *cache);
-void add_node(Cache *cache, char *uri, char *content, int object_size);
-void remove_node(Cache *cache, int remove_size);
+void add_node(CacheShard *shard, char *uri, char *content, 
+        size_t object_size, time_t expires);
+void record_hit(CacheShard *shard, CacheNode *node);
+void drain_hits(CacheShard *shard);
+int node_cached(CacheShard *shard, CacheNode *node, uint64_t hash);
+void move_to_front(CacheShard *shard, CacheNode *node);
+void remove_node(CacheShard *shard, CacheNode *node, int evicted);
+void retire_node(void *node);
 void print_cache(Cache *cache);
 /* Pthread Warning Wrapper Functions */
 int Pthread_rwlock_init(pthread_rwlock_t *rwlock, 
@@ -0,0 +1,335 @@
+/*
+ * connect.c
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This file contains the code that opens connections
+ * to web servers. open_clientfd_r tried only a server's IPv4 addresses,
+ * one at a time, with a blocking connect and no timeout, so a single dead
+ * address could hold a worker for the kernel's whole SYN timeout.
+ *
+ * Here every address the server resolves to, IPv4 and IPv6, takes part
+ * in a race, in the style of happy eyeballs. The first address is tried
+ * at once, and each following one after the previous attempt has had a
+ * short head start, or immediately if it failed. Attempts that are still
+ * in progress keep running, the first one to connect wins, and the rest
+ * are closed. The whole race is bounded by a timeout.
+ *
+ * The outcome of every attempt is reported to the DNS cache, which tries
+ * addresses that failed recently last. An address that had a head start
+ * and was still not connected when another one won counts as failed.
+ * The race never blocks on its own, so the event-driven engine drives it
+ * from its loop; the threaded engine uses race_connect, which waits for
+ * the outcome.
+ *
+ */
+
+#include <poll.h>
+
+#include "connect.h"
+
+/*
+ * Main Connect Functions
+ * ----------------------
+ */
+
+/*
+ * race_connect - This function opens a connection to a web server,
+ * waiting until an attempt wins or the timeout passes. It replaces
+ * open_clientfd_r for the threaded engine.
+ *
+ * Parameters:
+ *  - dns: cache of web server addresses
+ *  - host: the server's host name
+ *  - port: the port on the server
+ *  - timeout_ms: milliseconds allowed to connect
+ * Return value:
+ *  - a connected, blocking socket
+ *  - -1: the name does not resolve or no address could be connected to
+ */
+int race_connect(DnsCache *dns, char *host, int port, int timeout_ms)
+{
+    Race race;
+    int clientfd;
+
+    if (race_start(&race, dns, host, port, timeout_ms) < 0) {
+        return -1;
+    }
+    if ((clientfd = race_poll(&race, 1)) < 0) {
+        return -1;
+    }
+
+    fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL) & ~O_NONBLOCK);
+    return clientfd;
+}
+
+/*
+ * race_start - This function looks up a web server's addresses and sets
+ * up a race to connect to them. No attempt starts until race_poll.
+ *
+ * Parameters:
+ *  - race: the race to set up
+ *  - dns: cache of web server addresses
+ *  - host: the server's host name, which must outlive the race
+ *  - port: the port on the server
+ *  - timeout_ms: milliseconds allowed to connect
+ * Return value:
+ *  - 0: the race is ready
+ *  - -1: the name does not resolve
+ */
+int race_start(Race *race, DnsCache *dns, char *host, int port,
+        int timeout_ms)
+{
+    long now = now_ms();
+    int i;
+
+    race->naddrs = dns_lookup(dns, host, port, race->addrs, DNS_MAX_ADDRS);
+    if (race->naddrs < 0) {
+        return -1;
+    }
+
+    race->dns = dns;
+    race->host = host;
+    for (i = 0; i < DNS_MAX_ADDRS; i++) {
+        race->fds[i] = -1;
+    }
+    race->started = 0;
+    race->pending = 0;
+    race->won = -1;
+    race->next_ms = now;
+    race->deadline_ms = now + timeout_ms;
+    return 0;
+}
+
+/*
+ * race_poll - This function moves a race forward: it starts the attempts
+ * that are due and collects the ones that have finished. When block is
+ * set, it waits until the race is won or lost; otherwise it only handles
+ * what is ready now.
+ *
+ * Parameters:
+ *  - race: the race
+ *  - block: whether to wait for the outcome
+ * Return value:
+ *  - the winning socket, still non-blocking; the race is over
+ *  - -1: every attempt failed or time ran out; the race is over
+ *  - RACE_PENDING: attempts are still running (only when not blocking)
+ */
+int race_poll(Race *race, int block)
+{
+    struct pollfd pfds[DNS_MAX_ADDRS];
+    int which[DNS_MAX_ADDRS];
+    long now;
+    int clientfd;
+    int wait;
+    int count, n, i;
+
+    while (1) {
+        now = now_ms();
+
+        /* Start each address whose turn has come */
+        while (race->started < race->naddrs
+                && (race->pending == 0 || now >= race->next_ms)) {
+            if ((clientfd = race_launch(race, now)) >= 0) {
+                return clientfd;
+            }
+        }
+
+        if (race->pending == 0) {
+            /* Every address has been tried and failed */
+            return -1;
+        }
+        if (now >= race->deadline_ms) {
+            race_abort(race);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        count = 0;
+        for (i = 0; i < race->started; i++) {
+            if (race->fds[i] >= 0) {
+                pfds[count].fd = race->fds[i];
+                pfds[count].events = POLLOUT;
+                which[count++] = i;
+            }
+        }
+        wait = block ? (int)(race_timer(race) - now) : 0;
+
+        if ((n = poll(pfds, count, wait)) < 0 && errno != EINTR) {
+            race_abort(race);
+            return -1;
+        }
+        if (n <= 0 && !block) {
+            return RACE_PENDING;
+        }
+
+        for (i = 0; n > 0 && i < count; i++) {
+            if (pfds[i].revents == 0) {
+                continue;
+            }
+            n--;
+            if ((clientfd = race_check(race, which[i], now)) >= 0) {
+                return clientfd;
+            }
+        }
+    }
+}
+
+/*
+ * race_timer - Returns the time at which a race next needs attention: when
+ * the next address is due, or when the race times out.
+ */
+long race_timer(Race *race)
+{
+    if (race->started < race->naddrs && race->next_ms < race->deadline_ms) {
+        return race->next_ms;
+    }
+    return race->deadline_ms;
+}
+
+/*
+ * race_abort - This function ends a race, closing every attempt still in
+ * progress.
+ *
+ * Parameter:
+ *  - race: the race
+ */
+void race_abort(Race *race)
+{
+    int i;
+
+    for (i = 0; i < race->started; i++) {
+        if (race->fds[i] >= 0) {
+            close(race->fds[i]);
+            race->fds[i] = -1;
+        }
+    }
+    race->pending = 0;
+    race->started = race->naddrs;
+    return;
+}
+
+/*
+ * now_ms - Returns the time on the monotonic clock in milliseconds.
+ */
+long now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+/*
+ * End Main Connect Functions
+ * --------------------------
+ */
+
+
+/*
+ * Connect Helper Functions
+ * ------------------------
+ */
+
+/*
+ * race_launch - This function starts an attempt on the next address. If
+ * it fails at once, the address after it may start right away.
+ *
+ * Parameters:
+ *  - race: the race
+ *  - now: the current time
+ * Return value:
+ *  - a socket that connected at once; the race is over
+ *  - -1: the attempt is in progress, or failed
+ */
+int race_launch(Race *race, long now)
+{
+    int i = race->started++;
+    DnsAddr *addr = &race->addrs[i];
+    int clientfd;
+
+    clientfd = socket(addr->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (clientfd >= 0 && connect(clientfd, (SA *)&addr->addr, addr->len)
+            == 0) {
+        race_win(race, i);
+        return clientfd;
+    }
+
+    if (clientfd >= 0 && errno == EINPROGRESS) {
+        race->fds[i] = clientfd;
+        race->pending += 1;
+        race->next_ms = now + RACE_DELAY_MS;
+        return -1;
+    }
+
+    if (clientfd >= 0) {
+        close(clientfd);
+    }
+    dns_report(race->dns, race->host, addr, 0);
+    race->next_ms = now;
+    return -1;
+}
+
+/*
+ * race_check - This function collects an attempt that poll reported as
+ * finished. A failed attempt lets the next address start right away.
+ *
+ * Parameters:
+ *  - race: the race
+ *  - i: index of the attempt's address
+ *  - now: the current time
+ * Return value:
+ *  - the attempt's socket, if it connected; the race is over
+ *  - -1: the attempt failed
+ */
+int race_check(Race *race, int i, long now)
+{
+    int clientfd = race->fds[i];
+    socklen_t err_len = sizeof(int);
+    int err = 0;
+
+    race->fds[i] = -1;
+    race->pending -= 1;
+
+    if (getsockopt(clientfd, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0
+            && err == 0) {
+        race_win(race, i);
+        return clientfd;
+    }
+
+    close(clientfd);
+    dns_report(race->dns, race->host, &race->addrs[i], 0);
+    race->next_ms = now;
+    errno = err;
+    return -1;
+}
+
+/*
+ * race_win - This function ends a race that the attempt on address i has
+ * won. Attempts that started earlier and are still in progress have lost
+ * despite their head start, so their addresses are reported as failed.
+ *
+ * Parameters:
+ *  - race: the race
+ *  - i: index of the winning address
+ */
+void race_win(Race *race, int i)
+{
+    int j;
+
+    dns_report(race->dns, race->host, &race->addrs[i], 1);
+    for (j = 0; j < i; j++) {
+        if (race->fds[j] >= 0) {
+            dns_report(race->dns, race->host, &race->addrs[j], 0);
+        }
+    }
+    race->won = i;
+    race_abort(race);
+    return;
+}
+
+/*
+ * End Connect Helper Functions
+ * ----------------------------
+ */
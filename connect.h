@@ -0,0 +1,62 @@
+/*
+ * connect.h
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This is the header file for connect.c, which opens
+ * connections to web servers by racing attempts to each of a server's
+ * addresses. This file just has the relevant macros, structure
+ * definitions, and function prototypes.
+ *
+ */
+
+/* Include guards */
+#ifndef __CONNECT_H__
+#define __CONNECT_H__
+
+#include "csapp.h"
+#include "dns.h"
+
+/* Macros */
+#define RACE_DELAY_MS 250        /* Head start an attempt gets before the
+                                    next address is tried */
+#define RACE_DEFAULT_TIMEOUT 5000 /* Default milliseconds allowed to
+                                     connect to a server */
+#define RACE_PENDING -2          /* race_poll: no attempt has finished */
+
+/*
+ * One race to connect to a web server. Attempts start one address at a
+ * time, each RACE_DELAY_MS after the last or as soon as the last one
+ * fails, and keep running side by side. The first to connect wins and
+ * the rest are closed.
+ */
+typedef struct Race {
+    DnsCache *dns;               /* Where failed addresses are reported */
+    char *host;                  /* The server's host name, not owned */
+    DnsAddr addrs[DNS_MAX_ADDRS]; /* Its addresses, in the order to try */
+    int fds[DNS_MAX_ADDRS];      /* Attempt in progress on each address, or
+                                    -1 */
+    int naddrs;                  /* Number of addresses */
+    int started;                 /* Addresses tried so far */
+    int pending;                 /* Attempts in progress */
+    int won;                     /* Index of the address that connected, or
+                                    -1 */
+    long next_ms;                /* When the next address is tried */
+    long deadline_ms;            /* When the race is given up */
+} Race;
+
+/* Main Connect Function Prototypes */
+int race_connect(DnsCache *dns, char *host, int port, int timeout_ms);
+int race_start(Race *race, DnsCache *dns, char *host, int port,
+        int timeout_ms);
+int race_poll(Race *race, int block);
+long race_timer(Race *race);
+void race_abort(Race *race);
+long now_ms(void);
+/* Connect Helper Functions */
+int race_launch(Race *race, long now);
+int race_check(Race *race, int i, long now);
+void race_win(Race *race, int i);
+
+#endif
@@ -778,6 +778,7 @@ int open_clientfd_r(char *hostname, int port) {
     /* Get a list of addrinfo structs */
     sprintf(port_str, "%d", port);
     if ((rv = getaddrinfo(hostname, port_str, NULL, &addlist)) != 0) {
+        close(clientfd);
         return -1;
     }
   
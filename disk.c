@@ -0,0 +1,468 @@
+/*
+ * disk.c
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This file contains the optional second tier of the
+ * web cache, kept on disk. The memory tier only holds about a megabyte,
+ * so most objects it evicts are still worth keeping; instead of being
+ * thrown away, an evicted object is demoted here, and a later request
+ * for it is served from disk instead of from the web server. An object
+ * found on disk is promoted back into memory as it is served.
+ *
+ * Objects are appended to segment files, and an in-memory index maps
+ * each URI to the segment and offset holding it. Nothing is rewritten in
+ * place: when the tier is over its budget, the oldest segment is dropped
+ * whole, along with every object indexed in it. Segment files are
+ * unlinked as soon as they are created, so they never outlive the proxy
+ * and dropping one only needs to close it.
+ *
+ * The body of an object found on disk is sent to the browser with
+ * sendfile, straight from the segment file to the socket.
+ *
+ */
+
+#include <sys/sendfile.h>
+
+#include "disk.h"
+
+/*
+ * Main Disk Functions
+ * -------------------
+ */
+
+/*
+ * disk_init - This function creates an empty disk tier below a cache
+ * and has the cache demote the objects it evicts into it.
+ *
+ * Parameters:
+ *  - cache: the memory tier
+ *  - dir: the directory to make segment files in
+ *  - capacity: the most bytes the segment files may hold
+ * Return value:
+ *  - disk: the new disk tier
+ *  - NULL: dir cannot be written to
+ */
+DiskCache *disk_init(Cache *cache, char *dir, size_t capacity)
+{
+    DiskCache *disk;
+
+    if (access(dir, W_OK | X_OK) < 0) {
+        fprintf(stderr, "Cannot use %s for the disk cache: %s\n", dir,
+                strerror(errno));
+        return NULL;
+    }
+
+    disk = Calloc(1, sizeof(DiskCache));
+    pthread_mutex_init(&disk->lock, NULL);
+    disk->cache = cache;
+    disk->dir = Malloc(strlen(dir) + 1);
+    strcpy(disk->dir, dir);
+    disk->capacity = capacity;
+
+    /* Split the budget into segments, each big enough for any object */
+    disk->segment_size = capacity / DISK_MIN_SEGMENTS;
+    if (disk->segment_size > DISK_SEGMENT_SIZE) {
+        disk->segment_size = DISK_SEGMENT_SIZE;
+    }
+    if (disk->segment_size < MAX_OBJECT_SIZE) {
+        disk->segment_size = MAX_OBJECT_SIZE;
+    }
+    if (disk->segment_size > capacity) {
+        disk->segment_size = capacity;
+    }
+
+    cache_set_evict(cache, disk_demote, disk);
+    return disk;
+}
+
+/*
+ * disk_demote - This function appends an object evicted from memory to
+ * the newest segment and indexes it, dropping the oldest segments first
+ * if the tier is over its budget. An object that is already on disk,
+ * because it was promoted from here, is not written again if its body is
+ * unchanged, as told by its checksum; only its expiry is updated, in case
+ * a revalidation refreshed it in memory. One whose body was replaced in
+ * memory, even by one of the same length, is written again, and the
+ * outdated entry is removed. The cache calls this without holding any
+ * shard lock.
+ *
+ * Parameters:
+ *  - arg: the disk tier
+ *  - node: the evicted node, referenced for the duration of the call
+ */
+void disk_demote(void *arg, CacheNode *node)
+{
+    DiskCache *disk = arg;
+    size_t uri_len = strlen(node->uri);
+    size_t done = 0;
+    DiskSegment *seg;
+    DiskEntry *entry;
+    DiskEntry **bucket;
+    time_t expires = __atomic_load_n(&node->expires, __ATOMIC_RELAXED);
+    uint64_t sum;
+    ssize_t n;
+
+    if (node->object_size > disk->segment_size) {
+        return;
+    }
+    sum = fnv_sum(node->content, node->object_size, HASH_SUM_INIT);
+
+    pthread_mutex_lock(&disk->lock);
+
+    if ((entry = find_entry(disk, node->uri, node->hash)) != NULL) {
+        if (entry->size == node->object_size && entry->sum == sum) {
+            /* Unchanged, or only revalidated since it was promoted */
+            entry->expires = expires;
+            pthread_mutex_unlock(&disk->lock);
+            return;
+        }
+        remove_entry(disk, entry);
+    }
+
+    /* Make room, oldest segment first */
+    while (disk->oldest != NULL
+            && disk->bytes + node->object_size > disk->capacity) {
+        drop_segment(disk);
+    }
+    seg = disk->newest;
+    if (seg == NULL || seg->size + node->object_size > disk->segment_size) {
+        if ((seg = new_segment(disk)) == NULL) {
+            pthread_mutex_unlock(&disk->lock);
+            return;
+        }
+    }
+
+    /* Append the object */
+    while (done < node->object_size) {
+        n = pwrite(seg->fd, node->content + done, node->object_size - done,
+                seg->size + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "Error writing to the disk cache: %s\n",
+                    strerror(errno));
+            pthread_mutex_unlock(&disk->lock);
+            return;
+        }
+        done += n;
+    }
+
+    /* Index it */
+    entry = Malloc(sizeof(DiskEntry) + uri_len + 1);
+    entry->uri = entry->data;
+    memcpy(entry->uri, node->uri, uri_len + 1);
+    entry->hash = node->hash;
+    entry->seg = seg;
+    entry->offset = seg->size;
+    entry->size = node->object_size;
+    entry->expires = expires;
+    entry->sum = sum;
+    bucket = &disk->buckets[entry->hash & (DISK_BUCKETS - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    entry->seg_next = seg->entries;
+    seg->entries = entry;
+
+    seg->size += node->object_size;
+    disk->bytes += node->object_size;
+    disk->objects += 1;
+    disk->demoted += 1;
+
+    pthread_mutex_unlock(&disk->lock);
+    return;
+}
+
+/*
+ * disk_lookup - Searches the disk tier for a URI. On a hit, the object is
+ * read into obj->content and promoted into the memory tier, and obj is
+ * left holding a reference on its segment, so the body can still be sent
+ * from the file if the segment is dropped in the meantime. The caller
+ * must pass obj to disk_release when it is done.
+ *
+ * Parameters:
+ *  - disk: the disk tier
+ *  - uri: the URI of the content
+ *  - obj: filled in on a hit
+ * Return value:
+ *  - 1: a hit
+ *  - 0: a miss, or the object could not be read
+ */
+int disk_lookup(DiskCache *disk, char *uri, DiskObject *obj)
+{
+    DiskEntry *entry;
+    size_t done = 0;
+    ssize_t n;
+
+    pthread_mutex_lock(&disk->lock);
+    if ((entry = find_entry(disk, uri, hash_uri(uri))) == NULL) {
+        disk->misses += 1;
+        pthread_mutex_unlock(&disk->lock);
+        return 0;
+    }
+    disk->hits += 1;
+    obj->seg = entry->seg;
+    __atomic_add_fetch(&obj->seg->refcount, 1, __ATOMIC_RELAXED);
+    obj->fd = entry->seg->fd;
+    obj->offset = entry->offset;
+    obj->size = entry->size;
+    obj->expires = entry->expires;
+    pthread_mutex_unlock(&disk->lock);
+
+    /* Read the object without the lock held */
+    obj->content = Malloc(obj->size);
+    while (done < obj->size) {
+        n = pread(obj->fd, obj->content + done, obj->size - done,
+                obj->offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "Error reading from the disk cache: %s\n",
+                    n < 0 ? strerror(errno) : "short segment");
+            disk_release(obj);
+            return 0;
+        }
+        done += n;
+    }
+
+    /* Promote it, so the next request finds it in memory */
+    cache_add(disk->cache, uri, obj->content, obj->size, obj->expires);
+    return 1;
+}
+
+/*
+ * disk_send - This function sends part of an object found on disk to a
+ * socket with sendfile, so the bytes go from the segment file to the
+ * socket without passing through the proxy. On a non-blocking socket it
+ * stops with EAGAIN once the socket is full.
+ *
+ * Parameters:
+ *  - obj: the object, from disk_lookup
+ *  - tofd: the browser's socket
+ *  - off: offset within the object of the next byte to send, advanced
+ *         as bytes are sent
+ *  - end: offset within the object just past the last byte to send
+ * Return value:
+ *  - 0: everything up to end was sent
+ *  - -1: sendfile failed, with errno set
+ */
+int disk_send(DiskObject *obj, int tofd, size_t *off, size_t end)
+{
+    off_t pos;
+    ssize_t n;
+
+    while (*off < end) {
+        pos = obj->offset + *off;
+        if ((n = sendfile(tofd, obj->fd, &pos, end - *off)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            /* The file is shorter than the index says */
+            errno = EIO;
+            return -1;
+        }
+        *off += n;
+    }
+
+    return 0;
+}
+
+/*
+ * disk_release - Frees the copy of an object read by disk_lookup and
+ * drops its reference on the object's segment.
+ *
+ * Parameter:
+ *  - obj: the object to release
+ */
+void disk_release(DiskObject *obj)
+{
+    Free(obj->content);
+    obj->content = NULL;
+    segment_release(obj->seg);
+    obj->seg = NULL;
+    return;
+}
+
+/*
+ * disk_get_stats - This function copies the disk tier's counters into
+ * stats.
+ *
+ * Parameters:
+ *  - disk: the disk tier to report on
+ *  - stats: filled with the current counters
+ */
+void disk_get_stats(DiskCache *disk, DiskStats *stats)
+{
+    pthread_mutex_lock(&disk->lock);
+    stats->objects = disk->objects;
+    stats->bytes = disk->bytes;
+    stats->capacity = disk->capacity;
+    stats->segments = disk->nsegments;
+    stats->hits = disk->hits;
+    stats->misses = disk->misses;
+    stats->demoted = disk->demoted;
+    stats->dropped = disk->dropped;
+    pthread_mutex_unlock(&disk->lock);
+    return;
+}
+
+/*
+ * disk_destroy - This function stops the cache from demoting objects,
+ * drops every segment and frees the disk tier. Objects still being sent
+ * keep their segments open until they are released.
+ *
+ * Parameter:
+ *  - disk: the disk tier to destroy
+ */
+void disk_destroy(DiskCache *disk)
+{
+    cache_set_evict(disk->cache, NULL, NULL);
+    while (disk->oldest != NULL) {
+        drop_segment(disk);
+    }
+    pthread_mutex_destroy(&disk->lock);
+    Free(disk->dir);
+    Free(disk);
+    return;
+}
+
+/*
+ * End Main Disk Functions
+ * -----------------------
+ */
+
+
+/*
+ * Disk Helper Functions
+ * ---------------------
+ */
+
+/*
+ * find_entry - Looks up a URI in the index. The lock must be held.
+ *
+ * Return value:
+ *  - the entry for uri, or NULL if it is not on disk
+ */
+DiskEntry *find_entry(DiskCache *disk, char *uri, uint64_t hash)
+{
+    DiskEntry *entry = disk->buckets[hash & (DISK_BUCKETS - 1)];
+
+    for ( ; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && !strcmp(entry->uri, uri)) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * new_segment - Creates an empty segment file, unlinks it, and makes it
+ * the newest segment. The lock must be held.
+ *
+ * Return value:
+ *  - the new segment, or NULL if the file could not be created
+ */
+DiskSegment *new_segment(DiskCache *disk)
+{
+    char path[MAXLINE];
+    DiskSegment *seg;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/proxy-segment-XXXXXX", disk->dir);
+    if ((fd = mkstemp(path)) < 0) {
+        fprintf(stderr, "Error creating a disk cache segment: %s\n",
+                strerror(errno));
+        return NULL;
+    }
+    unlink(path);
+
+    seg = Malloc(sizeof(DiskSegment));
+    seg->fd = fd;
+    seg->refcount = 1;
+    seg->size = 0;
+    seg->entries = NULL;
+    seg->next = NULL;
+
+    if (disk->newest != NULL) {
+        disk->newest->next = seg;
+    } else {
+        disk->oldest = seg;
+    }
+    disk->newest = seg;
+    disk->nsegments += 1;
+    return seg;
+}
+
+/*
+ * drop_segment - Removes every object in the oldest segment from the
+ * index, then drops the index's reference on the segment, which closes
+ * it unless an object from it is still being sent. The lock must be held.
+ */
+void drop_segment(DiskCache *disk)
+{
+    DiskSegment *seg = disk->oldest;
+    DiskEntry *entry;
+
+    while ((entry = seg->entries) != NULL) {
+        remove_entry(disk, entry);
+        disk->dropped += 1;
+    }
+
+    disk->oldest = seg->next;
+    if (disk->newest == seg) {
+        disk->newest = NULL;
+    }
+    disk->bytes -= seg->size;
+    disk->nsegments -= 1;
+    segment_release(seg);
+    return;
+}
+
+/*
+ * remove_entry - Removes an object from the index and frees its entry.
+ * Its bytes stay in the segment until the segment is dropped. The lock
+ * must be held.
+ */
+void remove_entry(DiskCache *disk, DiskEntry *entry)
+{
+    DiskEntry **link;
+
+    link = &disk->buckets[entry->hash & (DISK_BUCKETS - 1)];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    link = &entry->seg->entries;
+    while (*link != entry) {
+        link = &(*link)->seg_next;
+    }
+    *link = entry->seg_next;
+    Free(entry);
+    disk->objects -= 1;
+    return;
+}
+
+/*
+ * segment_release - Drops a reference on a segment, closing its file and
+ * freeing it once the last one is gone.
+ */
+void segment_release(DiskSegment *seg)
+{
+    if (__atomic_sub_fetch(&seg->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        Close(seg->fd);
+        Free(seg);
+    }
+    return;
+}
+
+/*
+ * End Disk Helper Functions
+ * -------------------------
+ */
@@ -0,0 +1,127 @@
+/*
+ * disk.h
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This is the header file for disk.c, the on-disk
+ * second tier of the web cache. This file just has the relevant macros,
+ * structure definitions, and function prototypes.
+ *
+ */
+
+/* Include guards */
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include <stdint.h>
+
+#include "csapp.h"
+#include "cache.h"
+
+/* Macros */
+#define DISK_DEFAULT_BUDGET 256  /* Default disk budget, in megabytes */
+#define DISK_SEGMENT_SIZE (16 * 1024 * 1024) /* Largest segment file */
+#define DISK_MIN_SEGMENTS 4      /* Segments a small budget is split into,
+                                    so dropping one frees only part of it */
+#define DISK_BUCKETS 4096        /* Number of buckets in the index */
+
+/*
+ * One segment file. Objects are only ever appended to the newest
+ * segment, and space is only ever reclaimed by dropping the oldest one
+ * whole. The index holds one reference on a segment while it is in use,
+ * and every DiskObject served from it holds another, so a dropped segment
+ * stays readable until the last object sent from it is released.
+ */
+typedef struct DiskSegment {
+    int fd;                      /* The file, already unlinked */
+    int refcount;                /* References held on this segment */
+    size_t size;                 /* Bytes appended so far */
+    struct DiskEntry *entries;   /* Objects indexed in this segment */
+    struct DiskSegment *next;    /* Next newer segment */
+} DiskSegment;
+
+/*
+ * Where one object lives on disk. Each entry is chained both into a
+ * bucket of the index and into its segment's list of entries.
+ */
+typedef struct DiskEntry {
+    char *uri;                   /* Key of the object, stored in data */
+    uint64_t hash;               /* Hash of uri */
+    DiskSegment *seg;            /* Segment holding the object */
+    off_t offset;                /* Where the object starts in the file */
+    size_t size;                 /* Length of the object */
+    time_t expires;              /* When the object goes stale */
+    uint64_t sum;                /* Checksum of the object */
+    struct DiskEntry *next;      /* Next entry in the same bucket */
+    struct DiskEntry *seg_next;  /* Next entry in the same segment */
+    char data[];                 /* Storage for uri */
+} DiskEntry;
+
+/*
+ * Defines the disk tier: the segment files, oldest first, and the index
+ * over every object in them. Everything is protected by lock, which is
+ * also held while an object is appended. Reads never take it.
+ */
+typedef struct DiskCache {
+    pthread_mutex_t lock;        /* Protects everything below */
+    Cache *cache;                /* The memory tier above this one */
+    char *dir;                   /* Directory segment files are made in */
+    size_t capacity;             /* Budget for the segment files */
+    size_t segment_size;         /* Size a segment is filled to */
+    size_t bytes;                /* Bytes in all segments */
+    int nsegments;               /* Number of segments */
+    DiskSegment *oldest;         /* Next segment to drop */
+    DiskSegment *newest;         /* Segment being appended to, or NULL */
+    DiskEntry *buckets[DISK_BUCKETS]; /* The index */
+    size_t objects;              /* Objects in the index */
+    unsigned long hits;          /* Lookups found on disk */
+    unsigned long misses;        /* Lookups not found on disk */
+    unsigned long demoted;       /* Objects written out of memory */
+    unsigned long dropped;       /* Objects lost with their segment */
+} DiskCache;
+
+/*
+ * A referenced handle on one object found on disk. content holds a copy
+ * of the whole object, which was read to promote it into memory and is
+ * kept so the caller can parse its headers. The body is sent from fd.
+ */
+typedef struct DiskObject {
+    DiskSegment *seg;            /* Segment holding the object */
+    int fd;                      /* The segment's file */
+    off_t offset;                /* Where the object starts in the file */
+    size_t size;                 /* Length of the object */
+    time_t expires;              /* When the object goes stale */
+    char *content;               /* The object, read into memory */
+} DiskObject;
+
+/*
+ * A snapshot of the disk tier's counters, for monitoring.
+ */
+typedef struct DiskStats {
+    size_t objects;              /* Objects on disk */
+    size_t bytes;                /* Bytes in all segments */
+    size_t capacity;             /* Budget for the segments */
+    int segments;                /* Number of segments */
+    unsigned long hits;          /* Lookups found on disk */
+    unsigned long misses;        /* Lookups not found on disk */
+    unsigned long demoted;       /* Objects written out of memory */
+    unsigned long dropped;       /* Objects lost with their segment */
+} DiskStats;
+
+/* Main Disk Function Prototypes */
+DiskCache *disk_init(Cache *cache, char *dir, size_t capacity);
+void disk_demote(void *arg, CacheNode *node);
+int disk_lookup(DiskCache *disk, char *uri, DiskObject *obj);
+int disk_send(DiskObject *obj, int tofd, size_t *off, size_t end);
+void disk_release(DiskObject *obj);
+void disk_get_stats(DiskCache *disk, DiskStats *stats);
+void disk_destroy(DiskCache *disk);
+/* Disk Helper Functions */
+DiskEntry *find_entry(DiskCache *disk, char *uri, uint64_t hash);
+DiskSegment *new_segment(DiskCache *disk);
+void drop_segment(DiskCache *disk);
+void remove_entry(DiskCache *disk, DiskEntry *entry);
+void segment_release(DiskSegment *seg);
+
+#endif
@@ -0,0 +1,474 @@
+/*
+ * dns.c
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This file contains the cache of web server addresses
+ * that sits in front of getaddrinfo. Every connection to a server used to
+ * start with a blocking name lookup, so the time DNS took was added to
+ * every cache miss. Now the addresses a name resolved to are kept for a
+ * while and later connections to the same server use them directly.
+ *
+ * A name that fails to resolve is kept too, for a shorter time, so that a
+ * burst of requests for a bad name does not send a burst of queries. When
+ * several threads want the same name at once, only the first one looks it
+ * up; the others wait for its answer.
+ *
+ * getaddrinfo does not report the TTL of the records it returns, so each
+ * result is kept for a fixed number of seconds instead. The lookup itself
+ * goes through a function pointer, so it can be replaced with a stub.
+ *
+ * Both IPv4 and IPv6 addresses are kept, alternating between the two
+ * families. An address that fails to connect is moved to the back of the
+ * list for a while, so the next connection tries the others first.
+ *
+ */
+
+#include "dns.h"
+#include "hash.h"
+
+/*
+ * Main DNS Functions
+ * ------------------
+ */
+
+/*
+ * dns_init - This function creates an empty cache.
+ *
+ * Parameters:
+ *  - ttl: seconds a resolved name is kept; 0 keeps none
+ *  - negative_ttl: seconds a name that failed to resolve is kept
+ *  - resolve: the function that does the lookups, or NULL for getaddrinfo
+ * Return value:
+ *  - dns: a pointer to the cache
+ */
+DnsCache *dns_init(int ttl, int negative_ttl, Resolver resolve)
+{
+    DnsCache *dns = Malloc(sizeof(DnsCache));
+
+    pthread_mutex_init(&dns->lock, NULL);
+    pthread_cond_init(&dns->resolved, NULL);
+    dns->buckets = Calloc(DNS_BUCKETS, sizeof(DnsEntry *));
+    dns->names = 0;
+    dns->ttl = ttl;
+    dns->negative_ttl = negative_ttl;
+    dns->resolve = resolve != NULL ? resolve : dns_getaddrinfo;
+    dns->hits = 0;
+    dns->negative_hits = 0;
+    dns->misses = 0;
+    dns->shared = 0;
+
+    return dns;
+}
+
+/*
+ * dns_lookup - This function finds the addresses of a host name, from the
+ * cache if it has a current answer, and otherwise by looking the name up
+ * and caching the answer. If another thread is already looking the same
+ * name up, it waits for that answer instead of asking again.
+ *
+ * Parameters:
+ *  - dns: the cache
+ *  - host: the host name
+ *  - port: the port to put in each address
+ *  - addrs: filled with the addresses
+ *  - max: room in addrs
+ * Return value:
+ *  - the number of addresses filled in
+ *  - -1: the name does not resolve
+ */
+int dns_lookup(DnsCache *dns, char *host, int port, DnsAddr *addrs, int max)
+{
+    uint64_t hash = hash_uri(host);
+    time_t now = time(NULL);
+    DnsEntry *entry;
+    DnsEntry result;
+    int n;
+
+    pthread_mutex_lock(&dns->lock);
+    entry = find_name(dns, host, hash);
+
+    /* Another thread is looking the name up, so share its answer */
+    if (entry != NULL && entry->resolving) {
+        dns->shared += 1;
+        entry->waiters += 1;
+        while (entry->resolving) {
+            pthread_cond_wait(&dns->resolved, &dns->lock);
+        }
+        entry->waiters -= 1;
+        n = copy_addrs(entry, port, addrs, max, now);
+        pthread_mutex_unlock(&dns->lock);
+        return n;
+    }
+
+    /* The cached answer is still current */
+    if (entry != NULL && entry->expires > now) {
+        dns->hits += 1;
+        if (entry->naddrs == 0) {
+            dns->negative_hits += 1;
+        }
+        n = copy_addrs(entry, port, addrs, max, now);
+        pthread_mutex_unlock(&dns->lock);
+        return n;
+    }
+
+    /*
+     * Look the name up without holding the lock. If the table is full,
+     * the answer is just not cached.
+     */
+    dns->misses += 1;
+    if (entry == NULL) {
+        entry = add_name(dns, host, hash, now);
+    }
+    if (entry != NULL) {
+        entry->resolving = 1;
+    }
+    pthread_mutex_unlock(&dns->lock);
+
+    result.naddrs = dns->resolve(host, result.addrs, DNS_MAX_ADDRS);
+    if (result.naddrs < 0) {
+        result.naddrs = 0;
+    }
+    memset(result.down_until, 0, sizeof(result.down_until));
+
+    if (entry == NULL) {
+        return copy_addrs(&result, port, addrs, max, now);
+    }
+
+    pthread_mutex_lock(&dns->lock);
+    store_addrs(entry, &result);
+    n = copy_addrs(entry, port, addrs, max, now);
+    entry->expires = time(NULL)
+        + (result.naddrs > 0 ? dns->ttl : dns->negative_ttl);
+    entry->resolving = 0;
+    pthread_cond_broadcast(&dns->resolved);
+    pthread_mutex_unlock(&dns->lock);
+
+    return n;
+}
+
+/*
+ * dns_report - This function records whether connecting to one of a
+ * name's addresses worked. An address that failed is tried after the
+ * others for the next DNS_DOWN_TIME seconds; one that worked is tried in
+ * its usual place again.
+ *
+ * Parameters:
+ *  - dns: the cache
+ *  - host: the host name
+ *  - addr: the address that was tried
+ *  - ok: whether the connection was made
+ */
+void dns_report(DnsCache *dns, char *host, DnsAddr *addr, int ok)
+{
+    DnsEntry *entry;
+    int i;
+
+    pthread_mutex_lock(&dns->lock);
+    if ((entry = find_name(dns, host, hash_uri(host))) != NULL) {
+        for (i = 0; i < entry->naddrs; i++) {
+            if (same_addr(&entry->addrs[i], addr)) {
+                entry->down_until[i] = ok ? 0 : time(NULL) + DNS_DOWN_TIME;
+            }
+        }
+    }
+    pthread_mutex_unlock(&dns->lock);
+    return;
+}
+
+/*
+ * dns_get_stats - This function copies the cache's counters into stats.
+ *
+ * Parameters:
+ *  - dns: the cache to report on
+ *  - stats: filled with the current counters
+ */
+void dns_get_stats(DnsCache *dns, DnsStats *stats)
+{
+    pthread_mutex_lock(&dns->lock);
+
+    stats->names = dns->names;
+    stats->hits = dns->hits;
+    stats->negative_hits = dns->negative_hits;
+    stats->misses = dns->misses;
+    stats->shared = dns->shared;
+
+    pthread_mutex_unlock(&dns->lock);
+    return;
+}
+
+/*
+ * dns_destroy - This function frees the cache. No lookups may be in
+ * progress.
+ *
+ * Parameter:
+ *  - dns: the cache to free
+ */
+void dns_destroy(DnsCache *dns)
+{
+    DnsEntry *entry;
+    DnsEntry *next;
+    int i;
+
+    for (i = 0; i < DNS_BUCKETS; i++) {
+        for (entry = dns->buckets[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            Free(entry->host);
+            Free(entry);
+        }
+    }
+    Free(dns->buckets);
+    pthread_cond_destroy(&dns->resolved);
+    pthread_mutex_destroy(&dns->lock);
+    Free(dns);
+    return;
+}
+
+/*
+ * End Main DNS Functions
+ * ----------------------
+ */
+
+
+/*
+ * DNS Helper Functions
+ * --------------------
+ */
+
+/*
+ * dns_getaddrinfo - The default resolver. It asks getaddrinfo for the
+ * name's IPv4 and IPv6 stream addresses and alternates between the two
+ * families, starting with the one getaddrinfo prefers, so a race to
+ * connect soon tries both.
+ */
+int dns_getaddrinfo(char *host, DnsAddr *addrs, int max)
+{
+    struct addrinfo hints, *result, *p;
+    struct addrinfo *family[2][DNS_MAX_ADDRS];
+    int count[2] = {0, 0};
+    int n = 0;
+    int i, k;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host, NULL, &hints, &result) != 0) {
+        return -1;
+    }
+
+    /* family[0] holds the preferred family, family[1] the other one */
+    for (p = result; p != NULL; p = p->ai_next) {
+        k = p->ai_family != result->ai_family;
+        if (count[k] < DNS_MAX_ADDRS) {
+            family[k][count[k]++] = p;
+        }
+    }
+
+    for (i = 0; n < max && (i < count[0] || i < count[1]); i++) {
+        for (k = 0; k < 2 && n < max; k++) {
+            if (i < count[k]) {
+                memcpy(&addrs[n].addr, family[k][i]->ai_addr,
+                        family[k][i]->ai_addrlen);
+                addrs[n].len = family[k][i]->ai_addrlen;
+                n++;
+            }
+        }
+    }
+
+    freeaddrinfo(result);
+    return n > 0 ? n : -1;
+}
+
+/*
+ * find_name - Returns the table entry for a host name, or NULL if there
+ * is none. The caller must hold the cache's lock.
+ */
+DnsEntry *find_name(DnsCache *dns, char *host, uint64_t hash)
+{
+    DnsEntry *entry = dns->buckets[hash % DNS_BUCKETS];
+
+    while (entry != NULL) {
+        if (entry->hash == hash && !strcmp(entry->host, host)) {
+            return entry;
+        }
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+/*
+ * add_name - This function adds an empty, already expired entry for a
+ * host name to the table. If the table is full, expired names are removed
+ * first to make room. The caller must hold the cache's lock.
+ *
+ * Parameters:
+ *  - dns: the cache
+ *  - host: the host name
+ *  - hash: hash of host
+ *  - now: the current time
+ * Return value:
+ *  - entry: the new entry
+ *  - NULL: the table is full of current names
+ */
+DnsEntry *add_name(DnsCache *dns, char *host, uint64_t hash, time_t now)
+{
+    DnsEntry *entry;
+
+    if (dns->names >= DNS_MAX_NAMES) {
+        prune_names(dns, now);
+        if (dns->names >= DNS_MAX_NAMES) {
+            return NULL;
+        }
+    }
+
+    entry = Malloc(sizeof(DnsEntry));
+    entry->host = Malloc(strlen(host) + 1);
+    strcpy(entry->host, host);
+    entry->hash = hash;
+    entry->naddrs = 0;
+    entry->expires = 0;
+    entry->resolving = 0;
+    entry->waiters = 0;
+    entry->next = dns->buckets[hash % DNS_BUCKETS];
+    dns->buckets[hash % DNS_BUCKETS] = entry;
+    dns->names += 1;
+
+    return entry;
+}
+
+/*
+ * prune_names - This function removes every expired name that no thread
+ * is resolving or waiting on. The caller must hold the cache's lock.
+ *
+ * Parameters:
+ *  - dns: the cache
+ *  - now: the current time
+ */
+void prune_names(DnsCache *dns, time_t now)
+{
+    DnsEntry **link;
+    DnsEntry *entry;
+    int i;
+
+    for (i = 0; i < DNS_BUCKETS; i++) {
+        link = &dns->buckets[i];
+        while ((entry = *link) != NULL) {
+            if (entry->expires <= now && !entry->resolving
+                    && entry->waiters == 0) {
+                *link = entry->next;
+                Free(entry->host);
+                Free(entry);
+                dns->names -= 1;
+            } else {
+                link = &entry->next;
+            }
+        }
+    }
+    return;
+}
+
+/*
+ * store_addrs - This function replaces an entry's addresses with a new
+ * lookup's, keeping the failures recorded for addresses that are in
+ * both. The caller must hold the cache's lock.
+ *
+ * Parameters:
+ *  - entry: the entry to update
+ *  - result: the new addresses
+ */
+void store_addrs(DnsEntry *entry, DnsEntry *result)
+{
+    int i, j;
+
+    for (i = 0; i < result->naddrs; i++) {
+        for (j = 0; j < entry->naddrs; j++) {
+            if (same_addr(&result->addrs[i], &entry->addrs[j])) {
+                result->down_until[i] = entry->down_until[j];
+                break;
+            }
+        }
+    }
+
+    memcpy(entry->addrs, result->addrs, result->naddrs * sizeof(DnsAddr));
+    memcpy(entry->down_until, result->down_until,
+            sizeof(entry->down_until));
+    entry->naddrs = result->naddrs;
+    return;
+}
+
+/*
+ * copy_addrs - This function copies at most max of an entry's addresses
+ * into addrs, setting the port in each. Addresses that failed to connect
+ * recently come after all the others.
+ *
+ * Parameters:
+ *  - entry: the entry to copy from
+ *  - port: the port to put in each address
+ *  - addrs: filled with the addresses
+ *  - max: room in addrs
+ *  - now: the current time
+ * Return value:
+ *  - the number of addresses copied
+ *  - -1: the entry records a failed lookup
+ */
+int copy_addrs(DnsEntry *entry, int port, DnsAddr *addrs, int max,
+        time_t now)
+{
+    int down;
+    int n = 0;
+    int i;
+
+    if (entry->naddrs == 0) {
+        return -1;
+    }
+
+    /* Addresses that are up on the first pass, the others on the second */
+    for (down = 0; down <= 1; down++) {
+        for (i = 0; i < entry->naddrs && n < max; i++) {
+            if ((entry->down_until[i] > now) == down) {
+                addrs[n] = entry->addrs[i];
+                set_port(&addrs[n], port);
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+/*
+ * same_addr - Returns whether two addresses are the same host, ignoring
+ * their ports.
+ */
+int same_addr(DnsAddr *a, DnsAddr *b)
+{
+    if (a->addr.ss_family != b->addr.ss_family) {
+        return 0;
+    }
+    if (a->addr.ss_family == AF_INET6) {
+        return !memcmp(&((struct sockaddr_in6 *)&a->addr)->sin6_addr,
+                &((struct sockaddr_in6 *)&b->addr)->sin6_addr,
+                sizeof(struct in6_addr));
+    }
+    return ((struct sockaddr_in *)&a->addr)->sin_addr.s_addr
+        == ((struct sockaddr_in *)&b->addr)->sin_addr.s_addr;
+}
+
+/*
+ * set_port - Sets the port of an IPv4 or IPv6 address.
+ */
+void set_port(DnsAddr *addr, int port)
+{
+    if (addr->addr.ss_family == AF_INET6) {
+        ((struct sockaddr_in6 *)&addr->addr)->sin6_port = htons(port);
+    } else {
+        ((struct sockaddr_in *)&addr->addr)->sin_port = htons(port);
+    }
+    return;
+}
+
+/*
+ * End DNS Helper Functions
+ * ------------------------
+ */
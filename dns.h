@@ -0,0 +1,112 @@
+/*
+ * dns.h
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This is the header file for dns.c, which caches the
+ * addresses of web servers so that connecting to a server does not wait
+ * on a name lookup every time. This file just has the relevant macros,
+ * structure definitions, and function prototypes.
+ *
+ */
+
+/* Include guards */
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#include "csapp.h"
+
+/* Macros */
+#define DNS_DEFAULT_TTL 60       /* Seconds a resolved name is kept */
+#define DNS_NEGATIVE_TTL 5       /* Seconds a failed name is kept */
+#define DNS_MAX_ADDRS 8          /* Most addresses kept per name */
+#define DNS_MAX_NAMES 4096       /* Most names kept at once */
+#define DNS_DOWN_TIME 30         /* Seconds an address that failed to
+                                    connect is tried last */
+#define DNS_BUCKETS 1024         /* Number of buckets in the name table */
+
+/*
+ * One address of a web server, ready to pass to connect.
+ */
+typedef struct DnsAddr {
+    struct sockaddr_storage addr; /* The address */
+    socklen_t len;               /* Length of addr */
+} DnsAddr;
+
+/*
+ * Looks up the addresses of a host name. Fills in at most max addresses,
+ * with no port, and returns how many, or -1 if the name does not
+ * resolve. The cache calls it without holding its lock.
+ */
+typedef int (*Resolver)(char *host, DnsAddr *addrs, int max);
+
+/*
+ * The cached result for one host name. A name that did not resolve is
+ * kept with no addresses. While resolving is set, one thread is looking
+ * the name up and every other thread that wants it waits for the result.
+ */
+typedef struct DnsEntry {
+    char *host;                  /* The host name */
+    uint64_t hash;               /* Hash of host */
+    DnsAddr addrs[DNS_MAX_ADDRS]; /* Its addresses */
+    time_t down_until[DNS_MAX_ADDRS]; /* Until when each address is tried
+                                    last, having failed to connect */
+    int naddrs;                  /* Number of addresses, 0 if it failed */
+    time_t expires;              /* When the result must be looked up
+                                    again */
+    int resolving;               /* A lookup is in progress */
+    int waiters;                 /* Threads waiting for that lookup */
+    struct DnsEntry *next;       /* Next name in the same bucket */
+} DnsEntry;
+
+/*
+ * Defines the cache: a hash table of host names. Everything is protected
+ * by lock, and resolved is signalled whenever a lookup finishes.
+ */
+typedef struct DnsCache {
+    pthread_mutex_t lock;        /* Protects the table and the counters */
+    pthread_cond_t resolved;     /* Signalled when any lookup finishes */
+    DnsEntry **buckets;          /* Chains of names */
+    int names;                   /* Number of names in the table */
+    int ttl;                     /* Seconds a resolved name is kept */
+    int negative_ttl;            /* Seconds a failed name is kept */
+    Resolver resolve;            /* Does the actual lookups */
+    unsigned long hits;          /* Lookups answered from the table */
+    unsigned long negative_hits; /* Of those, answered with a failure */
+    unsigned long misses;        /* Lookups that called the resolver */
+    unsigned long shared;        /* Lookups that waited on another one */
+} DnsCache;
+
+/*
+ * A snapshot of the cache's counters, for monitoring.
+ */
+typedef struct DnsStats {
+    int names;                   /* Names in the table right now */
+    unsigned long hits;          /* Lookups answered from the table */
+    unsigned long negative_hits; /* Of those, answered with a failure */
+    unsigned long misses;        /* Lookups that called the resolver */
+    unsigned long shared;        /* Lookups that waited on another one */
+} DnsStats;
+
+/* Main DNS Function Prototypes */
+DnsCache *dns_init(int ttl, int negative_ttl, Resolver resolve);
+int dns_lookup(DnsCache *dns, char *host, int port, DnsAddr *addrs, int max);
+void dns_report(DnsCache *dns, char *host, DnsAddr *addr, int ok);
+void dns_get_stats(DnsCache *dns, DnsStats *stats);
+void dns_destroy(DnsCache *dns);
+/* DNS Helper Functions */
+int dns_getaddrinfo(char *host, DnsAddr *addrs, int max);
+DnsEntry *find_name(DnsCache *dns, char *host, uint64_t hash);
+DnsEntry *add_name(DnsCache *dns, char *host, uint64_t hash, time_t now);
+void prune_names(DnsCache *dns, time_t now);
+void store_addrs(DnsEntry *entry, DnsEntry *result);
+int copy_addrs(DnsEntry *entry, int port, DnsAddr *addrs, int max,
+        time_t now);
+int same_addr(DnsAddr *a, DnsAddr *b);
+void set_port(DnsAddr *addr, int port);
+
+#endif
@@ -0,0 +1,256 @@
+/*
+ * epoch.c
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This file contains the functions for epoch-based
+ * reclamation, which the cache uses so that lookups can walk a hash index
+ * while writers change it, without either taking a lock the other needs.
+ * A lookup only increments and decrements a counter in its thread's slot.
+ * Threads are given slots round robin, so a slot is a thread's own only
+ * while there are no more threads than EPOCH_SLOTS; beyond that, threads
+ * that share a slot increment the same counter, which is still correct
+ * but makes them contend for its cache line. A writer that unlinks a
+ * node or replaces the index retires it, and it is freed after a grace
+ * period, once every lookup that could have reached it has finished.
+ *
+ * This is the scheme of sleepable RCU: readers count themselves under the
+ * parity of the epoch they entered in, and a grace period flips the epoch
+ * and waits for the counters of each parity to drain in turn. Read
+ * sections in the cache last only as long as one walk of a hash chain, so
+ * grace periods are short, and retired objects are freed in batches so
+ * that writers rarely wait for one.
+ *
+ */
+
+#include <sched.h>
+
+#include "epoch.h"
+
+/* Thread Variables */
+static __thread int thread_slot = -1;  /* This thread's slot, once picked */
+static int next_slot = 0;              /* Slot for the next new thread */
+
+/*
+ * Main Epoch Functions
+ * --------------------
+ */
+
+/*
+ * epoch_init - This function creates an epoch domain with no readers and
+ * nothing retired.
+ *
+ * Return value:
+ *  - epoch: a pointer to the new domain
+ */
+Epoch *epoch_init(void)
+{
+    Epoch *epoch = NULL;
+
+    if (posix_memalign((void **)&epoch, EPOCH_LINE, sizeof(Epoch)) != 0) {
+        unix_error("posix_memalign error");
+    }
+    memset(epoch, 0, sizeof(Epoch));
+    pthread_mutex_init(&epoch->sync_lock, NULL);
+    pthread_mutex_init(&epoch->retire_lock, NULL);
+    epoch->size = EPOCH_BATCH;
+    epoch->retired = Malloc(epoch->size * sizeof(EpochRetired));
+    return epoch;
+}
+
+/*
+ * epoch_enter - This function starts a read section. Until the matching
+ * epoch_exit, nothing retired after this call is freed. Sections may
+ * nest.
+ *
+ * Parameter:
+ *  - epoch: the domain
+ * Return value:
+ *  - token: to be passed to epoch_exit
+ */
+int epoch_enter(Epoch *epoch)
+{
+    int slot = epoch_slot();
+    int parity = __atomic_load_n(&epoch->epoch, __ATOMIC_RELAXED) & 1;
+
+    /*
+     * A full barrier, so that no shared pointer is read before the
+     * count is seen by writers
+     */
+    __atomic_add_fetch(&epoch->slots[slot].readers[parity], 1,
+            __ATOMIC_SEQ_CST);
+    return slot << 1 | parity;
+}
+
+/*
+ * epoch_exit - This function ends a read section.
+ *
+ * Parameters:
+ *  - epoch: the domain
+ *  - token: returned by the epoch_enter that started the section
+ */
+void epoch_exit(Epoch *epoch, int token)
+{
+    __atomic_sub_fetch(&epoch->slots[token >> 1].readers[token & 1], 1,
+            __ATOMIC_RELEASE);
+    return;
+}
+
+/*
+ * epoch_synchronize - This function waits for a grace period: it returns
+ * once every read section that had started when it was called has ended.
+ * It must not be called from inside a read section.
+ *
+ * Parameter:
+ *  - epoch: the domain
+ */
+void epoch_synchronize(Epoch *epoch)
+{
+    unsigned long current;
+
+    pthread_mutex_lock(&epoch->sync_lock);
+    current = __atomic_load_n(&epoch->epoch, __ATOMIC_SEQ_CST);
+    wait_readers(epoch, (current + 1) & 1);
+    __atomic_store_n(&epoch->epoch, current + 1, __ATOMIC_SEQ_CST);
+    wait_readers(epoch, current & 1);
+    epoch->grace_periods += 1;
+    pthread_mutex_unlock(&epoch->sync_lock);
+    return;
+}
+
+/*
+ * epoch_retire - This function hands over an object that readers may
+ * still be reading, to be freed after a grace period. The caller must
+ * already have made it unreachable to new readers.
+ *
+ * Parameters:
+ *  - epoch: the domain
+ *  - ptr: the object
+ *  - free: called with ptr once no reader can be reading it
+ */
+void epoch_retire(Epoch *epoch, void *ptr, EpochFree free)
+{
+    pthread_mutex_lock(&epoch->retire_lock);
+    if (epoch->nretired == epoch->size) {
+        epoch->size *= 2;
+        epoch->retired = Realloc(epoch->retired,
+                epoch->size * sizeof(EpochRetired));
+    }
+    epoch->retired[epoch->nretired].ptr = ptr;
+    epoch->retired[epoch->nretired].free = free;
+    epoch->nretired += 1;
+    pthread_mutex_unlock(&epoch->retire_lock);
+    return;
+}
+
+/*
+ * epoch_reclaim - This function frees what has been retired, after a
+ * grace period, once there is at least a batch of it. Objects retired
+ * while it waits are left for the next call. It must not be called from
+ * inside a read section.
+ *
+ * Parameters:
+ *  - epoch: the domain
+ *  - force: free whatever has been retired, however little
+ */
+void epoch_reclaim(Epoch *epoch, int force)
+{
+    EpochRetired *batch;
+    size_t count, i;
+
+    pthread_mutex_lock(&epoch->retire_lock);
+    count = epoch->nretired;
+    if (count == 0 || (!force && count < EPOCH_BATCH)) {
+        pthread_mutex_unlock(&epoch->retire_lock);
+        return;
+    }
+    batch = epoch->retired;
+    epoch->retired = Malloc(epoch->size * sizeof(EpochRetired));
+    epoch->nretired = 0;
+    pthread_mutex_unlock(&epoch->retire_lock);
+
+    epoch_synchronize(epoch);
+    for (i = 0; i < count; i++) {
+        batch[i].free(batch[i].ptr);
+    }
+    Free(batch);
+    return;
+}
+
+/*
+ * epoch_destroy - This function frees everything still retired, and then
+ * the domain. No reader may be left.
+ *
+ * Parameter:
+ *  - epoch: the domain to destroy
+ */
+void epoch_destroy(Epoch *epoch)
+{
+    size_t i;
+
+    for (i = 0; i < epoch->nretired; i++) {
+        epoch->retired[i].free(epoch->retired[i].ptr);
+    }
+    Free(epoch->retired);
+    pthread_mutex_destroy(&epoch->retire_lock);
+    pthread_mutex_destroy(&epoch->sync_lock);
+    free(epoch);
+    return;
+}
+
+/*
+ * End Main Epoch Functions
+ * ------------------------
+ */
+
+
+/*
+ * Epoch Helper Functions
+ * ----------------------
+ */
+
+/*
+ * epoch_slot - This function returns the calling thread's slot, which is
+ * picked round robin the first time it asks. It is the same in every
+ * domain, and the cache also uses it to spread buffered hits.
+ */
+int epoch_slot(void)
+{
+    if (thread_slot < 0) {
+        thread_slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED)
+            % EPOCH_SLOTS;
+    }
+    return thread_slot;
+}
+
+/*
+ * wait_readers - This function waits until no reader is inside a read
+ * section entered under one parity of the epoch, yielding while any is.
+ *
+ * Parameters:
+ *  - epoch: the domain
+ *  - parity: 0 or 1
+ */
+void wait_readers(Epoch *epoch, int parity)
+{
+    unsigned long readers;
+    int i;
+
+    while (1) {
+        readers = 0;
+        for (i = 0; i < EPOCH_SLOTS; i++) {
+            readers += __atomic_load_n(&epoch->slots[i].readers[parity],
+                    __ATOMIC_SEQ_CST);
+        }
+        if (readers == 0) {
+            return;
+        }
+        sched_yield();
+    }
+}
+
+/*
+ * End Epoch Helper Functions
+ * --------------------------
+ */
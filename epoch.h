@@ -0,0 +1,88 @@
+/*
+ * epoch.h
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This is the header file for epoch.c, which lets the
+ * cache's lookups walk its hash index without taking any lock, by
+ * deferring the freeing of whatever they might be reading. This file just
+ * has the relevant macros, structure definitions, and function
+ * prototypes.
+ *
+ */
+
+/* Include guards */
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#include "csapp.h"
+
+/* Macros */
+#define EPOCH_SLOTS 64           /* Reader counters, shared by threads
+                                    beyond this many */
+#define EPOCH_BATCH 16           /* Retired objects freed at once */
+#define EPOCH_LINE 64            /* Bytes in a cache line */
+
+/*
+ * Called with an object once no reader can still be reading it.
+ */
+typedef void (*EpochFree)(void *ptr);
+
+/*
+ * The reader counters of one slot, which is only written by the threads
+ * mapped to it: how many of them are inside a read section, by the
+ * parity of the epoch each entered in. Each slot has a cache line to
+ * itself, so readers on different slots never write the same line, but
+ * readers that share a slot update its counters atomically and contend
+ * for it.
+ */
+typedef struct EpochSlot {
+    unsigned long readers[2];    /* Readers inside, by epoch parity */
+} __attribute__((aligned(EPOCH_LINE))) EpochSlot;
+
+/*
+ * An object waiting for a grace period before it is freed.
+ */
+typedef struct EpochRetired {
+    void *ptr;                   /* The object */
+    EpochFree free;              /* Frees it */
+} EpochRetired;
+
+/*
+ * Defines an epoch domain. Readers enter a read section before following
+ * shared pointers and exit it when done, only touching their slot's
+ * counters. A writer that has unlinked an object retires it rather than
+ * freeing it; retired objects are freed in batches, after a grace period
+ * in which every read section that might have seen them has ended.
+ *
+ * A grace period waits for the readers of the parity not in use to leave,
+ * flips the epoch, and waits for the readers of the old parity to leave.
+ * Waiting on both parities covers a reader that read the epoch before
+ * the flip but counted itself after it.
+ */
+typedef struct Epoch {
+    EpochSlot slots[EPOCH_SLOTS];  /* Reader counters */
+    unsigned long epoch;         /* Current epoch; its parity picks the
+                                    counters new readers use */
+    pthread_mutex_t sync_lock;   /* Serializes grace periods */
+    pthread_mutex_t retire_lock; /* Protects the retired list */
+    EpochRetired *retired;       /* Objects waiting to be freed */
+    size_t nretired;             /* Number of them */
+    size_t size;                 /* Entries allocated */
+    unsigned long grace_periods; /* Grace periods waited for */
+} Epoch;
+
+/* Main Epoch Function Prototypes */
+Epoch *epoch_init(void);
+int epoch_enter(Epoch *epoch);
+void epoch_exit(Epoch *epoch, int token);
+void epoch_synchronize(Epoch *epoch);
+void epoch_retire(Epoch *epoch, void *ptr, EpochFree free);
+void epoch_reclaim(Epoch *epoch, int force);
+void epoch_destroy(Epoch *epoch);
+/* Epoch Helper Functions */
+int epoch_slot(void);
+void wait_readers(Epoch *epoch, int parity);
+
+#endif
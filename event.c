@@ -0,0 +1,1721 @@
+/*
+ * event.c
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This file contains the proxy's event-driven engine, an
+ * alternative to serving each connection on its own thread. A fixed number
+ * of event loops, normally one per core, share the listening socket. Each
+ * loop owns an epoll instance and accepts and drives many non-blocking
+ * connections at once, so a slow browser costs a little memory instead of
+ * a whole thread.
+ *
+ * Every connection moves through a small state machine: it reads the
+ * browser's request, then either writes a cached object back, or connects
+ * to the web server, sends it the rewritten request, reads the response
+ * headers and relays the response. Each state runs until it would block,
+ * registers interest in the event it is waiting for, and returns to the
+ * loop. When the browser keeps its connection open, the connection goes
+ * back to reading the next request. The request is parsed and rewritten,
+ * and the response framed, by the same code in http.c that the threaded
+ * engine uses, and a response is cached under the same rules, so the two
+ * engines serve identical bytes.
+ *
+ * Connections to web servers come from the shared upstream pool when it
+ * has one for the server, and go back to it when a response ends at its
+ * Content-Length. A reused connection that turns out to be dead before
+ * the response starts is replaced with a new one and the request is sent
+ * again.
+ *
+ * Connections waiting for a request sit on a list in the order they
+ * started waiting, so the loop closes the ones that have waited too long
+ * by looking only at the front of the list.
+ *
+ * A new connection to a web server is a race between the server's
+ * addresses, driven by the loop: each attempt is watched for EPOLLOUT and
+ * the loop wakes up when the next address is due or the race times out.
+ * Connections that are racing sit on their own list for that purpose.
+ *
+ * Server names are resolved through the DNS cache, so a loop only blocks
+ * on getaddrinfo the first time it meets a name, or when the cached
+ * answer has expired.
+ *
+ * A miss in the cache is looked up in the disk cache, when there is one.
+ * The object is read and promoted on the loop's thread, which blocks only
+ * as long as a read from the page cache usually takes, and its body is
+ * then sent with sendfile as the browser's socket drains.
+ *
+ * When the proxy collapses misses, a request that misses while another
+ * request for the same URI is fetching it follows that fetch instead of
+ * connecting. It sits on the loop's list of waiting connections until the
+ * fetch lands, which writes to the loop's eventfd, or until it has waited
+ * as long as the flight table allows; then it is answered from the cache,
+ * or goes to the web server itself.
+ *
+ * A stale object that the web server allows to be served while it is
+ * revalidated is sent back at once, and its revalidation handed to the
+ * background refresh pool. One that it allows to be served on errors is
+ * kept while the request revalidates it, and sent instead if the server
+ * cannot be reached or fails before any of its response reaches the
+ * browser.
+ *
+ */
+
+/* For accept4 */
+#define _GNU_SOURCE
+
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <netinet/tcp.h>
+
+#include "event.h"
+
+/*
+ * Main Event Functions
+ * --------------------
+ */
+
+/*
+ * event_init - This function creates the engine's loops. Each loop gets
+ * its own epoll instance with the listening socket registered in it, and
+ * the process's open file limit is raised as far as allowed, since every
+ * connection can hold two descriptors.
+ *
+ * Parameters:
+ *  - listenfd: the proxy's listening socket; it is made non-blocking
+ *  - nloops: number of event loops to run
+ *  - cache: cache for web objects
+ *  - disk: the disk cache below cache, or NULL if there is none
+ *  - flights: table used to collapse concurrent misses, or NULL
+ *  - refresh: pool that refreshes stale objects in the background, or
+ *             NULL
+ *  - upstream: pool of idle connections to web servers
+ *  - dns: cache of web server addresses
+ *  - trace: trace that every request served is recorded in, or NULL
+ *  - idle_timeout: seconds a connection may wait for a request
+ *  - max_requests: most requests served on one connection
+ *  - connect_timeout: milliseconds allowed to connect to a web server
+ * Return value:
+ *  - engine: a pointer to the engine, ready to run
+ */
+EventEngine *event_init(int listenfd, int nloops, Cache *cache,
+        DiskCache *disk, FlightTable *flights, RefreshPool *refresh,
+        UpstreamPool *upstream, DnsCache *dns, Trace *trace,
+        int idle_timeout, int max_requests, int connect_timeout)
+{
+    EventEngine *engine = Malloc(sizeof(EventEngine));
+    EventLoop *loop;
+    struct rlimit limit;
+    int i;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0
+            && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+
+    engine->nloops = nloops;
+    engine->loops = Calloc(nloops, sizeof(EventLoop));
+    for (i = 0; i < nloops; i++) {
+        loop = &engine->loops[i];
+        if ((loop->epfd = epoll_create1(0)) < 0) {
+            unix_error("epoll_create1 error");
+        }
+        loop->listen.conn = NULL;
+        loop->listen.fd = listenfd;
+        loop->listen.events = 0;
+        loop->cache = cache;
+        loop->disk = disk;
+        loop->flights = flights;
+        loop->refresh = refresh;
+        loop->upstream = upstream;
+        loop->dns = dns;
+        loop->trace = trace;
+        loop->idle_timeout = idle_timeout;
+        loop->max_requests = max_requests;
+        loop->connect_timeout = connect_timeout;
+        loop->connecting = NULL;
+        loop->waiting = NULL;
+        loop->idle_head = NULL;
+        loop->idle_tail = NULL;
+        loop->closed = NULL;
+        /* Wake only one loop per new connection */
+        watch(loop, &loop->listen, EPOLLIN | EPOLLEXCLUSIVE);
+
+        loop->wake.conn = NULL;
+        loop->wake.fd = -1;
+        loop->wake.events = 0;
+        if (flights != NULL && (loop->wake.fd = eventfd(0, 
+                        EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            unix_error("eventfd error");
+        }
+        watch(loop, &loop->wake, EPOLLIN);
+    }
+
+    return engine;
+}
+
+/*
+ * event_run - This function runs the engine. Every loop but the first
+ * gets a thread of its own and the first runs on the calling thread.
+ *
+ * Parameter:
+ *  - engine: the engine to run
+ * Return value:
+ *  - never returns
+ */
+void event_run(EventEngine *engine)
+{
+    int i;
+
+    for (i = 1; i < engine->nloops; i++) {
+        Pthread_create(&engine->loops[i].tid, NULL, event_loop,
+                &engine->loops[i]);
+    }
+    engine->loops[0].tid = pthread_self();
+    event_loop(&engine->loops[0]);
+    return;
+}
+
+/*
+ * event_get_stats - This function sums the loops' counters into stats.
+ *
+ * Parameters:
+ *  - engine: the engine to report on
+ *  - stats: filled with the current counters
+ */
+void event_get_stats(EventEngine *engine, EventStats *stats)
+{
+    int i;
+
+    stats->nloops = engine->nloops;
+    stats->accepted = 0;
+    stats->active = 0;
+    for (i = 0; i < engine->nloops; i++) {
+        stats->accepted += __atomic_load_n(&engine->loops[i].accepted,
+                __ATOMIC_RELAXED);
+        stats->active += __atomic_load_n(&engine->loops[i].active,
+                __ATOMIC_RELAXED);
+    }
+    return;
+}
+
+/*
+ * End Main Event Functions
+ * ------------------------
+ */
+
+
+/*
+ * Event Helper Functions
+ * ----------------------
+ */
+
+/*
+ * event_loop - This is the body of every loop thread. It waits for a
+ * batch of events, or until the oldest idle connection times out, a
+ * race to connect needs attention or a follower has waited long enough,
+ * and hands each event to the listening socket, the wake eventfd or the
+ * connection it belongs to, forever. Connections that finish during a
+ * batch are only freed once the whole batch is handled, because later
+ * events in the same batch may still point at them.
+ *
+ * Parameter:
+ *  - vargp: the loop
+ * Return value:
+ *  - never returns
+ */
+void *event_loop(void *vargp)
+{
+    EventLoop *loop = vargp;
+    struct epoll_event events[EVENT_BATCH];
+    EventRef *ref;
+    Conn *conn;
+    int wait, connect_wait, follow_wait;
+    int i, n;
+
+    while (1) {
+        wait = idle_wait_ms(loop);
+        connect_wait = connect_wait_ms(loop);
+        if (connect_wait >= 0 && (wait < 0 || connect_wait < wait)) {
+            wait = connect_wait;
+        }
+        follow_wait = follow_wait_ms(loop);
+        if (follow_wait >= 0 && (wait < 0 || follow_wait < wait)) {
+            wait = follow_wait;
+        }
+
+        n = epoll_wait(loop->epfd, events, EVENT_BATCH, wait);
+        if (n < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "Error in epoll_wait: %s\n",
+                        strerror(errno));
+            }
+            continue;
+        }
+
+        for (i = 0; i < n; i++) {
+            ref = events[i].data.ptr;
+            if (ref == &loop->wake) {
+                follow_wake(loop);
+            } else if (ref->conn == NULL) {
+                accept_conns(loop);
+            } else if (ref->conn->state != CONN_CLOSED) {
+                conn_run(loop, ref->conn);
+            }
+        }
+        idle_expire(loop);
+        connect_expire(loop);
+        follow_expire(loop);
+
+        while ((conn = loop->closed) != NULL) {
+            loop->closed = conn->next_closed;
+            Free(conn);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * accept_conns - This function accepts every connection waiting on the
+ * listening socket and starts reading each one's request.
+ *
+ * Parameter:
+ *  - loop: the loop that was woken
+ */
+void accept_conns(EventLoop *loop)
+{
+    Conn *conn;
+    int connfd;
+    int on = 1;
+
+    while ((connfd = accept4(loop->listen.fd, NULL, NULL,
+                    SOCK_NONBLOCK)) >= 0) {
+        /* Send each response as soon as it is written */
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        conn = Calloc(1, sizeof(Conn));
+        conn->state = CONN_READ_REQUEST;
+        conn->browser.conn = conn;
+        conn->browser.fd = connfd;
+        conn->server.conn = conn;
+        conn->server.fd = -1;
+        conn->pipe[0] = -1;
+        conn->pipe[1] = -1;
+        buf_init(&conn->in, MAXLINE);
+        idle_add(loop, conn);
+
+        __atomic_add_fetch(&loop->accepted, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&loop->active, 1, __ATOMIC_RELAXED);
+        conn_run(loop, conn);
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        fprintf(stderr, "Error in accept: %s\n", strerror(errno));
+    }
+    return;
+}
+
+/*
+ * conn_run - This function runs a connection's state machine until it
+ * has to wait for an event or is finished. Every state tolerates being
+ * run when nothing is ready, since an event may be left over from an
+ * earlier state.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the connection
+ *  - conn: the connection
+ */
+void conn_run(EventLoop *loop, Conn *conn)
+{
+    int step = STEP_AGAIN;
+
+    while (step == STEP_AGAIN) {
+        switch (conn->state) {
+        case CONN_READ_REQUEST:
+            step = step_read_request(loop, conn);
+            break;
+        case CONN_SEND_HIT:
+            step = step_send_hit(loop, conn);
+            break;
+        case CONN_WAIT_FLIGHT:
+            step = step_wait_flight(loop, conn);
+            break;
+        case CONN_CONNECTING:
+            step = step_connecting(loop, conn);
+            break;
+        case CONN_SEND_REQUEST:
+            step = step_send_request(loop, conn);
+            break;
+        case CONN_READ_HEAD:
+            step = step_read_head(loop, conn);
+            break;
+        case CONN_RELAY:
+            step = step_relay(loop, conn);
+            break;
+        default:
+            step = STEP_DONE;
+            break;
+        }
+    }
+
+    if (step == STEP_DONE) {
+        conn_close(loop, conn);
+    }
+    return;
+}
+
+/*
+ * conn_finish - This function ends the current response. The request is
+ * recorded in the trace, if there is one, with the size of the object
+ * sent from the cache or of the response read from the web server. A
+ * complete response that is small enough is cached, and the connection
+ * to the server goes back to the upstream pool if the server keeps it
+ * open. Then, if the browser's connection stays open, the connection goes
+ * back to waiting for the next request.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the connection
+ *  - conn: the connection
+ * Return value:
+ *  - STEP_AGAIN or STEP_DONE
+ */
+int conn_finish(EventLoop *loop, Conn *conn)
+{
+    int keep_alive = conn->keep_alive && !conn->browser_gone;
+
+    if (conn->hit != NULL) {
+        trace_record(loop->trace, conn->uri, conn->hit->object_size, 1);
+    } else if (conn->disk_hit.seg != NULL) {
+        trace_record(loop->trace, conn->uri, conn->disk_hit.size, 1);
+    } else {
+        trace_record(loop->trace, conn->uri, conn->response_size,
+                conn->cacheable);
+    }
+
+    /* Cache the web object if it is small enough */
+    if (conn->need_to_cache) {
+        cache_add(loop->cache, conn->uri, conn->object.data,
+                conn->object.len, conn->expires);
+    }
+    flight_land(loop->flights, &conn->flight, conn->need_to_cache);
+
+    if (conn->server.fd >= 0 && conn->server_keep_alive) {
+        watch(loop, &conn->server, 0);
+        upstream_put(loop->upstream, conn->host, conn->port,
+                conn->server.fd);
+        conn->server.fd = -1;
+    }
+
+    conn_reset(conn);
+    if (!keep_alive) {
+        return STEP_DONE;
+    }
+
+    conn->state = CONN_READ_REQUEST;
+    idle_add(loop, conn);
+    return STEP_AGAIN;
+}
+
+/*
+ * conn_reset - This function frees everything a connection holds for
+ * its current request, including its connection to the web server.
+ *
+ * Parameter:
+ *  - conn: the connection
+ */
+void conn_reset(Conn *conn)
+{
+    /* Closing a descriptor also removes it from the epoll instance */
+    if (conn->server.fd >= 0) {
+        Close(conn->server.fd);
+        conn->server.fd = -1;
+        conn->server.events = 0;
+    }
+
+    if (conn->hit != NULL) {
+        cache_release(conn->hit);
+        conn->hit = NULL;
+    }
+    if (conn->stale != NULL) {
+        cache_release(conn->stale);
+        conn->stale = NULL;
+    }
+    if (conn->disk_hit.seg != NULL) {
+        disk_release(&conn->disk_hit);
+    }
+    if (conn->out.data != NULL) {
+        buf_free(&conn->out);
+    }
+    if (conn->head.data != NULL) {
+        buf_free(&conn->head);
+    }
+    if (conn->server_head.data != NULL) {
+        buf_free(&conn->server_head);
+    }
+    if (conn->object.data != NULL) {
+        buf_free(&conn->object);
+    }
+    Free(conn->uri);
+    conn->uri = NULL;
+    Free(conn->host);
+    conn->host = NULL;
+    Free(conn->relay);
+    conn->relay = NULL;
+    if (conn->pipe[0] >= 0) {
+        Close(conn->pipe[0]);
+        Close(conn->pipe[1]);
+        conn->pipe[0] = -1;
+        conn->pipe[1] = -1;
+    }
+    conn->piped = 0;
+
+    conn->out_off = 0;
+    conn->head_off = 0;
+    conn->relay_off = 0;
+    conn->relay_end = 0;
+    conn->server_done = 0;
+    conn->need_to_cache = 0;
+    conn->reused = 0;
+    conn->server_keep_alive = 0;
+    return;
+}
+
+/*
+ * conn_connect - This function gets a connection to the web server for
+ * the current request: an idle one from the upstream pool, which is
+ * ready for the request right away, or a new one, which must first
+ * finish connecting.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the connection
+ *  - conn: the connection
+ * Return value:
+ *  - STEP_AGAIN or STEP_DONE
+ */
+int conn_connect(EventLoop *loop, Conn *conn)
+{
+    int i;
+
+    if ((conn->server.fd = upstream_get(loop->upstream, conn->host,
+                    conn->port, 1)) >= 0) {
+        conn->reused = 1;
+        conn->state = CONN_SEND_REQUEST;
+        return STEP_AGAIN;
+    }
+
+    conn->reused = 0;
+    conn->race = Malloc(sizeof(Race));
+    if (race_start(conn->race, loop->dns, conn->host, conn->port,
+                loop->connect_timeout) < 0) {
+        Free(conn->race);
+        conn->race = NULL;
+        fprintf(stderr, "Error in open_clientfd: %s\n", conn->host);
+        return serve_stale(loop, conn);
+    }
+    for (i = 0; i < DNS_MAX_ADDRS; i++) {
+        conn->tries[i].conn = conn;
+        conn->tries[i].fd = -1;
+        conn->tries[i].events = 0;
+    }
+
+    conn->race_prev = NULL;
+    conn->race_next = loop->connecting;
+    if (loop->connecting != NULL) {
+        loop->connecting->race_prev = conn;
+    }
+    loop->connecting = conn;
+
+    conn->state = CONN_CONNECTING;
+    return STEP_AGAIN;
+}
+
+/*
+ * conn_retry - This function handles a failure on the connection to the
+ * web server before any of the response arrived. If the connection came
+ * from the upstream pool, the server had probably closed it while it sat
+ * idle, so the request is sent again on another connection. Otherwise
+ * the request is answered with its stale copy, if it may be.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the connection
+ *  - conn: the connection
+ * Return value:
+ *  - STEP_AGAIN or STEP_DONE
+ */
+int conn_retry(EventLoop *loop, Conn *conn)
+{
+    if (!conn->reused) {
+        return serve_stale(loop, conn);
+    }
+
+    Close(conn->server.fd);
+    conn->server.fd = -1;
+    conn->server.events = 0;
+    conn->out_off = 0;
+    return conn_connect(loop, conn);
+}
+
+/*
+ * connect_end - This function ends a connection's race to connect, if it
+ * has one, closing the attempts still in progress. A winning socket is
+ * left open for the caller but no longer watched.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the connection
+ *  - conn: the connection
+ */
+void connect_end(EventLoop *loop, Conn *conn)
+{
+    int i;
+
+    if (conn->race == NULL) {
+        return;
+    }
+
+    /* Closing a descriptor also removes it from the epoll instance */
+    race_abort(conn->race);
+    for (i = 0; i < DNS_MAX_ADDRS; i++) {
+        if (conn->tries[i].fd >= 0 && i == conn->race->won) {
+            watch(loop, &conn->tries[i], 0);
+        }
+        conn->tries[i].fd = -1;
+        conn->tries[i].events = 0;
+    }
+
+    if (conn->race_prev != NULL) {
+        conn->race_prev->race_next = conn->race_next;
+    } else {
+        loop->connecting = conn->race_next;
+    }
+    if (conn->race_next != NULL) {
+        conn->race_next->race_prev = conn->race_prev;
+    }
+    Free(conn->race);
+    conn->race = NULL;
+    return;
+}
+
+/*
+ * conn_close - This function closes both of a connection's sockets and
+ * frees everything it holds, except the connection itself, which is put
+ * on the loop's list to be freed after the current batch.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the connection
+ *  - conn: the connection
+ */
+void conn_close(EventLoop *loop, Conn *conn)
+{
+    idle_remove(loop, conn);
+    connect_end(loop, conn);
+    follow_end(loop, conn);
+    flight_land(loop->flights, &conn->flight, 0);
+    conn_reset(conn);
+    Close(conn->browser.fd);
+    buf_free(&conn->in);
+
+    conn->state = CONN_CLOSED;
+    conn->next_closed = loop->closed;
+    loop->closed = conn;
+    __atomic_sub_fetch(&loop->active, 1, __ATOMIC_RELAXED);
+    return;
+}
+
+/*
+ * watch - This function sets the events a loop waits for on one
+ * descriptor. The loop is level-triggered, so a descriptor that the
+ * connection is not interested in right now is taken out of the epoll
+ * instance entirely; otherwise a hang-up it is not ready to handle would
+ * wake the loop over and over.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the descriptor
+ *  - ref: the descriptor
+ *  - events: the events to wait for, or 0 for none
+ */
+void watch(EventLoop *loop, EventRef *ref, unsigned int events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (ref->fd < 0 || events == ref->events) {
+        return;
+    }
+
+    if (events == 0) {
+        op = EPOLL_CTL_DEL;
+    } else if (ref->events == 0) {
+        op = EPOLL_CTL_ADD;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+
+    ev.events = events;
+    ev.data.ptr = ref;
+    if (epoll_ctl(loop->epfd, op, ref->fd, &ev) < 0) {
+        fprintf(stderr, "Error in epoll_ctl: %s\n", strerror(errno));
+    }
+    ref->events = events;
+    return;
+}
+
+/*
+ * idle_add - Puts a connection that starts waiting for a request at the
+ * back of the loop's idle list.
+ */
+void idle_add(EventLoop *loop, Conn *conn)
+{
+    conn->idle_since = now_ms();
+    conn->idle_next = NULL;
+    conn->idle_prev = loop->idle_tail;
+    if (loop->idle_tail != NULL) {
+        loop->idle_tail->idle_next = conn;
+    } else {
+        loop->idle_head = conn;
+    }
+    loop->idle_tail = conn;
+    return;
+}
+
+/*
+ * idle_remove - Takes a connection off the loop's idle list, if it is on
+ * it.
+ */
+void idle_remove(EventLoop *loop, Conn *conn)
+{
+    if (conn->idle_prev == NULL && loop->idle_head != conn) {
+        return;
+    }
+
+    if (conn->idle_prev != NULL) {
+        conn->idle_prev->idle_next = conn->idle_next;
+    } else {
+        loop->idle_head = conn->idle_next;
+    }
+    if (conn->idle_next != NULL) {
+        conn->idle_next->idle_prev = conn->idle_prev;
+    } else {
+        loop->idle_tail = conn->idle_prev;
+    }
+    conn->idle_prev = NULL;
+    conn->idle_next = NULL;
+    return;
+}
+
+/*
+ * idle_wait_ms - Returns how long the loop may wait for events before
+ * the oldest idle connection times out, or -1 to wait indefinitely.
+ */
+int idle_wait_ms(EventLoop *loop)
+{
+    long wait;
+
+    if (loop->idle_head == NULL) {
+        return -1;
+    }
+    wait = loop->idle_head->idle_since + loop->idle_timeout * 1000L
+        - now_ms();
+    return wait > 0 ? (int)wait : 0;
+}
+
+/*
+ * idle_expire - Closes the connections that have waited for a request
+ * for longer than the idle timeout. They are at the front of the list.
+ */
+void idle_expire(EventLoop *loop)
+{
+    long now = now_ms();
+    Conn *conn;
+
+    while ((conn = loop->idle_head) != NULL
+            && now - conn->idle_since >= loop->idle_timeout * 1000L) {
+        conn_close(loop, conn);
+    }
+    return;
+}
+
+/*
+ * connect_wait_ms - Returns how long the loop may wait for events before
+ * one of its races to connect needs attention, or -1 if it has none.
+ */
+int connect_wait_ms(EventLoop *loop)
+{
+    long now = now_ms();
+    long wait = -1;
+    long timer;
+    Conn *conn;
+
+    for (conn = loop->connecting; conn != NULL; conn = conn->race_next) {
+        timer = race_timer(conn->race) - now;
+        if (wait < 0 || timer < wait) {
+            wait = timer > 0 ? timer : 0;
+        }
+    }
+    return (int)wait;
+}
+
+/*
+ * connect_expire - Runs every connection whose race to connect is due to
+ * try its next address or to time out.
+ */
+void connect_expire(EventLoop *loop)
+{
+    long now = now_ms();
+    Conn *conn;
+    Conn *next;
+
+    for (conn = loop->connecting; conn != NULL; conn = next) {
+        next = conn->race_next;
+        if (race_timer(conn->race) <= now) {
+            conn_run(loop, conn);
+        }
+    }
+    return;
+}
+
+/*
+ * follow_end - This function takes a follower off the loop's list of
+ * waiting connections and lets go of the fetch it followed. It does
+ * nothing for a connection that follows no fetch, or that leads one.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the connection
+ *  - conn: the connection
+ * Return value:
+ *  - the state of the fetch when it was let go, or FLIGHT_FAILED if
+ *    there was none to let go
+ */
+int follow_end(EventLoop *loop, Conn *conn)
+{
+    int state;
+
+    if (conn->flight == NULL || conn->leader) {
+        return FLIGHT_FAILED;
+    }
+
+    if (conn->wait_prev != NULL) {
+        conn->wait_prev->wait_next = conn->wait_next;
+    } else {
+        loop->waiting = conn->wait_next;
+    }
+    if (conn->wait_next != NULL) {
+        conn->wait_next->wait_prev = conn->wait_prev;
+    }
+    conn->wait_prev = NULL;
+    conn->wait_next = NULL;
+
+    state = flight_leave(loop->flights, conn->flight);
+    conn->flight = NULL;
+    return state;
+}
+
+/*
+ * follow_wake - Runs every waiting connection whose fetch has landed,
+ * once the loop's eventfd says that at least one has.
+ */
+void follow_wake(EventLoop *loop)
+{
+    uint64_t count;
+    Conn *conn;
+    Conn *next;
+
+    if (read(loop->wake.fd, &count, sizeof(count)) < 0
+            && errno != EAGAIN) {
+        fprintf(stderr, "Error reading eventfd: %s\n", strerror(errno));
+    }
+
+    for (conn = loop->waiting; conn != NULL; conn = next) {
+        next = conn->wait_next;
+        if (flight_state(conn->flight) != FLIGHT_PENDING) {
+            conn_run(loop, conn);
+        }
+    }
+    return;
+}
+
+/*
+ * follow_wait_ms - Returns how long the loop may wait for events before
+ * one of its followers stops waiting, or -1 if it has none.
+ */
+int follow_wait_ms(EventLoop *loop)
+{
+    long now = now_ms();
+    long wait = -1;
+    long timer;
+    Conn *conn;
+
+    for (conn = loop->waiting; conn != NULL; conn = conn->wait_next) {
+        timer = conn->wait_until - now;
+        if (wait < 0 || timer < wait) {
+            wait = timer > 0 ? timer : 0;
+        }
+    }
+    return (int)wait;
+}
+
+/*
+ * follow_expire - Runs every follower that has waited as long as the
+ * flight table allows.
+ */
+void follow_expire(EventLoop *loop)
+{
+    long now = now_ms();
+    Conn *conn;
+    Conn *next;
+
+    for (conn = loop->waiting; conn != NULL; conn = next) {
+        next = conn->wait_next;
+        if (conn->wait_until <= now) {
+            conn_run(loop, conn);
+        }
+    }
+    return;
+}
+
+/*
+ * step_read_request - This function reads what the browser has sent. Once
+ * the blank line that ends the request headers has arrived, it starts on
+ * the request. A request the browser sent early, behind the previous
+ * one, may already be buffered.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the connection
+ *  - conn: the connection
+ * Return value:
+ *  - STEP_AGAIN, STEP_WAIT or STEP_DONE
+ */
+int step_read_request(EventLoop *loop, Conn *conn)
+{
+    char buf[MAXBUF];
+    ssize_t n;
+    long hdr_end;
+
+    while (1) {
+        if ((hdr_end = find_header_end(conn->in.data, conn->in.len)) >= 0) {
+            watch(loop, &conn->browser, 0);
+            return start_request(loop, conn, hdr_end);
+        }
+        if (conn->in.len > MAX_REQUEST_SIZE) {
+            fprintf(stderr, "Request too long\n");
+            return STEP_DONE;
+        }
+
+        if ((n = read(conn->browser.fd, buf, sizeof(buf))) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(loop, &conn->browser, EPOLLIN);
+                return STEP_WAIT;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error during read: %s\n", strerror(errno));
+            return STEP_DONE;
+        }
+        if (n == 0) {
+            /* The browser closed its connection */
+            return STEP_DONE;
+        }
+        buf_append(&conn->in, buf, n);
+    }
+}
+
+/*
+ * start_request - This function handles a complete request from the
+ * browser. A hit in the cache, or failing that in the disk cache, is
+ * written back right away. Otherwise the request is rewritten for the
+ * web server and a connection to the server is started, unless another
+ * request is already fetching the same URI, in which case this one waits
+ * for that fetch. A stale hit is sent back at once if it may be refreshed
+ * in the background, and is otherwise kept while the request revalidates
+ * it. Only GET requests are handled.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the connection
+ *  - conn: the connection
+ *  - hdr_end: number of bytes of conn->in up to and including the blank
+ *             line after the headers
+ * Return value:
+ *  - STEP_AGAIN or STEP_DONE
+ */
+int start_request(EventLoop *loop, Conn *conn, size_t hdr_end)
+{
+    char line[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char host[MAXLINE], path[MAXLINE];
+    char *ptr = conn->in.data;
+    char *end = conn->in.data + hdr_end;
+    size_t line_len;
+    CacheNode *node;
+    size_t body_len;
+    int client_port;
+    int host_seen = 0;
+
+    idle_remove(loop, conn);
+    conn->served += 1;
+
+    /* Split the buffered request into lines, as rio would */
+    line_len = (char *)memchr(ptr, '\n', end - ptr) - ptr + 1;
+    if (line_len > MAXLINE - 1) {
+        line_len = MAXLINE - 1;
+    }
+    memcpy(line, ptr, line_len);
+    line[line_len] = '\0';
+    ptr += line_len;
+
+    if (parse_request_line(line, method, uri, version) < 0) {
+        return STEP_DONE;
+    }
+
+    /* Only handle GET requests */
+    if (strcasecmp(method, "GET")) {
+        fprintf(stderr, "%s method is not implemented\n", method);
+        return STEP_DONE;
+    }
+    conn->uri = Malloc(strlen(uri) + 1);
+    strcpy(conn->uri, uri);
+
+    /* HTTP/1.1 connections stay open unless the browser asks otherwise */
+    conn->http11 = !strcmp(version, "HTTP/1.1");
+    conn->keep_alive = conn->http11;
+
+    parse_uri(uri, host, path, &client_port);
+    conn->host = Malloc(strlen(host) + 1);
+    strcpy(conn->host, host);
+    conn->port = client_port;
+
+    buf_init(&conn->out, MAXBUF);
+    request_start(&conn->out, path);
+    while (ptr < end) {
+        line_len = (char *)memchr(ptr, '\n', end - ptr) - ptr + 1;
+        if (line_len > MAXLINE - 1) {
+            line_len = MAXLINE - 1;
+        }
+        memcpy(line, ptr, line_len);
+        line[line_len] = '\0';
+        ptr += line_len;
+
+        if (!strcmp(line, "\r\n") || !strcmp(line, "\n")) {
+            break;
+        }
+        request_header(&conn->out, line, &host_seen, &conn->keep_alive);
+    }
+    request_finish(&conn->out, host, host_seen,
+            loop->upstream->max_idle > 0);
+    conn->keep_alive = conn->keep_alive
+        && conn->served < loop->max_requests;
+
+    /* Keep whatever the browser sent after this request */
+    conn->in.len -= hdr_end;
+    memmove(conn->in.data, conn->in.data + hdr_end, conn->in.len);
+
+    /* If the object is cached and fresh, just send it back */
+    node = cache_lookup(loop->cache, uri);
+    if (node != NULL && cache_fresh(node, time(NULL))) {
+        return start_hit(loop, conn, node);
+    }
+
+    /* Or if it is fresh in the disk cache, send it from there */
+    if (node == NULL && loop->disk != NULL 
+            && disk_lookup(loop->disk, uri, &conn->disk_hit)) {
+        if (conn->disk_hit.expires > time(NULL)) {
+            buf_free(&conn->out);
+            buf_init(&conn->head, MAXBUF);
+            conn->keep_alive = cached_head(&conn->head, 
+                    conn->disk_hit.content, conn->disk_hit.size, 
+                    conn->keep_alive, conn->http11, &conn->hit_off, 
+                    &body_len);
+            conn->hit_end = conn->hit_off + body_len;
+            conn->state = CONN_SEND_HIT;
+            return STEP_AGAIN;
+        }
+        /* It was promoted all the same, so revalidate it from memory */
+        disk_release(&conn->disk_hit);
+        node = cache_lookup(loop->cache, uri);
+    }
+
+    /* Or if it may be sent stale, send it and refresh it in the background */
+    if (node != NULL && loop->refresh != NULL
+            && stale_usable(node->content, node->object_size,
+                cache_expires(node), time(NULL), 0)) {
+        request_revalidate(&conn->out, node->content, node->object_size);
+        refresh_submit(loop->refresh, uri, host, client_port, &conn->out,
+                node);
+        return start_hit(loop, conn, node);
+    }
+
+    /* 
+     * A stale copy is only worth keeping if the server can confirm it,
+     * or if it may stand in for the server should that fail.
+     */
+    if (node != NULL) {
+        if (request_revalidate(&conn->out, node->content, 
+                    node->object_size)
+                || stale_usable(node->content, node->object_size,
+                    cache_expires(node), time(NULL), 1)) {
+            conn->stale = node;
+        } else {
+            cache_release(node);
+        }
+    }
+
+    /* Or if another request is fetching it, wait for that fetch */
+    if (loop->flights != NULL) {
+        conn->flight = flight_join(loop->flights, uri, &conn->leader);
+        if (!conn->leader) {
+            conn->wait_until = now_ms() + loop->flights->timeout_ms;
+            flight_watch(loop->flights, conn->flight, loop->wake.fd);
+            conn->wait_prev = NULL;
+            conn->wait_next = loop->waiting;
+            if (loop->waiting != NULL) {
+                loop->waiting->wait_prev = conn;
+            }
+            loop->waiting = conn;
+            conn->state = CONN_WAIT_FLIGHT;
+            return STEP_AGAIN;
+        }
+    }
+
+    return conn_connect(loop, conn);
+}
+
+/*
+ * start_hit - This function starts writing an object found in the cache
+ * back to the browser.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the connection
+ *  - conn: the connection
+ *  - node: the cached object, which conn takes the reference on
+ * Return value:
+ *  - STEP_AGAIN
+ */
+int start_hit(EventLoop *loop, Conn *conn, CacheNode *node)
+{
+    size_t body_len;
+
+    conn->hit = node;
+    buf_free(&conn->out);
+    buf_init(&conn->head, MAXBUF);
+    conn->keep_alive = cached_head(&conn->head, conn->hit->content,
+            conn->hit->object_size, conn->keep_alive, conn->http11,
+            &conn->hit_off, &body_len);
+    conn->hit_end = conn->hit_off + body_len;
+    conn->state = CONN_SEND_HIT;
+    return STEP_AGAIN;
+}
+
+/*
+ * serve_stale - This function is called when the web server could not
+ * be reached, or failed, before any of the response was sent to the
+ * browser. If the request kept a stale copy whose stale-if-error window
+ * allows it, the copy is sent instead and the connection to the server
+ * is closed; otherwise the browser's connection is closed too.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the connection
+ *  - conn: the connection
+ * Return value:
+ *  - STEP_AGAIN or STEP_DONE
+ */
+int serve_stale(EventLoop *loop, Conn *conn)
+{
+    CacheNode *node = conn->stale;
+
+    if (node == NULL || !stale_usable(node->content, node->object_size,
+                cache_expires(node), time(NULL), 1)) {
+        return STEP_DONE;
+    }
+
+    flight_land(loop->flights, &conn->flight, 0);
+    if (conn->server.fd >= 0) {
+        Close(conn->server.fd);
+        conn->server.fd = -1;
+        conn->server.events = 0;
+    }
+    conn->server_keep_alive = 0;
+    if (conn->head.data != NULL) {
+        buf_free(&conn->head);
+    }
+    if (conn->server_head.data != NULL) {
+        buf_free(&conn->server_head);
+    }
+
+    conn->stale = NULL;
+    return start_hit(loop, conn, node);
+}
+
+/*
+ * step_send_hit - This function writes as much of a cached object to the
+ * browser as it will take. An object from the disk cache has its body
+ * sent from the segment file.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the connection
+ *  - conn: the connection
+ * Return value:
+ *  - STEP_AGAIN, STEP_WAIT or STEP_DONE
+ */
+int step_send_hit(EventLoop *loop, Conn *conn)
+{
+    if (!write_browser(loop, conn, conn->head.data, conn->head.len,
+                &conn->head_off)) {
+        return STEP_WAIT;
+    }
+    if (conn->hit != NULL) {
+        if (!write_browser(loop, conn, conn->hit->content, conn->hit_end,
+                    &conn->hit_off)) {
+            return STEP_WAIT;
+        }
+    } else if (!sendfile_browser(loop, conn)) {
+        return STEP_WAIT;
+    }
+
+    return conn_finish(loop, conn);
+}
+
+/*
+ * step_wait_flight - This function checks on the fetch a request is
+ * following. Once it has landed, or the request has waited long enough,
+ * the request is answered from the cache if the fetch cached the object,
+ * and otherwise goes to the web server itself.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the connection
+ *  - conn: the connection
+ * Return value:
+ *  - STEP_AGAIN, STEP_WAIT or STEP_DONE
+ */
+int step_wait_flight(EventLoop *loop, Conn *conn)
+{
+    CacheNode *node;
+
+    if (flight_state(conn->flight) == FLIGHT_PENDING
+            && now_ms() < conn->wait_until) {
+        return STEP_WAIT;
+    }
+
+    if (follow_end(loop, conn) == FLIGHT_CACHED
+            && (node = cache_lookup(loop->cache, conn->uri)) != NULL) {
+        return start_hit(loop, conn, node);
+    }
+    return conn_connect(loop, conn);
+}
+
+/*
+ * step_connecting - This function moves the race to connect to the web
+ * server forward. While attempts are still running, each one is watched
+ * for the moment it connects or fails.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the connection
+ *  - conn: the connection
+ * Return value:
+ *  - STEP_AGAIN, STEP_WAIT or STEP_DONE
+ */
+int step_connecting(EventLoop *loop, Conn *conn)
+{
+    Race *race = conn->race;
+    int clientfd;
+    int i;
+
+    if ((clientfd = race_poll(race, 0)) == RACE_PENDING) {
+        /* Forget the attempts that failed, then watch the new ones */
+        for (i = 0; i < DNS_MAX_ADDRS; i++) {
+            if (conn->tries[i].fd >= 0 && race->fds[i] < 0) {
+                conn->tries[i].fd = -1;
+                conn->tries[i].events = 0;
+            }
+        }
+        for (i = 0; i < DNS_MAX_ADDRS; i++) {
+            if (race->fds[i] >= 0 && conn->tries[i].fd < 0) {
+                conn->tries[i].fd = race->fds[i];
+                watch(loop, &conn->tries[i], EPOLLOUT);
+            }
+        }
+        return STEP_WAIT;
+    }
+
+    connect_end(loop, conn);
+    if (clientfd < 0) {
+        fprintf(stderr, "Error in connect: %s: %s\n", conn->host,
+                strerror(errno));
+        return serve_stale(loop, conn);
+    }
+
+    conn->server.fd = clientfd;
+    conn->state = CONN_SEND_REQUEST;
+    return STEP_AGAIN;
+}
+
+/*
+ * step_send_request - This function writes as much of the rewritten
+ * request to the web server as it will take.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the connection
+ *  - conn: the connection
+ * Return value:
+ *  - STEP_AGAIN, STEP_WAIT or STEP_DONE
+ */
+int step_send_request(EventLoop *loop, Conn *conn)
+{
+    ssize_t n;
+
+    while (conn->out_off < conn->out.len) {
+        n = write(conn->server.fd, conn->out.data + conn->out_off,
+                conn->out.len - conn->out_off);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(loop, &conn->server, EPOLLOUT);
+                return STEP_WAIT;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (conn->reused) {
+                return conn_retry(loop, conn);
+            }
+            fprintf(stderr, "Error during write: %s\n", strerror(errno));
+            return serve_stale(loop, conn);
+        }
+        conn->out_off += n;
+    }
+
+    if (conn->server_head.data == NULL) {
+        buf_init(&conn->server_head, MAXBUF);
+        conn->relay = Malloc(CHUNK_ROOM + MAXBUF);
+    }
+    conn->need_to_cache = 1;
+    conn->state = CONN_READ_HEAD;
+    return STEP_AGAIN;
+}
+
+/*
+ * step_read_head - This function reads the web server's response until
+ * its headers are complete.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the connection
+ *  - conn: the connection
+ * Return value:
+ *  - STEP_AGAIN, STEP_WAIT or STEP_DONE
+ */
+int step_read_head(EventLoop *loop, Conn *conn)
+{
+    char *data = conn->relay + CHUNK_HEAD_ROOM;
+    ssize_t n;
+    long hdr_end;
+
+    while (1) {
+        if ((n = read(conn->server.fd, data, MAXBUF)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(loop, &conn->server, EPOLLIN);
+                return STEP_WAIT;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (conn->server_head.len == 0 && conn->reused) {
+                return conn_retry(loop, conn);
+            }
+            fprintf(stderr, "Error during read: %s\n", strerror(errno));
+            return serve_stale(loop, conn);
+        }
+        if (n == 0) {
+            if (conn->server_head.len == 0) {
+                /* The server sent nothing at all */
+                return conn_retry(loop, conn);
+            }
+            /* The server closed the connection before the headers ended */
+            return start_response(loop, conn, -1);
+        }
+
+        buf_append(&conn->server_head, data, n);
+        hdr_end = find_header_end(conn->server_head.data,
+                conn->server_head.len);
+        if (hdr_end >= 0 || conn->server_head.len > MAX_REQUEST_SIZE) {
+            return start_response(loop, conn, hdr_end);
+        }
+    }
+}
+
+/*
+ * start_response - This function builds the response headers for the
+ * browser from the server's, and decides how to frame the body. Any body
+ * bytes that were read along with the headers are relayed first. They
+ * all came from the last read, so they fit in the relay buffer.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the connection
+ *  - conn: the connection
+ *  - hdr_end: number of bytes of server_head up to and including the
+ *             blank line after the headers, or -1 if the headers did not
+ *             end, in which case the response is passed on as it is
+ * Return value:
+ *  - STEP_AGAIN
+ */
+int start_response(EventLoop *loop, Conn *conn, long hdr_end)
+{
+    char *data = conn->server_head.data;
+    CacheNode *node;
+    Response resp;
+    size_t extra;
+
+    conn->need_to_cache = 0;
+    conn->cacheable = 0;
+    buf_init(&conn->head, MAXBUF);
+    if (hdr_end >= 0 && parse_response(data, hdr_end, &resp) == 0) {
+        conn->frame = response_frame(&resp, -1, conn->keep_alive,
+                conn->http11, &conn->length);
+        conn->keep_alive = conn->keep_alive && conn->frame != FRAME_CLOSE;
+        conn->server_keep_alive = resp.keep_alive
+            && conn->frame == FRAME_LENGTH;
+
+        /* A 304 confirms the stale copy, which is sent instead */
+        if (conn->stale != NULL && resp.status == 304) {
+            cache_refresh(conn->stale, refreshed_expires(
+                        conn->stale->content, conn->stale->object_size,
+                        data, hdr_end, time(NULL)));
+            flight_land(loop->flights, &conn->flight, 1);
+            conn->server_keep_alive = conn->server_keep_alive
+                && conn->server_head.len == (size_t)hdr_end;
+            buf_free(&conn->head);
+            buf_free(&conn->server_head);
+            watch(loop, &conn->server, 0);
+            node = conn->stale;
+            conn->stale = NULL;
+            return start_hit(loop, conn, node);
+        }
+
+        /* A server error is answered with the stale copy, if it may be */
+        if (conn->stale != NULL && resp.status >= 500
+                && stale_usable(conn->stale->content,
+                    conn->stale->object_size, cache_expires(conn->stale),
+                    time(NULL), 1)) {
+            return serve_stale(loop, conn);
+        }
+
+        conn->need_to_cache = response_freshness(data, hdr_end, 
+                time(NULL), &conn->expires);
+        conn->cacheable = conn->need_to_cache;
+        response_head(&conn->head, data, hdr_end, &resp, conn->frame,
+                conn->length, conn->keep_alive);
+    } else {
+        hdr_end = conn->server_head.len;
+        conn->frame = FRAME_CLOSE;
+        conn->keep_alive = 0;
+        buf_append(&conn->head, data, hdr_end);
+    }
+
+    /* The cache keeps the server's own headers */
+    if (conn->need_to_cache && hdr_end <= MAX_OBJECT_SIZE 
+            && (conn->frame != FRAME_LENGTH
+                || hdr_end + conn->length <= MAX_OBJECT_SIZE)) {
+        buf_init(&conn->object, MAXBUF);
+        buf_append(&conn->object, data, hdr_end);
+    } else {
+        /* Not cacheable, or too big from the headers or Content-Length */
+        conn->need_to_cache = 0;
+    }
+
+    buf_free(&conn->out);
+    conn->response_size = hdr_end;
+    extra = conn->server_head.len - hdr_end;
+    memcpy(conn->relay + CHUNK_HEAD_ROOM, data + hdr_end, extra);
+    buf_free(&conn->server_head);
+    if (extra > 0) {
+        relay_body(conn, extra);
+    }
+
+    conn->state = CONN_RELAY;
+    return STEP_AGAIN;
+}
+
+/*
+ * step_relay - This function moves the web server's response to the
+ * browser, at most MAXBUF bytes at a time, and waits on whichever side
+ * is holding it up. Like the threaded engine, it keeps reading the
+ * response if the browser goes away, so that it can still be cached.
+ * Once the response will not be cached and its body is not re-framed,
+ * the rest of it is spliced instead.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the connection
+ *  - conn: the connection
+ * Return value:
+ *  - STEP_AGAIN, STEP_WAIT or STEP_DONE
+ */
+int step_relay(EventLoop *loop, Conn *conn)
+{
+    size_t want;
+    ssize_t n;
+
+    while (1) {
+        /* Let followers go as soon as this response will not be cached */
+        if (!conn->need_to_cache) {
+            flight_land(loop->flights, &conn->flight, 0);
+        }
+
+        /* Finish sending what was last read before reading more */
+        if (!write_browser(loop, conn, conn->head.data, conn->head.len,
+                    &conn->head_off)
+                || !write_browser(loop, conn, conn->relay, conn->relay_end,
+                    &conn->relay_off)) {
+            return STEP_WAIT;
+        }
+
+        if (conn->server_done) {
+            return conn_finish(loop, conn);
+        }
+        if (conn->frame == FRAME_LENGTH && conn->length == 0) {
+            conn->server_done = 1;
+            continue;
+        }
+        if (!conn->need_to_cache && conn->frame != FRAME_CHUNKED
+                && !conn->browser_gone) {
+            return step_splice(loop, conn);
+        }
+
+        want = MAXBUF;
+        if (conn->frame == FRAME_LENGTH && conn->length < MAXBUF) {
+            want = conn->length;
+        }
+        if ((n = read(conn->server.fd, conn->relay + CHUNK_HEAD_ROOM,
+                        want)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(loop, &conn->browser, 0);
+                watch(loop, &conn->server, EPOLLIN);
+                return STEP_WAIT;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error during read: %s\n", strerror(errno));
+            return STEP_DONE;
+        }
+
+        if (n == 0) {
+            conn->server_done = 1;
+            conn->server_keep_alive = 0;
+            if (conn->frame == FRAME_LENGTH) {
+                /* The server did not send the whole response */
+                conn->keep_alive = 0;
+                conn->need_to_cache = 0;
+            } else if (conn->frame == FRAME_CHUNKED) {
+                memcpy(conn->relay, LAST_CHUNK, strlen(LAST_CHUNK));
+                conn->relay_off = 0;
+                conn->relay_end = strlen(LAST_CHUNK);
+            }
+            continue;
+        }
+
+        relay_body(conn, n);
+    }
+}
+
+/*
+ * step_splice - This function moves the rest of a response body that
+ * will not be cached from the web server to the browser through a pipe,
+ * so the bytes stay in the kernel. The pipe is emptied into the browser
+ * before it is filled again, so it never holds more than one splice.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the connection
+ *  - conn: the connection
+ * Return value:
+ *  - STEP_WAIT or STEP_DONE, or whatever conn_finish returns
+ */
+int step_splice(EventLoop *loop, Conn *conn)
+{
+    size_t want;
+    ssize_t n;
+
+    if (conn->pipe[0] < 0 && relay_pipe(conn->pipe) < 0) {
+        fprintf(stderr, "Error in pipe: %s\n", strerror(errno));
+        return STEP_DONE;
+    }
+
+    while (1) {
+        while (conn->piped > 0) {
+            if ((n = splice_out(conn->pipe[0], conn->browser.fd,
+                            conn->piped)) < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    watch(loop, &conn->server, 0);
+                    watch(loop, &conn->browser, EPOLLOUT);
+                    return STEP_WAIT;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                /* Nothing is being cached, so there is no reason to go on */
+                return STEP_DONE;
+            }
+            conn->piped -= n;
+        }
+
+        if (conn->server_done) {
+            return conn_finish(loop, conn);
+        }
+        if (conn->frame == FRAME_LENGTH && conn->length == 0) {
+            conn->server_done = 1;
+            continue;
+        }
+
+        want = RELAY_PIPE_SIZE;
+        if (conn->frame == FRAME_LENGTH && conn->length < RELAY_PIPE_SIZE) {
+            want = conn->length;
+        }
+        if ((n = splice_in(conn->server.fd, conn->pipe[1], want)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(loop, &conn->browser, 0);
+                watch(loop, &conn->server, EPOLLIN);
+                return STEP_WAIT;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error during splice: %s\n", strerror(errno));
+            return STEP_DONE;
+        }
+
+        if (n == 0) {
+            conn->server_done = 1;
+            conn->server_keep_alive = 0;
+            if (conn->frame == FRAME_LENGTH) {
+                /* The server did not send the whole response */
+                conn->keep_alive = 0;
+            }
+            continue;
+        }
+
+        conn->piped += n;
+        conn->response_size += n;
+        if (conn->frame == FRAME_LENGTH) {
+            conn->length -= n;
+        }
+    }
+}
+
+/*
+ * relay_body - This function takes n bytes of body that were read into
+ * the relay buffer, keeps a copy for the cache while the response may
+ * still be cached, and frames them for the browser.
+ *
+ * Parameters:
+ *  - conn: the connection
+ *  - n: number of bytes at conn->relay + CHUNK_HEAD_ROOM
+ */
+void relay_body(Conn *conn, size_t n)
+{
+    size_t len;
+
+    if (conn->frame == FRAME_LENGTH) {
+        /* Anything the server sends past its Content-Length is dropped */
+        if ((long)n > conn->length) {
+            n = conn->length;
+            conn->server_keep_alive = 0;
+        }
+        conn->length -= n;
+    }
+    conn->response_size += n;
+
+    /* Keep a copy of the object while it may still be cached */
+    if (conn->need_to_cache) {
+        if (conn->object.len + n > MAX_OBJECT_SIZE) {
+            conn->need_to_cache = 0;
+            buf_free(&conn->object);
+        } else {
+            buf_append(&conn->object, conn->relay + CHUNK_HEAD_ROOM, n);
+        }
+    }
+
+    if (conn->frame == FRAME_CHUNKED) {
+        conn->relay_off = chunk_wrap(conn->relay, n, &len);
+        conn->relay_end = conn->relay_off + len;
+    } else {
+        conn->relay_off = CHUNK_HEAD_ROOM;
+        conn->relay_end = CHUNK_HEAD_ROOM + n;
+    }
+    return;
+}
+
+/*
+ * write_browser - This function writes as much of data to the browser as
+ * it will take. If the browser has gone away, the data is dropped and
+ * the connection will close once the response is done.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the connection
+ *  - conn: the connection
+ *  - data: the bytes to write
+ *  - end: offset just past the last byte to write
+ *  - off: offset of the next byte to write, advanced as bytes are written
+ * Return value:
+ *  - 1: everything up to end was written or dropped
+ *  - 0: the browser is not taking more right now; the loop waits for it
+ */
+int write_browser(EventLoop *loop, Conn *conn, char *data, size_t end,
+        size_t *off)
+{
+    ssize_t n;
+
+    while (*off < end && !conn->browser_gone) {
+        if ((n = write(conn->browser.fd, data + *off, end - *off)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(loop, &conn->server, 0);
+                watch(loop, &conn->browser, EPOLLOUT);
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error during write: %s\n", strerror(errno));
+            conn->browser_gone = 1;
+            watch(loop, &conn->browser, 0);
+            break;
+        }
+        *off += n;
+    }
+
+    *off = end;
+    return 1;
+}
+
+/*
+ * sendfile_browser - This function sends as much of the body of an object
+ * from the disk cache to the browser as it will take, as write_browser
+ * does for bytes in memory.
+ *
+ * Parameters:
+ *  - loop: the loop that owns the connection
+ *  - conn: the connection
+ * Return value:
+ *  - 1: the whole body was sent or dropped
+ *  - 0: the browser is not taking more right now; the loop waits for it
+ */
+int sendfile_browser(EventLoop *loop, Conn *conn)
+{
+    if (!conn->browser_gone && disk_send(&conn->disk_hit, conn->browser.fd,
+                &conn->hit_off, conn->hit_end) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            watch(loop, &conn->server, 0);
+            watch(loop, &conn->browser, EPOLLOUT);
+            return 0;
+        }
+        fprintf(stderr, "Error during sendfile: %s\n", strerror(errno));
+        conn->browser_gone = 1;
+        watch(loop, &conn->browser, 0);
+    }
+
+    conn->hit_off = conn->hit_end;
+    return 1;
+}
+
+/*
+ * End Event Helper Functions
+ * --------------------------
+ */
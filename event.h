@@ -0,0 +1,226 @@
+/*
+ * event.h
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This is the header file for event.c, which contains
+ * the proxy's event-driven engine: one epoll loop per thread, each driving
+ * many non-blocking connections through a small state machine. This file
+ * just has the relevant macros, structure definitions, and function
+ * prototypes.
+ *
+ */
+
+/* Include guards */
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include <sys/epoll.h>
+
+#include "csapp.h"
+#include "cache.h"
+#include "http.h"
+#include "upstream.h"
+#include "dns.h"
+#include "connect.h"
+#include "relay.h"
+#include "disk.h"
+#include "flight.h"
+#include "refresh.h"
+#include "trace.h"
+
+/* Macros */
+#define EVENT_BATCH 256          /* Most events taken per epoll_wait */
+
+/* Connection states, in the order a request moves through them */
+#define CONN_READ_REQUEST 0      /* Reading the browser's request */
+#define CONN_SEND_HIT     1      /* Writing a cached object to the browser */
+#define CONN_WAIT_FLIGHT  2      /* Waiting for another request's fetch */
+#define CONN_CONNECTING   3      /* Waiting for the server connect */
+#define CONN_SEND_REQUEST 4      /* Writing the request to the server */
+#define CONN_READ_HEAD    5      /* Reading the server's response headers */
+#define CONN_RELAY        6      /* Relaying the response to the browser */
+#define CONN_CLOSED       7      /* Finished, waiting to be freed */
+
+/* What one step of a connection's state machine achieved */
+#define STEP_AGAIN 0             /* Made progress, run the next step */
+#define STEP_WAIT  1             /* Would block until an event arrives */
+#define STEP_DONE  2             /* The connection is finished */
+
+struct Conn;
+
+/*
+ * One file descriptor registered with epoll. The epoll data pointer of
+ * every registration points at one of these.
+ */
+typedef struct EventRef {
+    struct Conn *conn;           /* Owning connection, NULL for listenfd
+                                    and for the loop's wake eventfd */
+    int fd;                      /* The descriptor, or -1 */
+    unsigned int events;         /* Events currently registered, 0 if not
+                                    registered at all */
+} EventRef;
+
+/*
+ * The state of one browser connection in the event-driven engine. The
+ * browser side is connfd and the server side is clientfd, as in the
+ * threaded engine. A connection serves one request at a time, and may
+ * serve several in turn if the browser keeps it open.
+ */
+typedef struct Conn {
+    int state;                   /* One of the CONN_ states */
+    EventRef browser;            /* connfd, from the browser */
+    EventRef server;             /* clientfd, to the web server */
+    Buf in;                      /* Bytes read from the browser and not yet
+                                    handled, kept across requests */
+    int served;                  /* Requests started on this connection */
+    int keep_alive;              /* Stay open after the current response */
+    int http11;                  /* The request was HTTP/1.1 */
+    char *uri;                   /* The requested URI, used as cache key */
+    char *host;                  /* The web server's host name */
+    int port;                    /* The port on the web server */
+    int reused;                  /* clientfd came from the upstream pool */
+    int server_keep_alive;       /* clientfd can go back to the pool once
+                                    the response is read */
+    Race *race;                  /* Race to connect to the server, while
+                                    CONN_CONNECTING */
+    EventRef tries[DNS_MAX_ADDRS]; /* The race's attempts, by address */
+    Flight *flight;              /* Fetch of uri this request leads or
+                                    follows, or NULL */
+    int leader;                  /* This request leads flight */
+    long wait_until;             /* When a follower stops waiting, in
+                                    milliseconds */
+    Buf out;                     /* Request to send to the server */
+    size_t out_off;              /* Bytes of out already sent */
+    Buf head;                    /* Response headers for the browser */
+    size_t head_off;             /* Bytes of head already sent */
+    CacheNode *hit;              /* Cached object being sent, if a hit */
+    CacheNode *stale;            /* Stale cached object the request
+                                    revalidates, or NULL */
+    DiskObject disk_hit;         /* Object being sent from the disk cache,
+                                    if seg is set */
+    size_t hit_off;              /* Offset of the next byte of hit to send */
+    size_t hit_end;              /* Offset just past the last byte to send */
+    Buf server_head;             /* Response headers read from the server */
+    int frame;                   /* How the body is delimited, FRAME_ */
+    long length;                 /* Body bytes still due, for FRAME_LENGTH */
+    char *relay;                 /* Room for MAXBUF bytes read from the
+                                    server, framed as a chunk if needed */
+    size_t relay_off;            /* Offset of the next byte of relay */
+    size_t relay_end;            /* Offset just past the last byte */
+    int pipe[2];                 /* Pipe the body is spliced through, once
+                                    it will not be cached, or -1 */
+    size_t piped;                /* Bytes in the pipe */
+    int server_done;             /* The whole response has been read */
+    int browser_gone;            /* The browser stopped accepting data */
+    Buf object;                  /* Response collected for the cache */
+    int need_to_cache;           /* The response may still be cached */
+    int cacheable;               /* The response allows caching, whether
+                                    or not it fits */
+    size_t response_size;        /* Bytes of the response read so far */
+    time_t expires;              /* When the response goes stale */
+    long idle_since;             /* When it began waiting for a request, in
+                                    milliseconds */
+    struct Conn *idle_prev;      /* Links in the loop's list of connections */
+    struct Conn *idle_next;      /*   waiting for a request, oldest first */
+    struct Conn *race_prev;      /* Links in the loop's list of connections */
+    struct Conn *race_next;      /*   racing to connect, in no order */
+    struct Conn *wait_prev;      /* Links in the loop's list of connections */
+    struct Conn *wait_next;      /*   following a fetch, in no order */
+    struct Conn *next_closed;    /* Link in the loop's list to free */
+} Conn;
+
+/*
+ * One event loop, run by one thread.
+ */
+typedef struct EventLoop {
+    int epfd;                    /* The loop's epoll instance */
+    EventRef listen;             /* The shared listening socket */
+    Cache *cache;                /* Cache for web objects */
+    DiskCache *disk;             /* Objects evicted from cache, or NULL */
+    FlightTable *flights;        /* Fetches in flight, or NULL */
+    RefreshPool *refresh;        /* Background refreshes, or NULL */
+    Trace *trace;                /* Trace of requests served, or NULL */
+    EventRef wake;               /* eventfd written to when a fetch that
+                                    connections here follow lands */
+    UpstreamPool *upstream;      /* Idle connections to web servers */
+    DnsCache *dns;               /* Addresses of web servers */
+    int idle_timeout;            /* Seconds a connection may wait for a
+                                    request */
+    int max_requests;            /* Requests served per connection */
+    int connect_timeout;         /* Milliseconds allowed to connect to a
+                                    server */
+    Conn *connecting;            /* Connections racing to connect */
+    Conn *waiting;               /* Connections following a fetch */
+    Conn *idle_head;             /* Connection waiting longest */
+    Conn *idle_tail;             /* Connection waiting shortest */
+    Conn *closed;                /* Connections to free after a batch */
+    unsigned long accepted;      /* Connections accepted by this loop */
+    unsigned long active;        /* Connections open in this loop */
+    pthread_t tid;               /* Thread running the loop */
+} EventLoop;
+
+/*
+ * The engine: a fixed set of loops sharing one listening socket.
+ */
+typedef struct EventEngine {
+    int nloops;                  /* Number of loops */
+    EventLoop *loops;            /* The loops */
+} EventEngine;
+
+/*
+ * A snapshot of the engine's counters, for monitoring.
+ */
+typedef struct EventStats {
+    int nloops;                  /* Number of loops */
+    unsigned long accepted;      /* Connections accepted so far */
+    unsigned long active;        /* Connections open right now */
+} EventStats;
+
+/* Main Event Function Prototypes */
+EventEngine *event_init(int listenfd, int nloops, Cache *cache, 
+        DiskCache *disk, FlightTable *flights, RefreshPool *refresh,
+        UpstreamPool *upstream, DnsCache *dns, Trace *trace,
+        int idle_timeout, int max_requests, int connect_timeout);
+void event_run(EventEngine *engine);
+void event_get_stats(EventEngine *engine, EventStats *stats);
+/* Event Helper Functions */
+void *event_loop(void *vargp);
+void accept_conns(EventLoop *loop);
+void conn_run(EventLoop *loop, Conn *conn);
+int conn_finish(EventLoop *loop, Conn *conn);
+void conn_reset(Conn *conn);
+int conn_connect(EventLoop *loop, Conn *conn);
+int conn_retry(EventLoop *loop, Conn *conn);
+void connect_end(EventLoop *loop, Conn *conn);
+int connect_wait_ms(EventLoop *loop);
+void connect_expire(EventLoop *loop);
+int follow_end(EventLoop *loop, Conn *conn);
+void follow_wake(EventLoop *loop);
+int follow_wait_ms(EventLoop *loop);
+void follow_expire(EventLoop *loop);
+void conn_close(EventLoop *loop, Conn *conn);
+void watch(EventLoop *loop, EventRef *ref, unsigned int events);
+void idle_add(EventLoop *loop, Conn *conn);
+void idle_remove(EventLoop *loop, Conn *conn);
+int idle_wait_ms(EventLoop *loop);
+void idle_expire(EventLoop *loop);
+int step_read_request(EventLoop *loop, Conn *conn);
+int start_request(EventLoop *loop, Conn *conn, size_t hdr_end);
+int start_hit(EventLoop *loop, Conn *conn, CacheNode *node);
+int serve_stale(EventLoop *loop, Conn *conn);
+int step_send_hit(EventLoop *loop, Conn *conn);
+int step_wait_flight(EventLoop *loop, Conn *conn);
+int step_connecting(EventLoop *loop, Conn *conn);
+int step_send_request(EventLoop *loop, Conn *conn);
+int step_read_head(EventLoop *loop, Conn *conn);
+int start_response(EventLoop *loop, Conn *conn, long hdr_end);
+int step_relay(EventLoop *loop, Conn *conn);
+int step_splice(EventLoop *loop, Conn *conn);
+void relay_body(Conn *conn, size_t n);
+int write_browser(EventLoop *loop, Conn *conn, char *data, size_t end,
+        size_t *off);
+int sendfile_browser(EventLoop *loop, Conn *conn);
+
+#endif
@@ -0,0 +1,369 @@
+/*
+ * flight.c
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This file contains the table of fetches in flight,
+ * used to collapse concurrent misses on the same URI. When a popular
+ * object is missing from the cache, every request for it used to open its
+ * own connection to the web server, fetch its own copy and add it to the
+ * cache again. Now the first request to miss becomes the leader and
+ * fetches the object, and any request for the same URI that misses while
+ * the fetch is in flight becomes a follower and waits for it to land.
+ *
+ * When the leader has added the object to the cache, its followers are
+ * answered from the cache. When the fetch will not be cached, because the
+ * object is too big or the fetch failed, the leader lands it as soon as it
+ * knows, and its followers go to the web server themselves. A follower
+ * never waits longer than the table's timeout, so a slow leader cannot
+ * hold it up for longer than that.
+ *
+ * Followers in the threaded engine block on a condition variable. An
+ * event loop cannot block, so instead it registers a descriptor, normally
+ * an eventfd, that is written to when the fetch lands.
+ *
+ */
+
+#include "flight.h"
+#include "hash.h"
+
+/*
+ * Main Flight Functions
+ * ---------------------
+ */
+
+/*
+ * flight_init - This function creates an empty table.
+ *
+ * Parameter:
+ *  - timeout_ms: the longest a follower waits for a fetch
+ * Return value:
+ *  - table: a pointer to the new table
+ */
+FlightTable *flight_init(int timeout_ms)
+{
+    FlightTable *table = Calloc(1, sizeof(FlightTable));
+
+    pthread_mutex_init(&table->lock, NULL);
+    pthread_cond_init(&table->landed, NULL);
+    table->timeout_ms = timeout_ms;
+    return table;
+}
+
+/*
+ * flight_join - This function joins the fetch of a URI that missed in the
+ * cache. If no fetch of it is in flight, one is started and the caller is
+ * its leader: it must fetch the object and then call flight_land. Either
+ * way the caller holds a reference on the fetch; a follower gives it up
+ * with flight_wait or flight_leave.
+ *
+ * Parameters:
+ *  - table: the table of fetches
+ *  - uri: the URI that missed
+ *  - leader: set to 1 if the caller leads the fetch, 0 if it follows
+ * Return value:
+ *  - flight: the fetch of uri
+ */
+Flight *flight_join(FlightTable *table, char *uri, int *leader)
+{
+    uint64_t hash = hash_uri(uri);
+    Flight *flight;
+
+    pthread_mutex_lock(&table->lock);
+    if ((flight = flight_find(table, uri, hash)) != NULL) {
+        flight->refcount += 1;
+        table->followers += 1;
+        pthread_mutex_unlock(&table->lock);
+        *leader = 0;
+        return flight;
+    }
+    flight = flight_start(table, uri, hash);
+    pthread_mutex_unlock(&table->lock);
+
+    *leader = 1;
+    return flight;
+}
+
+/*
+ * flight_lead - This function starts the fetch of a URI only if no fetch
+ * of it is in flight, for a caller that would rather not fetch the object
+ * at all than follow another fetch. The caller leads the new fetch, and
+ * must call flight_land.
+ *
+ * Parameters:
+ *  - table: the table of fetches
+ *  - uri: the URI to fetch
+ * Return value:
+ *  - flight: the new fetch, or NULL if one was already in flight
+ */
+Flight *flight_lead(FlightTable *table, char *uri)
+{
+    uint64_t hash = hash_uri(uri);
+    Flight *flight = NULL;
+
+    pthread_mutex_lock(&table->lock);
+    if (flight_find(table, uri, hash) == NULL) {
+        flight = flight_start(table, uri, hash);
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    return flight;
+}
+
+/*
+ * flight_land - This function is called by a leader when its fetch is
+ * over, or as soon as it knows the object will not be cached. The fetch
+ * leaves the table, so the next miss starts a new one, and every
+ * follower is woken up. The leader's reference is dropped and *flight is
+ * cleared, so landing a fetch that has already landed does nothing.
+ *
+ * Parameters:
+ *  - table: the table of fetches
+ *  - flight: the leader's fetch, or NULL
+ *  - cached: whether the object was added to the cache
+ */
+void flight_land(FlightTable *table, Flight **flight, int cached)
+{
+    uint64_t one = 1;
+    Flight *landed = *flight;
+    Flight **link;
+    int i;
+
+    if (landed == NULL) {
+        return;
+    }
+    *flight = NULL;
+
+    pthread_mutex_lock(&table->lock);
+    __atomic_store_n(&landed->state, cached ? FLIGHT_CACHED : FLIGHT_FAILED,
+            __ATOMIC_RELEASE);
+    link = &table->buckets[landed->hash & (FLIGHT_BUCKETS - 1)];
+    while (*link != landed) {
+        link = &(*link)->next;
+    }
+    *link = landed->next;
+
+    pthread_cond_broadcast(&table->landed);
+    for (i = 0; i < landed->nwake; i++) {
+        if (write(landed->wake_fds[i], &one, sizeof(one)) < 0
+                && errno != EAGAIN) {
+            fprintf(stderr, "Error waking a follower: %s\n",
+                    strerror(errno));
+        }
+    }
+    flight_put(landed);
+    pthread_mutex_unlock(&table->lock);
+    return;
+}
+
+/*
+ * flight_wait - This function blocks a follower until its fetch lands or
+ * the table's timeout passes, and then gives up the follower's reference.
+ *
+ * Parameters:
+ *  - table: the table of fetches
+ *  - flight: the follower's fetch
+ * Return value:
+ *  - FLIGHT_CACHED: the object is in the cache
+ *  - FLIGHT_FAILED or FLIGHT_PENDING: the follower should fetch it itself
+ */
+int flight_wait(FlightTable *table, Flight *flight)
+{
+    struct timespec deadline;
+    int rc = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += table->timeout_ms / 1000;
+    deadline.tv_nsec += (table->timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&table->lock);
+    while (flight->state == FLIGHT_PENDING && rc != ETIMEDOUT) {
+        rc = pthread_cond_timedwait(&table->landed, &table->lock, &deadline);
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    return flight_leave(table, flight);
+}
+
+/*
+ * flight_watch - This function has fd written to when a fetch lands, for
+ * a follower that cannot block. A descriptor is only registered once per
+ * fetch, however many of its followers it serves.
+ *
+ * Parameters:
+ *  - table: the table of fetches
+ *  - flight: the follower's fetch
+ *  - fd: an eventfd, written to with a count of 1
+ * Return value:
+ *  - 0: fd will be written to when the fetch lands
+ *  - 1: the fetch has already landed
+ */
+int flight_watch(FlightTable *table, Flight *flight, int fd)
+{
+    int i;
+
+    pthread_mutex_lock(&table->lock);
+    if (flight->state != FLIGHT_PENDING) {
+        pthread_mutex_unlock(&table->lock);
+        return 1;
+    }
+    for (i = 0; i < flight->nwake && flight->wake_fds[i] != fd; i++) {
+        ;
+    }
+    if (i == flight->nwake) {
+        flight->wake_fds = Realloc(flight->wake_fds,
+                (flight->nwake + 1) * sizeof(int));
+        flight->wake_fds[flight->nwake++] = fd;
+    }
+    pthread_mutex_unlock(&table->lock);
+    return 0;
+}
+
+/*
+ * flight_state - Returns the state of a fetch the caller holds a
+ * reference on, without taking the table's lock.
+ */
+int flight_state(Flight *flight)
+{
+    return __atomic_load_n(&flight->state, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * flight_leave - This function gives up a follower's reference on its
+ * fetch, whether or not the fetch has landed, and counts how the wait
+ * ended.
+ *
+ * Parameters:
+ *  - table: the table of fetches
+ *  - flight: the follower's fetch
+ * Return value:
+ *  - the state of the fetch when the follower left it
+ */
+int flight_leave(FlightTable *table, Flight *flight)
+{
+    int state;
+
+    pthread_mutex_lock(&table->lock);
+    state = flight->state;
+    if (state == FLIGHT_CACHED) {
+        table->collapsed += 1;
+    } else if (state == FLIGHT_FAILED) {
+        table->failed += 1;
+    } else {
+        table->timeouts += 1;
+    }
+    flight_put(flight);
+    pthread_mutex_unlock(&table->lock);
+
+    return state;
+}
+
+/*
+ * flight_get_stats - This function copies the table's counters into
+ * stats.
+ *
+ * Parameters:
+ *  - table: the table to report on
+ *  - stats: filled with the current counters
+ */
+void flight_get_stats(FlightTable *table, FlightStats *stats)
+{
+    pthread_mutex_lock(&table->lock);
+    stats->leaders = table->leaders;
+    stats->followers = table->followers;
+    stats->collapsed = table->collapsed;
+    stats->failed = table->failed;
+    stats->timeouts = table->timeouts;
+    pthread_mutex_unlock(&table->lock);
+    return;
+}
+
+/*
+ * flight_destroy - This function frees the table. No fetch may be in
+ * flight.
+ *
+ * Parameter:
+ *  - table: the table to destroy
+ */
+void flight_destroy(FlightTable *table)
+{
+    pthread_cond_destroy(&table->landed);
+    pthread_mutex_destroy(&table->lock);
+    Free(table);
+    return;
+}
+
+/*
+ * End Main Flight Functions
+ * -------------------------
+ */
+
+
+/*
+ * Flight Helper Functions
+ * -----------------------
+ */
+
+/*
+ * flight_find - Returns the fetch of a URI in flight, or NULL. The
+ * table's lock must be held.
+ */
+Flight *flight_find(FlightTable *table, char *uri, uint64_t hash)
+{
+    Flight *flight;
+
+    for (flight = table->buckets[hash & (FLIGHT_BUCKETS - 1)]; 
+            flight != NULL; flight = flight->next) {
+        if (flight->hash == hash && !strcmp(flight->uri, uri)) {
+            return flight;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * flight_start - Adds a new fetch of a URI to the table, held by its
+ * leader only. The table's lock must be held.
+ */
+Flight *flight_start(FlightTable *table, char *uri, uint64_t hash)
+{
+    Flight **bucket = &table->buckets[hash & (FLIGHT_BUCKETS - 1)];
+    size_t uri_len = strlen(uri);
+    Flight *flight;
+
+    flight = Malloc(sizeof(Flight) + uri_len + 1);
+    flight->uri = flight->data;
+    memcpy(flight->uri, uri, uri_len + 1);
+    flight->hash = hash;
+    flight->state = FLIGHT_PENDING;
+    flight->refcount = 1;
+    flight->wake_fds = NULL;
+    flight->nwake = 0;
+    flight->next = *bucket;
+    *bucket = flight;
+    table->leaders += 1;
+    return flight;
+}
+
+/*
+ * flight_put - Drops a reference on a fetch, freeing it once the last one
+ * is gone. The table's lock must be held.
+ */
+void flight_put(Flight *flight)
+{
+    if (--flight->refcount == 0) {
+        Free(flight->wake_fds);
+        Free(flight);
+    }
+    return;
+}
+
+/*
+ * End Flight Helper Functions
+ * ---------------------------
+ */
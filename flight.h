@@ -0,0 +1,92 @@
+/*
+ * flight.h
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This is the header file for flight.c, which collapses
+ * concurrent misses on the same URI into one request to the web server.
+ * This file just has the relevant macros, structure definitions, and
+ * function prototypes.
+ *
+ */
+
+/* Include guards */
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include <stdint.h>
+
+#include "csapp.h"
+
+/* Macros */
+#define FLIGHT_DEFAULT_TIMEOUT 2000 /* Default milliseconds a request waits
+                                       for another one's fetch */
+#define FLIGHT_BUCKETS 1024      /* Number of buckets in the table */
+
+/* States of a fetch */
+#define FLIGHT_PENDING 0         /* The fetch is still going */
+#define FLIGHT_CACHED 1          /* The object was added to the cache */
+#define FLIGHT_FAILED 2          /* The fetch ended without caching it */
+
+/*
+ * One fetch from a web server that other requests for the same URI can
+ * wait for. The request that started it is the leader; the rest are
+ * followers. The fetch leaves the table as soon as it lands, but stays
+ * allocated until the leader and every follower have let go of it.
+ */
+typedef struct Flight {
+    char *uri;                   /* URI being fetched, stored in data */
+    uint64_t hash;               /* Hash of uri */
+    int state;                   /* One of the FLIGHT_ states */
+    int refcount;                /* Leader and followers holding it */
+    int *wake_fds;               /* Descriptors written to when it lands */
+    int nwake;                   /* Number of wake_fds */
+    struct Flight *next;         /* Next fetch in the same bucket */
+    char data[];                 /* Storage for uri */
+} Flight;
+
+/*
+ * Defines the table of fetches in progress. Everything is protected by
+ * lock, and landed is signalled whenever a fetch lands.
+ */
+typedef struct FlightTable {
+    pthread_mutex_t lock;        /* Protects the table and the counters */
+    pthread_cond_t landed;       /* Signalled when any fetch lands */
+    Flight *buckets[FLIGHT_BUCKETS]; /* Chains of fetches */
+    int timeout_ms;              /* Longest a follower waits */
+    unsigned long leaders;       /* Fetches started */
+    unsigned long followers;     /* Requests that waited for one */
+    unsigned long collapsed;     /* Of those, answered from the cache */
+    unsigned long failed;        /* Of those, whose fetch was not cached */
+    unsigned long timeouts;      /* Of those, that gave up waiting */
+} FlightTable;
+
+/*
+ * A snapshot of the table's counters, for monitoring.
+ */
+typedef struct FlightStats {
+    unsigned long leaders;       /* Fetches started */
+    unsigned long followers;     /* Requests that waited for one */
+    unsigned long collapsed;     /* Of those, answered from the cache */
+    unsigned long failed;        /* Of those, whose fetch was not cached */
+    unsigned long timeouts;      /* Of those, that gave up waiting */
+} FlightStats;
+
+/* Main Flight Function Prototypes */
+FlightTable *flight_init(int timeout_ms);
+Flight *flight_join(FlightTable *table, char *uri, int *leader);
+Flight *flight_lead(FlightTable *table, char *uri);
+void flight_land(FlightTable *table, Flight **flight, int cached);
+int flight_wait(FlightTable *table, Flight *flight);
+int flight_watch(FlightTable *table, Flight *flight, int fd);
+int flight_state(Flight *flight);
+int flight_leave(FlightTable *table, Flight *flight);
+void flight_get_stats(FlightTable *table, FlightStats *stats);
+void flight_destroy(FlightTable *table);
+/* Flight Helper Functions */
+Flight *flight_find(FlightTable *table, char *uri, uint64_t hash);
+Flight *flight_start(FlightTable *table, char *uri, uint64_t hash);
+void flight_put(Flight *flight);
+
+#endif
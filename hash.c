@@ -0,0 +1,73 @@
+/*
+ * hash.c
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This file contains the hash function for the keys of
+ * the proxy's tables: URIs in the cache, the disk cache and the flight
+ * table, and host names in the upstream pool and the DNS cache. It also
+ * has the checksum that snapshots and the disk cache keep of objects. It
+ * lives on its own so that those modules do not depend on the cache.
+ *
+ */
+
+#include "hash.h"
+
+/*
+ * Main Hash Functions
+ * -------------------
+ */
+
+/*
+ * hash_uri - This function hashes a URI with 64-bit FNV-1a. The hash is
+ * computed once when a node is added and stored in the node, so that
+ * lookups only compare full URIs when the hashes already match. FNV-1a
+ * leaves the high bits poorly mixed for URIs that differ only at the end,
+ * and the shard is picked from the high bits, so the result is passed 
+ * through a final avalanche step.
+ *
+ * Parameter:
+ *  - uri: the URI to hash
+ * Return value:
+ *  - hash: the 64-bit hash of the URI
+ */
+uint64_t hash_uri(const char *uri)
+{
+    uint64_t hash = 14695981039346656037ULL; /* FNV offset basis */
+
+    for ( ; *uri != '\0'; uri++) {
+        hash ^= (unsigned char)*uri;
+        hash *= 1099511628211ULL;            /* FNV prime */
+    }
+
+    /* Finalizer from MurmurHash3 */
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+/*
+ * fnv_sum - Continues a 64-bit FNV-1a checksum over len more bytes. A
+ * checksum is started by passing HASH_SUM_INIT as sum.
+ */
+uint64_t fnv_sum(const void *data, size_t len, uint64_t sum)
+{
+    const unsigned char *bytes = data;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        sum ^= bytes[i];
+        sum *= 1099511628211ULL;             /* FNV prime */
+    }
+    return sum;
+}
+
+/*
+ * End Main Hash Functions
+ * -----------------------
+ */
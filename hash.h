@@ -0,0 +1,30 @@
+/*
+ * hash.h
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This is the header file for hash.c, which has the
+ * hash function that the cache, the disk cache, the upstream pool, the
+ * DNS cache and the flight table all file their entries under, and the
+ * checksum of objects. This file just has the relevant macros and
+ * function prototypes.
+ *
+ */
+
+/* Include guards */
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Macros */
+#define HASH_SUM_INIT 14695981039346656037ULL /* FNV-1a offset basis,
+                                                 starts a checksum */
+
+/* Main Hash Function Prototypes */
+uint64_t hash_uri(const char *uri);
+uint64_t fnv_sum(const void *data, size_t len, uint64_t sum);
+
+#endif
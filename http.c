@@ -0,0 +1,990 @@
+/*
+ * http.c
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This file contains the HTTP handling that both of the
+ * proxy's engines share: parsing the browser's request line and URI, and
+ * building the request the proxy sends to the web server. The request is
+ * built in memory, one header at a time, so that the threaded engine can
+ * build it from lines it reads with rio and the event-driven engine can
+ * build it from lines it has already buffered, and both send exactly the
+ * same bytes. The predefined headers that coax sensible responses from
+ * web servers live here as well.
+ *
+ * Browsers may keep their connection to the proxy open across requests.
+ * Responses from web servers are read with the connection closing at the
+ * end, so their headers are rewritten before being passed on: the hop-by-
+ * hop headers are dropped, and the body is delimited with Content-Length
+ * when its length is known, with chunked coding for an HTTP/1.1 browser
+ * when it is not, and by closing the connection otherwise. The file also
+ * has a small growable byte buffer used to hold requests and responses.
+ *
+ * Whether a response may be cached, and for how long it stays fresh, is
+ * decided here from its status and its Cache-Control, Expires, Date, Age
+ * and Last-Modified headers. A cached response that has gone stale is
+ * revalidated by sending its ETag and Last-Modified back to the web
+ * server, so that a 304 can confirm it without sending the body again.
+ *
+ */
+
+/* For strcasestr */
+#define _GNU_SOURCE
+
+#include "http.h"
+
+/* Global Variables */
+/* You won't lose style points for including these long lines in your code */
+static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
+static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
+static const char *conn_hdr = "Connection: close\r\n";
+static const char *proxy_conn_hdr = "Proxy-Connection: close\r\n";
+static const char *conn_keep_hdr = "Connection: keep-alive\r\n";
+static const char *proxy_conn_keep_hdr = "Proxy-Connection: keep-alive\r\n";
+
+/*
+ * Buffer Functions
+ * ----------------
+ */
+
+/*
+ * buf_init - Initializes an empty buffer with room for cap bytes.
+ */
+void buf_init(Buf *buf, size_t cap)
+{
+    buf->data = Malloc(cap);
+    buf->len = 0;
+    buf->cap = cap;
+    return;
+}
+
+/*
+ * buf_append - Appends n bytes to a buffer, doubling its room as needed.
+ */
+void buf_append(Buf *buf, const void *data, size_t n)
+{
+    if (buf->len + n > buf->cap) {
+        while (buf->len + n > buf->cap) {
+            buf->cap *= 2;
+        }
+        buf->data = Realloc(buf->data, buf->cap);
+    }
+    memcpy(buf->data + buf->len, data, n);
+    buf->len += n;
+    return;
+}
+
+/*
+ * buf_free - Frees the bytes held by a buffer.
+ */
+void buf_free(Buf *buf)
+{
+    Free(buf->data);
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+    return;
+}
+
+/*
+ * End Buffer Functions
+ * --------------------
+ */
+
+
+/*
+ * Request Functions
+ * -----------------
+ */
+
+/*
+ * parse_request_line - This function splits an HTTP request line into
+ * its method, URI and version. Each output buffer must be at least as
+ * long as the line.
+ *
+ * Parameters:
+ *  - line: the request line, as read from the browser
+ *  - method: filled with the method, e.g. GET
+ *  - uri: filled with the URI
+ *  - version: filled with the HTTP version, or "" if there is none
+ * Return value:
+ *  - 0: the line has at least a method and a URI
+ *  - -1: the line is malformed
+ */
+int parse_request_line(char *line, char *method, char *uri, char *version)
+{
+    strcpy(version, "");
+    if (sscanf(line, "%s %s %s", method, uri, version) < 2) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * parse_uri - This functions parses the URI to determine the hostname,
+ * path of the web object, and the client port to which the proxy must
+ * connect. A URI with no path asks for "/".
+ *
+ * Parameters:
+ *  - uri: the URI of the content on the web server
+ *  - hostname: the server's host name
+ *  - path: the path of the web oject on the server
+ *  - client_port: port on web server to which the proxy must connect
+ */
+void parse_uri(char *uri, char *hostname, char *path, int *client_port)
+{
+    char *ptr = uri;
+    char *scheme_end;
+    size_t host_count;
+
+    /* Get rid of "http://" if its there */
+    if ((scheme_end = strstr(ptr, "://")) != NULL) {
+        ptr = scheme_end + 3;
+    }
+
+    /* Copy up until the first '/' or ':' to get the host name */
+    host_count = strcspn(ptr, "/:");
+    memcpy(hostname, ptr, host_count);
+    hostname[host_count] = '\0';
+    ptr += host_count;
+
+    /* Determine what the client port is */
+    if (*ptr == ':') {
+        /* A client port is specified in the URI */
+        ptr++;
+        *client_port = atoi(ptr);
+        while (isdigit(*ptr)) {
+            ptr++;
+        }
+    } else {
+        /* Use the default client port 80 */
+        *client_port = DEFAULT_CLIENT_PORT;
+    }
+
+    /* The rest is the path of the web object */
+    if (*ptr == '\0') {
+        strcpy(path, "/");
+    } else {
+        strcpy(path, ptr);
+    }
+
+    return;
+}
+
+/*
+ * request_start - Appends the request line the proxy sends to the web
+ * server. The proxy always speaks HTTP/1.0 to servers.
+ *
+ * Parameters:
+ *  - out: buffer holding the request being built
+ *  - path: the path of the web object on the server
+ */
+void request_start(Buf *out, char *path)
+{
+    buf_append(out, "GET ", strlen("GET "));
+    buf_append(out, path, strlen(path));
+    buf_append(out, " HTTP/1.0\r\n", strlen(" HTTP/1.0\r\n"));
+    return;
+}
+
+/*
+ * request_header - This function decides what to do with one header line
+ * from the browser's request. Headers that the proxy replaces with
+ * predefined ones are dropped, and all others, including the Host
+ * header, are forwarded unaltered. The browser's Connection and
+ * Proxy-Connection headers say whether it wants its connection to the
+ * proxy kept open.
+ *
+ * Parameters:
+ *  - out: buffer holding the request being built
+ *  - line: one header line, including its line ending
+ *  - host_seen: set to 1 if the line is a Host header
+ *  - keep_alive: set to 0 or 1 if the line asks to close the browser's
+ *                connection or to keep it open
+ */
+void request_header(Buf *out, char *line, int *host_seen, int *keep_alive)
+{
+    if (header_is(line, "Connection") 
+            || header_is(line, "Proxy-Connection")) {
+        if (strcasestr(line, "close") != NULL) {
+            *keep_alive = 0;
+        } else if (strcasestr(line, "keep-alive") != NULL) {
+            *keep_alive = 1;
+        }
+    }
+
+    /* Determine whether a request already has a host header */
+    if (!strncmp(line, "Host", strlen("Host"))) {
+        *host_seen = 1;
+    } else if (!strncmp(line, "User-Agent", strlen("User-Agent"))
+                || !strncmp(line, "Accept", strlen("Accept"))
+                || !strncmp(line, "Accept-Encoding",
+                    strlen("Accept-Encoding"))
+                || !strncmp(line, "Connection", strlen("Connection"))
+                || !strncmp(line, "Proxy-Connection",
+                    strlen("Proxy-Connection"))) {
+        /* If there is a header for any of the predefined ones, ignore it */
+        return;
+    }
+
+    /* Simply forward all other headers */
+    buf_append(out, line, strlen(line));
+    return;
+}
+
+/*
+ * request_finish - This function ends the request. If the browser did
+ * not send a Host header, one is created from the URI's host. Then the
+ * predefined headers that must always be the same are added, followed
+ * by the blank line that ends the headers. The request still says
+ * HTTP/1.0, so a server that keeps the connection open must send a
+ * Content-Length rather than chunk its response.
+ *
+ * Parameters:
+ *  - out: buffer holding the request being built
+ *  - host: the web server's host name
+ *  - host_seen: whether the browser sent its own Host header
+ *  - keep_alive: whether to ask the server to keep the connection open
+ */
+void request_finish(Buf *out, char *host, int host_seen, int keep_alive)
+{
+    if (!host_seen) {
+        buf_append(out, "Host: ", strlen("Host: "));
+        buf_append(out, host, strlen(host));
+        buf_append(out, "\r\n", 2);
+    }
+
+    buf_append(out, user_agent_hdr, strlen(user_agent_hdr));
+    buf_append(out, accept_hdr, strlen(accept_hdr));
+    buf_append(out, accept_encoding_hdr, strlen(accept_encoding_hdr));
+    if (keep_alive) {
+        buf_append(out, conn_keep_hdr, strlen(conn_keep_hdr));
+        buf_append(out, proxy_conn_keep_hdr, strlen(proxy_conn_keep_hdr));
+    } else {
+        buf_append(out, conn_hdr, strlen(conn_hdr));
+        buf_append(out, proxy_conn_hdr, strlen(proxy_conn_hdr));
+    }
+    buf_append(out, "\r\n", 2);
+    return;
+}
+
+/*
+ * request_revalidate - This function turns a finished request into one
+ * that revalidates a stale cached response: the response's ETag and
+ * Last-Modified are sent back as If-None-Match and If-Modified-Since, in
+ * place of any the browser sent, so that the server answers 304 if the
+ * cached copy is still current. The browser's own conditions are dropped
+ * because the 304 is for the proxy; the browser gets the cached copy.
+ *
+ * Parameters:
+ *  - out: buffer holding a request built by request_finish
+ *  - content: the stale cached response
+ *  - size: number of bytes in content
+ * Return value:
+ *  - 1: the request was made conditional
+ *  - 0: the response has no validators, and the request is unchanged
+ */
+int request_revalidate(Buf *out, char *content, size_t size)
+{
+    char etag[MAXLINE];
+    char modified[MAXLINE];
+    char *line = out->data;
+    char *end = out->data + out->len;
+    char *next;
+    long hdr_len;
+    Buf request;
+
+    if ((hdr_len = find_header_end(content, size)) < 0) {
+        return 0;
+    }
+    header_value(content, hdr_len, "ETag", etag, sizeof(etag));
+    header_value(content, hdr_len, "Last-Modified", modified, 
+            sizeof(modified));
+    if (etag[0] == '\0' && modified[0] == '\0') {
+        return 0;
+    }
+
+    /* Copy the request up to its blank line, without its conditions */
+    buf_init(&request, out->cap);
+    while ((next = memchr(line, '\n', end - line)) != NULL) {
+        next += 1;
+        if (next - line == 1 || (next - line == 2 && line[0] == '\r')) {
+            break;
+        }
+        if (!header_is(line, "If-None-Match")
+                && !header_is(line, "If-Modified-Since")) {
+            buf_append(&request, line, next - line);
+        }
+        line = next;
+    }
+
+    if (etag[0] != '\0') {
+        buf_append(&request, "If-None-Match: ", strlen("If-None-Match: "));
+        buf_append(&request, etag, strlen(etag));
+        buf_append(&request, "\r\n", 2);
+    }
+    if (modified[0] != '\0') {
+        buf_append(&request, "If-Modified-Since: ", 
+                strlen("If-Modified-Since: "));
+        buf_append(&request, modified, strlen(modified));
+        buf_append(&request, "\r\n", 2);
+    }
+    buf_append(&request, "\r\n", 2);
+
+    buf_free(out);
+    *out = request;
+    return 1;
+}
+
+/*
+ * End Request Functions
+ * ---------------------
+ */
+
+
+/*
+ * Response Functions
+ * ------------------
+ */
+
+/*
+ * find_header_end - This function looks for the empty line that ends a
+ * request's or response's headers, accepting either "\r\n" or "\n" line
+ * endings.
+ *
+ * Parameters:
+ *  - data: the bytes read so far
+ *  - len: number of bytes in data
+ * Return value:
+ *  - the number of bytes up to and including the empty line
+ *  - -1: the headers are not complete yet
+ */
+long find_header_end(char *data, size_t len)
+{
+    size_t line_start = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (data[i] != '\n') {
+            continue;
+        }
+        if (i == line_start || (i == line_start + 1
+                    && data[line_start] == '\r')) {
+            return i + 1;
+        }
+        line_start = i + 1;
+    }
+
+    return -1;
+}
+
+/*
+ * parse_response - This function reads the status, the headers that
+ * delimit the body, and whether the server keeps the connection open, out
+ * of a web server's response headers.
+ *
+ * Parameters:
+ *  - data: the response, starting with its status line
+ *  - hdr_len: number of bytes of headers, as found by find_header_end
+ *  - resp: filled with what was found
+ * Return value:
+ *  - 0: the headers were understood
+ *  - -1: the status line is malformed
+ */
+int parse_response(char *data, size_t hdr_len, Response *resp)
+{
+    char *line = data;
+    char *end = data + hdr_len;
+    char *next;
+    int minor;
+
+    if (sscanf(data, "HTTP/1.%d %d", &minor, &resp->status) != 2) {
+        return -1;
+    }
+    /* HTTP/1.1 servers keep connections open unless they say otherwise */
+    resp->keep_alive = (minor >= 1);
+    resp->content_length = -1;
+    resp->chunked = 0;
+    resp->no_body = (resp->status / 100 == 1 || resp->status == 204 
+            || resp->status == 304);
+
+    while ((next = memchr(line, '\n', end - line)) != NULL) {
+        next += 1;
+        if (header_is(line, "Content-Length")) {
+            resp->content_length = strtol(line + strlen("Content-Length:"),
+                    NULL, 10);
+        } else if (header_is(line, "Transfer-Encoding")) {
+            resp->chunked = 1;
+        } else if (header_is(line, "Connection")) {
+            if (strcasestr(line, "close") != NULL) {
+                resp->keep_alive = 0;
+            } else if (strcasestr(line, "keep-alive") != NULL) {
+                resp->keep_alive = 1;
+            }
+        }
+        line = next;
+    }
+
+    return 0;
+}
+
+/*
+ * response_frame - This function decides how a response's body is
+ * delimited for the browser. A body that the server chunked is passed on
+ * as is, so the browser's connection must close after it.
+ *
+ * Parameters:
+ *  - resp: the parsed response headers
+ *  - body_len: length of the whole body if it is already known, as for
+ *              a cached response, or -1
+ *  - keep_alive: whether the browser wants its connection kept open
+ *  - http11: whether the browser sent an HTTP/1.1 request
+ *  - length: set to the body length for FRAME_LENGTH
+ * Return value:
+ *  - FRAME_LENGTH, FRAME_CHUNKED or FRAME_CLOSE
+ */
+int response_frame(Response *resp, long body_len, int keep_alive, 
+        int http11, long *length)
+{
+    if (resp->no_body) {
+        *length = 0;
+        return FRAME_LENGTH;
+    }
+    if (resp->chunked) {
+        return FRAME_CLOSE;
+    }
+    if (body_len >= 0) {
+        *length = body_len;
+        return FRAME_LENGTH;
+    }
+    if (resp->content_length >= 0) {
+        *length = resp->content_length;
+        return FRAME_LENGTH;
+    }
+    if (keep_alive && http11) {
+        return FRAME_CHUNKED;
+    }
+    return FRAME_CLOSE;
+}
+
+/*
+ * response_head - This function builds the response headers sent to the
+ * browser from the ones the web server sent. The status line is sent as
+ * HTTP/1.1, the hop-by-hop headers are replaced, and when the proxy
+ * delimits the body itself, the server's own Content-Length and
+ * Transfer-Encoding are replaced too.
+ *
+ * Parameters:
+ *  - out: buffer the headers are added to
+ *  - data: the server's response, starting with its status line
+ *  - hdr_len: number of bytes of the server's headers
+ *  - resp: the parsed response headers
+ *  - frame: how the body is delimited, from response_frame
+ *  - length: the body length, for FRAME_LENGTH
+ *  - keep_alive: whether the browser's connection stays open afterwards
+ */
+void response_head(Buf *out, char *data, size_t hdr_len, Response *resp,
+        int frame, long length, int keep_alive)
+{
+    char *line = data;
+    char *end = data + hdr_len;
+    char *next;
+    char length_hdr[MAXLINE];
+
+    /* The status line, as HTTP/1.1 */
+    next = memchr(line, '\n', end - line) + 1;
+    if (!strncmp(line, "HTTP/1.0", strlen("HTTP/1.0"))) {
+        buf_append(out, "HTTP/1.1", strlen("HTTP/1.1"));
+        line += strlen("HTTP/1.0");
+    }
+    buf_append(out, line, next - line);
+    line = next;
+
+    while ((next = memchr(line, '\n', end - line)) != NULL) {
+        next += 1;
+        if (next - line == 1 || (next - line == 2 && line[0] == '\r')) {
+            /* At the blank line that ends the headers */
+            break;
+        }
+        if (header_is(line, "Connection") 
+                || header_is(line, "Proxy-Connection")
+                || header_is(line, "Keep-Alive")
+                || (frame != FRAME_CLOSE 
+                    && (header_is(line, "Content-Length")
+                        || header_is(line, "Transfer-Encoding")))) {
+            line = next;
+            continue;
+        }
+        buf_append(out, line, next - line);
+        line = next;
+    }
+
+    if (frame == FRAME_LENGTH && !resp->no_body) {
+        sprintf(length_hdr, "Content-Length: %ld\r\n", length);
+        buf_append(out, length_hdr, strlen(length_hdr));
+    } else if (frame == FRAME_CHUNKED) {
+        buf_append(out, "Transfer-Encoding: chunked\r\n", 
+                strlen("Transfer-Encoding: chunked\r\n"));
+    }
+    if (keep_alive) {
+        buf_append(out, "Connection: keep-alive\r\n", 
+                strlen("Connection: keep-alive\r\n"));
+    } else {
+        buf_append(out, "Connection: close\r\n", 
+                strlen("Connection: close\r\n"));
+    }
+    buf_append(out, "\r\n", 2);
+    return;
+}
+
+/*
+ * cached_head - This function builds the response headers sent to the
+ * browser for a cached response, and finds the part of the cached bytes
+ * that follows them. Since the whole body is at hand, it is always
+ * delimited with Content-Length unless the server chunked it. A cached
+ * response whose headers cannot be parsed is sent as it is.
+ *
+ * Parameters:
+ *  - head: buffer the headers are added to; left empty if the response
+ *          is sent as it is
+ *  - content: the cached response, as the server sent it
+ *  - size: number of bytes in content
+ *  - keep_alive: whether the browser wants its connection kept open
+ *  - http11: whether the browser sent an HTTP/1.1 request
+ *  - body_off: set to the offset in content of the bytes to send after
+ *              head
+ *  - body_len: set to the number of bytes to send after head
+ * Return value:
+ *  - 1: the browser's connection may stay open afterwards
+ *  - 0: the browser's connection must be closed
+ */
+int cached_head(Buf *head, char *content, size_t size, int keep_alive,
+        int http11, size_t *body_off, size_t *body_len)
+{
+    long hdr_len;
+    long length = 0;
+    Response resp;
+    int frame;
+
+    hdr_len = find_header_end(content, size);
+    if (hdr_len < 0 || parse_response(content, hdr_len, &resp) < 0) {
+        *body_off = 0;
+        *body_len = size;
+        return 0;
+    }
+
+    frame = response_frame(&resp, size - hdr_len, keep_alive, http11, 
+            &length);
+    keep_alive = keep_alive && frame != FRAME_CLOSE;
+    if (frame == FRAME_CLOSE) {
+        length = size - hdr_len;
+    }
+    response_head(head, content, hdr_len, &resp, frame, length, keep_alive);
+
+    *body_off = hdr_len;
+    *body_len = length;
+    return keep_alive;
+}
+
+/*
+ * chunk_wrap - This function turns n bytes of body into one chunk, in
+ * place. The bytes must sit CHUNK_HEAD_ROOM bytes into buf, with two
+ * more bytes of room after them.
+ *
+ * Parameters:
+ *  - buf: buffer holding the data at buf + CHUNK_HEAD_ROOM
+ *  - n: number of bytes of data
+ *  - len: set to the length of the whole chunk
+ * Return value:
+ *  - the offset in buf at which the chunk starts
+ */
+size_t chunk_wrap(char *buf, size_t n, size_t *len)
+{
+    char size_line[CHUNK_HEAD_ROOM];
+    int size_len;
+
+    size_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", n);
+    memcpy(buf + CHUNK_HEAD_ROOM - size_len, size_line, size_len);
+    memcpy(buf + CHUNK_HEAD_ROOM + n, "\r\n", 2);
+    *len = size_len + n + 2;
+    return CHUNK_HEAD_ROOM - size_len;
+}
+
+/*
+ * header_is - Returns whether a header line is the header with the given
+ * name, ignoring case.
+ */
+int header_is(char *line, char *name)
+{
+    size_t name_len = strlen(name);
+
+    return !strncasecmp(line, name, name_len) && line[name_len] == ':';
+}
+
+/*
+ * header_value - This function finds the value of a header, without the
+ * spaces around it. A header that appears more than once has its values
+ * joined with commas, as HTTP allows for list headers like Cache-Control.
+ *
+ * Parameters:
+ *  - data: the headers, starting with the status or request line
+ *  - hdr_len: number of bytes of headers
+ *  - name: the header to look for
+ *  - value: filled with the value, or "" if the header is absent; cut
+ *           short if it does not fit
+ *  - size: number of bytes in value
+ * Return value:
+ *  - 1 if the header is present, 0 if not
+ */
+int header_value(char *data, size_t hdr_len, char *name, char *value,
+        size_t size)
+{
+    char *line = data;
+    char *end = data + hdr_len;
+    char *next;
+    char *start;
+    char *stop;
+    size_t len = 0;
+    size_t n;
+    int found = 0;
+
+    value[0] = '\0';
+    while ((next = memchr(line, '\n', end - line)) != NULL) {
+        next += 1;
+        if (header_is(line, name)) {
+            start = line + strlen(name) + 1;
+            stop = next;
+            while (start < stop && isspace(*start)) {
+                start++;
+            }
+            while (stop > start && isspace(stop[-1])) {
+                stop--;
+            }
+            if (found && len + 2 < size) {
+                memcpy(value + len, ", ", 2);
+                len += 2;
+            }
+            n = stop - start;
+            if (n > size - 1 - len) {
+                n = size - 1 - len;
+            }
+            memcpy(value + len, start, n);
+            len += n;
+            value[len] = '\0';
+            found = 1;
+        }
+        line = next;
+    }
+
+    return found;
+}
+
+/*
+ * End Response Functions
+ * ----------------------
+ */
+
+
+/*
+ * Freshness Functions
+ * -------------------
+ */
+
+/*
+ * response_freshness - This function decides whether a response from a
+ * web server may be cached and, if so, until when it is fresh. Only the
+ * statuses that HTTP lets a cache store without being told it may are
+ * cached, and never when the server says no-store or private, or varies
+ * the response on everything. An uncacheable response bypasses the cache
+ * entirely, so error pages never displace good objects.
+ *
+ * Parameters:
+ *  - data: the response, starting with its status line
+ *  - hdr_len: number of bytes of headers, as found by find_header_end
+ *  - now: the time the response was received
+ *  - expires: set to when the response goes stale, if it is cacheable
+ * Return value:
+ *  - 1: the response may be cached
+ *  - 0: it must not be
+ */
+int response_freshness(char *data, size_t hdr_len, time_t now,
+        time_t *expires)
+{
+    Freshness fresh;
+
+    parse_freshness(data, hdr_len, &fresh);
+    if (!status_cacheable(fresh.status) || fresh.no_store) {
+        return 0;
+    }
+
+    *expires = freshness_expires(&fresh, now);
+    return 1;
+}
+
+/*
+ * refreshed_expires - This function works out the new expiry of a cached
+ * response that a web server has just confirmed with a 304. The 304's
+ * own Cache-Control or Expires wins; if it has neither, the cached
+ * response's lifetime is used again.
+ *
+ * Parameters:
+ *  - content: the cached response
+ *  - size: number of bytes in content
+ *  - data: the 304 response, starting with its status line
+ *  - hdr_len: number of bytes of the 304's headers
+ *  - now: the time the 304 was received
+ * Return value:
+ *  - when the cached response goes stale again
+ */
+time_t refreshed_expires(char *content, size_t size, char *data,
+        size_t hdr_len, time_t now)
+{
+    Freshness fresh, stored;
+    long stored_len;
+
+    parse_freshness(data, hdr_len, &fresh);
+    if (fresh.max_age < 0 && fresh.expires < 0 && !fresh.no_cache
+            && (stored_len = find_header_end(content, size)) >= 0) {
+        parse_freshness(content, stored_len, &stored);
+        fresh.no_cache = stored.no_cache;
+        fresh.max_age = freshness_lifetime(&stored, now);
+    }
+
+    return freshness_expires(&fresh, now);
+}
+
+/*
+ * stale_usable - This function decides whether a cached response that
+ * went stale at expires may still be served at now, going by the
+ * stale-while-revalidate and stale-if-error windows in its own headers.
+ * The windows are only looked up once a response is stale, so fresh hits
+ * never parse them. must-revalidate, proxy-revalidate and no-cache rule
+ * both windows out.
+ *
+ * Parameters:
+ *  - content: the cached response
+ *  - size: number of bytes in content
+ *  - expires: when it went stale
+ *  - now: the current time
+ *  - error: 0 to check stale-while-revalidate, while the response is
+ *           revalidated in the background; 1 to check stale-if-error,
+ *           when the web server could not be reached or failed
+ * Return value:
+ *  - 1: the stale response may be served
+ *  - 0: it must not be
+ */
+int stale_usable(char *content, size_t size, time_t expires, time_t now,
+        int error)
+{
+    Freshness fresh;
+    long hdr_len;
+    long window;
+
+    if ((hdr_len = find_header_end(content, size)) < 0) {
+        return 0;
+    }
+    parse_freshness(content, hdr_len, &fresh);
+    if (fresh.must_revalidate || fresh.no_cache) {
+        return 0;
+    }
+
+    window = error ? fresh.stale_error : fresh.stale_revalidate;
+    return now - expires < window;
+}
+
+/*
+ * parse_freshness - This function reads the status and the headers that
+ * bear on caching out of a response's headers. Pragma: no-cache is only
+ * honored when there is no Cache-Control.
+ *
+ * Parameters:
+ *  - data: the response, starting with its status line
+ *  - hdr_len: number of bytes of headers
+ *  - fresh: filled with what was found
+ */
+void parse_freshness(char *data, size_t hdr_len, Freshness *fresh)
+{
+    char value[MAXLINE];
+    char *token;
+    char *save;
+    long s_maxage = -1;
+
+    fresh->status = 0;
+    sscanf(data, "HTTP/%*d.%*d %d", &fresh->status);
+    fresh->no_store = 0;
+    fresh->no_cache = 0;
+    fresh->max_age = -1;
+    fresh->age = 0;
+    fresh->date = -1;
+    fresh->expires = -1;
+    fresh->last_modified = -1;
+    fresh->must_revalidate = 0;
+    fresh->stale_revalidate = 0;
+    fresh->stale_error = 0;
+
+    if (header_value(data, hdr_len, "Cache-Control", value, 
+                sizeof(value))) {
+        for (token = strtok_r(value, ",", &save); token != NULL;
+                token = strtok_r(NULL, ",", &save)) {
+            token += strspn(token, " \t");
+            if (!strncasecmp(token, "no-store", strlen("no-store"))
+                    || !strncasecmp(token, "private", strlen("private"))) {
+                fresh->no_store = 1;
+            } else if (!strncasecmp(token, "no-cache", 
+                        strlen("no-cache"))) {
+                fresh->no_cache = 1;
+            } else if (!strncasecmp(token, "s-maxage=", 
+                        strlen("s-maxage="))) {
+                s_maxage = strtol(token + strlen("s-maxage="), NULL, 10);
+            } else if (!strncasecmp(token, "max-age=", 
+                        strlen("max-age="))) {
+                fresh->max_age = strtol(token + strlen("max-age="), NULL, 
+                        10);
+            } else if (!strncasecmp(token, "must-revalidate",
+                        strlen("must-revalidate"))
+                    || !strncasecmp(token, "proxy-revalidate",
+                        strlen("proxy-revalidate"))) {
+                fresh->must_revalidate = 1;
+            } else if (!strncasecmp(token, "stale-while-revalidate=",
+                        strlen("stale-while-revalidate="))) {
+                fresh->stale_revalidate = strtol(token
+                        + strlen("stale-while-revalidate="), NULL, 10);
+            } else if (!strncasecmp(token, "stale-if-error=",
+                        strlen("stale-if-error="))) {
+                fresh->stale_error = strtol(token
+                        + strlen("stale-if-error="), NULL, 10);
+            }
+        }
+    } else if (header_value(data, hdr_len, "Pragma", value, sizeof(value))
+            && strcasestr(value, "no-cache") != NULL) {
+        fresh->no_cache = 1;
+    }
+    /* The proxy is a shared cache, so s-maxage wins over max-age */
+    if (s_maxage >= 0) {
+        fresh->max_age = s_maxage;
+    }
+    if (fresh->max_age < -1) {
+        fresh->max_age = 0;
+    }
+
+    if (header_value(data, hdr_len, "Vary", value, sizeof(value))
+            && strchr(value, '*') != NULL) {
+        fresh->no_store = 1;
+    }
+    if (header_value(data, hdr_len, "Age", value, sizeof(value))) {
+        fresh->age = strtol(value, NULL, 10);
+        if (fresh->age < 0) {
+            fresh->age = 0;
+        }
+    }
+    if (header_value(data, hdr_len, "Date", value, sizeof(value))) {
+        fresh->date = parse_http_date(value);
+    }
+    if (header_value(data, hdr_len, "Expires", value, sizeof(value))) {
+        /* An Expires that is not a date means already expired */
+        if ((fresh->expires = parse_http_date(value)) < 0) {
+            fresh->expires = 0;
+        }
+    }
+    if (header_value(data, hdr_len, "Last-Modified", value, 
+                sizeof(value))) {
+        fresh->last_modified = parse_http_date(value);
+    }
+    return;
+}
+
+/*
+ * status_cacheable - Returns whether a response with the given status may
+ * be cached without the server saying so explicitly. Redirects that may
+ * change, partial content, and server errors other than 501 never are.
+ */
+int status_cacheable(int status)
+{
+    switch (status) {
+    case 200: case 203: case 204: case 300: case 301: case 308:
+    case 404: case 405: case 410: case 414: case 501:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * freshness_lifetime - Returns how many seconds a response stays fresh
+ * after it was generated: its s-maxage or max-age, or else the time from
+ * its Date to its Expires, or else a tenth of how long it had gone
+ * unmodified, capped at HEURISTIC_MAX, or else HEURISTIC_DEFAULT. A
+ * response without a Date is taken to have been generated at now.
+ */
+long freshness_lifetime(Freshness *fresh, time_t now)
+{
+    time_t date = fresh->date >= 0 ? fresh->date : now;
+    long lifetime;
+
+    if (fresh->max_age >= 0) {
+        return fresh->max_age;
+    }
+    if (fresh->expires >= 0) {
+        return fresh->expires - date;
+    }
+    if (fresh->last_modified >= 0) {
+        lifetime = (date - fresh->last_modified) / HEURISTIC_FRACTION;
+        if (lifetime < 0) {
+            lifetime = 0;
+        }
+        return lifetime < HEURISTIC_MAX ? lifetime : HEURISTIC_MAX;
+    }
+    return HEURISTIC_DEFAULT;
+}
+
+/*
+ * freshness_expires - Returns when a response received at now goes
+ * stale: its lifetime less the age it already had, going by its Age
+ * header or its Date, whichever is older. A no-cache response is stale
+ * at once, so it is revalidated before every use.
+ */
+time_t freshness_expires(Freshness *fresh, time_t now)
+{
+    long age = fresh->age;
+
+    if (fresh->no_cache) {
+        return now;
+    }
+    if (fresh->date >= 0 && now - fresh->date > age) {
+        age = now - fresh->date;
+    }
+    return now + freshness_lifetime(fresh, now) - age;
+}
+
+/*
+ * parse_http_date - Returns the time an HTTP date stands for, accepting
+ * the preferred format and the two obsolete ones, or -1 if value is not
+ * a date.
+ */
+time_t parse_http_date(char *value)
+{
+    static const char *formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",   /* Sun, 06 Nov 1994 08:49:37 GMT */
+        "%A, %d-%b-%y %H:%M:%S GMT",   /* Sunday, 06-Nov-94 08:49:37 GMT */
+        "%a %b %d %H:%M:%S %Y"         /* Sun Nov  6 08:49:37 1994 */
+    };
+    struct tm tm;
+    char *end;
+    size_t i;
+
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        memset(&tm, 0, sizeof(tm));
+        if ((end = strptime(value, formats[i], &tm)) != NULL 
+                && *end == '\0') {
+            return timegm(&tm);
+        }
+    }
+    return -1;
+}
+
+/*
+ * End Freshness Functions
+ * -----------------------
+ */
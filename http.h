@@ -0,0 +1,132 @@
+/*
+ * http.h
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This is the header file for http.c, which contains
+ * the HTTP parsing and request rewriting shared by the proxy's threaded
+ * and event-driven engines, along with a small growable byte buffer.
+ * This file just has the relevant macros, structure definitions, and
+ * function prototypes.
+ *
+ */
+
+/* Include guards */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <time.h>
+
+#include "csapp.h"
+
+/* Macros */
+#define DEFAULT_CLIENT_PORT 80  /* If a port is not specified in
+                                   the URI, this is the default port
+                                   the proxy tries to connect to on
+                                   the web server. */
+#define MAX_REQUEST_SIZE (8 * MAXBUF) /* Longest request line plus headers
+                                         the event engine will buffer, and
+                                         longest response headers the
+                                         proxy will rewrite */
+#define KEEPALIVE_TIMEOUT 5     /* Default seconds a browser connection may
+                                   sit idle before the next request */
+#define KEEPALIVE_MAX 100       /* Default requests served on one browser
+                                   connection before it is closed */
+#define CHUNK_HEAD_ROOM 16      /* Room left before data for the size line
+                                   of a chunk */
+#define CHUNK_ROOM (CHUNK_HEAD_ROOM + 2) /* Room around data for a chunk */
+#define LAST_CHUNK "0\r\n\r\n"  /* Ends a chunked response body */
+#define HEURISTIC_FRACTION 10   /* Without an explicit lifetime, a response
+                                   with a Last-Modified stays fresh for
+                                   this fraction of its age */
+#define HEURISTIC_MAX 86400     /* Longest such heuristic lifetime, in
+                                   seconds */
+#define HEURISTIC_DEFAULT 60    /* Lifetime, in seconds, of a response with
+                                   neither an explicit lifetime nor a
+                                   Last-Modified */
+
+/* How the body of a response is delimited for the browser */
+#define FRAME_LENGTH  0         /* Content-Length, connection reusable */
+#define FRAME_CHUNKED 1         /* Chunked coding, connection reusable */
+#define FRAME_CLOSE   2         /* Closing the connection */
+
+/*
+ * A growable buffer of bytes. data holds len bytes and has room for cap.
+ */
+typedef struct Buf {
+    char *data;                 /* The bytes */
+    size_t len;                 /* Number of bytes in use */
+    size_t cap;                 /* Number of bytes allocated */
+} Buf;
+
+/*
+ * What the proxy needs to know about a web server's response headers.
+ */
+typedef struct Response {
+    int status;                 /* Status code */
+    long content_length;        /* Content-Length, or -1 if not given */
+    int chunked;                /* The server used a Transfer-Encoding */
+    int no_body;                /* The status never has a body */
+    int keep_alive;             /* The server will keep the connection
+                                   open after the response */
+} Response;
+
+/*
+ * What the proxy needs to know about a web server's response headers to
+ * decide whether, and for how long, it may be cached. Times are seconds
+ * since the epoch.
+ */
+typedef struct Freshness {
+    int status;                 /* Status code */
+    int no_store;               /* Must not be cached at all */
+    int no_cache;               /* Must be revalidated before every use */
+    long max_age;               /* s-maxage or max-age, or -1 if neither */
+    long age;                   /* The Age header, or 0 */
+    time_t date;                /* The Date header, or -1 */
+    time_t expires;             /* The Expires header, or -1 if there is
+                                   none; 0 if it is not a valid date */
+    time_t last_modified;       /* The Last-Modified header, or -1 */
+    int must_revalidate;        /* Must never be used once stale */
+    long stale_revalidate;      /* stale-while-revalidate, or 0 */
+    long stale_error;           /* stale-if-error, or 0 */
+} Freshness;
+
+/* Buffer Function Prototypes */
+void buf_init(Buf *buf, size_t cap);
+void buf_append(Buf *buf, const void *data, size_t n);
+void buf_free(Buf *buf);
+/* Request Function Prototypes */
+int parse_request_line(char *line, char *method, char *uri, char *version);
+void parse_uri(char *uri, char *hostname, char *path, int *client_port);
+void request_start(Buf *out, char *path);
+void request_header(Buf *out, char *line, int *host_seen, int *keep_alive);
+void request_finish(Buf *out, char *host, int host_seen, int keep_alive);
+int request_revalidate(Buf *out, char *content, size_t size);
+/* Response Function Prototypes */
+long find_header_end(char *data, size_t len);
+int parse_response(char *data, size_t hdr_len, Response *resp);
+int response_frame(Response *resp, long body_len, int keep_alive, 
+        int http11, long *length);
+void response_head(Buf *out, char *data, size_t hdr_len, Response *resp,
+        int frame, long length, int keep_alive);
+int cached_head(Buf *head, char *content, size_t size, int keep_alive,
+        int http11, size_t *body_off, size_t *body_len);
+size_t chunk_wrap(char *buf, size_t n, size_t *len);
+int header_is(char *line, char *name);
+int header_value(char *data, size_t hdr_len, char *name, char *value,
+        size_t size);
+/* Freshness Function Prototypes */
+int response_freshness(char *data, size_t hdr_len, time_t now,
+        time_t *expires);
+time_t refreshed_expires(char *content, size_t size, char *data,
+        size_t hdr_len, time_t now);
+int stale_usable(char *content, size_t size, time_t expires, time_t now,
+        int error);
+void parse_freshness(char *data, size_t hdr_len, Freshness *fresh);
+int status_cacheable(int status);
+long freshness_lifetime(Freshness *fresh, time_t now);
+time_t freshness_expires(Freshness *fresh, time_t now);
+time_t parse_http_date(char *value);
+
+#endif
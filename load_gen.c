@@ -0,0 +1,460 @@
+/*
+ * load_gen.c
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This file is an HTTP load generator for benchmarking
+ * the proxy end to end against stub_origin. Each thread keeps one HTTP/1.1
+ * connection open to the proxy and sends GETs for objects on the origin
+ * back to back, picking each object from a Zipf distribution, so that a
+ * few objects are very popular and most are rarely asked for, as on the
+ * web. It connects again whenever the proxy closes the connection.
+ *
+ * After a warmup, during which the cache fills, it measures for a fixed
+ * time and prints the requests per second, the 50th, 99th and 99.9th
+ * percentile latencies, the share of requests that never reached the
+ * origin, from the origin's /stats, and, given the proxy's pid, the CPU
+ * time the proxy spent per request, from /proc.
+ *
+ * The Zipf exponent is fixed at 1, where the weight of the object of rank
+ * k is just 1/k.
+ *
+ * Usage: load_gen [-t threads] [-d seconds] [-w seconds] [-n objects]
+ *                 [-o port] [-p pid] <proxy host> <proxy port>
+ *  - -t threads: number of connections (default: LOAD_DEFAULT_THREADS)
+ *  - -d seconds: how long to measure for (default: LOAD_DEFAULT_DURATION)
+ *  - -w seconds: how long to warm up for first (default:
+ *                LOAD_DEFAULT_WARMUP)
+ *  - -n objects: number of distinct objects (default:
+ *                LOAD_DEFAULT_OBJECTS)
+ *  - -o port: port of stub_origin on this machine (default:
+ *             LOAD_DEFAULT_ORIGIN)
+ *  - -p pid: the proxy's pid, to measure its CPU time
+ */
+
+#include <time.h>
+
+#include "csapp.h"
+
+/* Macros */
+#define LOAD_DEFAULT_THREADS 8       /* Default connections */
+#define LOAD_DEFAULT_DURATION 10     /* Default seconds measured */
+#define LOAD_DEFAULT_WARMUP 3        /* Default seconds of warmup */
+#define LOAD_DEFAULT_OBJECTS 10000   /* Default distinct objects */
+#define LOAD_DEFAULT_ORIGIN 18081    /* Default port of stub_origin */
+#define LOAD_RETRY_DELAY 10000       /* Microseconds between failed
+                                        connects */
+
+/* Phases of a run */
+#define PHASE_WARMUP 0
+#define PHASE_MEASURE 1
+#define PHASE_STOP 2
+
+/*
+ * One thread of the load generator and what it measured.
+ */
+typedef struct Worker {
+    pthread_t tid;                   /* The thread */
+    unsigned int seed;               /* State of its random numbers */
+    double *latencies;               /* Microseconds per measured request */
+    size_t count;                    /* Measured requests */
+    size_t size;                     /* Latencies allocated */
+    unsigned long errors;            /* Failed or non-200 requests */
+} Worker;
+
+/* Global Variables */
+char *proxy_host;                    /* Where the proxy is */
+int proxy_port;
+int origin_port = LOAD_DEFAULT_ORIGIN; /* Where stub_origin is */
+int nobjects = LOAD_DEFAULT_OBJECTS; /* Distinct objects */
+double *zipf_cdf;                    /* zipf_cdf[k]: chance of rank <= k */
+int phase = PHASE_WARMUP;            /* Phase of the run */
+
+/* Function prototypes */
+void usage(char *prog);
+double now_us(void);
+void zipf_init(int n);
+int zipf_next(unsigned int *seed);
+void *worker_thread(void *vargp);
+int do_request(rio_t *rio, int fd, int object, int *keep_alive);
+int origin_stats(unsigned long *requests);
+int proxy_cpu(int pid, double *seconds);
+int compare_double(const void *a, const void *b);
+
+int main(int argc, char **argv)
+{
+    int nthreads = LOAD_DEFAULT_THREADS;
+    int duration = LOAD_DEFAULT_DURATION;
+    int warmup = LOAD_DEFAULT_WARMUP;
+    int pid = 0;
+    Worker *workers;
+    double *all;
+    size_t total = 0;
+    unsigned long errors = 0;
+    unsigned long origin_start, origin_end;
+    double cpu_start, cpu_end;
+    double start, elapsed;
+    int have_origin, have_cpu;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "t:d:w:n:o:p:")) != -1) {
+        switch (opt) {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 'n':
+            nobjects = atoi(optarg);
+            break;
+        case 'o':
+            origin_port = atoi(optarg);
+            break;
+        case 'p':
+            pid = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 2 || nthreads < 1 || duration < 1 || warmup < 0
+            || nobjects < 1) {
+        usage(argv[0]);
+    }
+    proxy_host = argv[optind];
+    proxy_port = atoi(argv[optind + 1]);
+
+    Signal(SIGPIPE, SIG_IGN);
+    zipf_init(nobjects);
+    workers = Calloc(nthreads, sizeof(Worker));
+    for (i = 0; i < nthreads; i++) {
+        workers[i].seed = i + 1;
+        Pthread_create(&workers[i].tid, NULL, worker_thread, &workers[i]);
+    }
+
+    sleep(warmup);
+    have_origin = origin_stats(&origin_start) == 0;
+    have_cpu = pid > 0 && proxy_cpu(pid, &cpu_start) == 0;
+    start = now_us();
+    __atomic_store_n(&phase, PHASE_MEASURE, __ATOMIC_RELEASE);
+
+    sleep(duration);
+    __atomic_store_n(&phase, PHASE_STOP, __ATOMIC_RELEASE);
+    elapsed = (now_us() - start) / 1e6;
+    have_origin = have_origin && origin_stats(&origin_end) == 0;
+    have_cpu = have_cpu && proxy_cpu(pid, &cpu_end) == 0;
+
+    for (i = 0; i < nthreads; i++) {
+        Pthread_join(workers[i].tid, NULL);
+        total += workers[i].count;
+        errors += workers[i].errors;
+    }
+    all = Malloc((total + 1) * sizeof(double));
+    total = 0;
+    for (i = 0; i < nthreads; i++) {
+        memcpy(all + total, workers[i].latencies,
+                workers[i].count * sizeof(double));
+        total += workers[i].count;
+        Free(workers[i].latencies);
+    }
+    qsort(all, total, sizeof(double), compare_double);
+
+    printf("requests:      %lu in %.1f s, %lu errors\n",
+            (unsigned long)total, elapsed, errors);
+    printf("requests/sec:  %.0f\n", total / elapsed);
+    if (total > 0) {
+        printf("latency (ms):  p50 %.3f  p99 %.3f  p999 %.3f\n",
+                all[(size_t)(0.5 * (total - 1))] / 1000,
+                all[(size_t)(0.99 * (total - 1))] / 1000,
+                all[(size_t)(0.999 * (total - 1))] / 1000);
+    }
+    if (have_origin && total > 0) {
+        printf("hit ratio:     %.1f%% (%lu origin requests)\n",
+                origin_end - origin_start >= total ? 0.0
+                : 100.0 * (total - (origin_end - origin_start)) / total,
+                origin_end - origin_start);
+    } else {
+        printf("hit ratio:     unknown, the origin's /stats did not answer\n");
+    }
+    if (have_cpu && total > 0) {
+        printf("CPU/request:   %.1f us (%.0f%% of a core)\n",
+                (cpu_end - cpu_start) * 1e6 / total,
+                100.0 * (cpu_end - cpu_start) / elapsed);
+    }
+
+    Free(all);
+    Free(workers);
+    Free(zipf_cdf);
+    return 0;
+}
+
+/*
+ * usage - Prints the load generator's command line usage and exits.
+ */
+void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-t threads] [-d seconds] [-w seconds] "
+            "[-n objects] [-o port] [-p pid] <proxy host> <proxy port>\n",
+            prog);
+    exit(1);
+}
+
+/*
+ * now_us - Returns a monotonic timestamp in microseconds.
+ */
+double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * zipf_init - Builds the cumulative distribution of object ranks 1..n.
+ */
+void zipf_init(int n)
+{
+    double sum = 0;
+    int k;
+
+    zipf_cdf = Malloc(n * sizeof(double));
+    for (k = 0; k < n; k++) {
+        sum += 1.0 / (k + 1);
+        zipf_cdf[k] = sum;
+    }
+    for (k = 0; k < n; k++) {
+        zipf_cdf[k] /= sum;
+    }
+    return;
+}
+
+/*
+ * zipf_next - Returns a random object, 0 being the most popular.
+ *
+ * Parameter:
+ *  - seed: the calling thread's random state
+ */
+int zipf_next(unsigned int *seed)
+{
+    double u = (double)rand_r(seed) / ((double)RAND_MAX + 1);
+    int lo = 0;
+    int hi = nobjects - 1;
+    int mid;
+
+    /* The first rank whose cumulative chance is above u */
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] <= u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * worker_thread - Sends requests through the proxy until the run stops,
+ * recording the latency of those made while measuring.
+ *
+ * Parameter:
+ *  - vargp: the thread's Worker
+ */
+void *worker_thread(void *vargp)
+{
+    Worker *w = vargp;
+    int fd = -1;
+    int keep_alive = 0;
+    int current;
+    double start;
+    rio_t rio;
+
+    while ((current = __atomic_load_n(&phase, __ATOMIC_ACQUIRE))
+            != PHASE_STOP) {
+        if (fd < 0) {
+            if ((fd = open_clientfd(proxy_host, proxy_port)) < 0) {
+                w->errors += current == PHASE_MEASURE;
+                usleep(LOAD_RETRY_DELAY);
+                continue;
+            }
+            Rio_readinitb(&rio, fd);
+        }
+
+        start = now_us();
+        if (do_request(&rio, fd, zipf_next(&w->seed), &keep_alive) < 0) {
+            w->errors += current == PHASE_MEASURE;
+        } else if (current == PHASE_MEASURE) {
+            if (w->count == w->size) {
+                w->size = w->size ? 2 * w->size : 4096;
+                w->latencies = Realloc(w->latencies,
+                        w->size * sizeof(double));
+            }
+            w->latencies[w->count++] = now_us() - start;
+        }
+        if (!keep_alive) {
+            Close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd >= 0) {
+        Close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * do_request - Sends one GET for an object through the proxy and reads
+ * the whole response.
+ *
+ * Parameters:
+ *  - rio: rio state of the connection to the proxy
+ *  - fd: the connection
+ *  - object: which object to ask for
+ *  - keep_alive: set to whether the connection may be used again
+ * Return value:
+ *  - 0: a 200 response was read in full
+ *  - -1: the request failed, or the status was not 200
+ */
+int do_request(rio_t *rio, int fd, int object, int *keep_alive)
+{
+    char request[MAXLINE];
+    char line[MAXLINE];
+    char body[MAXBUF];
+    long length = -1;
+    ssize_t n;
+    int status;
+
+    *keep_alive = 0;
+    snprintf(request, MAXLINE, "GET http://127.0.0.1:%d/obj/%d HTTP/1.1\r\n"
+            "Host: 127.0.0.1:%d\r\n\r\n", origin_port, object, origin_port);
+    if (rio_writen(fd, request, strlen(request)) < 0) {
+        return -1;
+    }
+
+    if (rio_readlineb(rio, line, MAXLINE) <= 0
+            || sscanf(line, "HTTP/%*d.%*d %d", &status) != 1) {
+        return -1;
+    }
+    *keep_alive = 1;
+    while (1) {
+        if (rio_readlineb(rio, line, MAXLINE) <= 0) {
+            *keep_alive = 0;
+            return -1;
+        }
+        if (!strcmp(line, "\r\n") || !strcmp(line, "\n")) {
+            break;
+        }
+        if (!strncasecmp(line, "Content-Length:",
+                    strlen("Content-Length:"))) {
+            length = atol(line + strlen("Content-Length:"));
+        } else if (!strncasecmp(line, "Connection:", strlen("Connection:"))
+                && strstr(line, "close") != NULL) {
+            *keep_alive = 0;
+        }
+    }
+
+    /* Without a length, the body runs to the end of the connection */
+    if (length < 0) {
+        *keep_alive = 0;
+        while ((n = rio_readnb(rio, body, MAXBUF)) > 0) {
+            ;
+        }
+        return n < 0 || status != 200 ? -1 : 0;
+    }
+    while (length > 0) {
+        n = rio_readnb(rio, body, length < MAXBUF ? length : MAXBUF);
+        if (n <= 0) {
+            *keep_alive = 0;
+            return -1;
+        }
+        length -= n;
+    }
+    return status == 200 ? 0 : -1;
+}
+
+/*
+ * origin_stats - Asks stub_origin how many objects it has served.
+ *
+ * Return value:
+ *  - 0 on success, -1 if the origin did not answer
+ */
+int origin_stats(unsigned long *requests)
+{
+    char request[MAXLINE];
+    char line[MAXLINE];
+    rio_t rio;
+    int fd;
+    int found = 0;
+
+    if ((fd = open_clientfd("127.0.0.1", origin_port)) < 0) {
+        return -1;
+    }
+    snprintf(request, MAXLINE, "GET /stats HTTP/1.0\r\n\r\n");
+    if (rio_writen(fd, request, strlen(request)) < 0) {
+        Close(fd);
+        return -1;
+    }
+    Rio_readinitb(&rio, fd);
+    while (rio_readlineb(&rio, line, MAXLINE) > 0) {
+        if (sscanf(line, "requests %lu", requests) == 1) {
+            found = 1;
+        }
+    }
+    Close(fd);
+    return found ? 0 : -1;
+}
+
+/*
+ * proxy_cpu - Reads the user and system CPU time a process has used.
+ *
+ * Parameters:
+ *  - pid: the process
+ *  - seconds: set to its CPU time
+ * Return value:
+ *  - 0 on success, -1 if /proc could not be read
+ */
+int proxy_cpu(int pid, double *seconds)
+{
+    char path[MAXLINE];
+    char stat[MAXBUF];
+    unsigned long utime, stime;
+    char *fields;
+    FILE *fp;
+    size_t n;
+
+    snprintf(path, MAXLINE, "/proc/%d/stat", pid);
+    if ((fp = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    n = fread(stat, 1, MAXBUF - 1, fp);
+    fclose(fp);
+    stat[n] = '\0';
+
+    /* The command name may hold spaces, so start after its parenthesis */
+    if ((fields = strrchr(stat, ')')) == NULL
+            || sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u "
+                "%*u %lu %lu", &utime, &stime) != 2) {
+        return -1;
+    }
+    *seconds = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+    return 0;
+}
+
+/*
+ * compare_double - Orders doubles for qsort.
+ */
+int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,836 @@
+/*
+ * policy.c
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This file contains the eviction policies a cache
+ * shard can use to decide which object to evict when a new one needs
+ * room. The cache tells its shard's policy about every node it adds,
+ * hits and removes, and asks it for a victim when the shard is full.
+ *
+ *  - lru: evicts the least recently used node, the back of the shard's
+ *    recency list. This is the default.
+ *  - arc: Adaptive Replacement Cache. Nodes seen once lately and nodes
+ *    seen more often are kept on separate queues, and the ghosts of nodes
+ *    recently evicted from each tell ARC which queue it evicted from too
+ *    early, so it shifts the budget between them to suit the workload.
+ *    Sizes are counted in bytes rather than in objects.
+ *  - s3fifo: new nodes go on a small FIFO queue, and those not hit while
+ *    on it are evicted quickly, while nodes hit there move to a main FIFO
+ *    queue, which gives every node hit since its last pass another pass.
+ *    A hit only bumps a counter, and never moves the node.
+ *  - gdsf: GreedyDual-Size-Frequency evicts the node with the least
+ *    priority, the inflation value plus its hits divided by its size, so
+ *    that large objects must be hit proportionally more often to stay.
+ *    The inflation value rises to the priority of each evicted node, so
+ *    nodes that stop being hit are eventually evicted however small.
+ *    It favors the hit ratio by objects over the one by bytes.
+ *
+ */
+
+#include "policy.h"
+#include "cache.h"
+
+/* Every policy, by name */
+const CachePolicy lru_policy = {
+    "lru", lru_init, lru_destroy, lru_insert, lru_hit, lru_remove,
+    lru_victim, lru_hold, lru_unhold
+};
+const CachePolicy arc_policy = {
+    "arc", arc_init, arc_destroy, arc_insert, arc_hit, arc_remove,
+    arc_victim, arc_hold, arc_unhold
+};
+const CachePolicy s3fifo_policy = {
+    "s3fifo", s3fifo_init, s3fifo_destroy, s3fifo_insert, s3fifo_hit,
+    s3fifo_remove, s3fifo_victim, s3fifo_hold, s3fifo_unhold
+};
+const CachePolicy gdsf_policy = {
+    "gdsf", gdsf_init, gdsf_destroy, gdsf_insert, gdsf_hit, gdsf_remove,
+    gdsf_victim, gdsf_hold, gdsf_unhold
+};
+
+/*
+ * Main Policy Functions
+ * ---------------------
+ */
+
+/*
+ * policy_find - Returns the policy with the given name.
+ *
+ * Parameter:
+ *  - name: "lru", "arc", "s3fifo" or "gdsf"
+ * Return value:
+ *  - the policy, or NULL if there is none by that name
+ */
+const CachePolicy *policy_find(const char *name)
+{
+    static const CachePolicy *policies[] = {
+        &lru_policy, &arc_policy, &s3fifo_policy, &gdsf_policy
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (!strcmp(policies[i]->name, name)) {
+            return policies[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * End Main Policy Functions
+ * -------------------------
+ */
+
+
+/*
+ * LRU Policy Functions
+ * --------------------
+ * The cache already keeps every shard's nodes in recency order, so LRU
+ * has nothing to keep of its own.
+ */
+
+void lru_init(CacheShard *shard)
+{
+    shard->policy_state = NULL;
+    return;
+}
+
+void lru_destroy(CacheShard *shard)
+{
+    return;
+}
+
+void lru_insert(CacheShard *shard, CacheNode *node)
+{
+    return;
+}
+
+void lru_hit(CacheShard *shard, CacheNode *node)
+{
+    return;
+}
+
+void lru_remove(CacheShard *shard, CacheNode *node, int evicted)
+{
+    return;
+}
+
+/*
+ * lru_victim - Returns the node at the back of the recency list.
+ */
+CacheNode *lru_victim(CacheShard *shard)
+{
+    return shard->end->prev;
+}
+
+/*
+ * lru_hold - Unlinks a node from the recency list, leaving its own links
+ * alone so that lru_unhold can put it back between the same neighbors.
+ */
+void lru_hold(CacheShard *shard, CacheNode *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    return;
+}
+
+/*
+ * lru_unhold - Links a held node back between its old neighbors.
+ */
+void lru_unhold(CacheShard *shard, CacheNode *node)
+{
+    node->prev->next = node;
+    node->next->prev = node;
+    return;
+}
+
+/*
+ * End LRU Policy Functions
+ * ------------------------
+ */
+
+
+/*
+ * ARC Policy Functions
+ * --------------------
+ */
+
+/*
+ * arc_init - Creates empty queues, with room for a shard's budget of
+ * ghosts on each ghost queue, and a target of nothing for the recent
+ * queue.
+ */
+void arc_init(CacheShard *shard)
+{
+    ArcState *state = Calloc(1, sizeof(ArcState));
+
+    ghost_init(&state->recent_ghosts, shard->capacity);
+    ghost_init(&state->frequent_ghosts, shard->capacity);
+    state->target = 0;
+    shard->policy_state = state;
+    return;
+}
+
+/*
+ * arc_destroy - Frees the ghosts and the state. The nodes belong to the
+ * cache.
+ */
+void arc_destroy(CacheShard *shard)
+{
+    ArcState *state = shard->policy_state;
+
+    ghost_destroy(&state->recent_ghosts);
+    ghost_destroy(&state->frequent_ghosts);
+    Free(state);
+    return;
+}
+
+/*
+ * arc_insert - Puts a new node on the recent queue, unless it was evicted
+ * lately. A node that comes back while its ghost is on the recent ghost
+ * queue was evicted from the recent queue too early, so the recent
+ * queue's target grows; one whose ghost is on the frequent ghost queue
+ * shrinks it. Either way the node has now been seen twice, and goes on
+ * the frequent queue. The target moves by the node's charge, scaled up by
+ * how much smaller the ghost queue it was found on is than the other.
+ */
+void arc_insert(CacheShard *shard, CacheNode *node)
+{
+    ArcState *state = shard->policy_state;
+    size_t ratio;
+    size_t delta;
+    size_t taken;
+
+    if ((taken = ghost_take(&state->recent_ghosts, node->hash)) > 0) {
+        ratio = state->frequent_ghosts.bytes
+            / (state->recent_ghosts.bytes + taken);
+        delta = (ratio > 1 ? ratio : 1) * node->charge;
+        state->target = (state->target + delta < shard->capacity)
+            ? state->target + delta : shard->capacity;
+        node->queue = QUEUE_FREQUENT;
+        queue_push(&state->frequent, node);
+    } else if ((taken = ghost_take(&state->frequent_ghosts, node->hash))
+            > 0) {
+        ratio = state->recent_ghosts.bytes
+            / (state->frequent_ghosts.bytes + taken);
+        delta = (ratio > 1 ? ratio : 1) * node->charge;
+        state->target = (state->target > delta) ? state->target - delta : 0;
+        node->queue = QUEUE_FREQUENT;
+        queue_push(&state->frequent, node);
+    } else {
+        node->queue = QUEUE_RECENT;
+        queue_push(&state->recent, node);
+    }
+    return;
+}
+
+/*
+ * arc_hit - Moves a hit node to the head of the frequent queue.
+ */
+void arc_hit(CacheShard *shard, CacheNode *node)
+{
+    ArcState *state = shard->policy_state;
+
+    queue_unlink(node->queue == QUEUE_RECENT ? &state->recent
+            : &state->frequent, node);
+    node->queue = QUEUE_FREQUENT;
+    queue_push(&state->frequent, node);
+    return;
+}
+
+/*
+ * arc_remove - Takes a node off its queue, leaving its ghost on the
+ * matching ghost queue if it was evicted.
+ */
+void arc_remove(CacheShard *shard, CacheNode *node, int evicted)
+{
+    ArcState *state = shard->policy_state;
+
+    if (node->queue == QUEUE_RECENT) {
+        queue_unlink(&state->recent, node);
+        if (evicted) {
+            ghost_push(&state->recent_ghosts, node->hash, node->charge);
+        }
+    } else {
+        queue_unlink(&state->frequent, node);
+        if (evicted) {
+            ghost_push(&state->frequent_ghosts, node->hash, node->charge);
+        }
+    }
+    node->queue = QUEUE_NONE;
+    return;
+}
+
+/*
+ * arc_victim - Returns the oldest node on the recent queue if that queue
+ * is over its target, or the frequent queue is empty, and the oldest node
+ * on the frequent queue otherwise.
+ */
+CacheNode *arc_victim(CacheShard *shard)
+{
+    ArcState *state = shard->policy_state;
+
+    if (state->recent.count > 0 && (state->recent.bytes > state->target
+                || state->frequent.count == 0)) {
+        return state->recent.tail;
+    }
+    return state->frequent.tail;
+}
+
+/*
+ * arc_hold - Takes a node off the back of its queue. It keeps its queue,
+ * so that arc_unhold can put it back there.
+ */
+void arc_hold(CacheShard *shard, CacheNode *node)
+{
+    ArcState *state = shard->policy_state;
+
+    queue_unlink(node->queue == QUEUE_RECENT ? &state->recent
+            : &state->frequent, node);
+    return;
+}
+
+/*
+ * arc_unhold - Puts a held node back at the back of its queue.
+ */
+void arc_unhold(CacheShard *shard, CacheNode *node)
+{
+    ArcState *state = shard->policy_state;
+
+    queue_append(node->queue == QUEUE_RECENT ? &state->recent
+            : &state->frequent, node);
+    return;
+}
+
+/*
+ * End ARC Policy Functions
+ * ------------------------
+ */
+
+
+/*
+ * S3-FIFO Policy Functions
+ * ------------------------
+ */
+
+/*
+ * s3fifo_init - Creates empty queues. The small queue may hold
+ * S3FIFO_SMALL_PERCENT of the shard's budget before nodes are evicted
+ * from it, and the ghost queue remembers as many bytes of nodes as the
+ * main queue holds.
+ */
+void s3fifo_init(CacheShard *shard)
+{
+    S3State *state = Calloc(1, sizeof(S3State));
+
+    state->small_limit = shard->capacity * S3FIFO_SMALL_PERCENT / 100;
+    ghost_init(&state->ghosts, shard->capacity - state->small_limit);
+    shard->policy_state = state;
+    return;
+}
+
+/*
+ * s3fifo_destroy - Frees the ghosts and the state. The nodes belong to
+ * the cache.
+ */
+void s3fifo_destroy(CacheShard *shard)
+{
+    S3State *state = shard->policy_state;
+
+    ghost_destroy(&state->ghosts);
+    Free(state);
+    return;
+}
+
+/*
+ * s3fifo_insert - Puts a new node on the small queue, or on the main
+ * queue if it was evicted from the small queue lately and has come back.
+ */
+void s3fifo_insert(CacheShard *shard, CacheNode *node)
+{
+    S3State *state = shard->policy_state;
+
+    node->freq = 0;
+    if (ghost_take(&state->ghosts, node->hash) > 0) {
+        node->queue = QUEUE_FREQUENT;
+        queue_push(&state->main, node);
+    } else {
+        node->queue = QUEUE_RECENT;
+        queue_push(&state->small, node);
+    }
+    return;
+}
+
+/*
+ * s3fifo_hit - Counts a hit, up to S3FIFO_MAX_FREQ. The node stays where
+ * it is.
+ */
+void s3fifo_hit(CacheShard *shard, CacheNode *node)
+{
+    if (node->freq < S3FIFO_MAX_FREQ) {
+        node->freq += 1;
+    }
+    return;
+}
+
+/*
+ * s3fifo_remove - Takes a node off its queue, leaving its ghost if it was
+ * evicted from the small queue.
+ */
+void s3fifo_remove(CacheShard *shard, CacheNode *node, int evicted)
+{
+    S3State *state = shard->policy_state;
+
+    if (node->queue == QUEUE_RECENT) {
+        queue_unlink(&state->small, node);
+        if (evicted) {
+            ghost_push(&state->ghosts, node->hash, node->charge);
+        }
+    } else {
+        queue_unlink(&state->main, node);
+    }
+    node->queue = QUEUE_NONE;
+    return;
+}
+
+/*
+ * s3fifo_victim - Finds the node to evict. While the small queue is over
+ * its limit, or the main queue is empty, its oldest node is evicted unless
+ * it was hit while on it, in which case it moves to the main queue
+ * instead. Otherwise the oldest node on the main queue is evicted unless
+ * it was hit since it was last looked at, in which case its count goes
+ * down by one and it goes back to the head of the main queue. This ends,
+ * since every pass over a node lowers its count or moves it to the main
+ * queue.
+ */
+CacheNode *s3fifo_victim(CacheShard *shard)
+{
+    S3State *state = shard->policy_state;
+    CacheNode *node;
+
+    while (1) {
+        if (state->small.count > 0 && (state->small.bytes
+                    > state->small_limit || state->main.count == 0)) {
+            node = state->small.tail;
+            if (node->freq == 0) {
+                return node;
+            }
+            queue_unlink(&state->small, node);
+            node->freq = 0;
+            node->queue = QUEUE_FREQUENT;
+            queue_push(&state->main, node);
+        } else {
+            node = state->main.tail;
+            if (node->freq == 0) {
+                return node;
+            }
+            queue_unlink(&state->main, node);
+            node->freq -= 1;
+            queue_push(&state->main, node);
+        }
+    }
+}
+
+/*
+ * s3fifo_hold - Takes a node off the back of its queue. It keeps its
+ * queue, so that s3fifo_unhold can put it back there. Nodes that
+ * s3fifo_victim moved while looking for the next victim stay moved, as
+ * they would have if the held nodes had been evicted.
+ */
+void s3fifo_hold(CacheShard *shard, CacheNode *node)
+{
+    S3State *state = shard->policy_state;
+
+    queue_unlink(node->queue == QUEUE_RECENT ? &state->small
+            : &state->main, node);
+    return;
+}
+
+/*
+ * s3fifo_unhold - Puts a held node back at the back of its queue.
+ */
+void s3fifo_unhold(CacheShard *shard, CacheNode *node)
+{
+    S3State *state = shard->policy_state;
+
+    queue_append(node->queue == QUEUE_RECENT ? &state->small
+            : &state->main, node);
+    return;
+}
+
+/*
+ * End S3-FIFO Policy Functions
+ * ----------------------------
+ */
+
+
+/*
+ * GDSF Policy Functions
+ * ---------------------
+ */
+
+/*
+ * gdsf_init - Creates an empty heap and an inflation value of zero.
+ */
+void gdsf_init(CacheShard *shard)
+{
+    GdsfState *state = Malloc(sizeof(GdsfState));
+
+    state->size = CACHE_INIT_BUCKETS;
+    state->heap = Malloc(state->size * sizeof(CacheNode *));
+    state->count = 0;
+    state->inflation = 0;
+    shard->policy_state = state;
+    return;
+}
+
+/*
+ * gdsf_destroy - Frees the heap and the state. The nodes belong to the
+ * cache.
+ */
+void gdsf_destroy(CacheShard *shard)
+{
+    GdsfState *state = shard->policy_state;
+
+    Free(state->heap);
+    Free(state);
+    return;
+}
+
+/*
+ * gdsf_insert - Counts a new node's first use and puts it in the heap.
+ */
+void gdsf_insert(CacheShard *shard, CacheNode *node)
+{
+    GdsfState *state = shard->policy_state;
+
+    node->freq = 1;
+    node->priority = gdsf_priority(state, node);
+    heap_insert(state, node);
+    return;
+}
+
+/*
+ * gdsf_hit - Counts a hit and raises the node's priority to match. A
+ * priority never goes down, so the node can only sink in the heap.
+ */
+void gdsf_hit(CacheShard *shard, CacheNode *node)
+{
+    GdsfState *state = shard->policy_state;
+
+    node->freq += 1;
+    node->priority = gdsf_priority(state, node);
+    heap_down(state, node->heap_index);
+    return;
+}
+
+/*
+ * gdsf_remove - Takes a node out of the heap, filling its place with the
+ * last node. An evicted node's priority becomes the inflation value.
+ */
+void gdsf_remove(CacheShard *shard, CacheNode *node, int evicted)
+{
+    GdsfState *state = shard->policy_state;
+    size_t i = node->heap_index;
+
+    if (evicted) {
+        state->inflation = node->priority;
+    }
+    state->count -= 1;
+    if (i != state->count) {
+        state->heap[i] = state->heap[state->count];
+        state->heap[i]->heap_index = i;
+        heap_down(state, i);
+        heap_up(state, i);
+    }
+    return;
+}
+
+/*
+ * gdsf_victim - Returns the node with the least priority, the root of the
+ * heap.
+ */
+CacheNode *gdsf_victim(CacheShard *shard)
+{
+    GdsfState *state = shard->policy_state;
+
+    return state->heap[0];
+}
+
+/*
+ * gdsf_hold - Takes a node out of the heap, leaving the inflation value
+ * alone. gdsf_unhold puts it back with the priority it had.
+ */
+void gdsf_hold(CacheShard *shard, CacheNode *node)
+{
+    gdsf_remove(shard, node, 0);
+    return;
+}
+
+/*
+ * gdsf_unhold - Puts a held node back in the heap.
+ */
+void gdsf_unhold(CacheShard *shard, CacheNode *node)
+{
+    heap_insert(shard->policy_state, node);
+    return;
+}
+
+/*
+ * End GDSF Policy Functions
+ * -------------------------
+ */
+
+
+/*
+ * Policy Helper Functions
+ * -----------------------
+ */
+
+/*
+ * queue_push - Puts a node at the head of a queue.
+ */
+void queue_push(NodeQueue *queue, CacheNode *node)
+{
+    node->qprev = NULL;
+    node->qnext = queue->head;
+    if (queue->head != NULL) {
+        queue->head->qprev = node;
+    } else {
+        queue->tail = node;
+    }
+    queue->head = node;
+    queue->bytes += node->charge;
+    queue->count += 1;
+    return;
+}
+
+/*
+ * queue_unlink - Takes a node off a queue, wherever it is on it.
+ */
+void queue_unlink(NodeQueue *queue, CacheNode *node)
+{
+    if (node->qprev != NULL) {
+        node->qprev->qnext = node->qnext;
+    } else {
+        queue->head = node->qnext;
+    }
+    if (node->qnext != NULL) {
+        node->qnext->qprev = node->qprev;
+    } else {
+        queue->tail = node->qprev;
+    }
+    queue->bytes -= node->charge;
+    queue->count -= 1;
+    return;
+}
+
+/*
+ * queue_append - Puts a node at the tail of a queue.
+ */
+void queue_append(NodeQueue *queue, CacheNode *node)
+{
+    node->qnext = NULL;
+    node->qprev = queue->tail;
+    if (queue->tail != NULL) {
+        queue->tail->qnext = node;
+    } else {
+        queue->head = node;
+    }
+    queue->tail = node;
+    queue->bytes += node->charge;
+    queue->count += 1;
+    return;
+}
+
+/*
+ * ghost_init - Creates an empty queue of ghosts that remembers up to
+ * limit bytes of evicted objects.
+ */
+void ghost_init(GhostQueue *ghosts, size_t limit)
+{
+    memset(ghosts, 0, sizeof(GhostQueue));
+    ghosts->limit = limit;
+    return;
+}
+
+/*
+ * ghost_destroy - Frees every ghost on a queue.
+ */
+void ghost_destroy(GhostQueue *ghosts)
+{
+    while (ghosts->head != NULL) {
+        ghost_drop(ghosts, ghosts->head);
+    }
+    return;
+}
+
+/*
+ * ghost_push - Remembers an evicted object at the head of a queue of
+ * ghosts, forgetting the oldest ghosts until the queue is within its
+ * limit again.
+ */
+void ghost_push(GhostQueue *ghosts, uint64_t hash, size_t charge)
+{
+    Ghost *ghost = Malloc(sizeof(Ghost));
+    Ghost **bucket = &ghosts->buckets[hash & (GHOST_BUCKETS - 1)];
+
+    ghost->hash = hash;
+    ghost->charge = charge;
+    ghost->prev = NULL;
+    ghost->next = ghosts->head;
+    if (ghosts->head != NULL) {
+        ghosts->head->prev = ghost;
+    } else {
+        ghosts->tail = ghost;
+    }
+    ghosts->head = ghost;
+    ghost->hash_next = *bucket;
+    *bucket = ghost;
+    ghosts->bytes += charge;
+
+    while (ghosts->bytes > ghosts->limit) {
+        ghost_drop(ghosts, ghosts->tail);
+    }
+    return;
+}
+
+/*
+ * ghost_take - Looks for the ghost of a URI on a queue, and forgets it if
+ * it is there.
+ *
+ * Return value:
+ *  - the charge of the object the ghost remembered, or 0 if there was no
+ *    ghost of the URI
+ */
+size_t ghost_take(GhostQueue *ghosts, uint64_t hash)
+{
+    Ghost *ghost = ghosts->buckets[hash & (GHOST_BUCKETS - 1)];
+    size_t charge;
+
+    for ( ; ghost != NULL; ghost = ghost->hash_next) {
+        if (ghost->hash == hash) {
+            charge = ghost->charge;
+            ghost_drop(ghosts, ghost);
+            return charge;
+        }
+    }
+    return 0;
+}
+
+/*
+ * ghost_drop - Unlinks a ghost from its queue and hash chain, and frees
+ * it.
+ */
+void ghost_drop(GhostQueue *ghosts, Ghost *ghost)
+{
+    Ghost **link = &ghosts->buckets[ghost->hash & (GHOST_BUCKETS - 1)];
+
+    while (*link != ghost) {
+        link = &(*link)->hash_next;
+    }
+    *link = ghost->hash_next;
+
+    if (ghost->prev != NULL) {
+        ghost->prev->next = ghost->next;
+    } else {
+        ghosts->head = ghost->next;
+    }
+    if (ghost->next != NULL) {
+        ghost->next->prev = ghost->prev;
+    } else {
+        ghosts->tail = ghost->prev;
+    }
+    ghosts->bytes -= ghost->charge;
+    Free(ghost);
+    return;
+}
+
+/*
+ * gdsf_priority - Returns a node's priority: the inflation value, plus
+ * its hits per byte.
+ */
+double gdsf_priority(GdsfState *state, CacheNode *node)
+{
+    return state->inflation + (double)node->freq / node->charge;
+}
+
+/*
+ * heap_insert - Puts a node in the heap, with the priority it already
+ * has. The heap grows when it is full.
+ */
+void heap_insert(GdsfState *state, CacheNode *node)
+{
+    if (state->count == state->size) {
+        state->size *= 2;
+        state->heap = Realloc(state->heap,
+                state->size * sizeof(CacheNode *));
+    }
+    node->heap_index = state->count;
+    state->heap[state->count] = node;
+    state->count += 1;
+    heap_up(state, node->heap_index);
+    return;
+}
+
+/*
+ * heap_swap - Swaps two nodes in the heap, keeping their indexes right.
+ */
+void heap_swap(GdsfState *state, size_t i, size_t j)
+{
+    CacheNode *node = state->heap[i];
+
+    state->heap[i] = state->heap[j];
+    state->heap[j] = node;
+    state->heap[i]->heap_index = i;
+    state->heap[j]->heap_index = j;
+    return;
+}
+
+/*
+ * heap_up - Moves the node at i up the heap until its parent's priority
+ * is no greater than its own.
+ */
+void heap_up(GdsfState *state, size_t i)
+{
+    size_t parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (state->heap[parent]->priority <= state->heap[i]->priority) {
+            break;
+        }
+        heap_swap(state, i, parent);
+        i = parent;
+    }
+    return;
+}
+
+/*
+ * heap_down - Moves the node at i down the heap until neither child's
+ * priority is less than its own.
+ */
+void heap_down(GdsfState *state, size_t i)
+{
+    size_t child;
+
+    while ((child = 2 * i + 1) < state->count) {
+        if (child + 1 < state->count && state->heap[child + 1]->priority
+                < state->heap[child]->priority) {
+            child += 1;
+        }
+        if (state->heap[i]->priority <= state->heap[child]->priority) {
+            break;
+        }
+        heap_swap(state, i, child);
+        i = child;
+    }
+    return;
+}
+
+/*
+ * End Policy Helper Functions
+ * ---------------------------
+ */
@@ -0,0 +1,209 @@
+/*
+ * policy.h
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This is the header file for policy.c, which contains
+ * the eviction policies a cache shard can use to pick what to evict. This
+ * file just has the relevant macros, structure definitions, and function
+ * prototypes.
+ *
+ */
+
+/* Include guards */
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+#include <stdint.h>
+
+#include "csapp.h"
+
+/* Macros */
+#define GHOST_BUCKETS 256        /* Hash chains in a queue of ghosts */
+#define S3FIFO_SMALL_PERCENT 10  /* Share of the budget for the small queue
+                                    of new objects */
+#define S3FIFO_MAX_FREQ 3        /* Hit counts saturate here */
+
+/* Which of a policy's queues a node is on */
+#define QUEUE_NONE 0             /* Not on a queue */
+#define QUEUE_RECENT 1           /* ARC's T1, S3-FIFO's small queue */
+#define QUEUE_FREQUENT 2         /* ARC's T2, S3-FIFO's main queue */
+
+struct CacheShard;
+struct CacheNode;
+
+/*
+ * Defines an eviction policy. The cache keeps every shard's recency list
+ * and hash index itself, and tells the policy about each node it adds,
+ * hits and removes; the policy keeps whatever order it needs in the
+ * node's policy fields and its own state, and picks the node to evict
+ * when the shard is full. Every function is called with the shard locked
+ * for writing. To let the cache weigh the nodes it would evict before
+ * evicting any, the policy can hold nodes out of its order and put them
+ * back. Lookups buffer their hits, so hit is called some time
+ * after the lookup, when the buffer is drained, and may miss a hit that
+ * was dropped from a busy buffer.
+ */
+typedef struct CachePolicy {
+    const char *name;            /* Name the policy is selected by */
+    /* Creates the policy's state in shard->policy_state */
+    void (*init)(struct CacheShard *shard);
+    /* Frees it */
+    void (*destroy)(struct CacheShard *shard);
+    /* A node was added to the shard */
+    void (*insert)(struct CacheShard *shard, struct CacheNode *node);
+    /* A lookup found the node */
+    void (*hit)(struct CacheShard *shard, struct CacheNode *node);
+    /* The node is leaving the shard, evicted or replaced */
+    void (*remove)(struct CacheShard *shard, struct CacheNode *node,
+            int evicted);
+    /* Returns the node to evict next, which is still in the shard */
+    struct CacheNode *(*victim)(struct CacheShard *shard);
+    /* Takes the node victim returned out of the policy's order, without
+       removing it, so that victim returns the one after it */
+    void (*hold)(struct CacheShard *shard, struct CacheNode *node);
+    /* Puts a held node back where it was; held nodes are put back in the
+       reverse of the order they were held in */
+    void (*unhold)(struct CacheShard *shard, struct CacheNode *node);
+} CachePolicy;
+
+/*
+ * A queue of nodes, linked through their qnext and qprev fields, newest
+ * at the head and oldest at the tail.
+ */
+typedef struct NodeQueue {
+    struct CacheNode *head;      /* Newest node */
+    struct CacheNode *tail;      /* Oldest node */
+    size_t bytes;                /* Sum of charge over the nodes */
+    size_t count;                /* Number of nodes */
+} NodeQueue;
+
+/*
+ * A ghost: the memory of a recently evicted object, which keeps only its
+ * URI's hash and its charge.
+ */
+typedef struct Ghost {
+    uint64_t hash;               /* Hash of the evicted object's URI */
+    size_t charge;               /* Bytes it was charged */
+    struct Ghost *next;          /* Next older ghost */
+    struct Ghost *prev;          /* Next newer ghost */
+    struct Ghost *hash_next;     /* Next ghost in the same hash chain */
+} Ghost;
+
+/*
+ * A queue of ghosts, newest at the head, bounded by the sum of their
+ * charges, and hashed so that a URI can be looked for quickly.
+ */
+typedef struct GhostQueue {
+    Ghost *head;                 /* Newest ghost */
+    Ghost *tail;                 /* Oldest ghost */
+    size_t bytes;                /* Sum of charge over the ghosts */
+    size_t limit;                /* Oldest ghosts are dropped past this */
+    Ghost *buckets[GHOST_BUCKETS]; /* Ghosts chained by hash */
+} GhostQueue;
+
+/*
+ * State of ARC in one shard. Nodes seen once lately are on recent (T1)
+ * and nodes seen more often on frequent (T2); the ghosts of nodes evicted
+ * from each are on recent_ghosts (B1) and frequent_ghosts (B2). target is
+ * the share of the budget, in bytes, ARC currently wants recent to have.
+ */
+typedef struct ArcState {
+    NodeQueue recent;            /* T1 */
+    NodeQueue frequent;          /* T2 */
+    GhostQueue recent_ghosts;    /* B1 */
+    GhostQueue frequent_ghosts;  /* B2 */
+    size_t target;               /* Bytes wanted on recent */
+} ArcState;
+
+/*
+ * State of S3-FIFO in one shard: a small FIFO queue that new nodes go on,
+ * a main FIFO queue for nodes hit while on it, and the ghosts of nodes
+ * evicted from the small queue, which go straight to the main queue when
+ * they come back.
+ */
+typedef struct S3State {
+    NodeQueue small;             /* New nodes */
+    NodeQueue main;              /* Nodes that proved popular */
+    GhostQueue ghosts;           /* Nodes evicted from small */
+    size_t small_limit;          /* Bytes small may hold before it is
+                                    evicted from */
+} S3State;
+
+/*
+ * State of GreedyDual-Size-Frequency in one shard: a binary min-heap of
+ * nodes by priority, and the inflation value, which is the priority of
+ * the last node evicted.
+ */
+typedef struct GdsfState {
+    struct CacheNode **heap;     /* Nodes, least priority first */
+    size_t count;                /* Number of nodes in the heap */
+    size_t size;                 /* Slots allocated in heap */
+    double inflation;            /* Priority of the last evicted node */
+} GdsfState;
+
+/* The policies */
+extern const CachePolicy lru_policy;
+extern const CachePolicy arc_policy;
+extern const CachePolicy s3fifo_policy;
+extern const CachePolicy gdsf_policy;
+
+/* Main Policy Function Prototypes */
+const CachePolicy *policy_find(const char *name);
+/* LRU Policy Functions */
+void lru_init(struct CacheShard *shard);
+void lru_destroy(struct CacheShard *shard);
+void lru_insert(struct CacheShard *shard, struct CacheNode *node);
+void lru_hit(struct CacheShard *shard, struct CacheNode *node);
+void lru_remove(struct CacheShard *shard, struct CacheNode *node,
+        int evicted);
+struct CacheNode *lru_victim(struct CacheShard *shard);
+void lru_hold(struct CacheShard *shard, struct CacheNode *node);
+void lru_unhold(struct CacheShard *shard, struct CacheNode *node);
+/* ARC Policy Functions */
+void arc_init(struct CacheShard *shard);
+void arc_destroy(struct CacheShard *shard);
+void arc_insert(struct CacheShard *shard, struct CacheNode *node);
+void arc_hit(struct CacheShard *shard, struct CacheNode *node);
+void arc_remove(struct CacheShard *shard, struct CacheNode *node,
+        int evicted);
+struct CacheNode *arc_victim(struct CacheShard *shard);
+void arc_hold(struct CacheShard *shard, struct CacheNode *node);
+void arc_unhold(struct CacheShard *shard, struct CacheNode *node);
+/* S3-FIFO Policy Functions */
+void s3fifo_init(struct CacheShard *shard);
+void s3fifo_destroy(struct CacheShard *shard);
+void s3fifo_insert(struct CacheShard *shard, struct CacheNode *node);
+void s3fifo_hit(struct CacheShard *shard, struct CacheNode *node);
+void s3fifo_remove(struct CacheShard *shard, struct CacheNode *node,
+        int evicted);
+struct CacheNode *s3fifo_victim(struct CacheShard *shard);
+void s3fifo_hold(struct CacheShard *shard, struct CacheNode *node);
+void s3fifo_unhold(struct CacheShard *shard, struct CacheNode *node);
+/* GDSF Policy Functions */
+void gdsf_init(struct CacheShard *shard);
+void gdsf_destroy(struct CacheShard *shard);
+void gdsf_insert(struct CacheShard *shard, struct CacheNode *node);
+void gdsf_hit(struct CacheShard *shard, struct CacheNode *node);
+void gdsf_remove(struct CacheShard *shard, struct CacheNode *node,
+        int evicted);
+struct CacheNode *gdsf_victim(struct CacheShard *shard);
+void gdsf_hold(struct CacheShard *shard, struct CacheNode *node);
+void gdsf_unhold(struct CacheShard *shard, struct CacheNode *node);
+/* Policy Helper Functions */
+void queue_push(NodeQueue *queue, struct CacheNode *node);
+void queue_unlink(NodeQueue *queue, struct CacheNode *node);
+void queue_append(NodeQueue *queue, struct CacheNode *node);
+void ghost_init(GhostQueue *ghosts, size_t limit);
+void ghost_destroy(GhostQueue *ghosts);
+void ghost_push(GhostQueue *ghosts, uint64_t hash, size_t charge);
+size_t ghost_take(GhostQueue *ghosts, uint64_t hash);
+void ghost_drop(GhostQueue *ghosts, Ghost *ghost);
+double gdsf_priority(GdsfState *state, struct CacheNode *node);
+void heap_insert(GdsfState *state, struct CacheNode *node);
+void heap_swap(GdsfState *state, size_t i, size_t j);
+void heap_up(GdsfState *state, size_t i);
+void heap_down(GdsfState *state, size_t i);
+
+#endif
@@ -0,0 +1,209 @@
+/*
+ * pool.c
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This file contains the implementation of a fixed-size
+ * pool of worker threads. The workers are created once, up front, and each
+ * one repeatedly takes an accepted connection off a bounded queue and
+ * passes it to the pool's handler. This caps the number of threads the
+ * proxy runs no matter how many connections arrive at once, and avoids
+ * paying for thread creation on every request. When the queue is full,
+ * the pool either makes the submitter wait or refuses the connection,
+ * depending on how it was configured. The pool also records how long
+ * connections wait in the queue before a worker picks them up.
+ *
+ */
+
+#include "pool.h"
+
+/*
+ * Main Pool Functions
+ * -------------------
+ */
+
+/*
+ * pool_init - This function creates the queue and starts the workers.
+ *
+ * Parameters:
+ *  - nworkers: number of worker threads to start
+ *  - depth: number of connections that may wait in the queue
+ *  - overflow: POOL_BLOCK or POOL_REJECT, what to do when the queue is full
+ *  - handler: function that serves one connection; the pool closes the
+ *             connection after the handler returns
+ * Return value:
+ *  - pool: a pointer to the running pool
+ */
+ThreadPool *pool_init(int nworkers, int depth, int overflow,
+        void (*handler)(int connfd))
+{
+    ThreadPool *pool = Malloc(sizeof(ThreadPool));
+    int i;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+    pool->jobs = Malloc(depth * sizeof(PoolJob));
+    pool->depth = depth;
+    pool->head = 0;
+    pool->count = 0;
+    pool->overflow = overflow;
+    pool->nworkers = nworkers;
+    pool->workers = Malloc(nworkers * sizeof(pthread_t));
+    pool->handler = handler;
+    pool->served = 0;
+    pool->rejected = 0;
+    pool->peak_queued = 0;
+    pool->total_wait_ns = 0;
+    pool->max_wait_ns = 0;
+
+    for (i = 0; i < nworkers; i++) {
+        Pthread_create(&pool->workers[i], NULL, pool_worker, pool);
+    }
+
+    return pool;
+}
+
+/*
+ * pool_submit - This function queues an accepted connection for the
+ * workers. If the queue is full, it either waits for a free slot or
+ * refuses the connection, depending on the pool's overflow setting.
+ *
+ * Parameters:
+ *  - pool: the pool
+ *  - connfd: the accepted client connection
+ * Return value:
+ *  - 0: the connection was queued and now belongs to the pool
+ *  - -1: the queue was full and the connection was refused; the caller
+ *        still owns connfd
+ */
+int pool_submit(ThreadPool *pool, int connfd)
+{
+    PoolJob *job;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->count == pool->depth && pool->overflow == POOL_REJECT) {
+        pool->rejected += 1;
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    while (pool->count == pool->depth) {
+        pthread_cond_wait(&pool->not_full, &pool->lock);
+    }
+
+    /* Append the job at the tail of the circular queue */
+    job = &pool->jobs[(pool->head + pool->count) % pool->depth];
+    job->connfd = connfd;
+    clock_gettime(CLOCK_MONOTONIC, &job->queued_at);
+    pool->count += 1;
+    if ((size_t)pool->count > pool->peak_queued) {
+        pool->peak_queued = pool->count;
+    }
+
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/*
+ * pool_get_stats - This function copies the pool's counters into stats.
+ *
+ * Parameters:
+ *  - pool: the pool to report on
+ *  - stats: filled with the current counters
+ */
+void pool_get_stats(ThreadPool *pool, PoolStats *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    stats->queued = pool->count;
+    stats->peak_queued = pool->peak_queued;
+    stats->served = pool->served;
+    stats->rejected = pool->rejected;
+    stats->mean_wait_ns = pool->served ?
+        pool->total_wait_ns / pool->served : 0;
+    stats->max_wait_ns = pool->max_wait_ns;
+
+    pthread_mutex_unlock(&pool->lock);
+    return;
+}
+
+/*
+ * End Main Pool Functions
+ * -----------------------
+ */
+
+
+/*
+ * Pool Helper Functions
+ * ---------------------
+ */
+
+/*
+ * pool_worker - This is the body of every worker thread. It takes the
+ * oldest job off the queue, records how long the job waited, serves the
+ * connection with the pool's handler and closes it, forever.
+ *
+ * Parameter:
+ *  - vargp: the pool
+ * Return value:
+ *  - never returns
+ */
+void *pool_worker(void *vargp)
+{
+    ThreadPool *pool = vargp;
+    PoolJob job;
+    double wait_ns;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0) {
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        }
+
+        /* Take the job at the head of the circular queue */
+        job = pool->jobs[pool->head];
+        pool->head = (pool->head + 1) % pool->depth;
+        pool->count -= 1;
+
+        wait_ns = elapsed_ns(&job.queued_at);
+        pool->served += 1;
+        pool->total_wait_ns += wait_ns;
+        if (wait_ns > pool->max_wait_ns) {
+            pool->max_wait_ns = wait_ns;
+        }
+
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->handler(job.connfd);
+        Close(job.connfd);
+    }
+
+    return NULL;
+}
+
+/*
+ * elapsed_ns - Returns the nanoseconds elapsed on the monotonic clock
+ * since a given time.
+ *
+ * Parameter:
+ *  - since: the earlier time
+ * Return value:
+ *  - nanoseconds from since until now
+ */
+double elapsed_ns(struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1e9
+        + (now.tv_nsec - since->tv_nsec);
+}
+
+/*
+ * End Pool Helper Functions
+ * -------------------------
+ */
@@ -0,0 +1,82 @@
+/*
+ * pool.h
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This is the header file for pool.c, which contains
+ * a fixed-size pool of worker threads fed by a bounded queue of client
+ * connections. This file just has the relevant macros, structure
+ * definitions, and function prototypes.
+ *
+ */
+
+/* Include guards */
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <time.h>
+
+#include "csapp.h"
+
+/* Macros */
+#define POOL_DEFAULT_WORKERS 32  /* Default number of worker threads */
+#define POOL_DEFAULT_DEPTH   256 /* Default number of queued connections */
+
+/* What pool_submit does when the queue is full */
+#define POOL_BLOCK  0            /* Wait for a worker to free a slot */
+#define POOL_REJECT 1            /* Refuse the connection right away */
+
+/*
+ * One accepted connection waiting in the queue.
+ */
+typedef struct PoolJob {
+    int connfd;                  /* The client connection */
+    struct timespec queued_at;   /* When it was submitted */
+} PoolJob;
+
+/*
+ * Defines the pool: its workers and the circular queue of connections
+ * they take work from. Everything is protected by lock.
+ */
+typedef struct ThreadPool {
+    pthread_mutex_t lock;        /* Protects the queue and the counters */
+    pthread_cond_t not_empty;    /* Signaled when a job is queued */
+    pthread_cond_t not_full;     /* Signaled when a job is dequeued */
+    PoolJob *jobs;               /* Circular queue of depth slots */
+    int depth;                   /* Capacity of the queue */
+    int head;                    /* Index of the oldest queued job */
+    int count;                   /* Number of queued jobs */
+    int overflow;                /* POOL_BLOCK or POOL_REJECT */
+    int nworkers;                /* Number of worker threads */
+    pthread_t *workers;          /* The worker threads */
+    void (*handler)(int connfd); /* Serves one connection */
+    unsigned long served;        /* Jobs taken by workers */
+    unsigned long rejected;      /* Connections refused when full */
+    size_t peak_queued;          /* High-water mark of count */
+    double total_wait_ns;        /* Sum of queue wait over served jobs */
+    double max_wait_ns;          /* Longest queue wait seen */
+} ThreadPool;
+
+/*
+ * A snapshot of the pool's counters, for monitoring.
+ */
+typedef struct PoolStats {
+    int queued;                  /* Jobs waiting right now */
+    size_t peak_queued;          /* Most jobs ever waiting at once */
+    unsigned long served;        /* Jobs taken by workers */
+    unsigned long rejected;      /* Connections refused when full */
+    double mean_wait_ns;         /* Mean time a served job waited */
+    double max_wait_ns;          /* Longest time a served job waited */
+} PoolStats;
+
+/* Main Pool Function Prototypes */
+ThreadPool *pool_init(int nworkers, int depth, int overflow,
+        void (*handler)(int connfd));
+int pool_submit(ThreadPool *pool, int connfd);
+void pool_get_stats(ThreadPool *pool, PoolStats *stats);
+/* Pool Helper Functions */
+void *pool_worker(void *vargp);
+double elapsed_ns(struct timespec *since);
+
+#endif
@@ -10,48 +10,77 @@
  * HTTP request. If this is a GET request, the proxy acts as a client and 
  * connects to the appropriate web server based on the URI in the request.
  * It forwards the request to the server and forwards the subsequent response
- * to the browser. This proxy uses a concurrency model based on threads: it
- * creates a new thread for each new request that is received from a client.
+ * to the browser. This proxy uses a concurrency model based on threads: a
+ * fixed pool of worker threads takes accepted connections off a bounded
+ * queue, and each worker serves one client connection at a time. With -e,
+ * the event-driven engine in event.c serves connections instead.
+ * Browsers may keep their connection open and send more requests on it;
+ * each response is framed with Content-Length or chunked coding so the
+ * browser knows where it ends, and idle or long-used connections are
+ * closed.
  * The proxy also utilizes a web cache to speed up web object access. It 
  * caches web objects within a certain size limit as it forwards the server
- * response to the client, and it does a cache lookup as soon as is gets the
- * server URI from the GET request. If the web object is cached, the proxy 
+ * response to the client, and it does a cache lookup as soon as it has read
+ * the GET request. If the web object is cached, the proxy 
  * simply forwards the object to the client and does not need to make a 
  * connection to a web server.
  *
  */
 
 #include <stdio.h>
-#include <assert.h>
+#include <poll.h>
+#include <netinet/tcp.h>
 
 #include "csapp.h"
 #include "cache.h"
-
-/* Macros */
-#define DEFAULT_CLIENT_PORT 80  /* If a port is not specified in
-                                   the URI, this is the default port
-                                   the proxy tries to connect to on
-                                   the web server. */
+#include "http.h"
+#include "pool.h"
+#include "upstream.h"
+#include "dns.h"
+#include "connect.h"
+#include "relay.h"
+#include "disk.h"
+#include "snapshot.h"
+#include "flight.h"
+#include "refresh.h"
+#include "trace.h"
+#include "event.h"
 
 /* Global Variables */
-/* You won't lose style points for including these long lines in your code */
-static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
-static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
-pthread_rwlock_t cache_lock; /* Read/Write lock for web cache */
+static const char *busy_response = "HTTP/1.0 503 Service Unavailable\r\nContent-Type: text/plain\r\nContent-Length: 20\r\nConnection: close\r\n\r\nProxy is overloaded\n";
 Cache *cache;                /* Cache for web objects */
+ThreadPool *pool;            /* Workers that serve client connections */
+EventEngine *engine;         /* Event loops, used instead of the pool */
+UpstreamPool *upstream;      /* Idle connections to web servers */
+DnsCache *dns;               /* Addresses of web servers */
+DiskCache *disk;             /* Objects evicted from cache, if enabled */
+char *snapshot_path;         /* Where the cache is saved, if anywhere */
+FlightTable *flights;        /* Fetches in flight, NULL if concurrent
+                                misses are not collapsed */
+RefreshPool *refresh;        /* Background refreshes, NULL if stale
+                                objects are never served */
+Trace *trace;                /* Trace of requests served, if recording */
+int idle_timeout = KEEPALIVE_TIMEOUT; /* Seconds a browser may be idle */
+int max_requests = KEEPALIVE_MAX;     /* Requests per browser connection */
+int connect_timeout = RACE_DEFAULT_TIMEOUT; /* Milliseconds to connect to
+                                               a web server */
 
 /* 
  * Function Prototypes 
  */
 /* Main proxy functions */
-void *thread(void *connfdp);
+void usage(char *prog);
+void *signal_thread(void *vargp);
+void print_stats(void);
 void doit(int connfd);
-int handle_request(int fd, char *host, char *uri, int *client_port, 
-        int *clientfd); 
-void get_response(int clientfd, int connfd, char *uri);
-void read_requesthdrs(rio_t *rp, char *host_hdr, int clientfd); 
-void parse_uri(char *uri, char *hostname, char *path, int *client_port); 
+int wait_readable(int fd, int timeout);
+int handle_request(rio_t *rio, int connfd, int may_keep_alive); 
+int get_response(int clientfd, int connfd, char *uri, int keep_alive, 
+        int http11, int *reuse, Flight **flight, CacheNode *stale);
+int serve_hit(int connfd, CacheNode *node, int keep_alive, int http11);
+int serve_disk_hit(int connfd, DiskObject *obj, int keep_alive, int http11);
+void read_requesthdrs(rio_t *rp, char *host_hdr, Buf *request, 
+        int *keep_alive); 
 /* Warning wrapper functions */
 ssize_t Rio_writen_w(int fd, void *usrbuf, size_t n);
 ssize_t Rio_readlineb_w(rio_t *rp, void *usrbuf, size_t maxlen);
@@ -69,6 +98,55 @@ int Open_clientfd_w(char *hostname, int port);
  * main - The proxy's main routine. It performs all the necessary 
  * initializations and then enter an infinite server loop.
  *
+ * Options:
+ *  - -s shards: number of independently locked cache shards (default: 
+ *               one per core)
+ *  - -P policy: how the cache picks objects to evict: lru, arc, s3fifo
+ *               or gdsf (default: lru)
+ *  - -a: only add an object to a full cache if it has lately been
+ *        requested more often than the objects it would evict (TinyLFU
+ *        admission), so that URIs requested once do not flush the cache
+ *  - -t threads: number of worker threads (default: POOL_DEFAULT_WORKERS),
+ *                or of event loops with -e (default: one per core)
+ *  - -q depth: number of accepted connections that may wait for a worker
+ *              (default: POOL_DEFAULT_DEPTH)
+ *  - -r: when the queue is full, answer new connections with a 503 
+ *        instead of waiting for a worker to free up
+ *  - -e: serve connections with the event-driven engine, where each
+ *        thread runs an epoll loop driving many non-blocking connections,
+ *        instead of with the worker pool
+ *  - -k seconds: how long a browser's connection may sit idle between
+ *                requests before it is closed (default: KEEPALIVE_TIMEOUT)
+ *  - -m requests: most requests served on one browser connection
+ *                 (default: KEEPALIVE_MAX)
+ *  - -u conns: most idle connections kept open to each web server for
+ *              reuse, 0 to close every one (default: UPSTREAM_DEFAULT_IDLE)
+ *  - -d seconds: how long a web server's addresses are cached, 0 to look
+ *                the name up for every connection (default: DNS_DEFAULT_TTL)
+ *  - -c ms: milliseconds allowed to connect to a web server, across all
+ *           of its addresses (default: RACE_DEFAULT_TIMEOUT)
+ *  - -D dir: keep objects evicted from the cache in segment files in dir,
+ *            and serve later requests for them from there (default: no
+ *            disk cache)
+ *  - -B megabytes: most space the disk cache may use (default: 
+ *                  DISK_DEFAULT_BUDGET)
+ *  - -S file: load the cache from the snapshot in file at startup, and
+ *             save it there on SIGUSR2 and when stopped with SIGTERM or
+ *             SIGINT (default: start empty and save nothing)
+ *  - -w ms: how long a request that misses waits for a fetch of the same
+ *           URI already in flight, 0 to never wait (default: 
+ *           FLIGHT_DEFAULT_TIMEOUT)
+ *  - -R threads: number of threads that refresh stale objects in the
+ *                background while they are served under
+ *                stale-while-revalidate, 0 to always revalidate them
+ *                before answering (default: REFRESH_DEFAULT_WORKERS)
+ *  - -T file: append a line to file for every GET answered, with its
+ *             URI and response size, for the cache simulator to replay
+ *             (default: record nothing)
+ *
+ * Sending the proxy SIGUSR1 prints its cache, disk cache, upstream 
+ * connection, DNS and worker pool (or event loop) statistics to stderr.
+ *
  * Parameters:
  *  - argc: the number of commandline arguments given to main
  *  - argv: the array of commandline arguments
@@ -79,97 +157,419 @@ int Open_clientfd_w(char *hostname, int port);
 int main(int argc, char **argv) 
 {
     int listenfd;
-    int *connfdp;
+    int connfd;
     int listen_port;
     socklen_t clientlen;
     struct sockaddr_in clientaddr;
     pthread_t tid;
+    sigset_t signal_mask;
+    long loaded;
+    int nshards = 0;
+    int nthreads = 0;
+    int event_mode = 0;
+    int admission = 0;
+    char *policy = "lru";
+    int max_idle = UPSTREAM_DEFAULT_IDLE;
+    int dns_ttl = DNS_DEFAULT_TTL;
+    char *disk_dir = NULL;
+    long disk_budget = DISK_DEFAULT_BUDGET;
+    int flight_timeout = FLIGHT_DEFAULT_TIMEOUT;
+    int refresh_workers = REFRESH_DEFAULT_WORKERS;
+    char *trace_path = NULL;
+    int depth = POOL_DEFAULT_DEPTH;
+    int overflow = POOL_BLOCK;
+    const char *options = "s:P:at:q:rek:m:u:d:c:D:B:S:w:R:T:";
+    int opt;
+
+    /* Check command line args */
+    while ((opt = getopt(argc, argv, options)) != -1) {
+        switch (opt) {
+        case 's':
+            nshards = atoi(optarg);
+            break;
+        case 'P':
+            policy = optarg;
+            break;
+        case 'a':
+            admission = 1;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'q':
+            depth = atoi(optarg);
+            break;
+        case 'r':
+            overflow = POOL_REJECT;
+            break;
+        case 'e':
+            event_mode = 1;
+            break;
+        case 'k':
+            idle_timeout = atoi(optarg);
+            break;
+        case 'm':
+            max_requests = atoi(optarg);
+            break;
+        case 'u':
+            max_idle = atoi(optarg);
+            break;
+        case 'd':
+            dns_ttl = atoi(optarg);
+            break;
+        case 'c':
+            connect_timeout = atoi(optarg);
+            break;
+        case 'D':
+            disk_dir = optarg;
+            break;
+        case 'B':
+            disk_budget = atol(optarg);
+            break;
+        case 'S':
+            snapshot_path = optarg;
+            break;
+        case 'w':
+            flight_timeout = atoi(optarg);
+            break;
+        case 'R':
+            refresh_workers = atoi(optarg);
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || nthreads < 0 || depth < 1
+            || idle_timeout < 0 || max_requests < 1 || max_idle < 0
+            || dns_ttl < 0 || connect_timeout < 1 || disk_budget < 1
+            || flight_timeout < 0 || refresh_workers < 0) {
+        usage(argv[0]);
+    }
 
     /* Handle SIGPIPE */
     Signal(SIGPIPE, SIG_IGN);
 
+    /* 
+     * Block SIGUSR1, and the signals that save a snapshot or stop the
+     * proxy cleanly, in every thread, so that only the signal thread
+     * receives them, with sigwait.
+     */
+    Sigemptyset(&signal_mask);
+    Sigaddset(&signal_mask, SIGUSR1);
+    if (snapshot_path != NULL) {
+        Sigaddset(&signal_mask, SIGUSR2);
+    }
+    if (snapshot_path != NULL || trace_path != NULL) {
+        Sigaddset(&signal_mask, SIGTERM);
+        Sigaddset(&signal_mask, SIGINT);
+    }
+    pthread_sigmask(SIG_BLOCK, &signal_mask, NULL);
+
     /* Initialize web cache */
-    cache = cache_init();
+    cache = cache_init(MAX_CACHE_SIZE, nshards);
+    if (cache_set_policy(cache, policy) < 0) {
+        fprintf(stderr, "Unknown eviction policy %s\n", policy);
+        usage(argv[0]);
+    }
 
-    /* Initialize cache read/write lock */
-    Pthread_rwlock_init(&cache_lock, NULL);
+    /* Warm it up from the last snapshot, before taking any requests */
+    if (snapshot_path != NULL
+            && (loaded = snapshot_load(cache, snapshot_path)) > 0) {
+        fprintf(stderr, "Loaded %ld objects from %s\n", loaded,
+                snapshot_path);
+    }
 
-    /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    /* Turn away new objects less popular than the ones they would evict */
+    if (admission) {
+        cache_set_admit(cache);
+    }
+
+    /* Keep what the cache evicts on disk, if asked to */
+    if (disk_dir != NULL 
+            && (disk = disk_init(cache, disk_dir, 
+                    (size_t)disk_budget * 1024 * 1024)) == NULL) {
+        exit(1);
+    }
+
+    /* Collapse concurrent misses on the same URI into one fetch */
+    if (flight_timeout > 0) {
+        flights = flight_init(flight_timeout);
+    }
+
+    /* Keep connections to web servers for reuse */
+    upstream = upstream_init(max_idle, UPSTREAM_IDLE_TIMEOUT);
+
+    /* Remember where web servers are */
+    dns = dns_init(dns_ttl, DNS_NEGATIVE_TTL, NULL);
+
+    /* Record the requests served, if asked to */
+    if (trace_path != NULL && (trace = trace_open(trace_path)) == NULL) {
         exit(1);
     }
 
+    /* Refresh stale objects in the background while they are served */
+    if (refresh_workers > 0) {
+        refresh = refresh_init(refresh_workers, cache, upstream, dns,
+                flights, connect_timeout);
+    }
+
     /* Open a port and listen for client connections */
-    listen_port = atoi(argv[1]);
+    listen_port = atoi(argv[optind]);
     listenfd = Open_listenfd(listen_port);
 
+    if (event_mode) {
+        /* Run one event loop per core unless told otherwise */
+        if (nthreads == 0) {
+            nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        engine = event_init(listenfd, nthreads < 1 ? 1 : nthreads, cache,
+                disk, flights, refresh, upstream, dns, trace, idle_timeout, 
+                max_requests, connect_timeout);
+        Pthread_create(&tid, NULL, signal_thread, &signal_mask);
+        event_run(engine);
+        return 0;
+    }
+
+    /* Start the workers and the signal thread */
+    if (nthreads == 0) {
+        nthreads = POOL_DEFAULT_WORKERS;
+    }
+    pool = pool_init(nthreads, depth, overflow, doit);
+    Pthread_create(&tid, NULL, signal_thread, &signal_mask);
+
     /* Infinite server loop */
     while (1) {
-        /* Accept a connection and create a new thread for the request */
+        /* Accept a connection and hand it to the worker pool */
         clientlen = sizeof(clientaddr);
-        connfdp = Malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        Pthread_create(&tid, NULL, thread, connfdp);
+        connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        if (pool_submit(pool, connfd) < 0) {
+            /* Every worker is busy and the queue is full */
+            Rio_writen_w(connfd, (void *)busy_response, 
+                    strlen(busy_response));
+            Close(connfd);
+        }
     }
     return 0;
 }
 
-/* 
- * thread - This function is executed whenever a new thread is created.
- * The thread detaches itself so that it does not need to be reaped by 
- * another thread, and the workhorse function, doit(), of the proxy is
- * called. Then the conenction is closed.
+/*
+ * usage - Prints the proxy's command line usage and exits.
+ *
+ * Parameter:
+ *  - prog: the name the proxy was run as
+ */
+void usage(char *prog)
+{
+    fprintf(stderr, 
+            "usage: %s [-s shards] [-P policy] [-a] [-t threads] [-q depth] "
+            "[-r] [-e] [-k seconds] [-m requests] [-u conns] [-d seconds] "
+            "[-c ms] [-D dir] [-B megabytes] [-S file] [-w ms] "
+            "[-R threads] [-T file] <port>\n",
+            prog);
+    exit(1);
+}
+
+/*
+ * signal_thread - This thread waits for the signals every other thread
+ * blocks. On SIGUSR1 it prints the proxy's statistics. On SIGUSR2 it
+ * saves a snapshot of the cache, and on SIGTERM or SIGINT it saves one,
+ * if there is a snapshot file, and exits, which also writes out what is
+ * buffered of the trace. Using sigwait means the work happens in a
+ * normal thread rather than in a signal handler.
  *
  * Parameter:
- *  - connfdp: pointer to the connection file descriptor
+ *  - vargp: pointer to the set of signals to wait for
  * Return value:
- *  - NULL
+ *  - never returns
  */
-void *thread(void *connfdp)
+void *signal_thread(void *vargp)
 {
-    int connfd = *((int *)connfdp);
+    sigset_t *mask = vargp;
+    long saved;
+    int sig;
+
     Pthread_detach(pthread_self());
-    Free(connfdp);
-    doit(connfd);
-    Close(connfd);
+    while (1) {
+        if (sigwait(mask, &sig) != 0) {
+            continue;
+        }
+        if (sig == SIGUSR1) {
+            print_stats();
+            continue;
+        }
+
+        if (snapshot_path != NULL
+                && (saved = snapshot_save(cache, snapshot_path)) >= 0) {
+            fprintf(stderr, "Saved %ld objects to %s\n", saved,
+                    snapshot_path);
+        }
+        if (sig != SIGUSR2) {
+            exit(0);
+        }
+    }
     return NULL;
 }
 
 /*
- * doit - This is the workhorse function of the proxy. It starts the
- * request-handling of the HTTP request and forwards the server 
- * response to the web browser.
+ * print_stats - Prints the cache, upstream connection and DNS statistics,
+ * and those of the worker pool or of the event loops, whichever is
+ * running, to stderr.
+ */
+void print_stats(void)
+{
+    CacheStats cache_stats;
+    UpstreamStats upstream_stats;
+    DnsStats dns_stats;
+    DiskStats disk_stats;
+    FlightStats flight_stats;
+    RefreshStats refresh_stats;
+    PoolStats pool_stats;
+    EventStats event_stats;
+
+    cache_get_stats(cache, &cache_stats);
+
+    fprintf(stderr, "cache: %lu objects, %lu bytes (peak %lu objects, "
+            "%lu bytes), %lu evictions, %lu rejected\n",
+            (unsigned long)cache_stats.nodes, 
+            (unsigned long)cache_stats.bytes,
+            (unsigned long)cache_stats.peak_nodes, 
+            (unsigned long)cache_stats.peak_bytes,
+            cache_stats.evictions, cache_stats.rejections);
+
+    if (disk != NULL) {
+        disk_get_stats(disk, &disk_stats);
+        fprintf(stderr, "disk: %lu objects, %lu of %lu bytes in %d "
+                "segments, %lu hits, %lu misses (%.1f%% hit rate), "
+                "%lu demoted, %lu dropped\n",
+                (unsigned long)disk_stats.objects,
+                (unsigned long)disk_stats.bytes,
+                (unsigned long)disk_stats.capacity, disk_stats.segments,
+                disk_stats.hits, disk_stats.misses,
+                disk_stats.hits + disk_stats.misses == 0 ? 0.0 :
+                100.0 * disk_stats.hits 
+                / (disk_stats.hits + disk_stats.misses),
+                disk_stats.demoted, disk_stats.dropped);
+    }
+
+    if (flights != NULL) {
+        flight_get_stats(flights, &flight_stats);
+        fprintf(stderr, "flights: %lu fetches, %lu waited (%lu served from "
+                "cache, %lu not cached, %lu timed out)\n",
+                flight_stats.leaders, flight_stats.followers,
+                flight_stats.collapsed, flight_stats.failed,
+                flight_stats.timeouts);
+    }
+
+    if (refresh != NULL) {
+        refresh_get_stats(refresh, &refresh_stats);
+        fprintf(stderr, "refresh: %lu queued (%lu confirmed, %lu replaced, "
+                "%lu failed, %d pending), %lu already in flight, "
+                "%lu dropped\n",
+                refresh_stats.queued, refresh_stats.confirmed,
+                refresh_stats.replaced, refresh_stats.failed,
+                refresh_stats.pending, refresh_stats.deduped,
+                refresh_stats.dropped);
+    }
+
+    if (trace != NULL) {
+        pthread_mutex_lock(&trace->lock);
+        fprintf(stderr, "trace: %lu requests recorded\n", trace->records);
+        pthread_mutex_unlock(&trace->lock);
+    }
+
+    upstream_get_stats(upstream, &upstream_stats);
+    fprintf(stderr, "upstream: %lu reused, %lu opened, %lu stale, "
+            "%lu expired, %d idle\n",
+            upstream_stats.hits, upstream_stats.misses, 
+            upstream_stats.stale, upstream_stats.expired, 
+            upstream_stats.idle);
+
+    dns_get_stats(dns, &dns_stats);
+    fprintf(stderr, "dns: %lu hits (%lu negative), %lu lookups, "
+            "%lu shared, %d names\n",
+            dns_stats.hits, dns_stats.negative_hits, dns_stats.misses,
+            dns_stats.shared, dns_stats.names);
+
+    if (engine != NULL) {
+        event_get_stats(engine, &event_stats);
+        fprintf(stderr, "events: %d loops, %lu accepted, %lu active\n",
+                event_stats.nloops, event_stats.accepted, 
+                event_stats.active);
+        return;
+    }
+
+    pool_get_stats(pool, &pool_stats);
+    fprintf(stderr, "pool: %lu served, %lu rejected, %d queued "
+            "(peak %lu), queue wait mean %.1f us, max %.1f us\n",
+            pool_stats.served, pool_stats.rejected, pool_stats.queued,
+            (unsigned long)pool_stats.peak_queued,
+            pool_stats.mean_wait_ns / 1e3, pool_stats.max_wait_ns / 1e3);
+    return;
+}
+
+/*
+ * doit - This is the workhorse function of the proxy. It serves requests
+ * from the browser on one connection, one after another, for as long as
+ * the browser keeps the connection open, up to max_requests requests. The
+ * connection is closed when the browser stays idle for idle_timeout
+ * seconds between requests.
  *
  * Parameter:
  *  - connfd: connection file descriptot
  */
 void doit(int connfd)
 {
-    char host[MAXLINE];
-    char uri[MAXLINE];
-    int client_port;
-    int clientfd;
-    int request_ok;
+    rio_t rio;
+    int served = 0;
+    int keep_alive = 1;
+    int on = 1;
 
-    /* Handle the request sent by the browser */
-    request_ok = handle_request(connfd, host, uri, &client_port, &clientfd);
+    /* Send each response as soon as it is written */
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
 
-    /* Forward the server response */
-    if (request_ok) {
-        get_response(clientfd, connfd, uri);
-        Close(clientfd);
+    Rio_readinitb(&rio, connfd);
+    while (keep_alive && served < max_requests) {
+        /* Unless a request is already buffered, wait for the next one */
+        if (rio.rio_cnt == 0 && !wait_readable(connfd, idle_timeout)) {
+            break;
+        }
+        served += 1;
+        keep_alive = handle_request(&rio, connfd, served < max_requests);
     }
-
-    /* Zero out the host buffer */
-    memset(host, 0, strlen(host));
     return;
 }
 
+/*
+ * wait_readable - Waits up to timeout seconds for a socket to become
+ * readable, and returns whether it did.
+ */
+int wait_readable(int fd, int timeout)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, timeout * 1000) > 0;
+}
+
 /* 
  * get_response - This function reads the server response and forwards it
  * to the client. It also determines whether to cache the web object and does
- * so.
+ * so: only a response whose status and headers allow it is cached, along
+ * with when it goes stale. When the request revalidates a stale cached
+ * copy and the server answers 304, the copy is refreshed and sent to the
+ * browser in place of the 304; if the server fails with a 5xx and the
+ * copy's stale-if-error window allows it, the copy is sent instead of
+ * the error. The response is handled as raw bytes with an explicit length, so
+ * binary objects are cached intact. What is cached is the response exactly
+ * as the server sent it; only the copy sent to the browser has its headers
+ * rewritten and its body framed. Once the object is known to be too big
+ * to cache, a body that is not re-framed is spliced to the browser
+ * without passing through the proxy's buffers. A complete response is
+ * recorded in the trace, if there is one, with its full size.
  *
  * Parameters:
  *  - clientfd: file descriptor of socket on the web server to which the
@@ -177,72 +577,294 @@ void doit(int connfd)
  *  - connfd: file descriptor on which the client has connected to the
  *            proxy
  *  - uri: the URI of the web server
+ *  - keep_alive: whether the browser's connection may stay open
+ *  - http11: whether the browser sent an HTTP/1.1 request
+ *  - reuse: set to 1 if the response ended at its Content-Length and the
+ *           server keeps the connection open, so it can be reused
+ *  - flight: the fetch this request leads, or NULL; it is landed once the
+ *            object is cached or known not to be
+ *  - stale: the stale cached copy the request revalidates, or NULL
+ * Return value:
+ *  - 1: the response was framed and the browser's connection may stay open
+ *  - 0: the browser's connection must be closed
+ *  - -1: the server sent nothing at all, and nothing was sent to the
+ *        browser
  */
-void get_response(int clientfd, int connfd, char *uri) 
+int get_response(int clientfd, int connfd, char *uri, int keep_alive, 
+        int http11, int *reuse, Flight **flight, CacheNode *stale) 
 {
     rio_t rio;
-    char buf[MAXBUF];
+    char buf[CHUNK_ROOM + MAXBUF];
+    char *data = buf + CHUNK_HEAD_ROOM;
     char object_buf[MAX_OBJECT_SIZE];
-    int obj_size = 0;
-    int need_to_cache = 1;
-    size_t read_count;
-
-    strcpy(object_buf, "");
+    size_t obj_size = 0;
+    size_t resp_size = 0;
+    int need_to_cache = 0;
+    int cacheable = 0;
+    time_t expires = 0;
+    ssize_t read_count = 0;
+    Buf server_head, head;
+    Response resp;
+    int frame = FRAME_CLOSE;
+    long length = 0;
+    long left;
+    int server_keep_alive = 0;
+    size_t chunk_off, chunk_len;
 
+    *reuse = 0;
     Rio_readinitb(&rio, clientfd);
+
+    /* Read the server's status line and headers */
+    buf_init(&server_head, MAXBUF);
+    while (server_head.len <= MAX_REQUEST_SIZE
+            && (read_count = Rio_readlineb_w(&rio, data, MAXLINE)) > 0) {
+        buf_append(&server_head, data, read_count);
+        if (!strcmp(data, "\r\n") || !strcmp(data, "\n")) {
+            break;
+        }
+    }
+    if (server_head.len == 0) {
+        buf_free(&server_head);
+        return -1;
+    }
+
+    /* Rewrite the headers for the browser, or pass them on as they are */
+    if (find_header_end(server_head.data, server_head.len) >= 0
+            && parse_response(server_head.data, server_head.len, 
+                &resp) == 0) {
+        frame = response_frame(&resp, -1, keep_alive, http11, &length);
+        keep_alive = keep_alive && frame != FRAME_CLOSE;
+        server_keep_alive = resp.keep_alive && frame == FRAME_LENGTH;
+
+        /* A 304 confirms the stale copy, which is sent instead */
+        if (stale != NULL && resp.status == 304) {
+            cache_refresh(stale, refreshed_expires(stale->content,
+                        stale->object_size, server_head.data,
+                        server_head.len, time(NULL)));
+            buf_free(&server_head);
+            flight_land(flights, flight, 1);
+            *reuse = server_keep_alive && rio.rio_cnt == 0;
+            return serve_hit(connfd, stale, keep_alive, http11);
+        }
+        if (stale != NULL && resp.status >= 500
+                && stale_usable(stale->content, stale->object_size,
+                    cache_expires(stale), time(NULL), 1)) {
+            buf_free(&server_head);
+            flight_land(flights, flight, 0);
+            return serve_hit(connfd, stale, keep_alive, http11);
+        }
+
+        need_to_cache = response_freshness(server_head.data, 
+                server_head.len, time(NULL), &expires);
+        cacheable = need_to_cache;
+        buf_init(&head, MAXBUF);
+        response_head(&head, server_head.data, server_head.len, &resp,
+                frame, length, keep_alive);
+        Rio_writen_w(connfd, head.data, head.len);
+        buf_free(&head);
+    } else {
+        keep_alive = 0;
+        Rio_writen_w(connfd, server_head.data, server_head.len);
+    }
+
+    if (need_to_cache && server_head.len <= MAX_OBJECT_SIZE) {
+        memcpy(object_buf, server_head.data, server_head.len);
+        obj_size = server_head.len;
+    } else {
+        need_to_cache = 0;
+    }
+    if (frame == FRAME_LENGTH && obj_size + length > MAX_OBJECT_SIZE) {
+        /* The Content-Length already rules out caching */
+        need_to_cache = 0;
+    }
+    resp_size = server_head.len;
+    buf_free(&server_head);
     
-    /* Read and write the server response */
-    while ((read_count = Rio_readnb_w(&rio, buf, MAXBUF)) > 0) {
-        Rio_writen_w(connfd, buf, read_count);
-        obj_size += read_count;
+    /* Read and write the rest of the server response */
+    while (read_count >= 0 && (frame != FRAME_LENGTH || length > 0)) {
+        /* Followers need not wait for an object that will not be cached */
+        if (!need_to_cache) {
+            flight_land(flights, flight, 0);
+        }
+
+        /* 
+         * Once the object will not be cached and nothing is left in the
+         * rio buffer, the kernel can move the rest of the body by itself.
+         */
+        if (!need_to_cache && frame != FRAME_CHUNKED && rio.rio_cnt == 0) {
+            /* Without a length, count down from LONG_MAX to learn it */
+            left = (frame == FRAME_LENGTH) ? length : LONG_MAX;
+            read_count = splice_relay(clientfd, connfd, &left);
+            resp_size += ((frame == FRAME_LENGTH) ? length : LONG_MAX) - left;
+            if (frame == FRAME_LENGTH) {
+                length = left;
+            }
+            break;
+        }
+
+        if ((read_count = Rio_readnb_w(&rio, data, 
+                        frame == FRAME_LENGTH && length < MAXBUF ? 
+                        length : MAXBUF)) <= 0) {
+            break;
+        }
+        if (frame == FRAME_LENGTH) {
+            length -= read_count;
+        }
+        if (frame == FRAME_CHUNKED) {
+            chunk_off = chunk_wrap(buf, read_count, &chunk_len);
+            Rio_writen_w(connfd, buf + chunk_off, chunk_len);
+        } else {
+            Rio_writen_w(connfd, data, read_count);
+        }
 
         /* Determine whether or not to cache the web object */
-        if (obj_size <= MAX_OBJECT_SIZE) {
-            strncat(object_buf, buf, read_count);
+        if (need_to_cache && obj_size + read_count <= MAX_OBJECT_SIZE) {
+            memcpy(object_buf + obj_size, data, read_count);
         } else {
             need_to_cache = 0;
         }
+        obj_size += read_count;
+        resp_size += read_count;
+    }
+
+    if (frame == FRAME_LENGTH ? length > 0 : read_count != 0) {
+        /* The server did not send the whole response */
+        return 0;
     }
+    if (frame == FRAME_CHUNKED) {
+        Rio_writen_w(connfd, LAST_CHUNK, strlen(LAST_CHUNK));
+    }
+
+    /* Nothing past the response may be left unread on a reused connection */
+    *reuse = server_keep_alive && rio.rio_cnt == 0;
+    trace_record(trace, uri, resp_size, cacheable);
 
     if (need_to_cache) {
         /* Cache the web object */
-        cache_add(cache, uri, object_buf);
+        cache_add(cache, uri, object_buf, obj_size, expires);
     }
+    flight_land(flights, flight, need_to_cache);
 
-    return;
+    return keep_alive;
+}
+
+/*
+ * serve_hit - This function sends a cached response to the browser, with
+ * its headers rewritten and its body framed the same way as a response
+ * that came straight from the server. The request is recorded in the trace,
+ * if there is one.
+ *
+ * Parameters:
+ *  - connfd: file descriptor on which the client has connected to the
+ *            proxy
+ *  - node: the cached response
+ *  - keep_alive: whether the browser's connection may stay open
+ *  - http11: whether the browser sent an HTTP/1.1 request
+ * Return value:
+ *  - 1: the browser's connection may stay open
+ *  - 0: the browser's connection must be closed
+ */
+int serve_hit(int connfd, CacheNode *node, int keep_alive, int http11)
+{
+    size_t body_off, body_len;
+    Buf head;
+
+    trace_record(trace, node->uri, node->object_size, 1);
+    buf_init(&head, MAXBUF);
+    keep_alive = cached_head(&head, node->content, node->object_size,
+            keep_alive, http11, &body_off, &body_len);
+    Rio_writen_w(connfd, head.data, head.len);
+    Rio_writen_w(connfd, node->content + body_off, body_len);
+    buf_free(&head);
+
+    return keep_alive;
+}
+
+/*
+ * serve_disk_hit - This function sends a response found in the disk cache
+ * to the browser. The headers are rewritten from the copy read into 
+ * memory, as serve_hit does, and the body is sent from the segment file
+ * with sendfile.
+ *
+ * Parameters:
+ *  - connfd: file descriptor on which the client has connected to the
+ *            proxy
+ *  - obj: the response, from disk_lookup
+ *  - keep_alive: whether the browser's connection may stay open
+ *  - http11: whether the browser sent an HTTP/1.1 request
+ * Return value:
+ *  - 1: the browser's connection may stay open
+ *  - 0: the browser's connection must be closed
+ */
+int serve_disk_hit(int connfd, DiskObject *obj, int keep_alive, int http11)
+{
+    size_t body_off, body_len;
+    Buf head;
+
+    buf_init(&head, MAXBUF);
+    keep_alive = cached_head(&head, obj->content, obj->size, keep_alive,
+            http11, &body_off, &body_len);
+    if (Rio_writen_w(connfd, head.data, head.len) < 0) {
+        keep_alive = 0;
+    } else if (disk_send(obj, connfd, &body_off, body_off + body_len) < 0) {
+        fprintf(stderr, "Error during sendfile: %s\n", strerror(errno));
+        keep_alive = 0;
+    }
+    buf_free(&head);
+
+    return keep_alive;
 }
 
 /*
- * handle_request - This function handles all HTTP requests sent by
- * the client. If it is a get request, it forwards the request to the
- * server. Otherwise, it ignores the request.
+ * handle_request - This function handles one HTTP request sent by the
+ * client. If it is a get request, it answers it from the cache, or from
+ * the disk cache if there is one, or forwards it to the server and
+ * relays the response. A cached copy that has gone stale is revalidated
+ * with a conditional request rather than fetched again; if its
+ * stale-while-revalidate window allows, it is served at once and
+ * revalidated in the background instead, and if its stale-if-error
+ * window allows, it is served when the server cannot be reached. Any
+ * request other than a get request is ignored. The request sent to the
+ * server is built in memory and written all at once. An idle connection
+ * to the server is reused if the upstream pool has one; if a reused
+ * connection turns out to be dead before any of the response arrives,
+ * the request is sent again on another connection.
  *
  * Parameters:
- *  - fd: the file descriptor of the client connection socket
- *  - host: the web server's host name
- *  - uri: URI from the request
- *  - client_port: pointer to the port number on the server to which
- *                 the proxy must connect
- *  - client_fd: pointer to the proxy's client file descriptor
+ *  - rio: rio state of the client connection, kept across requests
+ *  - connfd: the file descriptor of the client connection socket
+ *  - may_keep_alive: whether the connection may serve another request
  * Return value:
- *  - 0: the request was ignored or handled already (retrieved from the cache)
- *  - 1: the request warrants a response from the server
+ *  - 1: the connection may be used for another request
+ *  - 0: the connection must be closed
  */
-int handle_request(int fd, char *host, char *uri, int *client_port, 
-        int *clientfd) 
+int handle_request(rio_t *rio, int connfd, int may_keep_alive)
 {
-    char method[MAXLINE], version[MAXLINE];
-    char request_line[MAXLINE];
+    char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
     char temp[MAXLINE];
+    char host[MAXLINE];
     char path[MAXLINE];
-    char content[MAX_OBJECT_SIZE];
-    rio_t rio; 
-    int hit = 0;
+    int client_port;
+    int clientfd;
+    int keep_alive;
+    int http11;
+    int reused;
+    int reuse;
+    int rtn;
+    CacheNode *node;
+    CacheNode *stale = NULL;
+    DiskObject obj;
+    Flight *flight = NULL;
+    int leader;
+    Buf request;
 
-    /* Read request line and headers */
-    Rio_readinitb(&rio, fd);
-    Rio_readlineb_w(&rio, temp, MAXLINE);
-    sscanf(temp, "%s %s %s", method, uri, version);
+    /* Read request line */
+    if (Rio_readlineb_w(rio, temp, MAXLINE) <= 0) {
+        return 0;
+    }
+    if (parse_request_line(temp, method, uri, version) < 0) {
+        return 0;
+    }
 
     /* Determine if the request is a GET request */
     if (strcasecmp(method, "GET")) { 
@@ -250,163 +872,176 @@ int handle_request(int fd, char *host, char *uri, int *client_port,
         return 0;
     }
 
-    /* If the content at the URI is cached, just write the content */
-    hit = cache_lookup(cache, uri, content);
-    if (hit) {
-        Rio_writen_w(fd, content, strlen(content));
-        return 0;
-    }
+    /* HTTP/1.1 connections stay open unless the browser asks otherwise */
+    http11 = !strcmp(version, "HTTP/1.1");
+    keep_alive = http11;
 
     /* Parse URI from GET request */
-    parse_uri(uri, host, path, client_port); 
+    parse_uri(uri, host, path, &client_port); 
 
-    /* Open connection to web server */
-    *clientfd = Open_clientfd_w(host, *client_port);
-    if (*clientfd < 0) {
-        return 0;
-    }
+    /* Build the request line and headers for the server */
+    buf_init(&request, MAXBUF);
+    request_start(&request, path);
+    read_requesthdrs(rio, host, &request, &keep_alive);
+    keep_alive = keep_alive && may_keep_alive;
 
-    /* Write request line of response */
-    sprintf(request_line, "GET %s HTTP/1.0\n", path);
-    Rio_writen_w(*clientfd, request_line, strlen(request_line));
+    /* 
+     * If the content at the URI is cached, just write the content. It is
+     * written straight from the cache's copy, which stays valid until
+     * the node is released, with no cache lock held.
+     */
+    node = cache_lookup(cache, uri);
 
-    /* Read the request headers */
-    read_requesthdrs(&rio, host, *clientfd);
-    
-    return 1;
-}
+    /* Next, look for it in the disk cache */
+    if (node == NULL && disk != NULL && disk_lookup(disk, uri, &obj)) {
+        if (obj.expires > time(NULL)) {
+            buf_free(&request);
+            trace_record(trace, uri, obj.size, 1);
+            keep_alive = serve_disk_hit(connfd, &obj, keep_alive, http11);
+            disk_release(&obj);
+            return keep_alive;
+        }
+        /* It was promoted all the same, so revalidate it from memory */
+        disk_release(&obj);
+        node = cache_lookup(cache, uri);
+    }
 
-/*
- * read_requesthdrs - This function reads and parses HTTP request headers.
- * It replaces select headers with predefined ones in order to coax
- * sensible responses from some web servers. It forwards the rest 
- * unaltered.
- *
- * Parameters:
- *  - rp: pointer to persistent rio package state
- *  - host_hdr: header that contains the host
- *  - clientfd: file descriptor for proxy's client socket, to which it
- *              connects on the web server
- */
-void read_requesthdrs(rio_t *rp, char *host_hdr, int clientfd) 
-{
-    char buf[MAXLINE];
-    char conn[MAXLINE];
-    char proxy_conn[MAXLINE];
-    char host[MAXLINE];
-    int host_seen = 0;
-    ssize_t n;
+    if (node != NULL && cache_fresh(node, time(NULL))) {
+        buf_free(&request);
+        keep_alive = serve_hit(connfd, node, keep_alive, http11);
+        cache_release(node);
+        return keep_alive;
+    }
 
-    /* Loop over all the request headers */
-    while ((n = Rio_readlineb_w(rp, buf, MAXLINE)) != 0) {
-        if (!strncmp(buf, "\r\n", strlen(buf))) {
-            /* At end of the request headers */
+    /* Serve a stale copy at once if it may be refreshed in the background */
+    if (node != NULL && refresh != NULL
+            && stale_usable(node->content, node->object_size,
+                cache_expires(node), time(NULL), 0)) {
+        request_revalidate(&request, node->content, node->object_size);
+        refresh_submit(refresh, uri, host, client_port, &request, node);
+        buf_free(&request);
+        keep_alive = serve_hit(connfd, node, keep_alive, http11);
+        cache_release(node);
+        return keep_alive;
+    }
+
+    /* 
+     * A stale copy is only worth keeping if the server can confirm it,
+     * or if it may stand in for the server should that fail.
+     */
+    if (node != NULL) {
+        if (request_revalidate(&request, node->content, node->object_size)
+                || stale_usable(node->content, node->object_size,
+                    cache_expires(node), time(NULL), 1)) {
+            stale = node;
+        } else {
+            cache_release(node);
+        }
+    }
 
-            /* 
-             * If there is a host header write it to the server.
-             * Otherwise, create a host header and write that.
-             */
-            if (!host_seen) {
-                sprintf(host, "Host: %s\r\n", host_hdr);
-                Rio_writen_w(clientfd, host, strlen(host));
+    /* 
+     * If another request is already fetching the object, wait for it to
+     * be cached instead of fetching it again. Otherwise this request
+     * leads the fetch, and lands it once it knows whether the object
+     * will be cached.
+     */
+    if (flights != NULL) {
+        flight = flight_join(flights, uri, &leader);
+        if (!leader) {
+            if (flight_wait(flights, flight) == FLIGHT_CACHED
+                    && (node = cache_lookup(cache, uri)) != NULL) {
+                buf_free(&request);
+                keep_alive = serve_hit(connfd, node, keep_alive, http11);
+                cache_release(node);
+                if (stale != NULL) {
+                    cache_release(stale);
+                }
+                return keep_alive;
             }
-            
-            /* Write the predefined headers that must always be the same */
-            Rio_writen_w(clientfd, (void *)user_agent_hdr, 
-                    strlen(user_agent_hdr));
-            Rio_writen_w(clientfd, (void *)accept_hdr, 
-                    strlen(accept_hdr));
-            Rio_writen_w(clientfd, (void *)accept_encoding_hdr, 
-                    strlen(accept_encoding_hdr));
-            sprintf(conn, "Connection: close\r\n");
-            sprintf(proxy_conn, "Proxy-Connection: close\r\n");
-            Rio_writen_w(clientfd, conn, strlen(conn));
-            Rio_writen_w(clientfd, proxy_conn, strlen(proxy_conn));
-            Rio_writen_w(clientfd, buf, strlen(buf));
+            /* The leader did not cache it in time; fetch it here */
+            flight = NULL;
+        }
+    }
+
+    while (1) {
+        /* Reuse a connection to the web server, or open one */
+        clientfd = upstream_get(upstream, host, client_port, 0);
+        reused = (clientfd >= 0);
+        if (!reused && (clientfd = Open_clientfd_w(host, client_port)) < 0) {
+            rtn = -1;
             break;
+        }
+
+        /* Send the request and forward the server response */
+        if (rio_writen(clientfd, request.data, request.len) < 0) {
+            rtn = -1;
         } else {
-            /* Determine whether a request already has a host header */
-            if (!strncmp(buf, "Host", strlen("Host"))) {
-                host_seen = 1;
-                Rio_writen_w(clientfd, buf, strlen(buf));
-            } else if (!strncmp(buf, "User-Agent", strlen("User-Agent"))
-                        || !strncmp(buf, "Accept", strlen("Accept"))
-                        || !strncmp(buf, "Accept-Encoding", 
-                            strlen("Accept-Encoding"))
-                        || !strncmp(buf, "Connection", strlen("Connection"))
-                        || !strncmp(buf, "Proxy-Connection", 
-                            strlen("Proxy-Connection"))) {
-                /* 
-                 * If there is a header for any of the predefined ones,
-                 * ignore it, and zero out the buffer.
-                 */
-                memset(buf, 0, strlen(buf));
-                continue;
-            } else {
-                /* Simply forward all other headers */
-                Rio_writen_w(clientfd, buf, strlen(buf));
-            }
+            rtn = get_response(clientfd, connfd, uri, keep_alive, http11,
+                    &reuse, &flight, stale);
         }
-        memset(buf, 0, strlen(buf));
+
+        if (rtn < 0 && reused) {
+            /* The server had closed the idle connection; try again */
+            Close(clientfd);
+            continue;
+        }
+        if (rtn >= 0 && reuse) {
+            upstream_put(upstream, host, client_port, clientfd);
+        } else {
+            Close(clientfd);
+        }
+        break;
     }
+    buf_free(&request);
 
-    return;
+    /* 
+     * If nothing came from the server, answer with the stale copy if it
+     * may stand in for the server.
+     */
+    if (rtn < 0 && stale != NULL 
+            && stale_usable(stale->content, stale->object_size,
+                cache_expires(stale), time(NULL), 1)) {
+        rtn = serve_hit(connfd, stale, keep_alive, http11);
+    }
+
+    /* Let the followers go if the fetch ended before it was cached */
+    flight_land(flights, &flight, 0);
+    if (stale != NULL) {
+        cache_release(stale);
+    }
+    
+    return rtn > 0;
 }
 
 /*
- * parse_uri - This functions parses the URI to determine the hostname,
- * path of the web object, and the client port to which the proxy must 
- * connect.
+ * read_requesthdrs - This function reads the HTTP request headers and
+ * adds them to the request for the server. Select headers are replaced
+ * with predefined ones in order to coax sensible responses from some web
+ * servers, and the rest are forwarded unaltered.
  *
  * Parameters:
- *  - uri: the URI of the content on the web server
- *  - hostname: the server's host name
- *  - path: the path of the web oject on the server
- *  - client_port: port on web server to which the proxy must connect
+ *  - rp: pointer to persistent rio package state
+ *  - host_hdr: the web server's host name, used if there is no Host header
+ *  - request: buffer holding the request being built for the server
+ *  - keep_alive: updated if the browser asks to close its connection or
+ *                to keep it open
  */
-void parse_uri(char *uri, char *hostname, char *path, int *client_port) 
+void read_requesthdrs(rio_t *rp, char *host_hdr, Buf *request, 
+        int *keep_alive) 
 {
-    char ptr[MAXLINE];
-    char port_string[MAXLINE];
-    char port[MAXLINE];
-    size_t host_count = 0;
-    size_t port_count = 0;
-    size_t i;
-    
-    strcpy(ptr, uri);
-    
-    /* Get rid of "http://" if its there */
-    if (strstr(ptr, "://")) {
-        strcpy(ptr, index(ptr, ':'));
-        strcpy(ptr, &ptr[3]);
-    }
-
-    /* Copy up until the first '/' to get the host name */
-    assert(ptr != NULL);
-    for (i = 0; (ptr[i] != '/') && (ptr[i] != '\0') && (ptr[i] != ':'); i++) {
-        host_count++;
-    }
-    strncpy(hostname, ptr, host_count);
-
-    /* Determine what the client port is */
-    if (ptr[i] == ':') {
-        /* A client port is specified in the URI */
-        i += 1;
-        strcpy(port_string, &ptr[i]);
-        for ( ; isdigit(ptr[i]); i++) {
-            port_count++;
+    char buf[MAXLINE];
+    int host_seen = 0;
+
+    /* Loop over all the request headers */
+    while (Rio_readlineb_w(rp, buf, MAXLINE) > 0) {
+        if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n")) {
+            /* At end of the request headers */
+            break;
         }
-        strncpy(port, port_string, port_count);
-        *client_port = atoi(port);
-    } else {
-        /* Use the default client port 80 */
-        *client_port = DEFAULT_CLIENT_PORT;
+        request_header(request, buf, &host_seen, keep_alive);
     }
+    request_finish(request, host_hdr, host_seen, upstream->max_idle > 0);
 
-    /* The rest is the path of the web object */
-    strcpy(path, &ptr[i]);
-
-    memset(ptr, 0, strlen(ptr));
     return;
 }
 
@@ -453,7 +1088,7 @@ ssize_t Rio_readnb_w(rio_t *rp, void *usrbuf, size_t n)
 int Open_clientfd_w(char *hostname, int port) 
 {
     int rtn;
-    if ((rtn = open_clientfd_r(hostname, port)) < 0) {
+    if ((rtn = race_connect(dns, hostname, port, connect_timeout)) < 0) {
         fprintf(stderr, "Error in open_clientfd\n");
     }
     return rtn;
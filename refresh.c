@@ -0,0 +1,366 @@
+/*
+ * refresh.c
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This file contains a small pool of threads that
+ * revalidate stale cached objects in the background. When a stale object
+ * may still be served, because the web server gave it a
+ * stale-while-revalidate window, the request is answered from the stale
+ * copy right away and the revalidation is handed to this pool, so no
+ * browser waits on the web server just because an object aged out.
+ *
+ * A refresh sends the conditional request the proxy would have sent in
+ * the foreground. A 304 refreshes the stale copy's expiry, and a new
+ * cacheable response replaces it. Anything else leaves the cache alone.
+ *
+ * Refreshes are deduplicated per URI through the table of fetches in
+ * flight: a refresh leads the fetch of its URI, so a second one for the
+ * same URI is not queued while the first is pending, and a request that
+ * misses meanwhile follows the refresh rather than fetching the object
+ * again. When the queue is full, refreshes are dropped; the object will
+ * be refreshed by a later request instead.
+ *
+ */
+
+#include "refresh.h"
+#include "connect.h"
+
+/*
+ * Main Refresh Functions
+ * ----------------------
+ */
+
+/*
+ * refresh_init - This function creates the queue and starts the refresh
+ * threads.
+ *
+ * Parameters:
+ *  - nworkers: number of refresh threads to start
+ *  - cache: cache the refreshed objects go into
+ *  - upstream: pool of idle connections to web servers
+ *  - dns: cache of web server addresses
+ *  - flights: table of fetches in flight, or NULL if the proxy does not
+ *             collapse misses, in which case the pool keeps its own
+ *  - connect_timeout: milliseconds allowed to connect to a web server
+ * Return value:
+ *  - pool: a pointer to the running pool
+ */
+RefreshPool *refresh_init(int nworkers, Cache *cache,
+        UpstreamPool *upstream, DnsCache *dns, FlightTable *flights,
+        int connect_timeout)
+{
+    RefreshPool *pool = Calloc(1, sizeof(RefreshPool));
+    int i;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pool->nworkers = nworkers;
+    pool->workers = Malloc(nworkers * sizeof(pthread_t));
+    pool->cache = cache;
+    pool->upstream = upstream;
+    pool->dns = dns;
+    pool->flights = flights != NULL ? flights
+        : flight_init(FLIGHT_DEFAULT_TIMEOUT);
+    pool->connect_timeout = connect_timeout;
+
+    for (i = 0; i < nworkers; i++) {
+        Pthread_create(&pool->workers[i], NULL, refresh_worker, pool);
+    }
+
+    return pool;
+}
+
+/*
+ * refresh_submit - This function queues a refresh of a stale object,
+ * unless the object is already being fetched or the queue is full. It
+ * never blocks on the web server, so it can be called from an event
+ * loop.
+ *
+ * Parameters:
+ *  - pool: the pool
+ *  - uri: the URI of the object
+ *  - host: the web server to ask
+ *  - port: its port
+ *  - request: the request to send it, copied into the refresh
+ *  - stale: the stale copy; the refresh takes its own reference
+ * Return value:
+ *  - 1: the refresh was queued
+ *  - 0: it was not, because it was not needed or there was no room
+ */
+int refresh_submit(RefreshPool *pool, char *uri, char *host, int port,
+        Buf *request, CacheNode *stale)
+{
+    RefreshJob *job;
+    Flight *flight;
+
+    if ((flight = flight_lead(pool->flights, uri)) == NULL) {
+        pthread_mutex_lock(&pool->lock);
+        pool->deduped += 1;
+        pthread_mutex_unlock(&pool->lock);
+        return 0;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count == REFRESH_DEPTH) {
+        pool->dropped += 1;
+        pthread_mutex_unlock(&pool->lock);
+        flight_land(pool->flights, &flight, 0);
+        return 0;
+    }
+
+    /* Append the refresh at the tail of the circular queue */
+    job = &pool->jobs[(pool->head + pool->count) % REFRESH_DEPTH];
+    job->uri = Malloc(strlen(uri) + 1);
+    strcpy(job->uri, uri);
+    job->host = Malloc(strlen(host) + 1);
+    strcpy(job->host, host);
+    job->port = port;
+    buf_init(&job->request, request->len);
+    buf_append(&job->request, request->data, request->len);
+    __atomic_add_fetch(&stale->refcount, 1, __ATOMIC_RELAXED);
+    job->stale = stale;
+    job->flight = flight;
+    pool->count += 1;
+    pool->queued += 1;
+
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    return 1;
+}
+
+/*
+ * refresh_get_stats - This function copies the pool's counters into
+ * stats.
+ *
+ * Parameters:
+ *  - pool: the pool to report on
+ *  - stats: filled with the current counters
+ */
+void refresh_get_stats(RefreshPool *pool, RefreshStats *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+    stats->pending = pool->count;
+    stats->queued = pool->queued;
+    stats->deduped = pool->deduped;
+    stats->dropped = pool->dropped;
+    stats->confirmed = pool->confirmed;
+    stats->replaced = pool->replaced;
+    stats->failed = pool->failed;
+    pthread_mutex_unlock(&pool->lock);
+    return;
+}
+
+/*
+ * End Main Refresh Functions
+ * --------------------------
+ */
+
+
+/*
+ * Refresh Helper Functions
+ * ------------------------
+ */
+
+/*
+ * refresh_worker - This is the body of every refresh thread. It takes the
+ * oldest refresh off the queue, runs it, and lands its fetch, forever.
+ *
+ * Parameter:
+ *  - vargp: the pool
+ * Return value:
+ *  - never returns
+ */
+void *refresh_worker(void *vargp)
+{
+    RefreshPool *pool = vargp;
+    RefreshJob job;
+    int done;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0) {
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        }
+        job = pool->jobs[pool->head];
+        pool->head = (pool->head + 1) % REFRESH_DEPTH;
+        pool->count -= 1;
+        pthread_mutex_unlock(&pool->lock);
+
+        done = refresh_fetch(pool, &job);
+        flight_land(pool->flights, &job.flight, done != REFRESH_FAILED);
+
+        pthread_mutex_lock(&pool->lock);
+        if (done == REFRESH_CONFIRMED) {
+            pool->confirmed += 1;
+        } else if (done == REFRESH_REPLACED) {
+            pool->replaced += 1;
+        } else {
+            pool->failed += 1;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        job_free(&job);
+    }
+
+    return NULL;
+}
+
+/*
+ * refresh_fetch - This function sends a refresh's request to the web
+ * server and applies the response to the cache. An idle connection is
+ * reused if the upstream pool has one, and the connection goes back to
+ * the pool if the whole response was read and the server keeps it open.
+ * Reads give up after REFRESH_TIMEOUT, so a silent server cannot hold a
+ * refresh thread, or the fetch it leads, forever.
+ *
+ * Parameters:
+ *  - pool: the pool
+ *  - job: the refresh
+ * Return value:
+ *  - REFRESH_CONFIRMED, REFRESH_REPLACED or REFRESH_FAILED
+ */
+int refresh_fetch(RefreshPool *pool, RefreshJob *job)
+{
+    struct timeval timeout = {REFRESH_TIMEOUT, 0};
+    struct timeval no_timeout = {0, 0};
+    rio_t rio;
+    Buf object;
+    Response resp;
+    time_t expires;
+    long hdr_len;
+    int done = REFRESH_FAILED;
+    int clean = 0;
+    int reused;
+    int fd;
+
+    /* Reuse a connection to the web server, or open one */
+    while (1) {
+        fd = upstream_get(pool->upstream, job->host, job->port, 0);
+        reused = (fd >= 0);
+        if (!reused && (fd = race_connect(pool->dns, job->host, job->port,
+                        pool->connect_timeout)) < 0) {
+            return REFRESH_FAILED;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        buf_init(&object, MAXBUF);
+        Rio_readinitb(&rio, fd);
+        if (rio_writen(fd, job->request.data, job->request.len) >= 0
+                && (hdr_len = read_head(&rio, &object)) > 0) {
+            break;
+        }
+        buf_free(&object);
+        Close(fd);
+        if (!reused) {
+            return REFRESH_FAILED;
+        }
+        /* The server had closed the idle connection; try again */
+    }
+
+    if (parse_response(object.data, hdr_len, &resp) == 0) {
+        if (resp.status == 304) {
+            cache_refresh(job->stale, refreshed_expires(job->stale->content,
+                        job->stale->object_size, object.data, hdr_len,
+                        time(NULL)));
+            done = REFRESH_CONFIRMED;
+            clean = 1;
+        } else if (response_freshness(object.data, hdr_len, time(NULL),
+                    &expires) && read_body(&rio, &object, &resp)) {
+            cache_add(pool->cache, job->uri, object.data, object.len,
+                    expires);
+            done = REFRESH_REPLACED;
+            clean = (resp.content_length >= 0 || resp.no_body);
+        }
+    }
+
+    /* Nothing past the response may be left unread on a reused connection */
+    if (clean && resp.keep_alive && !resp.chunked && rio.rio_cnt == 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &no_timeout,
+                sizeof(no_timeout));
+        upstream_put(pool->upstream, job->host, job->port, fd);
+    } else {
+        Close(fd);
+    }
+    buf_free(&object);
+    return done;
+}
+
+/*
+ * read_head - Reads a response's status line and headers into object.
+ *
+ * Return value:
+ *  - the length of the headers, or -1 if they did not arrive whole
+ */
+long read_head(rio_t *rio, Buf *object)
+{
+    char line[MAXLINE];
+    ssize_t n;
+
+    while (object->len <= MAX_REQUEST_SIZE
+            && (n = rio_readlineb(rio, line, MAXLINE)) > 0) {
+        buf_append(object, line, n);
+        if (!strcmp(line, "\r\n") || !strcmp(line, "\n")) {
+            return object->len;
+        }
+    }
+    return -1;
+}
+
+/*
+ * read_body - Reads a response's body onto the end of object, up to its
+ * Content-Length or, without one, until the server closes the
+ * connection. A chunked body is not read, since servers only send one to
+ * an HTTP/1.0 request by mistake.
+ *
+ * Return value:
+ *  - 1: the whole body was read and the object fits in the cache
+ *  - 0: it was not, and the object must not be cached
+ */
+int read_body(rio_t *rio, Buf *object, Response *resp)
+{
+    char buf[MAXBUF];
+    long left = resp->no_body ? 0 : resp->content_length;
+    size_t want;
+    ssize_t n;
+
+    if (resp->chunked && !resp->no_body) {
+        return 0;
+    }
+
+    while (left != 0) {
+        want = (left > 0 && left < MAXBUF) ? left : MAXBUF;
+        if ((n = rio_readnb(rio, buf, want)) < 0) {
+            return 0;
+        }
+        if (n == 0) {
+            /* Closing the connection only ends a body without a length */
+            return left < 0;
+        }
+        if (object->len + n > MAX_OBJECT_SIZE) {
+            return 0;
+        }
+        buf_append(object, buf, n);
+        if (left > 0) {
+            left -= n;
+        }
+    }
+    return 1;
+}
+
+/*
+ * job_free - Frees everything a refresh holds.
+ */
+void job_free(RefreshJob *job)
+{
+    Free(job->uri);
+    Free(job->host);
+    buf_free(&job->request);
+    cache_release(job->stale);
+    return;
+}
+
+/*
+ * End Refresh Helper Functions
+ * ----------------------------
+ */
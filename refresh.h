@@ -0,0 +1,105 @@
+/*
+ * refresh.h
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This is the header file for refresh.c, which
+ * revalidates stale cached objects in the background while the stale
+ * copy is served. This file just has the relevant macros, structure
+ * definitions, and function prototypes.
+ *
+ */
+
+/* Include guards */
+#ifndef __REFRESH_H__
+#define __REFRESH_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "http.h"
+#include "upstream.h"
+#include "dns.h"
+#include "flight.h"
+
+/* Macros */
+#define REFRESH_DEFAULT_WORKERS 2 /* Default number of refresh threads */
+#define REFRESH_DEPTH 64         /* Refreshes that may wait for a thread;
+                                    more are dropped */
+#define REFRESH_TIMEOUT 10       /* Seconds a refresh waits on a silent
+                                    web server */
+
+/* How a refresh ended */
+#define REFRESH_FAILED 0         /* Nothing changed */
+#define REFRESH_CONFIRMED 1      /* The server confirmed the stale copy */
+#define REFRESH_REPLACED 2       /* The server sent a new copy */
+
+/*
+ * One refresh waiting for a thread: the request to send, which is
+ * normally conditional, and the stale copy it revalidates.
+ */
+typedef struct RefreshJob {
+    char *uri;                   /* Key of the object */
+    char *host;                  /* Web server to ask */
+    int port;                    /* Its port */
+    Buf request;                 /* Request to send it */
+    CacheNode *stale;            /* The stale copy, referenced */
+    Flight *flight;              /* The fetch this refresh leads */
+} RefreshJob;
+
+/*
+ * Defines the refresh pool: its threads and the circular queue of
+ * refreshes they take work from. The queue and counters are protected by
+ * lock. A refresh leads a fetch in flights for its URI, so there is never
+ * more than one fetch of a URI at a time, whether in the background or
+ * not.
+ */
+typedef struct RefreshPool {
+    pthread_mutex_t lock;        /* Protects the queue and the counters */
+    pthread_cond_t not_empty;    /* Signaled when a refresh is queued */
+    RefreshJob jobs[REFRESH_DEPTH]; /* Circular queue of refreshes */
+    int head;                    /* Index of the oldest queued refresh */
+    int count;                   /* Number of queued refreshes */
+    int nworkers;                /* Number of refresh threads */
+    pthread_t *workers;          /* The refresh threads */
+    Cache *cache;                /* Cache the refreshed objects go into */
+    UpstreamPool *upstream;      /* Idle connections to web servers */
+    DnsCache *dns;               /* Addresses of web servers */
+    FlightTable *flights;        /* Fetches in flight, by URI */
+    int connect_timeout;         /* Milliseconds to connect to a server */
+    unsigned long queued;        /* Refreshes queued */
+    unsigned long deduped;       /* Not queued, the URI was being fetched */
+    unsigned long dropped;       /* Not queued, the queue was full */
+    unsigned long confirmed;     /* Stale copies confirmed by a 304 */
+    unsigned long replaced;      /* Stale copies replaced by a new one */
+    unsigned long failed;        /* Refreshes that changed nothing */
+} RefreshPool;
+
+/*
+ * A snapshot of the pool's counters, for monitoring.
+ */
+typedef struct RefreshStats {
+    int pending;                 /* Refreshes waiting right now */
+    unsigned long queued;        /* Refreshes queued */
+    unsigned long deduped;       /* Not queued, the URI was being fetched */
+    unsigned long dropped;       /* Not queued, the queue was full */
+    unsigned long confirmed;     /* Stale copies confirmed by a 304 */
+    unsigned long replaced;      /* Stale copies replaced by a new one */
+    unsigned long failed;        /* Refreshes that changed nothing */
+} RefreshStats;
+
+/* Main Refresh Function Prototypes */
+RefreshPool *refresh_init(int nworkers, Cache *cache,
+        UpstreamPool *upstream, DnsCache *dns, FlightTable *flights,
+        int connect_timeout);
+int refresh_submit(RefreshPool *pool, char *uri, char *host, int port,
+        Buf *request, CacheNode *stale);
+void refresh_get_stats(RefreshPool *pool, RefreshStats *stats);
+/* Refresh Helper Functions */
+void *refresh_worker(void *vargp);
+int refresh_fetch(RefreshPool *pool, RefreshJob *job);
+long read_head(rio_t *rio, Buf *object);
+int read_body(rio_t *rio, Buf *object, Response *resp);
+void job_free(RefreshJob *job);
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ * relay.c
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This file contains the zero-copy relay for response
+ * bodies that will not be cached. Relaying a body through a user-space
+ * buffer copies every byte twice, once out of the server's socket and
+ * once into the browser's. Once the proxy knows it will not keep a copy,
+ * there is no reason for the bytes to leave the kernel, so they are
+ * spliced from the server's socket into a pipe and from the pipe into
+ * the browser's socket instead.
+ *
+ * Splicing only works when the body goes to the browser unchanged, so a
+ * response that is re-framed with chunked coding is still copied.
+ *
+ */
+
+/* For splice */
+#define _GNU_SOURCE
+
+#include "relay.h"
+
+/*
+ * Main Relay Functions
+ * --------------------
+ */
+
+/*
+ * relay_pipe - This function creates the pipe a splice relay goes
+ * through. Both ends are non-blocking, so that a full or empty pipe never
+ * blocks a splice; the sockets decide whether a splice waits.
+ *
+ * Parameter:
+ *  - pipefd: filled with the read and write ends
+ * Return value:
+ *  - 0 on success, -1 on error
+ */
+int relay_pipe(int pipefd[2])
+{
+    return pipe2(pipefd, O_NONBLOCK | O_CLOEXEC);
+}
+
+/*
+ * splice_relay - This function relays the rest of a response body from a
+ * blocking server socket to a blocking browser socket without copying it
+ * into the proxy. It stops after length bytes, or at end of file when
+ * length is NULL.
+ *
+ * Parameters:
+ *  - fromfd: the server's socket
+ *  - tofd: the browser's socket
+ *  - length: body bytes still due, decreased as they are relayed, or NULL
+ * Return value:
+ *  - 0: the body ended, at its length or at end of file
+ *  - -1: reading from the server or writing to the browser failed
+ */
+int splice_relay(int fromfd, int tofd, long *length)
+{
+    int pipefd[2];
+    size_t want;
+    ssize_t n, out;
+    int rtn = 0;
+
+    if (relay_pipe(pipefd) < 0) {
+        return -1;
+    }
+
+    while (length == NULL || *length > 0) {
+        want = RELAY_PIPE_SIZE;
+        if (length != NULL && *length < RELAY_PIPE_SIZE) {
+            want = *length;
+        }
+        if ((n = splice_in(fromfd, pipefd[1], want)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            rtn = -1;
+            break;
+        }
+        if (n == 0) {
+            /* The server closed the connection */
+            break;
+        }
+        if (length != NULL) {
+            *length -= n;
+        }
+
+        /* The pipe is emptied before it is filled again */
+        while (n > 0) {
+            if ((out = splice_out(pipefd[0], tofd, n)) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                fprintf(stderr, "Error during splice: %s\n",
+                        strerror(errno));
+                rtn = -1;
+                break;
+            }
+            n -= out;
+        }
+        if (rtn < 0) {
+            break;
+        }
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return rtn;
+}
+
+/*
+ * splice_in - Moves at most n bytes from a socket into an empty pipe.
+ * Since the pipe is empty, EAGAIN can only mean the socket has nothing
+ * to read.
+ */
+ssize_t splice_in(int fromfd, int pipefd, size_t n)
+{
+    return splice(fromfd, NULL, pipefd, NULL, n, SPLICE_F_MOVE);
+}
+
+/*
+ * splice_out - Moves at most n bytes from a pipe into a socket.
+ */
+ssize_t splice_out(int pipefd, int tofd, size_t n)
+{
+    return splice(pipefd, NULL, tofd, NULL, n, SPLICE_F_MOVE);
+}
+
+/*
+ * End Main Relay Functions
+ * ------------------------
+ */
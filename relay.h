@@ -0,0 +1,29 @@
+/*
+ * relay.h
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This is the header file for relay.c, which moves
+ * response bodies from a web server to a browser inside the kernel. This
+ * file just has the relevant macros and function prototypes.
+ *
+ */
+
+/* Include guards */
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include "csapp.h"
+
+/* Macros */
+#define RELAY_PIPE_SIZE (64 * 1024) /* Most bytes moved by one splice, the
+                                       default capacity of a pipe */
+
+/* Main Relay Function Prototypes */
+int relay_pipe(int pipefd[2]);
+int splice_relay(int fromfd, int tofd, long *length);
+ssize_t splice_in(int fromfd, int pipefd, size_t n);
+ssize_t splice_out(int pipefd, int tofd, size_t n);
+
+#endif
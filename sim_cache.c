@@ -0,0 +1,346 @@
+/*
+ * sim_cache.c
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This file is a trace-driven simulator for the cache.
+ * It replays an access trace, such as one recorded by the proxy with -T,
+ * through the cache code the proxy uses, without any sockets, once for
+ * every combination of eviction policy and cache size asked for, and
+ * prints the share of requests and of bytes that hit, the number of
+ * evictions and admission rejections, and how many requests per second
+ * the cache replayed.
+ *
+ * Every request is looked up, as the proxy does. A hit only counts if the
+ * cached object is the size the trace says, since otherwise the object
+ * has changed; a miss, or a changed object, is added if the trace says
+ * the response was cacheable and it is no larger than the largest object
+ * allowed. Expiry is not simulated, so an object is served from the cache
+ * for as long as it stays there.
+ *
+ * Usage: sim_cache [-p policies] [-s sizes] [-m bytes] [-n shards] [-a]
+ *                  <trace>
+ *  - -p policies: comma-separated eviction policies to compare (default:
+ *                 lru,arc,s3fifo,gdsf)
+ *  - -s sizes: comma-separated cache sizes in bytes, each optionally
+ *              followed by K or M (default: a quarter of MAX_CACHE_SIZE up
+ *              to eight times it, doubling)
+ *  - -m bytes: largest object added to the cache (default:
+ *              MAX_OBJECT_SIZE)
+ *  - -n shards: number of cache shards (default: 1)
+ *  - -a: turn on TinyLFU admission
+ */
+
+#include <time.h>
+
+#include "cache.h"
+#include "trace.h"
+
+/* Macros */
+#define SIM_MAX_RUNS 32         /* Most policies, or sizes, in one sweep */
+#define SIM_LINE (2 * MAXLINE)  /* Room for one line of the trace */
+
+/*
+ * One request of the trace being replayed.
+ */
+typedef struct SimRequest {
+    char *uri;                  /* The requested URI */
+    size_t size;                /* Bytes in the response */
+    int cacheable;              /* The response may be cached */
+} SimRequest;
+
+/*
+ * The trace, loaded into memory so that reading it is not timed.
+ */
+typedef struct SimTrace {
+    SimRequest *requests;       /* The requests, in order */
+    size_t count;               /* Number of requests */
+    size_t size;                /* Requests allocated */
+    size_t cacheable;           /* Requests whose response was cacheable */
+    unsigned long long bytes;   /* Sum of size over the requests */
+    double first;               /* Time of the first request */
+    double last;                /* Time of the last request */
+    unsigned long skipped;      /* Lines that were not records */
+} SimTrace;
+
+/* Function prototypes */
+void usage(char *prog);
+double now_ns(void);
+void load_trace(char *path, SimTrace *trace);
+int split_list(char *list, char **items);
+size_t parse_size(char *arg);
+void simulate(SimTrace *trace, const char *policy, size_t capacity,
+        size_t max_object, int nshards, int admission);
+
+int main(int argc, char **argv)
+{
+    char default_policies[] = "lru,arc,s3fifo,gdsf";
+    char *policies[SIM_MAX_RUNS];
+    char *sizes[SIM_MAX_RUNS];
+    size_t capacities[SIM_MAX_RUNS];
+    int npolicies, ncapacities;
+    char *policy_list = default_policies;
+    char *size_list = NULL;
+    size_t max_object = MAX_OBJECT_SIZE;
+    int nshards = 1;
+    int admission = 0;
+    SimTrace trace;
+    int opt;
+    int i, j;
+
+    while ((opt = getopt(argc, argv, "p:s:m:n:a")) != -1) {
+        switch (opt) {
+        case 'p':
+            policy_list = optarg;
+            break;
+        case 's':
+            size_list = optarg;
+            break;
+        case 'm':
+            max_object = parse_size(optarg);
+            break;
+        case 'n':
+            nshards = atoi(optarg);
+            break;
+        case 'a':
+            admission = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || max_object == 0 || nshards < 1) {
+        usage(argv[0]);
+    }
+
+    npolicies = split_list(policy_list, policies);
+    for (i = 0; i < npolicies; i++) {
+        if (policy_find(policies[i]) == NULL) {
+            fprintf(stderr, "Unknown eviction policy %s\n", policies[i]);
+            usage(argv[0]);
+        }
+    }
+    if (size_list != NULL) {
+        ncapacities = split_list(size_list, sizes);
+        for (i = 0; i < ncapacities; i++) {
+            if ((capacities[i] = parse_size(sizes[i])) == 0) {
+                usage(argv[0]);
+            }
+        }
+    } else {
+        for (ncapacities = 0; ncapacities < 6; ncapacities++) {
+            capacities[ncapacities] = (MAX_CACHE_SIZE / 4) << ncapacities;
+        }
+    }
+    if (npolicies == 0 || ncapacities == 0) {
+        usage(argv[0]);
+    }
+
+    load_trace(argv[optind], &trace);
+    printf("trace: %lu requests (%lu cacheable), %llu bytes, over %.1f "
+            "seconds", (unsigned long)trace.count,
+            (unsigned long)trace.cacheable, trace.bytes,
+            trace.count > 0 ? trace.last - trace.first : 0.0);
+    if (trace.skipped > 0) {
+        printf(", %lu lines skipped", trace.skipped);
+    }
+    printf("\n\n%14s %12s %12s %12s %10s %10s %12s\n", "policy",
+            "cache bytes", "object hits", "byte hits", "evictions",
+            "rejected", "ops/sec");
+
+    for (i = 0; i < npolicies; i++) {
+        for (j = 0; j < ncapacities; j++) {
+            simulate(&trace, policies[i], capacities[j], max_object,
+                    nshards, admission);
+        }
+    }
+
+    for (i = 0; (size_t)i < trace.count; i++) {
+        Free(trace.requests[i].uri);
+    }
+    Free(trace.requests);
+    return 0;
+}
+
+/*
+ * usage - Prints the simulator's command line usage and exits.
+ */
+void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-p policies] [-s sizes] [-m bytes] "
+            "[-n shards] [-a] <trace>\n", prog);
+    exit(1);
+}
+
+/*
+ * now_ns - Returns a monotonic timestamp in nanoseconds.
+ */
+double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * load_trace - Reads every record of a trace file into memory, counting
+ * the lines that are not records. Exits if the file cannot be opened.
+ *
+ * Parameters:
+ *  - path: the trace file
+ *  - trace: filled with the requests
+ */
+void load_trace(char *path, SimTrace *trace)
+{
+    char line[SIM_LINE];
+    TraceRecord rec;
+    SimRequest *req;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "Cannot open trace %s: %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+
+    memset(trace, 0, sizeof(SimTrace));
+    trace->size = 1024;
+    trace->requests = Malloc(trace->size * sizeof(SimRequest));
+    while (fgets(line, SIM_LINE, fp) != NULL) {
+        if (trace_parse(line, &rec) < 0) {
+            trace->skipped += 1;
+            continue;
+        }
+        if (trace->count == trace->size) {
+            trace->size *= 2;
+            trace->requests = Realloc(trace->requests,
+                    trace->size * sizeof(SimRequest));
+        }
+        req = &trace->requests[trace->count];
+        req->uri = Malloc(strlen(rec.uri) + 1);
+        strcpy(req->uri, rec.uri);
+        req->size = rec.size;
+        req->cacheable = rec.cacheable;
+
+        if (trace->count == 0) {
+            trace->first = rec.time;
+        }
+        trace->last = rec.time;
+        trace->count += 1;
+        trace->cacheable += rec.cacheable;
+        trace->bytes += rec.size;
+    }
+
+    fclose(fp);
+    return;
+}
+
+/*
+ * split_list - Splits a comma-separated list in place, into at most
+ * SIM_MAX_RUNS items.
+ *
+ * Return value:
+ *  - the number of items
+ */
+int split_list(char *list, char **items)
+{
+    char *save;
+    char *item;
+    int n = 0;
+
+    for (item = strtok_r(list, ",", &save); item != NULL && n < SIM_MAX_RUNS;
+            item = strtok_r(NULL, ",", &save)) {
+        items[n++] = item;
+    }
+    return n;
+}
+
+/*
+ * parse_size - Parses a number of bytes, optionally followed by K or M.
+ *
+ * Return value:
+ *  - the number of bytes, or 0 if arg is not a size
+ */
+size_t parse_size(char *arg)
+{
+    char *end;
+    size_t size = strtoul(arg, &end, 10);
+
+    if (*arg == '-') {
+        return 0;
+    }
+    if (*end == 'K' || *end == 'k') {
+        size *= 1024;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        size *= 1024 * 1024;
+        end++;
+    }
+    return *end == '\0' ? size : 0;
+}
+
+/*
+ * simulate - Replays the trace through a fresh cache and prints one line
+ * of results.
+ *
+ * Parameters:
+ *  - trace: the trace
+ *  - policy: name of the eviction policy
+ *  - capacity: the cache's budget in bytes
+ *  - max_object: largest object added
+ *  - nshards: number of shards
+ *  - admission: whether TinyLFU admission is on
+ */
+void simulate(SimTrace *trace, const char *policy, size_t capacity,
+        size_t max_object, int nshards, int admission)
+{
+    char *object = Calloc(max_object, 1);
+    Cache *cache = cache_init(capacity, nshards);
+    unsigned long hits = 0;
+    unsigned long long hit_bytes = 0;
+    char label[MAXLINE];
+    SimRequest *req;
+    CacheStats stats;
+    CacheNode *node;
+    double start, elapsed;
+    size_t i;
+
+    cache_set_policy(cache, policy);
+    if (admission) {
+        cache_set_admit(cache);
+    }
+
+    start = now_ns();
+    for (i = 0; i < trace->count; i++) {
+        req = &trace->requests[i];
+        if ((node = cache_lookup(cache, req->uri)) != NULL) {
+            if (node->object_size == req->size) {
+                hits += 1;
+                hit_bytes += req->size;
+                cache_release(node);
+                continue;
+            }
+            /* The object has changed since it was cached */
+            cache_release(node);
+        }
+        if (req->cacheable && req->size <= max_object) {
+            cache_add(cache, req->uri, object, req->size, CACHE_FOREVER);
+        }
+    }
+    elapsed = now_ns() - start;
+
+    cache_get_stats(cache, &stats);
+    snprintf(label, MAXLINE, "%s%s", policy, admission ? "+tinylfu" : "");
+    printf("%14s %12lu %11.1f%% %11.1f%% %10lu %10lu %12.0f\n", label,
+            (unsigned long)capacity,
+            trace->count ? 100.0 * hits / trace->count : 0.0,
+            trace->bytes ? 100.0 * hit_bytes / trace->bytes : 0.0,
+            stats.evictions, stats.rejections,
+            elapsed > 0 ? trace->count / (elapsed / 1e9) : 0.0);
+
+    cache_destroy(cache);
+    Free(object);
+    return;
+}
@@ -0,0 +1,346 @@
+/*
+ * snapshot.c
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This file saves the cache to a snapshot file and
+ * loads it back, so that a restarted proxy does not begin with an empty
+ * cache and send every request to the web servers until it refills.
+ *
+ * A snapshot is a header followed by one record per cached object: its
+ * URI, its content, its expiry and a checksum. The records of each shard
+ * are written most recently used first. A snapshot is written to a
+ * temporary file that is renamed over the old one once it is complete, so
+ * a crash while saving leaves the previous snapshot in place.
+ *
+ * Loading maps the file instead of reading it. A first pass looks only at
+ * the record headers, most recently used first, and picks the records
+ * that fit in the cache; a second pass adds them least recently used
+ * first, so the order they end up in matches the order they were saved
+ * in. Only the chosen records' URIs and contents are ever read, so the
+ * cost of loading depends on how much is loaded, not on the size of the
+ * file.
+ *
+ * A snapshot with the wrong magic, version, byte order or header
+ * checksum, or whose records do not fit exactly in the file, is rejected
+ * before anything is loaded. A record whose own checksum does not match
+ * is skipped.
+ *
+ */
+
+#include "snapshot.h"
+
+/*
+ * Main Snapshot Functions
+ * -----------------------
+ */
+
+/*
+ * snapshot_save - This function writes every object in the cache to a
+ * snapshot file. The cache stays in use while it is saved; each shard is
+ * only locked long enough to take a reference on its nodes.
+ *
+ * Parameters:
+ *  - cache: the cache to save
+ *  - path: the snapshot file, replaced only once the new one is complete
+ * Return value:
+ *  - the number of objects saved, or -1 on error
+ */
+long snapshot_save(Cache *cache, char *path)
+{
+    char tmp[MAXLINE];
+    long saved;
+    FILE *fp;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        fprintf(stderr, "Cannot write snapshot %s: %s\n", tmp,
+                strerror(errno));
+        return -1;
+    }
+
+    saved = write_snapshot(cache, fp);
+    if (fclose(fp) != 0) {
+        saved = -1;
+    }
+    if (saved < 0 || rename(tmp, path) < 0) {
+        fprintf(stderr, "Cannot write snapshot %s: %s\n", path,
+                strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+
+    return saved;
+}
+
+/*
+ * snapshot_load - This function adds the objects in a snapshot file to a
+ * cache, normally an empty one at startup. When the snapshot holds more
+ * than fits, the most recently used objects of each shard are kept. The
+ * cache may have a different number of shards than the one saved.
+ *
+ * Parameters:
+ *  - cache: the cache to fill
+ *  - path: the snapshot file
+ * Return value:
+ *  - the number of objects loaded, 0 if there is no snapshot
+ *  - -1: the snapshot was rejected, and nothing was loaded
+ */
+long snapshot_load(Cache *cache, char *path)
+{
+    SnapshotHeader header;
+    SnapshotRecord *rec;
+    struct stat st;
+    char uri[MAXLINE];
+    char *map;
+    char *data;
+    size_t *chosen;
+    size_t *used;
+    size_t nchosen = 0;
+    size_t pos, len, charge, i;
+    uint64_t n;
+    CacheShard *shard;
+    unsigned long corrupt = 0;
+    long loaded = 0;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        fprintf(stderr, "Cannot read snapshot %s: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(header)) {
+        fprintf(stderr, "Rejected snapshot %s: too short\n", path);
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Cannot map snapshot %s: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+
+    /* Check the header */
+    memcpy(&header, map, sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic))
+            || header.version != SNAPSHOT_VERSION
+            || header.byte_order != SNAPSHOT_BYTE_ORDER
+            || header.checksum != header_sum(&header)
+            || header.bytes != st.st_size - sizeof(header)
+            || header.records > header.bytes / sizeof(SnapshotRecord)) {
+        fprintf(stderr, "Rejected snapshot %s: not a version %d snapshot\n",
+                path, SNAPSHOT_VERSION);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    /*
+     * Check that every record lies within the file and pick the ones
+     * that fit, most recently used first, looking only at their headers.
+     */
+    chosen = Malloc((header.records + 1) * sizeof(size_t));
+    used = Calloc(cache->nshards, sizeof(size_t));
+    pos = sizeof(header);
+    for (n = 0; n < header.records; n++) {
+        if (st.st_size - pos < sizeof(SnapshotRecord)) {
+            break;
+        }
+        rec = (SnapshotRecord *)(map + pos);
+        len = st.st_size - pos - sizeof(SnapshotRecord);
+        if (rec->uri_len == 0 || rec->uri_len >= MAXLINE
+                || rec->uri_len > len || rec->object_size > len
+                || SNAPSHOT_RECORD_LEN(rec->uri_len, rec->object_size)
+                    > st.st_size - pos) {
+            break;
+        }
+
+        shard = get_shard(cache, rec->hash);
+        charge = CACHE_NODE_CHARGE(rec->uri_len, rec->object_size);
+        if (used[shard - cache->shards] + charge <= shard->capacity) {
+            used[shard - cache->shards] += charge;
+            chosen[nchosen++] = pos;
+        }
+        pos += SNAPSHOT_RECORD_LEN(rec->uri_len, rec->object_size);
+    }
+    Free(used);
+    if (n < header.records || pos != (size_t)st.st_size) {
+        fprintf(stderr, "Rejected snapshot %s: bad record %lu\n", path,
+                (unsigned long)n);
+        Free(chosen);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    /* Add the chosen records, least recently used first */
+    for (i = nchosen; i-- > 0; ) {
+        rec = (SnapshotRecord *)(map + chosen[i]);
+        data = (char *)(rec + 1);
+        if (record_sum(rec, data, data + rec->uri_len) != rec->checksum) {
+            corrupt += 1;
+            continue;
+        }
+        memcpy(uri, data, rec->uri_len);
+        uri[rec->uri_len] = '\0';
+        cache_add(cache, uri, data + rec->uri_len, rec->object_size,
+                rec->expires);
+        loaded += 1;
+    }
+    if (corrupt > 0) {
+        fprintf(stderr, "Skipped %lu corrupt objects in snapshot %s\n",
+                corrupt, path);
+    }
+
+    Free(chosen);
+    munmap(map, st.st_size);
+    return loaded;
+}
+
+/*
+ * End Main Snapshot Functions
+ * ---------------------------
+ */
+
+
+/*
+ * Snapshot Helper Functions
+ * -------------------------
+ */
+
+/*
+ * write_snapshot - Writes a whole snapshot to fp. Room is left for the
+ * header, which is written last, once the records have been counted, and
+ * the file is flushed to disk before it is renamed into place.
+ *
+ * Return value:
+ *  - the number of objects written, or -1 on error
+ */
+long write_snapshot(Cache *cache, FILE *fp)
+{
+    SnapshotHeader header;
+    int i;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.saved = time(NULL);
+
+    if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+        return -1;
+    }
+    for (i = 0; i < cache->nshards; i++) {
+        if (save_shard(&cache->shards[i], fp, &header) < 0) {
+            return -1;
+        }
+    }
+
+    header.checksum = header_sum(&header);
+    if (fseek(fp, 0, SEEK_SET) < 0
+            || fwrite(&header, sizeof(header), 1, fp) != 1
+            || fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+        return -1;
+    }
+
+    return header.records;
+}
+
+/*
+ * save_shard - Writes one record for every node in a shard, most recently
+ * used first, and counts them in header. A reference is taken on every
+ * node while the shard is locked, and the nodes are written with no lock
+ * held. The shard is locked for writing, so that the hits lookups have
+ * buffered can be applied to the list first.
+ *
+ * Return value:
+ *  - 0 on success, -1 if writing failed
+ */
+int save_shard(CacheShard *shard, FILE *fp, SnapshotHeader *header)
+{
+    static const char zeros[8];
+    SnapshotRecord rec;
+    CacheNode **nodes;
+    CacheNode *rover;
+    size_t count = 0;
+    size_t len, i;
+    int rtn = 0;
+
+    Pthread_rwlock_wrlock(&shard->lock);
+    drain_hits(shard);
+    nodes = Malloc((shard->node_count + 1) * sizeof(CacheNode *));
+    for (rover = shard->start->next; rover != shard->end;
+            rover = rover->next) {
+        __atomic_add_fetch(&rover->refcount, 1, __ATOMIC_RELAXED);
+        nodes[count++] = rover;
+    }
+    Pthread_rwlock_unlock(&shard->lock);
+
+    for (i = 0; i < count; i++) {
+        if (rtn == 0) {
+            rec.hash = nodes[i]->hash;
+            rec.uri_len = strlen(nodes[i]->uri);
+            rec.pad = 0;
+            rec.object_size = nodes[i]->object_size;
+            rec.expires = __atomic_load_n(&nodes[i]->expires,
+                    __ATOMIC_RELAXED);
+            rec.checksum = record_sum(&rec, nodes[i]->uri,
+                    nodes[i]->content);
+            len = rec.uri_len + rec.object_size;
+            if (fwrite(&rec, sizeof(rec), 1, fp) != 1
+                    || fwrite(nodes[i]->uri, 1, rec.uri_len, fp)
+                        != rec.uri_len
+                    || fwrite(nodes[i]->content, 1, rec.object_size, fp)
+                        != rec.object_size
+                    || fwrite(zeros, 1, SNAPSHOT_ALIGN(len) - len, fp)
+                        != SNAPSHOT_ALIGN(len) - len) {
+                rtn = -1;
+            }
+            header->records += 1;
+            header->bytes += SNAPSHOT_RECORD_LEN(rec.uri_len,
+                    rec.object_size);
+        }
+        cache_release(nodes[i]);
+    }
+
+    Free(nodes);
+    return rtn;
+}
+
+/*
+ * header_sum - Returns the checksum of a snapshot header, computed as if
+ * its checksum field were 0.
+ */
+uint64_t header_sum(SnapshotHeader *header)
+{
+    SnapshotHeader copy = *header;
+
+    copy.checksum = 0;
+    return fnv_sum(&copy, sizeof(copy), SNAPSHOT_SUM_INIT);
+}
+
+/*
+ * record_sum - Returns the checksum of a record: of its hash, lengths and
+ * expiry, then of its URI and content.
+ */
+uint64_t record_sum(SnapshotRecord *rec, const char *uri,
+        const char *content)
+{
+    uint64_t sum = SNAPSHOT_SUM_INIT;
+
+    sum = fnv_sum(&rec->hash, sizeof(rec->hash), sum);
+    sum = fnv_sum(&rec->uri_len, sizeof(rec->uri_len), sum);
+    sum = fnv_sum(&rec->object_size, sizeof(rec->object_size), sum);
+    sum = fnv_sum(&rec->expires, sizeof(rec->expires), sum);
+    sum = fnv_sum(uri, rec->uri_len, sum);
+    return fnv_sum(content, rec->object_size, sum);
+}
+
+/*
+ * End Snapshot Helper Functions
+ * -----------------------------
+ */
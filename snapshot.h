@@ -0,0 +1,76 @@
+/*
+ * snapshot.h
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This is the header file for snapshot.c, which saves
+ * the cache to a file and loads it back when the proxy restarts. This
+ * file just has the relevant macros, structure definitions, and function
+ * prototypes.
+ *
+ */
+
+/* Include guards */
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdint.h>
+
+#include "csapp.h"
+#include "cache.h"
+
+/* Macros */
+#define SNAPSHOT_MAGIC "WPCACHE"  /* First bytes of every snapshot, with
+                                     the NUL */
+#define SNAPSHOT_VERSION 2       /* Bumped whenever the layout changes */
+#define SNAPSHOT_BYTE_ORDER 0x01020304 /* Read back differently on a
+                                          machine of another byte order */
+#define SNAPSHOT_SUM_INIT 14695981039346656037ULL /* FNV-1a offset basis,
+                                                     starts a checksum */
+
+/* Records are padded so that every record header is 8-byte aligned */
+#define SNAPSHOT_ALIGN(n) (((n) + 7) & ~(size_t)7)
+#define SNAPSHOT_RECORD_LEN(uri_len, object_size) \
+    (sizeof(SnapshotRecord) + SNAPSHOT_ALIGN((uri_len) + (object_size)))
+
+/*
+ * The start of a snapshot file. checksum covers the header itself, with
+ * checksum taken as 0; each record carries its own.
+ */
+typedef struct SnapshotHeader {
+    char magic[8];               /* SNAPSHOT_MAGIC */
+    uint32_t version;            /* SNAPSHOT_VERSION */
+    uint32_t byte_order;         /* SNAPSHOT_BYTE_ORDER */
+    uint64_t records;            /* Number of records after the header */
+    uint64_t bytes;              /* Length of those records */
+    int64_t saved;               /* When the snapshot was written */
+    uint64_t checksum;           /* Checksum of the header */
+} SnapshotHeader;
+
+/*
+ * One cached object. The record is followed by uri_len bytes of URI, with
+ * no NUL, then object_size bytes of content, then padding. The records of
+ * one shard are written most recently used first.
+ */
+typedef struct SnapshotRecord {
+    uint64_t hash;               /* Hash of the URI, as hash_uri gives it */
+    uint32_t uri_len;            /* Length of the URI */
+    uint32_t pad;                /* Always 0 */
+    uint64_t object_size;        /* Length of the content */
+    int64_t expires;             /* When the content goes stale */
+    uint64_t checksum;           /* Checksum of the fields above, the URI
+                                    and the content */
+} SnapshotRecord;
+
+/* Main Snapshot Function Prototypes */
+long snapshot_save(Cache *cache, char *path);
+long snapshot_load(Cache *cache, char *path);
+/* Snapshot Helper Functions */
+long write_snapshot(Cache *cache, FILE *fp);
+int save_shard(CacheShard *shard, FILE *fp, SnapshotHeader *header);
+uint64_t header_sum(SnapshotHeader *header);
+uint64_t record_sum(SnapshotRecord *rec, const char *uri,
+        const char *content);
+
+#endif
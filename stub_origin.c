@@ -0,0 +1,270 @@
+/*
+ * stub_origin.c
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This file is a stub web server for benchmarking the
+ * proxy on one machine without network access. It answers every GET with
+ * a cacheable object of a size that depends only on the path, so that the
+ * same URI always gets the same object, after a fixed delay that stands
+ * in for the latency of a real web server. Each connection gets its own
+ * thread and is kept open for as long as the client asks.
+ *
+ * GET /stats is not counted, and answers with the number of objects and
+ * bytes served so far, which the load generator uses to work out the
+ * proxy's hit ratio.
+ *
+ * Usage: stub_origin [-l ms] [-s sizes] [-m seconds] <port>
+ *  - -l ms: delay before every response (default: ORIGIN_DEFAULT_LATENCY)
+ *  - -s sizes: object size distribution: "mix", mostly small objects of
+ *              up to 8 KB with ORIGIN_BIG_PERCENT of them large, up to
+ *              about 100 KB; "N", every object N bytes; or "MIN-MAX",
+ *              sizes spread evenly between MIN and MAX bytes (default:
+ *              mix)
+ *  - -m seconds: max-age the objects are served with (default:
+ *                ORIGIN_DEFAULT_MAX_AGE)
+ */
+
+/* For strcasestr */
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <netinet/tcp.h>
+
+#include "csapp.h"
+
+/* Macros */
+#define ORIGIN_DEFAULT_LATENCY 5     /* Default milliseconds per response */
+#define ORIGIN_DEFAULT_MAX_AGE 3600  /* Default freshness of objects */
+#define ORIGIN_BIG_PERCENT 20        /* Percent of large objects in mix */
+#define ORIGIN_MAX_BODY (1024 * 1024) /* Largest object served */
+
+/* Global Variables */
+char body[ORIGIN_MAX_BODY];          /* Every body is a prefix of this */
+int latency = ORIGIN_DEFAULT_LATENCY; /* Milliseconds per response */
+int max_age = ORIGIN_DEFAULT_MAX_AGE; /* Freshness of objects, seconds */
+int mix = 1;                         /* Sizes come from the mix */
+size_t min_size;                     /* Otherwise, smallest object */
+size_t max_size;                     /* And largest object */
+unsigned long served;                /* Objects served */
+unsigned long long served_bytes;     /* Body bytes served */
+
+/* Function prototypes */
+void usage(char *prog);
+int parse_sizes(char *arg);
+void *serve_thread(void *vargp);
+int serve_request(rio_t *rio, int fd);
+size_t object_size(char *path);
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_in clientaddr;
+    socklen_t clientlen;
+    pthread_t tid;
+    int listenfd;
+    int *connfd;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:s:m:")) != -1) {
+        switch (opt) {
+        case 'l':
+            latency = atoi(optarg);
+            break;
+        case 's':
+            if (parse_sizes(optarg) < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'm':
+            max_age = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || latency < 0 || max_age < 0) {
+        usage(argv[0]);
+    }
+
+    Signal(SIGPIPE, SIG_IGN);
+    memset(body, 'x', sizeof(body));
+    listenfd = Open_listenfd(atoi(argv[optind]));
+
+    while (1) {
+        clientlen = sizeof(clientaddr);
+        connfd = Malloc(sizeof(int));
+        *connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        Pthread_create(&tid, NULL, serve_thread, connfd);
+    }
+    return 0;
+}
+
+/*
+ * usage - Prints the server's command line usage and exits.
+ */
+void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-l ms] [-s mix|N|MIN-MAX] [-m seconds] "
+            "<port>\n", prog);
+    exit(1);
+}
+
+/*
+ * parse_sizes - Parses the -s argument into the size distribution.
+ *
+ * Return value:
+ *  - 0 on success, -1 if it is not a distribution
+ */
+int parse_sizes(char *arg)
+{
+    char *end;
+
+    if (!strcmp(arg, "mix")) {
+        mix = 1;
+        return 0;
+    }
+
+    mix = 0;
+    min_size = strtoul(arg, &end, 10);
+    max_size = min_size;
+    if (*end == '-') {
+        max_size = strtoul(end + 1, &end, 10);
+    }
+    if (*end != '\0' || *arg == '-' || min_size > max_size
+            || max_size > ORIGIN_MAX_BODY) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * serve_thread - Serves requests on one connection until the client
+ * closes it or asks for it to be closed.
+ *
+ * Parameter:
+ *  - vargp: pointer to the connection's descriptor, which is freed
+ */
+void *serve_thread(void *vargp)
+{
+    int fd = *(int *)vargp;
+    int on = 1;
+    rio_t rio;
+
+    Free(vargp);
+    Pthread_detach(pthread_self());
+
+    /* Send the body straight after the headers, as a real server would */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    Rio_readinitb(&rio, fd);
+    while (serve_request(&rio, fd)) {
+        ;
+    }
+    Close(fd);
+    return NULL;
+}
+
+/*
+ * serve_request - Reads one request and answers it. An HTTP/1.1 request
+ * keeps the connection open unless it says Connection: close, and an
+ * HTTP/1.0 one only if it says Connection: keep-alive.
+ *
+ * Parameters:
+ *  - rio: rio state of the connection
+ *  - fd: the connection
+ * Return value:
+ *  - 1: the connection stays open for another request
+ *  - 0: it must be closed
+ */
+int serve_request(rio_t *rio, int fd)
+{
+    char line[MAXLINE], method[MAXLINE], target[MAXLINE], version[MAXLINE];
+    char head[MAXLINE];
+    char stats[MAXLINE];
+    char *path = target;
+    char *data;
+    size_t size;
+    int keep_alive;
+
+    if (rio_readlineb(rio, line, MAXLINE) <= 0
+            || sscanf(line, "%s %s %s", method, target, version) != 3) {
+        return 0;
+    }
+    keep_alive = !strcmp(version, "HTTP/1.1");
+    while (1) {
+        if (rio_readlineb(rio, line, MAXLINE) <= 0) {
+            return 0;
+        }
+        if (!strcmp(line, "\r\n") || !strcmp(line, "\n")) {
+            break;
+        }
+        if (!strncasecmp(line, "Connection:", strlen("Connection:"))) {
+            if (strcasestr(line, "close") != NULL) {
+                keep_alive = 0;
+            } else if (strcasestr(line, "keep-alive") != NULL) {
+                keep_alive = 1;
+            }
+        }
+    }
+
+    /* Accept the absolute form too, by skipping the scheme and host */
+    if (!strncmp(path, "http://", strlen("http://"))
+            && (path = strchr(path + strlen("http://"), '/')) == NULL) {
+        path = "/";
+    }
+
+    if (!strcmp(path, "/stats")) {
+        snprintf(stats, MAXLINE, "requests %lu bytes %llu\n",
+                __atomic_load_n(&served, __ATOMIC_RELAXED),
+                __atomic_load_n(&served_bytes, __ATOMIC_RELAXED));
+        data = stats;
+        size = strlen(stats);
+        snprintf(head, MAXLINE, "HTTP/1.1 200 OK\r\n"
+                "Content-Length: %lu\r\nCache-Control: no-store\r\n"
+                "Content-Type: text/plain\r\n%s\r\n", (unsigned long)size,
+                keep_alive ? "" : "Connection: close\r\n");
+    } else {
+        if (latency > 0) {
+            usleep(latency * 1000);
+        }
+        data = body;
+        size = object_size(path);
+        __atomic_add_fetch(&served, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&served_bytes, size, __ATOMIC_RELAXED);
+        snprintf(head, MAXLINE, "HTTP/1.1 200 OK\r\n"
+                "Content-Length: %lu\r\nCache-Control: max-age=%d\r\n"
+                "Content-Type: application/octet-stream\r\n%s\r\n",
+                (unsigned long)size, max_age,
+                keep_alive ? "" : "Connection: close\r\n");
+    }
+
+    if (rio_writen(fd, head, strlen(head)) < 0
+            || (strcasecmp(method, "HEAD")
+                && rio_writen(fd, data, size) < 0)) {
+        return 0;
+    }
+    return keep_alive;
+}
+
+/*
+ * object_size - Returns the size of the object at a path, from a hash of
+ * the path, so that it is the same every time.
+ */
+size_t object_size(char *path)
+{
+    uint64_t hash = 14695981039346656037ULL; /* FNV offset basis */
+
+    for ( ; *path != '\0'; path++) {
+        hash ^= (unsigned char)*path;
+        hash *= 1099511628211ULL;            /* FNV prime */
+    }
+    hash ^= hash >> 29;
+
+    if (!mix) {
+        return min_size + (hash >> 8) % (max_size - min_size + 1);
+    }
+    if ((hash >> 32) % 100 < ORIGIN_BIG_PERCENT) {
+        return 20 * 1024 + (hash >> 8) % (80 * 1024);
+    }
+    return 512 + (hash >> 8) % (8 * 1024 - 512);
+}
@@ -4,12 +4,256 @@
  * Author: Kais Kudrolli
  * Andrew ID: kkudroll
  *
- * File Description: This file tests basic cache functions.
+ * File Description: This file tests basic cache functions, the disk tier
+ * below the cache, cache snapshots, the cache of web server addresses, the
+ * rules for serving stale objects, TinyLFU admission, the eviction
+ * policies, and access traces, and stresses the cache from many threads
+ * at once. Build it with make tsan to run it under ThreadSanitizer.
  */
 
 #include <assert.h>
+#include <sys/eventfd.h>
 
 #include "cache.h"
+#include "dns.h"
+#include "disk.h"
+#include "snapshot.h"
+#include "flight.h"
+#include "http.h"
+#include "refresh.h"
+#include "trace.h"
+
+/* Macros */
+#define STRESS_THREADS 8        /* Threads sharing the stressed cache */
+#define STRESS_KEYS 64          /* URIs each stress thread adds */
+#define STRESS_OPS 20000        /* Operations done by each stress thread */
+#define STRESS_MAX_SIZE 600     /* Largest object in the stress test */
+#define GROW_KEYS 2000          /* URIs each growing thread adds */
+#define STRESS_CAPACITY (STRESS_THREADS * STRESS_KEYS / 4 \
+        * CACHE_NODE_CHARGE(8, STRESS_MAX_SIZE / 2))
+
+/*
+ * One stress thread: the cache it shares, which URIs are its own, and
+ * what it did.
+ */
+typedef struct StressArgs {
+    Cache *cache;               /* The shared cache */
+    int id;                     /* Its URIs are id * STRESS_KEYS onwards */
+    unsigned long adds;         /* Adds it made */
+} StressArgs;
+
+int stub_calls = 0;             /* Lookups the stub resolver has done */
+int stress_done = 0;            /* The stress threads have finished */
+unsigned long stress_evicted = 0; /* Nodes handed to the evict hook */
+
+/*
+ * lookup_copy - Looks up a URI and, on a hit, copies the content out of
+ * the returned handle and releases it.
+ */
+int lookup_copy(Cache *cache, char *uri, char *content, size_t *size)
+{
+    CacheNode *node = cache_lookup(cache, uri);
+
+    if (node == NULL) {
+        return 0;
+    }
+    memcpy(content, node->content, node->object_size);
+    *size = node->object_size;
+    cache_release(node);
+    return 1;
+}
+
+/*
+ * stub_resolve - A resolver that never touches the network. "good" is
+ * 127.0.0.1, "slow" is 127.0.0.2 after a pause, "two" is both, and every
+ * other name fails. It counts its calls.
+ */
+int stub_resolve(char *host, DnsAddr *addrs, int max)
+{
+    struct sockaddr_in *addr = (struct sockaddr_in *)&addrs[0].addr;
+
+    __atomic_add_fetch(&stub_calls, 1, __ATOMIC_RELAXED);
+    if (!strcmp(host, "two")) {
+        stub_resolve("good", addrs, max);
+        stub_resolve("slow", addrs + 1, max - 1);
+        return 2;
+    }
+    if (!strcmp(host, "slow")) {
+        usleep(100000);
+    } else if (strcmp(host, "good")) {
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(strcmp(host, "slow") ? 0x7f000001
+            : 0x7f000002);
+    addrs[0].len = sizeof(*addr);
+    return 1;
+}
+
+/*
+ * lookup_thread - Looks up "slow" in the cache passed to it.
+ */
+void *lookup_thread(void *vargp)
+{
+    DnsAddr addr;
+
+    assert(dns_lookup(vargp, "slow", 80, &addr, 1) == 1);
+    return NULL;
+}
+
+/*
+ * stress_size - Returns the size of the object stored under a stress URI,
+ * the same every time, so that any copy of it can be checked.
+ */
+size_t stress_size(int key)
+{
+    return 1 + (key * 37) % STRESS_MAX_SIZE;
+}
+
+/*
+ * stress_check - Checks that a node holds exactly the object its URI
+ * names: stress_size bytes of one letter picked by the key.
+ */
+void stress_check(CacheNode *node)
+{
+    int key = atoi(node->uri + 1);
+    size_t i;
+
+    assert(node->object_size == stress_size(key));
+    for (i = 0; i < node->object_size; i++) {
+        assert(node->content[i] == 'a' + key % 26);
+    }
+}
+
+/*
+ * stress_evict - Evict hook of the stressed cache, which checks and
+ * counts every evicted node.
+ */
+void stress_evict(void *arg, CacheNode *node)
+{
+    stress_check(node);
+    __atomic_add_fetch(&stress_evicted, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * stress_thread - Looks up random URIs of every thread, checking each
+ * hit and sometimes refreshing it, and adds one of its own URIs whenever
+ * it misses. Only the owner adds a URI, and only after missing it, so no
+ * add replaces a cached node, and every add is either still cached at the
+ * end, or was evicted, or was turned away by admission.
+ */
+void *stress_thread(void *vargp)
+{
+    StressArgs *args = vargp;
+    unsigned int seed = args->id + 1;
+    char object[STRESS_MAX_SIZE];
+    char uri[MAXLINE];
+    CacheNode *node;
+    int key;
+    int i;
+
+    for (i = 0; i < STRESS_OPS; i++) {
+        if (rand_r(&seed) % 2) {
+            key = args->id * STRESS_KEYS + rand_r(&seed) % STRESS_KEYS;
+        } else {
+            key = rand_r(&seed) % (STRESS_THREADS * STRESS_KEYS);
+        }
+        sprintf(uri, "/%d", key);
+
+        if ((node = cache_lookup(args->cache, uri)) != NULL) {
+            stress_check(node);
+            if (rand_r(&seed) % 16 == 0) {
+                cache_refresh(node, CACHE_FOREVER);
+            }
+            cache_release(node);
+        } else if (key / STRESS_KEYS == args->id) {
+            memset(object, 'a' + key % 26, stress_size(key));
+            cache_add(args->cache, uri, object, stress_size(key),
+                    CACHE_FOREVER);
+            args->adds += 1;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * grow_thread - Adds its own URIs one by one to a cache with room for
+ * every thread's, while the other threads do the same, so the shards'
+ * indexes grow under their lookups, and checks after each add that one of
+ * its earlier URIs, picked at random, is still found.
+ */
+void *grow_thread(void *vargp)
+{
+    StressArgs *args = vargp;
+    unsigned int seed = args->id + 1;
+    char object[STRESS_MAX_SIZE];
+    char uri[MAXLINE];
+    CacheNode *node;
+    int key;
+    int i;
+
+    for (i = 0; i < GROW_KEYS; i++) {
+        key = args->id * GROW_KEYS + i;
+        sprintf(uri, "/%d", key);
+        memset(object, 'a' + key % 26, stress_size(key));
+        cache_add(args->cache, uri, object, stress_size(key), CACHE_FOREVER);
+        args->adds += 1;
+
+        sprintf(uri, "/%d", args->id * GROW_KEYS + rand_r(&seed) % (i + 1));
+        node = cache_lookup(args->cache, uri);
+        assert(node != NULL);
+        stress_check(node);
+        cache_release(node);
+    }
+    return NULL;
+}
+
+/*
+ * stress_monitor - Checks the cache's counters over and over while the
+ * stress threads run, so that the budget is never seen exceeded.
+ */
+void *stress_monitor(void *vargp)
+{
+    CacheStats stats;
+
+    while (!__atomic_load_n(&stress_done, __ATOMIC_ACQUIRE)) {
+        cache_get_stats(vargp, &stats);
+        assert(stats.bytes <= STRESS_CAPACITY);
+    }
+    return NULL;
+}
+
+/*
+ * check_shards - Checks, with no other thread using the cache, that each
+ * shard's list and hash index hold the same nodes, that its counters
+ * match them, and that it is within its budget.
+ */
+void check_shards(Cache *cache)
+{
+    CacheShard *shard;
+    CacheNode *node;
+    size_t nodes, bytes;
+    int i;
+
+    for (i = 0; i < cache->nshards; i++) {
+        shard = &cache->shards[i];
+        nodes = 0;
+        bytes = 0;
+        for (node = shard->start->next; node != shard->end;
+                node = node->next) {
+            assert(node->next->prev == node);
+            assert(find_node(shard, node->uri, node->hash) == node);
+            assert(node->refcount == 1);
+            nodes += 1;
+            bytes += node->charge;
+        }
+        assert(nodes == shard->node_count && bytes == shard->byte_count);
+        assert(shard->byte_count <= shard->capacity);
+        assert(shard->peak_bytes <= shard->capacity);
+    }
+}
 
 int main() {
     
@@ -21,11 +265,58 @@ int main() {
     char object[MAX_OBJECT_SIZE];
     char object2[MAX_OBJECT_SIZE];
     char object3[MAX_OBJECT_SIZE];
+    memset(object, 0, sizeof(object));
     strcpy(uri, "A");
     strcpy(content, "Bye ");
     int hit;
+    CacheStats stats;
+    CacheNode *node;
+    size_t size;
+    static char big[MAX_OBJECT_SIZE];
+    static char binary[MAX_OBJECT_SIZE];
+    static char binary_out[MAX_OBJECT_SIZE];
+    size_t i;
+    DnsCache *dns;
+    DnsAddr addrs[DNS_MAX_ADDRS];
+    DnsStats dns_stats;
+    pthread_t tids[4];
+    DiskCache *disk;
+    DiskObject obj;
+    DiskStats disk_stats;
+    int fds[2];
+    UpstreamPool *upstream;
+    char *snap = "/tmp/test_cache.snap";
+    FILE *fp;
+    FlightTable *flights;
+    FlightStats flight_stats;
+    Flight *lead;
+    Flight *follow;
+    Flight *other;
+    int leader;
+    int wake;
+    uint64_t count;
+    time_t now = time(NULL);
+    time_t expires;
+    Buf request;
+    char *resp;
+    RefreshPool *refresh;
+    RefreshStats refresh_stats;
+    Admit *admit;
+    const char *policies[] = {"lru", "arc", "s3fifo", "gdsf"};
+    size_t p;
+    size_t found;
+    Trace *trace;
+    TraceRecord rec;
+    char line[MAXLINE];
+    StressArgs stress[STRESS_THREADS];
+    pthread_t stress_tids[STRESS_THREADS];
+    pthread_t monitor;
+    unsigned long adds;
+
+    memset(big, 'x', sizeof(big) - 1);
 
-    cache = cache_init(cache);
+    /* Room for exactly two of the test objects */
+    cache = cache_init(2 * CACHE_NODE_CHARGE(1, 4), 1);
 
     assert(cache != NULL);
 
@@ -33,31 +324,771 @@ int main() {
     assert(get_cache_size(cache) == 0);
 
     /* Lookup without adding anything should yield a miss */
-    assert(!cache_lookup(cache, uri, object));
+    assert(!lookup_copy(cache, uri, object, &size));
 
     /* After adding a node, there should be a hit */
-    cache_add(cache, uri, content);
-    hit = cache_lookup(cache, uri, object);
+    cache_add(cache, uri, content, strlen(content), CACHE_FOREVER);
+    hit = lookup_copy(cache, uri, object, &size);
     assert(hit);
+    assert(size == strlen(content));
     assert(!strcmp(content, object));
 
     /* Add nodes so that one has to be removed */
-    /* Changed macros in cache.h to be lower when testing */
-    /* object -> 4, cache -> 10 */
     strcpy(uri2, "B");
     strcpy(object2, "hi! ");
     strcpy(uri3, "C");
     strcpy(object3, "bye ");
-    cache_add(cache, uri2, object2);
-    cache_add(cache, uri3, object3);
-    hit = cache_lookup(cache, uri3, content);
+    cache_add(cache, uri2, object2, strlen(object2), CACHE_FOREVER);
+    cache_add(cache, uri3, object3, strlen(object3), CACHE_FOREVER);
+    hit = lookup_copy(cache, uri3, content, &size);
     assert(hit);
     assert(!strcmp(content, object3));
-    hit = cache_lookup(cache, uri, content);
+    hit = lookup_copy(cache, uri, content, &size);
     assert(!hit);
     assert(strcmp(content, object));
 
+    /* A hit makes a node most recently used, so the other one is evicted */
+    hit = lookup_copy(cache, uri2, content, &size);
+    assert(hit);
+    cache_add(cache, uri, object, strlen(object), CACHE_FOREVER);
+    assert(lookup_copy(cache, uri2, content, &size));
+    assert(!strcmp(content, object2));
+    assert(!lookup_copy(cache, uri3, content, &size));
+    assert(lookup_copy(cache, uri, content, &size));
+
+    /* The counters track adds and evictions */
+    cache_get_stats(cache, &stats);
+    assert(stats.nodes == 2);
+    assert(stats.bytes == 2 * CACHE_NODE_CHARGE(1, 4));
+    assert(get_cache_size(cache) == stats.bytes);
+    assert(stats.peak_nodes == 2);
+    assert(stats.peak_bytes == stats.bytes);
+    assert(stats.evictions == 2);
+
+    /* A handle stays readable after its node is evicted */
+    node = cache_lookup(cache, uri);
+    assert(node != NULL);
+    cache_add(cache, uri2, object2, strlen(object2), CACHE_FOREVER);
+    cache_add(cache, uri3, object3, strlen(object3), CACHE_FOREVER);
+    assert(!lookup_copy(cache, uri, content, &size));
+    assert(node->object_size == strlen(object));
+    assert(!memcmp(node->content, object, node->object_size));
+    cache_release(node);
+
+    /* An object bigger than the whole cache is not stored */
+    cache_add(cache, uri, big, sizeof(big), CACHE_FOREVER);
+    assert(!lookup_copy(cache, uri, content, &size));
+    assert(lookup_copy(cache, uri3, content, &size));
+
+    cache_destroy(cache);
+
+    /* Binary objects, including NUL bytes, are cached and replayed intact */
+    cache = cache_init(MAX_CACHE_SIZE, 0);
+    for (i = 0; i < sizeof(binary); i++) {
+        binary[i] = (char)(i * 7);
+    }
+    cache_add(cache, "bin", binary, sizeof(binary), CACHE_FOREVER);
+    memset(binary_out, 0xff, sizeof(binary_out));
+    assert(lookup_copy(cache, "bin", binary_out, &size));
+    assert(size == sizeof(binary));
+    assert(!memcmp(binary, binary_out, sizeof(binary)));
+
+    /* An object that starts with a NUL byte keeps its full length */
+    cache_add(cache, "nul", "\0a\0b", 4, CACHE_FOREVER);
+    assert(lookup_copy(cache, "nul", binary_out, &size));
+    assert(size == 4);
+    assert(!memcmp(binary_out, "\0a\0b", 4));
+
+    /* An empty object is a hit of length zero */
+    cache_add(cache, "empty", "", 0, CACHE_FOREVER);
+    assert(lookup_copy(cache, "empty", binary_out, &size));
+    assert(size == 0);
+
     cache_destroy(cache);
+
+    /* The default shard count leaves room for the largest objects */
+    cache = cache_init(MAX_CACHE_SIZE, 0);
+    assert(cache->nshards >= 1);
+    assert(cache->nshards == 1 
+            || MAX_CACHE_SIZE / cache->nshards >= CACHE_MIN_SHARD_SIZE);
+    cache_destroy(cache);
+
+    /* Objects spread over several shards are all found again */
+    cache = cache_init(64 * 4 * CACHE_NODE_CHARGE(8, 4), 4);
+    for (i = 0; i < 64; i++) {
+        sprintf(uri, "k%lu", (unsigned long)i);
+        cache_add(cache, uri, "data", 4, CACHE_FOREVER);
+    }
+    for (i = 0; i < 64; i++) {
+        sprintf(uri, "k%lu", (unsigned long)i);
+        assert(lookup_copy(cache, uri, content, &size));
+        assert(size == 4 && !memcmp(content, "data", 4));
+    }
+    cache_get_stats(cache, &stats);
+    assert(stats.nodes == 64);
+    assert(stats.evictions == 0);
+    for (i = 0; i < 4; i++) {
+        assert(cache->shards[i].node_count > 0);
+    }
+    cache_destroy(cache);
+
+    /* A resolved name is looked up once and then served from the cache */
+    dns = dns_init(60, 60, stub_resolve);
+    assert(dns_lookup(dns, "good", 8080, addrs, DNS_MAX_ADDRS) == 1);
+    assert(dns_lookup(dns, "good", 80, addrs, DNS_MAX_ADDRS) == 1);
+    assert(stub_calls == 1);
+    assert(((struct sockaddr_in *)&addrs[0].addr)->sin_port == htons(80));
+    assert(((struct sockaddr_in *)&addrs[0].addr)->sin_addr.s_addr
+            == htonl(0x7f000001));
+
+    /* A name that fails is remembered as failing */
+    assert(dns_lookup(dns, "bad", 80, addrs, DNS_MAX_ADDRS) < 0);
+    assert(dns_lookup(dns, "bad", 80, addrs, DNS_MAX_ADDRS) < 0);
+    assert(stub_calls == 2);
+
+    /* Threads that want the same name at once share one lookup */
+    for (i = 0; i < 4; i++) {
+        Pthread_create(&tids[i], NULL, lookup_thread, dns);
+    }
+    for (i = 0; i < 4; i++) {
+        Pthread_join(tids[i], NULL);
+    }
+    assert(stub_calls == 3);
+
+    dns_get_stats(dns, &dns_stats);
+    assert(dns_stats.names == 3);
+    assert(dns_stats.misses == 3);
+    assert(dns_stats.hits + dns_stats.shared == 5);
+    assert(dns_stats.negative_hits == 1);
+
+    /* An address that failed to connect is tried after the others */
+    assert(dns_lookup(dns, "two", 80, addrs, DNS_MAX_ADDRS) == 2);
+    assert(((struct sockaddr_in *)&addrs[0].addr)->sin_addr.s_addr
+            == htonl(0x7f000001));
+    dns_report(dns, "two", &addrs[0], 0);
+    assert(dns_lookup(dns, "two", 80, addrs, DNS_MAX_ADDRS) == 2);
+    assert(((struct sockaddr_in *)&addrs[0].addr)->sin_addr.s_addr
+            == htonl(0x7f000002));
+    dns_report(dns, "two", &addrs[1], 1);
+    assert(dns_lookup(dns, "two", 80, addrs, DNS_MAX_ADDRS) == 2);
+    assert(((struct sockaddr_in *)&addrs[0].addr)->sin_addr.s_addr
+            == htonl(0x7f000001));
+    dns_destroy(dns);
+
+    /* With no TTL every lookup goes to the resolver */
+    dns = dns_init(0, 0, stub_resolve);
+    assert(dns_lookup(dns, "good", 80, addrs, DNS_MAX_ADDRS) == 1);
+    assert(dns_lookup(dns, "good", 80, addrs, DNS_MAX_ADDRS) == 1);
+    assert(stub_calls == 8);
+    dns_destroy(dns);
+
+    /* The default resolver finds names in /etc/hosts */
+    dns = dns_init(60, 5, NULL);
+    assert(dns_lookup(dns, "localhost", 80, addrs, DNS_MAX_ADDRS) >= 1);
+    dns_destroy(dns);
+
+    /* Objects evicted from memory are demoted to disk */
+    cache = cache_init(2 * CACHE_NODE_CHARGE(1, 4), 1);
+    disk = disk_init(cache, "/tmp", 4 * MAX_OBJECT_SIZE);
+    assert(disk != NULL);
+    cache_add(cache, "A", "aaaa", 4, CACHE_FOREVER);
+    cache_add(cache, "B", "bbbb", 4, CACHE_FOREVER);
+    cache_add(cache, "C", "cccc", 4, CACHE_FOREVER);
+    assert(!lookup_copy(cache, "A", content, &size));
+    disk_get_stats(disk, &disk_stats);
+    assert(disk_stats.objects == 1 && disk_stats.demoted == 1);
+    assert(disk_stats.bytes == 4 && disk_stats.segments == 1);
+
+    /* A disk hit can be sent from the file, and is promoted */
+    assert(disk_lookup(disk, "A", &obj));
+    assert(obj.size == 4 && !memcmp(obj.content, "aaaa", 4));
+    assert(pipe(fds) == 0);
+    size = 1;
+    assert(disk_send(&obj, fds[1], &size, 4) == 0);
+    assert(size == 4);
+    assert(read(fds[0], content, sizeof(content)) == 3);
+    assert(!memcmp(content, "aaa", 3));
+    close(fds[0]);
+    close(fds[1]);
+    disk_release(&obj);
+    assert(lookup_copy(cache, "A", content, &size));
+    assert(size == 4 && !memcmp(content, "aaaa", 4));
+    assert(!lookup_copy(cache, "B", content, &size));
+
+    /* Evicting a promoted object does not write it again */
+    cache_add(cache, "D", "dddd", 4, CACHE_FOREVER);
+    cache_add(cache, "E", "eeee", 4, CACHE_FOREVER);
+    assert(!lookup_copy(cache, "A", content, &size));
+    assert(!disk_lookup(disk, "Z", &obj));
+    disk_get_stats(disk, &disk_stats);
+    assert(disk_stats.objects == 3 && disk_stats.demoted == 3);
+    assert(disk_stats.hits == 1 && disk_stats.misses == 1);
+
+    /* A promoted object refreshed in memory has its expiry updated */
+    assert(disk_lookup(disk, "A", &obj));
+    disk_release(&obj);
+    expires = time(NULL) + 60;
+    node = cache_lookup(cache, "A");
+    assert(node != NULL);
+    cache_refresh(node, expires);
+    cache_release(node);
+    cache_add(cache, "F", "ffff", 4, CACHE_FOREVER);
+    cache_add(cache, "G", "gggg", 4, CACHE_FOREVER);
+    assert(!lookup_copy(cache, "A", content, &size));
+    disk_get_stats(disk, &disk_stats);
+    assert(disk_stats.objects == 5 && disk_stats.demoted == 5);
+    assert(disk_lookup(disk, "A", &obj));
+    assert(obj.size == 4 && obj.expires == expires);
+    disk_release(&obj);
+
+    /* One replaced in memory is written again, over the outdated entry */
+    cache_add(cache, "A", "AAAAAA", 6, CACHE_FOREVER);
+    cache_add(cache, "H", "hhhh", 4, CACHE_FOREVER);
+    assert(!lookup_copy(cache, "A", content, &size));
+    disk_get_stats(disk, &disk_stats);
+    assert(disk_stats.objects == 7 && disk_stats.demoted == 8);
+    assert(disk_lookup(disk, "A", &obj));
+    assert(obj.size == 6 && !memcmp(obj.content, "AAAAAA", 6));
+    assert(obj.expires == CACHE_FOREVER);
+    disk_release(&obj);
+
+    /* So is one replaced by a body of the same length */
+    cache_add(cache, "A", "BBBBBB", 6, CACHE_FOREVER);
+    cache_add(cache, "I", "iiii", 4, CACHE_FOREVER);
+    assert(!lookup_copy(cache, "A", content, &size));
+    disk_get_stats(disk, &disk_stats);
+    assert(disk_stats.objects == 8 && disk_stats.demoted == 10);
+    assert(disk_lookup(disk, "A", &obj));
+    assert(obj.size == 6 && !memcmp(obj.content, "BBBBBB", 6));
+    disk_release(&obj);
+    disk_destroy(disk);
+    cache_destroy(cache);
+
+    /* The oldest segment is dropped to stay within the budget */
+    cache = cache_init(CACHE_NODE_CHARGE(2, sizeof(big)), 1);
+    disk = disk_init(cache, "/tmp", 2 * MAX_OBJECT_SIZE);
+    for (i = 0; i < 5; i++) {
+        sprintf(uri, "b%d", (int)i);
+        big[0] = '0' + i;
+        cache_add(cache, uri, big, sizeof(big), CACHE_FOREVER);
+    }
+    disk_get_stats(disk, &disk_stats);
+    assert(disk_stats.demoted == 4 && disk_stats.dropped == 2);
+    assert(disk_stats.objects == 2 && disk_stats.segments == 2);
+    assert(disk_stats.bytes <= disk_stats.capacity);
+    assert(!disk_lookup(disk, "b1", &obj));
+    assert(disk_lookup(disk, "b3", &obj));
+    big[0] = '3';
+    assert(obj.size == sizeof(big) && !memcmp(obj.content, big, obj.size));
+    disk_release(&obj);
+    disk_destroy(disk);
+    cache_destroy(cache);
+
+    /* A snapshot keeps objects and their recency across a restart */
+    unlink(snap);
+    cache = cache_init(3 * CACHE_NODE_CHARGE(1, 4), 1);
+    assert(snapshot_load(cache, snap) == 0);
+    cache_add(cache, "A", "aaaa", 4, CACHE_FOREVER);
+    cache_add(cache, "B", "b\0bb", 4, CACHE_FOREVER);
+    cache_add(cache, "C", "cccc", 4, CACHE_FOREVER);
+    assert(lookup_copy(cache, "A", content, &size));
+    assert(snapshot_save(cache, snap) == 3);
+    cache_destroy(cache);
+    cache = cache_init(3 * CACHE_NODE_CHARGE(1, 4), 1);
+    assert(snapshot_load(cache, snap) == 3);
+    assert(lookup_copy(cache, "B", content, &size));
+    assert(size == 4 && !memcmp(content, "b\0bb", 4));
+    cache_add(cache, "D", "dddd", 4, CACHE_FOREVER);
+    assert(!lookup_copy(cache, "C", content, &size));
+    assert(lookup_copy(cache, "A", content, &size));
+    cache_destroy(cache);
+
+    /* A smaller cache loads only the most recently used objects */
+    cache = cache_init(2 * CACHE_NODE_CHARGE(1, 4), 1);
+    assert(snapshot_load(cache, snap) == 2);
+    assert(lookup_copy(cache, "A", content, &size));
+    assert(lookup_copy(cache, "C", content, &size));
+    assert(!lookup_copy(cache, "B", content, &size));
+    cache_destroy(cache);
+
+    /* A damaged object is skipped, and only that one */
+    fp = fopen(snap, "r+");
+    fseek(fp, sizeof(SnapshotHeader) + sizeof(SnapshotRecord) + 1, 
+            SEEK_SET);
+    fputc('x', fp);
+    fclose(fp);
+    cache = cache_init(3 * CACHE_NODE_CHARGE(1, 4), 1);
+    assert(snapshot_load(cache, snap) == 2);
+    cache_destroy(cache);
+
+    /* A snapshot of another version, or a cut off one, is rejected */
+    fp = fopen(snap, "r+");
+    fseek(fp, sizeof(SNAPSHOT_MAGIC), SEEK_SET);
+    fputc(SNAPSHOT_VERSION + 1, fp);
+    fclose(fp);
+    cache = cache_init(3 * CACHE_NODE_CHARGE(1, 4), 1);
+    assert(snapshot_load(cache, snap) == -1);
+    assert(get_cache_size(cache) == 0);
+    assert(snapshot_save(cache, snap) == 0);
+    assert(truncate(snap, sizeof(SnapshotHeader) - 1) == 0);
+    assert(snapshot_load(cache, snap) == -1);
+    cache_add(cache, "A", "aaaa", 4, CACHE_FOREVER);
+    assert(snapshot_save(cache, snap) == 1);
+    assert(truncate(snap, sizeof(SnapshotHeader) + 8) == 0);
+    assert(snapshot_load(cache, snap) == -1);
+    cache_destroy(cache);
+    unlink(snap);
+
+    /* The first miss on a URI leads its fetch and later ones follow it */
+    flights = flight_init(50);
+    lead = flight_join(flights, "A", &leader);
+    assert(leader);
+    follow = flight_join(flights, "A", &leader);
+    assert(!leader && follow == lead);
+    other = flight_join(flights, "B", &leader);
+    assert(leader && other != lead);
+    flight_land(flights, &other, 0);
+
+    /* A follower that cannot block is woken through its descriptor */
+    wake = eventfd(0, EFD_NONBLOCK);
+    assert(flight_watch(flights, follow, wake) == 0);
+    assert(flight_watch(flights, follow, wake) == 0);
+    assert(read(wake, &count, sizeof(count)) < 0 && errno == EAGAIN);
+    flight_land(flights, &lead, 1);
+    assert(lead == NULL);
+    assert(read(wake, &count, sizeof(count)) == sizeof(count));
+    assert(count == 1);
+    assert(flight_watch(flights, follow, wake) == 1);
+    assert(flight_wait(flights, follow) == FLIGHT_CACHED);
+    close(wake);
+
+    /* Landing twice does nothing, and a landed fetch is not joined */
+    flight_land(flights, &lead, 0);
+    lead = flight_join(flights, "A", &leader);
+    assert(leader);
+
+    /* A follower gives up on a slow leader after the timeout */
+    follow = flight_join(flights, "A", &leader);
+    assert(flight_wait(flights, follow) == FLIGHT_PENDING);
+    follow = flight_join(flights, "A", &leader);
+    flight_land(flights, &lead, 0);
+    assert(flight_wait(flights, follow) == FLIGHT_FAILED);
+
+    flight_get_stats(flights, &flight_stats);
+    assert(flight_stats.leaders == 3);
+    assert(flight_stats.followers == 3);
+    assert(flight_stats.collapsed == 1);
+    assert(flight_stats.failed == 1);
+    assert(flight_stats.timeouts == 1);
+    flight_destroy(flights);
+
+    /* Adding a URI again replaces it, and a stale node can be refreshed */
+    cache = cache_init(3 * CACHE_NODE_CHARGE(1, 4), 1);
+    cache_add(cache, "A", "aaaa", 4, now - 1);
+    cache_add(cache, "A", "AAAA", 4, now + 60);
+    assert(get_cache_size(cache) == CACHE_NODE_CHARGE(1, 4));
+    node = cache_lookup(cache, "A");
+    assert(!memcmp(node->content, "AAAA", 4) && cache_fresh(node, now));
+    cache_refresh(node, now);
+    assert(!cache_fresh(node, now));
+    cache_release(node);
+
+    /* The expiry survives a snapshot */
+    assert(snapshot_save(cache, snap) == 1);
+    cache_destroy(cache);
+    cache = cache_init(3 * CACHE_NODE_CHARGE(1, 4), 1);
+    assert(snapshot_load(cache, snap) == 1);
+    node = cache_lookup(cache, "A");
+    assert(node->expires == now);
+    cache_release(node);
+    cache_destroy(cache);
+    unlink(snap);
+
+    /* Freshness comes from max-age, then Expires, then heuristics */
+    resp = "HTTP/1.1 200 OK\r\nCache-Control: public, max-age=100\r\n"
+        "Expires: Thu, 01 Jan 1970 00:00:00 GMT\r\n\r\n";
+    assert(response_freshness(resp, strlen(resp), now, &expires));
+    assert(expires == now + 100);
+    resp = "HTTP/1.1 200 OK\r\nCache-Control: max-age=100, s-maxage=5\r\n"
+        "Age: 2\r\n\r\n";
+    assert(response_freshness(resp, strlen(resp), now, &expires));
+    assert(expires == now + 3);
+    resp = "HTTP/1.0 200 OK\r\nDate: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+        "Expires: Sun, 06 Nov 1994 09:49:37 GMT\r\n\r\n";
+    assert(response_freshness(resp, strlen(resp), 
+                parse_http_date("Sun, 06 Nov 1994 08:49:37 GMT"), 
+                &expires));
+    assert(expires == parse_http_date("Sunday, 06-Nov-94 09:49:37 GMT"));
+    resp = "HTTP/1.0 200 OK\r\nExpires: 0\r\n\r\n";
+    assert(response_freshness(resp, strlen(resp), now, &expires));
+    assert(expires < now);
+    resp = "HTTP/1.0 200 OK\r\nDate: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+        "Last-Modified: Sun, 06 Nov 1994 08:32:57 GMT\r\n\r\n";
+    assert(response_freshness(resp, strlen(resp), 
+                parse_http_date("Sun Nov  6 08:49:37 1994"), &expires));
+    assert(expires == parse_http_date("Sun Nov  6 08:51:17 1994"));
+    resp = "HTTP/1.0 404 Not Found\r\n\r\n";
+    assert(response_freshness(resp, strlen(resp), now, &expires));
+    assert(expires == now + HEURISTIC_DEFAULT);
+    resp = "HTTP/1.0 200 OK\r\nPragma: no-cache\r\n\r\n";
+    assert(response_freshness(resp, strlen(resp), now, &expires));
+    assert(expires == now);
+
+    /* Uncacheable statuses and headers bypass the cache */
+    resp = "HTTP/1.1 503 Service Unavailable\r\n\r\n";
+    assert(!response_freshness(resp, strlen(resp), now, &expires));
+    resp = "HTTP/1.1 206 Partial Content\r\n\r\n";
+    assert(!response_freshness(resp, strlen(resp), now, &expires));
+    resp = "HTTP/1.1 200 OK\r\nCache-Control: no-store\r\n\r\n";
+    assert(!response_freshness(resp, strlen(resp), now, &expires));
+    resp = "HTTP/1.1 200 OK\r\ncache-control: max-age=9\r\n"
+        "Cache-Control: private\r\n\r\n";
+    assert(!response_freshness(resp, strlen(resp), now, &expires));
+    resp = "HTTP/1.1 200 OK\r\nVary: *\r\n\r\n";
+    assert(!response_freshness(resp, strlen(resp), now, &expires));
+
+    /* A stale copy is revalidated with its own validators only */
+    resp = "HTTP/1.1 200 OK\r\nETag: \"v1\"\r\nCache-Control: max-age=30"
+        "\r\n\r\nbody";
+    buf_init(&request, 16);
+    buf_append(&request, "GET / HTTP/1.0\r\nIf-None-Match: \"x\"\r\n"
+            "Host: a\r\n\r\n", strlen("GET / HTTP/1.0\r\nIf-None-Match:"
+                " \"x\"\r\nHost: a\r\n\r\n"));
+    assert(request_revalidate(&request, resp, strlen(resp)));
+    assert(request.len == strlen("GET / HTTP/1.0\r\nHost: a\r\n"
+                "If-None-Match: \"v1\"\r\n\r\n"));
+    assert(!memcmp(request.data, "GET / HTTP/1.0\r\nHost: a\r\n"
+                "If-None-Match: \"v1\"\r\n\r\n", request.len));
+    assert(!request_revalidate(&request, "HTTP/1.1 200 OK\r\n\r\n", 19));
+    buf_free(&request);
+
+    /* A 304 without a lifetime of its own reuses the cached one */
+    assert(refreshed_expires(resp, strlen(resp), "HTTP/1.1 304 OK\r\n\r\n",
+                strlen("HTTP/1.1 304 OK\r\n\r\n"), now) == now + 30);
+    assert(refreshed_expires(resp, strlen(resp), "HTTP/1.1 304 OK\r\n"
+                "Cache-Control: max-age=5\r\n\r\n", strlen("HTTP/1.1 "
+                    "304 OK\r\nCache-Control: max-age=5\r\n\r\n"), now)
+            == now + 5);
+
+    /* A stale copy may be served within its windows, unless it must not */
+    resp = "HTTP/1.1 200 OK\r\nCache-Control: max-age=1, "
+        "stale-while-revalidate=30, stale-if-error=300\r\n\r\n";
+    assert(stale_usable(resp, strlen(resp), now - 29, now, 0));
+    assert(!stale_usable(resp, strlen(resp), now - 30, now, 0));
+    assert(stale_usable(resp, strlen(resp), now - 30, now, 1));
+    assert(!stale_usable(resp, strlen(resp), now - 300, now, 1));
+    resp = "HTTP/1.1 200 OK\r\nCache-Control: max-age=1, must-revalidate, "
+        "stale-if-error=300\r\n\r\n";
+    assert(!stale_usable(resp, strlen(resp), now - 1, now, 1));
+    resp = "HTTP/1.1 200 OK\r\nCache-Control: max-age=1\r\n\r\n";
+    assert(!stale_usable(resp, strlen(resp), now, now, 0));
+
+    /* 
+     * A refresh is queued once per URI, and misses on the URI follow it;
+     * refreshes past the queue's room are dropped. With no threads the
+     * queue is never drained.
+     */
+    cache = cache_init(MAX_CACHE_SIZE, 1);
+    cache_add(cache, "A", "aaaa", 4, now - 1);
+    node = cache_lookup(cache, "A");
+    flights = flight_init(50);
+    refresh = refresh_init(0, cache, upstream_init(1, 1), 
+            dns_init(60, 60, stub_resolve), flights, 100);
+    buf_init(&request, 16);
+    buf_append(&request, "GET / HTTP/1.0\r\n\r\n", 18);
+    assert(refresh_submit(refresh, "A", "a", 80, &request, node));
+    assert(!refresh_submit(refresh, "A", "a", 80, &request, node));
+    follow = flight_join(flights, "A", &leader);
+    assert(!leader);
+    flight_leave(flights, follow);
+    for (i = 1; i < REFRESH_DEPTH; i++) {
+        sprintf(uri, "A%lu", (unsigned long)i);
+        assert(refresh_submit(refresh, uri, "a", 80, &request, node));
+    }
+    assert(!refresh_submit(refresh, "B", "a", 80, &request, node));
+    assert(flight_lead(flights, "B") != NULL);
+    refresh_get_stats(refresh, &refresh_stats);
+    assert(refresh_stats.pending == REFRESH_DEPTH);
+    assert(refresh_stats.queued == REFRESH_DEPTH);
+    assert(refresh_stats.deduped == 1);
+    assert(refresh_stats.dropped == 1);
+    assert(node->refcount == REFRESH_DEPTH + 2);
+    buf_free(&request);
+    cache_release(node);
+
+    /*
+     * A connection an event loop put back non-blocking is blocking when a
+     * refresh takes it, and the other way around
+     */
+    upstream = upstream_init(1, 60);
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    upstream_put(upstream, "a", 80, fds[0]);
+    assert(upstream_get(upstream, "a", 80, 0) == fds[0]);
+    assert(!(fcntl(fds[0], F_GETFL) & O_NONBLOCK));
+    upstream_put(upstream, "a", 80, fds[0]);
+    assert(upstream_get(upstream, "a", 80, 1) == fds[0]);
+    assert(fcntl(fds[0], F_GETFL) & O_NONBLOCK);
+    close(fds[0]);
+    close(fds[1]);
+
+    /* The sketch counts requests once past the doorkeeper, then ages */
+    admit = admit_init(0);
+    assert(admit_estimate(admit, hash_uri("A")) == 0);
+    admit_record(admit, hash_uri("A"));
+    assert(admit_estimate(admit, hash_uri("A")) == 1);
+    for (i = 0; i < 4; i++) {
+        admit_record(admit, hash_uri("A"));
+    }
+    assert(admit_estimate(admit, hash_uri("A")) == 5);
+    for (i = 0; i < 2 * ADMIT_MAX_COUNT; i++) {
+        admit_record(admit, hash_uri("A"));
+    }
+    assert(admit_estimate(admit, hash_uri("A")) == ADMIT_MAX_COUNT + 1);
+    while (admit->agings == 0) {
+        admit_record(admit, hash_uri("B"));
+    }
+    assert(admit_estimate(admit, hash_uri("A")) == ADMIT_MAX_COUNT / 2);
+    admit_destroy(admit);
+
+    /* With admission, a URI requested once does not evict popular ones */
+    cache = cache_init(2 * CACHE_NODE_CHARGE(1, 4), 1);
+    cache_set_admit(cache);
+    cache_add(cache, "A", "aaaa", 4, CACHE_FOREVER);
+    cache_add(cache, "B", "bbbb", 4, CACHE_FOREVER);
+    for (i = 0; i < 3; i++) {
+        cache_release(cache_lookup(cache, "A"));
+        cache_release(cache_lookup(cache, "B"));
+    }
+    assert(cache_lookup(cache, "C") == NULL);
+    cache_add(cache, "C", "cccc", 4, CACHE_FOREVER);
+    assert(cache_lookup(cache, "C") == NULL);
+    cache_get_stats(cache, &stats);
+    assert(stats.nodes == 2 && stats.evictions == 0);
+    assert(stats.rejections == 1);
+
+    /* Once it is requested more often than its victim, it is added */
+    for (i = 0; i < 4; i++) {
+        assert(cache_lookup(cache, "C") == NULL);
+    }
+    cache_add(cache, "C", "cccc", 4, CACHE_FOREVER);
+    assert(lookup_copy(cache, "C", object, &size) && size == 4);
+    assert(!lookup_copy(cache, "A", object, &size));
+    assert(lookup_copy(cache, "B", object, &size));
+    cache_destroy(cache);
+
+    /*
+     * An object that would need two victims, the second of them popular,
+     * evicts neither, whatever the policy; once it beats both, it evicts
+     * both
+     */
+    for (p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+        cache = cache_init(2 * CACHE_NODE_CHARGE(1, 4), 1);
+        assert(cache_set_policy(cache, policies[p]) == 0);
+        cache_set_admit(cache);
+        cache_add(cache, "A", "aaaa", 4, CACHE_FOREVER);
+        cache_add(cache, "B", "bbbb", 4, CACHE_FOREVER);
+        for (hit = 0; hit < 3; hit++) {
+            cache_release(cache_lookup(cache, "B"));
+        }
+        assert(cache_lookup(cache, "C") == NULL);
+        assert(cache_lookup(cache, "C") == NULL);
+        cache_add(cache, "C", "cccccccc", 8, CACHE_FOREVER);
+        cache_get_stats(cache, &stats);
+        assert(stats.nodes == 2 && stats.evictions == 0);
+        assert(stats.rejections == 1);
+        assert(lookup_copy(cache, "A", object, &size) && size == 4);
+        assert(lookup_copy(cache, "B", object, &size) && size == 4);
+        for (hit = 0; hit < 4; hit++) {
+            assert(cache_lookup(cache, "C") == NULL);
+        }
+        cache_add(cache, "C", "cccccccc", 8, CACHE_FOREVER);
+        cache_get_stats(cache, &stats);
+        assert(stats.nodes == 1 && stats.evictions == 2);
+        assert(lookup_copy(cache, "C", object, &size) && size == 8);
+        cache_destroy(cache);
+    }
+
+    /* Only known policies can be chosen */
+    cache = cache_init(4 * CACHE_NODE_CHARGE(1, 4), 1);
+    assert(cache_set_policy(cache, "random") == -1);
+    assert(cache->shards[0].policy == &lru_policy);
+
+    /* ARC keeps a node hit twice through a scan of nodes seen once */
+    assert(cache_set_policy(cache, "arc") == 0);
+    cache_add(cache, "A", "aaaa", 4, CACHE_FOREVER);
+    cache_release(cache_lookup(cache, "A"));
+    for (i = 0; i < 8; i++) {
+        sprintf(uri, "%c", (int)('B' + i));
+        cache_add(cache, uri, "scan", 4, CACHE_FOREVER);
+    }
+    assert(lookup_copy(cache, "A", object, &size));
+    assert(!lookup_copy(cache, "B", object, &size));
+    cache_destroy(cache);
+
+    /* 
+     * S3-FIFO moves a node hit while new to the main queue, and sends one
+     * evicted from the small queue straight to the main one if it returns
+     */
+    cache = cache_init(10 * CACHE_NODE_CHARGE(1, 4), 1);
+    assert(cache_set_policy(cache, "s3fifo") == 0);
+    cache_add(cache, "A", "aaaa", 4, CACHE_FOREVER);
+    cache_release(cache_lookup(cache, "A"));
+    for (i = 0; i < 12; i++) {
+        sprintf(uri, "%c", (int)('B' + i));
+        cache_add(cache, uri, "scan", 4, CACHE_FOREVER);
+    }
+    node = cache_lookup(cache, "A");
+    assert(node != NULL && node->queue == QUEUE_FREQUENT);
+    cache_release(node);
+    assert(cache_lookup(cache, "B") == NULL);
+    cache_add(cache, "B", "bbbb", 4, CACHE_FOREVER);
+    node = cache_lookup(cache, "B");
+    assert(node != NULL && node->queue == QUEUE_FREQUENT);
+    cache_release(node);
+    cache_destroy(cache);
+
+    /* GDSF evicts a large object before older small ones */
+    cache = cache_init(CACHE_NODE_CHARGE(1, 1000) 
+            + 2 * CACHE_NODE_CHARGE(1, 4), 1);
+    assert(cache_set_policy(cache, "gdsf") == 0);
+    cache_add(cache, "A", "aaaa", 4, CACHE_FOREVER);
+    cache_add(cache, "L", big, 1000, CACHE_FOREVER);
+    cache_add(cache, "B", "bbbb", 4, CACHE_FOREVER);
+    cache_add(cache, "C", "cccc", 4, CACHE_FOREVER);
+    assert(!lookup_copy(cache, "L", object, &size));
+    assert(lookup_copy(cache, "A", object, &size));
+    assert(lookup_copy(cache, "B", object, &size));
+    assert(lookup_copy(cache, "C", object, &size));
+    cache_destroy(cache);
+
+    /* 
+     * Under every policy, a random mix of lookups and adds of different
+     * sizes keeps the cache within its budget, and every node the cache
+     * counts can be found
+     */
+    srand(1);
+    for (p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+        cache = cache_init(16 * CACHE_NODE_CHARGE(3, 200), 1);
+        assert(cache_set_policy(cache, policies[p]) == 0);
+        for (i = 0; i < 20000; i++) {
+            sprintf(uri, "%d", rand() % 64);
+            if (!lookup_copy(cache, uri, object, &size)) {
+                cache_add(cache, uri, big, 1 + rand() % 400, CACHE_FOREVER);
+            }
+            cache_get_stats(cache, &stats);
+            assert(stats.bytes <= 16 * CACHE_NODE_CHARGE(3, 200));
+        }
+        for (i = 0, found = 0; i < 64; i++) {
+            sprintf(uri, "%d", (int)i);
+            found += lookup_copy(cache, uri, object, &size);
+        }
+        cache_get_stats(cache, &stats);
+        assert(found == stats.nodes && stats.evictions > 0);
+        cache_destroy(cache);
+    }
+
+    /* A recorded trace reads back record by record */
+    unlink("/tmp/test_cache.trace");
+    trace = trace_open("/tmp/test_cache.trace");
+    assert(trace != NULL);
+    trace_record(trace, "http://a/x.js", 1234, 1);
+    trace_record(trace, "http://a/", 77, 0);
+    trace_record(NULL, "http://a/", 77, 0);
+    assert(trace->records == 2);
+    trace_close(trace);
+    fp = fopen("/tmp/test_cache.trace", "r");
+    assert(fgets(line, MAXLINE, fp) != NULL);
+    assert(trace_parse(line, &rec) == 0);
+    assert(!strcmp(rec.uri, "http://a/x.js") && rec.size == 1234);
+    assert(rec.cacheable == 1 && rec.time > now - 60);
+    assert(fgets(line, MAXLINE, fp) != NULL);
+    assert(trace_parse(line, &rec) == 0);
+    assert(!strcmp(rec.uri, "http://a/") && rec.size == 77);
+    assert(rec.cacheable == 0);
+    assert(fgets(line, MAXLINE, fp) == NULL);
+    fclose(fp);
+    unlink("/tmp/test_cache.trace");
+
+    /* Without the last field a response is cacheable; junk is rejected */
+    strcpy(line, "12.5 http://b/ 10\n");
+    assert(trace_parse(line, &rec) == 0 && rec.cacheable == 1);
+    assert(rec.time == 12.5 && rec.size == 10);
+    strcpy(line, "12.5 http://b/\n");
+    assert(trace_parse(line, &rec) == -1);
+    strcpy(line, "when http://b/ 10\n");
+    assert(trace_parse(line, &rec) == -1);
+    strcpy(line, "12.5 http://b/ -10\n");
+    assert(trace_parse(line, &rec) == -1);
+    strcpy(line, "12.5 http://b/ 10 yes\n");
+    assert(trace_parse(line, &rec) == -1);
+    strcpy(line, "\n");
+    assert(trace_parse(line, &rec) == -1);
+
+    /* 
+     * Under every policy, and with admission, threads looking up and
+     * adding objects at once never push the cache over its budget, never
+     * see an object that is not the one its URI names, and lose no
+     * object: every add is still cached, evicted or turned away
+     */
+    for (p = 0; p <= sizeof(policies) / sizeof(policies[0]); p++) {
+        cache = cache_init(STRESS_CAPACITY, 4);
+        if (p < sizeof(policies) / sizeof(policies[0])) {
+            assert(cache_set_policy(cache, policies[p]) == 0);
+        } else {
+            cache_set_admit(cache);
+        }
+        cache_set_evict(cache, stress_evict, NULL);
+        stress_evicted = 0;
+        stress_done = 0;
+        Pthread_create(&monitor, NULL, stress_monitor, cache);
+        for (i = 0; i < STRESS_THREADS; i++) {
+            stress[i].cache = cache;
+            stress[i].id = i;
+            stress[i].adds = 0;
+            Pthread_create(&stress_tids[i], NULL, stress_thread, &stress[i]);
+        }
+        for (i = 0, adds = 0; i < STRESS_THREADS; i++) {
+            Pthread_join(stress_tids[i], NULL);
+            adds += stress[i].adds;
+        }
+        __atomic_store_n(&stress_done, 1, __ATOMIC_RELEASE);
+        Pthread_join(monitor, NULL);
+
+        check_shards(cache);
+        cache_get_stats(cache, &stats);
+        assert(stats.peak_bytes <= STRESS_CAPACITY);
+        assert(stats.evictions > 0 && stats.evictions == stress_evicted);
+        assert(adds == stats.nodes + stats.evictions + stats.rejections);
+        for (i = 0, found = 0; i < STRESS_THREADS * STRESS_KEYS; i++) {
+            sprintf(uri, "/%d", (int)i);
+            found += lookup_copy(cache, uri, object, &size);
+        }
+        assert(found == stats.nodes);
+        cache_destroy(cache);
+    }
+
+    /* Lookups never miss an object while indexes grow under them */
+    cache = cache_init(STRESS_THREADS * GROW_KEYS 
+            * CACHE_NODE_CHARGE(8, STRESS_MAX_SIZE), 4);
+    for (i = 0; i < STRESS_THREADS; i++) {
+        stress[i].cache = cache;
+        stress[i].id = i;
+        stress[i].adds = 0;
+        Pthread_create(&stress_tids[i], NULL, grow_thread, &stress[i]);
+    }
+    for (i = 0, adds = 0; i < STRESS_THREADS; i++) {
+        Pthread_join(stress_tids[i], NULL);
+        adds += stress[i].adds;
+    }
+    check_shards(cache);
+    cache_get_stats(cache, &stats);
+    assert(adds == stats.nodes && stats.evictions == 0);
+    for (i = 0; i < (size_t)cache->nshards; i++) {
+        assert(cache->shards[i].index->nbuckets > CACHE_INIT_BUCKETS);
+    }
+    cache_destroy(cache);
+
     printf("Passed all tests!\n");
     return 0;
 }
@@ -0,0 +1,161 @@
+/*
+ * trace.c
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This file contains the functions that write and read
+ * access traces. When asked to, the proxy appends one line to a trace
+ * file for every GET it answers, whether from the cache or from the web
+ * server, and the cache simulator replays those lines through the cache
+ * to see how another size or eviction policy would have done on the same
+ * traffic. Each line is
+ *
+ *     <seconds since the epoch> <URI> <response bytes> [<cacheable>]
+ *
+ * where the time has microseconds, and cacheable is 1 or 0. A trace from
+ * elsewhere may leave the last field out, in which case every response is
+ * taken to be cacheable.
+ *
+ * Records are buffered, so recording costs no system call per request,
+ * and flushed at least every TRACE_FLUSH_INTERVAL seconds while traffic
+ * flows.
+ *
+ */
+
+#include "trace.h"
+
+/*
+ * Main Trace Functions
+ * --------------------
+ */
+
+/*
+ * trace_open - This function opens a trace file for appending.
+ *
+ * Parameter:
+ *  - path: the trace file, created if it does not exist
+ * Return value:
+ *  - trace: a pointer to the open trace, or NULL if the file could not be
+ *           opened, which is reported to stderr
+ */
+Trace *trace_open(char *path)
+{
+    Trace *trace;
+    FILE *fp;
+
+    if ((fp = fopen(path, "a")) == NULL) {
+        fprintf(stderr, "Cannot open trace %s: %s\n", path,
+                strerror(errno));
+        return NULL;
+    }
+
+    trace = Malloc(sizeof(Trace));
+    trace->fp = fp;
+    trace->buffer = Malloc(TRACE_BUFFER);
+    setvbuf(fp, trace->buffer, _IOFBF, TRACE_BUFFER);
+    pthread_mutex_init(&trace->lock, NULL);
+    trace->last_flush = time(NULL);
+    trace->records = 0;
+    return trace;
+}
+
+/*
+ * trace_record - This function appends one request to a trace, stamped
+ * with the current time. It does nothing if trace is NULL, so callers
+ * need not check whether tracing is on.
+ *
+ * Parameters:
+ *  - trace: the trace, or NULL
+ *  - uri: the requested URI
+ *  - size: bytes in the response, headers included
+ *  - cacheable: whether the response may be cached
+ */
+void trace_record(Trace *trace, char *uri, size_t size, int cacheable)
+{
+    struct timeval now;
+
+    if (trace == NULL) {
+        return;
+    }
+
+    gettimeofday(&now, NULL);
+    pthread_mutex_lock(&trace->lock);
+    fprintf(trace->fp, "%ld.%06ld %s %lu %d\n", (long)now.tv_sec,
+            (long)now.tv_usec, uri, (unsigned long)size, cacheable != 0);
+    trace->records += 1;
+    if (now.tv_sec - trace->last_flush >= TRACE_FLUSH_INTERVAL) {
+        fflush(trace->fp);
+        trace->last_flush = now.tv_sec;
+    }
+    pthread_mutex_unlock(&trace->lock);
+    return;
+}
+
+/*
+ * trace_close - This function writes out what is buffered, closes the
+ * trace file and frees the trace.
+ *
+ * Parameter:
+ *  - trace: the trace to close
+ */
+void trace_close(Trace *trace)
+{
+    fclose(trace->fp);
+    Free(trace->buffer);
+    pthread_mutex_destroy(&trace->lock);
+    Free(trace);
+    return;
+}
+
+/*
+ * trace_parse - This function parses one line of a trace. The line is
+ * modified, and the record's URI points into it.
+ *
+ * Parameters:
+ *  - line: the line, with or without its newline
+ *  - rec: filled with the record
+ * Return value:
+ *  - 0: on success
+ *  - -1: the line is not a record
+ */
+int trace_parse(char *line, TraceRecord *rec)
+{
+    char *field;
+    char *save;
+    char *end;
+
+    if ((field = strtok_r(line, " \t\r\n", &save)) == NULL) {
+        return -1;
+    }
+    rec->time = strtod(field, &end);
+    if (*end != '\0') {
+        return -1;
+    }
+
+    if ((rec->uri = strtok_r(NULL, " \t\r\n", &save)) == NULL) {
+        return -1;
+    }
+
+    if ((field = strtok_r(NULL, " \t\r\n", &save)) == NULL) {
+        return -1;
+    }
+    rec->size = strtoul(field, &end, 10);
+    if (*end != '\0' || *field == '-') {
+        return -1;
+    }
+
+    rec->cacheable = 1;
+    if ((field = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+        if (strcmp(field, "0") && strcmp(field, "1")) {
+            return -1;
+        }
+        rec->cacheable = (*field == '1');
+    }
+    return 0;
+}
+
+/*
+ * End Main Trace Functions
+ * ------------------------
+ */
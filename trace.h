@@ -0,0 +1,56 @@
+/*
+ * trace.h
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This is the header file for trace.c, which writes
+ * the access traces the proxy can record and reads them back for the
+ * cache simulator. This file just has the relevant macros, structure
+ * definitions, and function prototypes.
+ *
+ */
+
+/* Include guards */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "csapp.h"
+
+/* Macros */
+#define TRACE_BUFFER 65536       /* Bytes of records buffered before they
+                                    are written */
+#define TRACE_FLUSH_INTERVAL 1   /* Most seconds a record stays buffered */
+
+/*
+ * Defines a trace being recorded. Records from every thread go through
+ * one buffered stream, serialized by lock.
+ */
+typedef struct Trace {
+    FILE *fp;                    /* The trace file, opened for appending */
+    char *buffer;                /* The stream's buffer */
+    pthread_mutex_t lock;        /* Serializes records */
+    time_t last_flush;           /* When the stream was last flushed */
+    unsigned long records;       /* Records written */
+} Trace;
+
+/*
+ * One record of a trace: a request for a URI, when it was made, how many
+ * bytes the response was, headers included, and whether the response
+ * could be cached. A URI never contains white space, so it is written
+ * as is.
+ */
+typedef struct TraceRecord {
+    double time;                 /* Seconds since the epoch */
+    char *uri;                   /* The requested URI */
+    size_t size;                 /* Bytes in the response */
+    int cacheable;               /* The response may be cached */
+} TraceRecord;
+
+/* Main Trace Function Prototypes */
+Trace *trace_open(char *path);
+void trace_record(Trace *trace, char *uri, size_t size, int cacheable);
+void trace_close(Trace *trace);
+int trace_parse(char *line, TraceRecord *rec);
+
+#endif
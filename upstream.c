@@ -0,0 +1,283 @@
+/*
+ * upstream.c
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This file contains the pool of idle connections to
+ * web servers. When a response ends at its Content-Length and the server
+ * agreed to keep the connection open, the connection is returned here
+ * instead of being closed, filed under the server's host and port. The
+ * next request to that server takes it back out, which saves a name
+ * lookup, a TCP handshake and a fresh slow start.
+ *
+ * Each server keeps at most a fixed number of idle connections, and the
+ * most recently used one is handed out first, so the ones that go unused
+ * age out. Connections idle for longer than the timeout are closed. A
+ * server may close an idle connection at any time, so each one is checked
+ * before it is handed out, and the caller retries with a new connection
+ * if a reused one fails before the response starts.
+ *
+ * The event loops use their connections non-blocking and the threads
+ * that fetch requests or refresh objects use theirs blocking, but they
+ * share one pool, so a connection is put in the caller's mode each time
+ * it is handed out.
+ *
+ */
+
+#include "upstream.h"
+#include "hash.h"
+
+/*
+ * Main Upstream Functions
+ * -----------------------
+ */
+
+/*
+ * upstream_init - This function creates an empty pool.
+ *
+ * Parameters:
+ *  - max_idle: most idle connections kept per server; 0 keeps none
+ *  - idle_timeout: seconds an idle connection is kept
+ * Return value:
+ *  - pool: a pointer to the pool
+ */
+UpstreamPool *upstream_init(int max_idle, int idle_timeout)
+{
+    UpstreamPool *pool = Malloc(sizeof(UpstreamPool));
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->buckets = Calloc(UPSTREAM_BUCKETS, sizeof(UpstreamHost *));
+    pool->max_idle = max_idle;
+    pool->idle_timeout = idle_timeout;
+    pool->last_sweep = time(NULL);
+    pool->idle_total = 0;
+    pool->hits = 0;
+    pool->misses = 0;
+    pool->stale = 0;
+    pool->expired = 0;
+
+    return pool;
+}
+
+/*
+ * upstream_get - This function takes an idle connection to a server out
+ * of the pool, skipping any the server has closed in the meantime, and
+ * makes it blocking or non-blocking as the caller asks, whichever mode
+ * it was put back in.
+ *
+ * Parameters:
+ *  - pool: the pool
+ *  - host: the server's host name
+ *  - port: the port on the server
+ *  - nonblocking: whether the caller uses the connection non-blocking
+ * Return value:
+ *  - a connection to the server that now belongs to the caller
+ *  - -1: there is no idle connection; the caller must open one
+ */
+int upstream_get(UpstreamPool *pool, char *host, int port, int nonblocking)
+{
+    char key[MAXLINE];
+    uint64_t hash;
+    UpstreamHost *entry;
+    int flags;
+    int fd;
+
+    snprintf(key, MAXLINE, "%s:%d", host, port);
+    hash = hash_uri(key);
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        expire_idle(pool, time(NULL));
+        entry = find_host(pool, key, hash);
+        if (entry == NULL || entry->count == 0) {
+            pool->misses += 1;
+            pthread_mutex_unlock(&pool->lock);
+            return -1;
+        }
+        entry->count -= 1;
+        pool->idle_total -= 1;
+        fd = entry->idle[entry->count].fd;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (conn_alive(fd)) {
+            flags = fcntl(fd, F_GETFL);
+            fcntl(fd, F_SETFL, nonblocking ? flags | O_NONBLOCK
+                    : flags & ~O_NONBLOCK);
+            pthread_mutex_lock(&pool->lock);
+            pool->hits += 1;
+            pthread_mutex_unlock(&pool->lock);
+            return fd;
+        }
+
+        Close(fd);
+        pthread_mutex_lock(&pool->lock);
+        pool->stale += 1;
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/*
+ * upstream_put - This function returns a connection to a server to the
+ * pool once a response on it is complete. If the server already has as
+ * many idle connections as allowed, the connection is closed instead.
+ *
+ * Parameters:
+ *  - pool: the pool
+ *  - host: the server's host name
+ *  - port: the port on the server
+ *  - fd: the connection, which now belongs to the pool
+ */
+void upstream_put(UpstreamPool *pool, char *host, int port, int fd)
+{
+    char key[MAXLINE];
+    uint64_t hash;
+    UpstreamHost *entry;
+    time_t now = time(NULL);
+
+    snprintf(key, MAXLINE, "%s:%d", host, port);
+    hash = hash_uri(key);
+
+    pthread_mutex_lock(&pool->lock);
+    expire_idle(pool, now);
+
+    if ((entry = find_host(pool, key, hash)) == NULL && pool->max_idle > 0) {
+        entry = Malloc(sizeof(UpstreamHost));
+        entry->key = Malloc(strlen(key) + 1);
+        strcpy(entry->key, key);
+        entry->hash = hash;
+        entry->count = 0;
+        entry->idle = Malloc(pool->max_idle * sizeof(IdleConn));
+        entry->next = pool->buckets[hash % UPSTREAM_BUCKETS];
+        pool->buckets[hash % UPSTREAM_BUCKETS] = entry;
+    }
+
+    if (entry == NULL || entry->count == pool->max_idle) {
+        pthread_mutex_unlock(&pool->lock);
+        Close(fd);
+        return;
+    }
+
+    entry->idle[entry->count].fd = fd;
+    entry->idle[entry->count].idle_since = now;
+    entry->count += 1;
+    pool->idle_total += 1;
+
+    pthread_mutex_unlock(&pool->lock);
+    return;
+}
+
+/*
+ * upstream_get_stats - This function copies the pool's counters into
+ * stats.
+ *
+ * Parameters:
+ *  - pool: the pool to report on
+ *  - stats: filled with the current counters
+ */
+void upstream_get_stats(UpstreamPool *pool, UpstreamStats *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    stats->idle = pool->idle_total;
+    stats->hits = pool->hits;
+    stats->misses = pool->misses;
+    stats->stale = pool->stale;
+    stats->expired = pool->expired;
+
+    pthread_mutex_unlock(&pool->lock);
+    return;
+}
+
+/*
+ * End Main Upstream Functions
+ * ---------------------------
+ */
+
+
+/*
+ * Upstream Helper Functions
+ * -------------------------
+ */
+
+/*
+ * find_host - Returns the table entry for a "host:port" key, or NULL if
+ * there is none. The caller must hold the pool's lock.
+ */
+UpstreamHost *find_host(UpstreamPool *pool, char *key, uint64_t hash)
+{
+    UpstreamHost *entry = pool->buckets[hash % UPSTREAM_BUCKETS];
+
+    while (entry != NULL) {
+        if (entry->hash == hash && !strcmp(entry->key, key)) {
+            return entry;
+        }
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+/*
+ * expire_idle - This function closes the idle connections that have been
+ * kept for longer than the idle timeout. It walks the whole table, so it
+ * does so at most once a second. The caller must hold the pool's lock.
+ *
+ * Parameters:
+ *  - pool: the pool
+ *  - now: the current time
+ */
+void expire_idle(UpstreamPool *pool, time_t now)
+{
+    UpstreamHost *entry;
+    int expired;
+    int i;
+
+    if (now == pool->last_sweep || pool->idle_total == 0) {
+        return;
+    }
+    pool->last_sweep = now;
+
+    for (i = 0; i < UPSTREAM_BUCKETS; i++) {
+        for (entry = pool->buckets[i]; entry != NULL; entry = entry->next) {
+            /* The oldest connections are at the front */
+            expired = 0;
+            while (expired < entry->count && now
+                    - entry->idle[expired].idle_since >= pool->idle_timeout) {
+                Close(entry->idle[expired].fd);
+                expired++;
+            }
+            if (expired > 0) {
+                entry->count -= expired;
+                memmove(entry->idle, entry->idle + expired,
+                        entry->count * sizeof(IdleConn));
+                pool->idle_total -= expired;
+                pool->expired += expired;
+            }
+        }
+    }
+    return;
+}
+
+/*
+ * conn_alive - This function checks an idle connection before it is
+ * reused. An idle server has nothing to say, so a connection that reads
+ * as closed, or that has unexpected bytes waiting, is not reused.
+ *
+ * Parameter:
+ *  - fd: the idle connection
+ * Return value:
+ *  - 1: the connection looks usable
+ *  - 0: the connection must be closed
+ */
+int conn_alive(int fd)
+{
+    char c;
+
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0
+        && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * End Upstream Helper Functions
+ * -----------------------------
+ */
@@ -0,0 +1,88 @@
+/*
+ * upstream.h
+ *
+ * Author: Kais Kudrolli
+ * Andrew ID: kkudroll
+ *
+ * File Description: This is the header file for upstream.c, which keeps
+ * idle connections to web servers open so that later requests to the
+ * same server can reuse them. This file just has the relevant macros,
+ * structure definitions, and function prototypes.
+ *
+ */
+
+/* Include guards */
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#include "csapp.h"
+
+/* Macros */
+#define UPSTREAM_DEFAULT_IDLE 8  /* Default idle connections kept per
+                                    server */
+#define UPSTREAM_IDLE_TIMEOUT 10 /* Seconds an idle connection is kept */
+#define UPSTREAM_BUCKETS 256     /* Number of buckets in the server table */
+
+/*
+ * One idle connection to a web server.
+ */
+typedef struct IdleConn {
+    int fd;                      /* The connection */
+    time_t idle_since;           /* When it was returned to the pool */
+} IdleConn;
+
+/*
+ * The idle connections to one server. They are used last in, first out,
+ * so idle[0] is always the one that has waited longest.
+ */
+typedef struct UpstreamHost {
+    char *key;                   /* "host:port" */
+    uint64_t hash;               /* Hash of key */
+    int count;                   /* Number of idle connections */
+    IdleConn *idle;              /* Room for max_idle connections */
+    struct UpstreamHost *next;   /* Next server in the same bucket */
+} UpstreamHost;
+
+/*
+ * Defines the pool: a hash table of servers, each with its idle
+ * connections. Everything is protected by lock.
+ */
+typedef struct UpstreamPool {
+    pthread_mutex_t lock;        /* Protects the table and the counters */
+    UpstreamHost **buckets;      /* Chains of servers */
+    int max_idle;                /* Most idle connections kept per server */
+    int idle_timeout;            /* Seconds an idle connection is kept */
+    time_t last_sweep;           /* When expired connections were last
+                                    closed */
+    int idle_total;              /* Idle connections across all servers */
+    unsigned long hits;          /* Requests that reused a connection */
+    unsigned long misses;        /* Requests that needed a new one */
+    unsigned long stale;         /* Idle connections found closed */
+    unsigned long expired;       /* Idle connections closed as too old */
+} UpstreamPool;
+
+/*
+ * A snapshot of the pool's counters, for monitoring.
+ */
+typedef struct UpstreamStats {
+    int idle;                    /* Idle connections right now */
+    unsigned long hits;          /* Requests that reused a connection */
+    unsigned long misses;        /* Requests that needed a new one */
+    unsigned long stale;         /* Idle connections found closed */
+    unsigned long expired;       /* Idle connections closed as too old */
+} UpstreamStats;
+
+/* Main Upstream Function Prototypes */
+UpstreamPool *upstream_init(int max_idle, int idle_timeout);
+int upstream_get(UpstreamPool *pool, char *host, int port, int nonblocking);
+void upstream_put(UpstreamPool *pool, char *host, int port, int fd);
+void upstream_get_stats(UpstreamPool *pool, UpstreamStats *stats);
+/* Upstream Helper Functions */
+UpstreamHost *find_host(UpstreamPool *pool, char *key, uint64_t hash);
+void expire_idle(UpstreamPool *pool, time_t now);
+int conn_alive(int fd);
+
+#endif